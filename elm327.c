@@ -5,8 +5,14 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <errno.h>
 #include "elm327.h"
+#include "elm327trace.h"
+#include "elm327probe.h"
+#include "elm327metrics.h"
+#include "elm327clock.h"
+#include "elm327loopback.h"
+#include "elm327replay.h"
 
 
 /*
@@ -22,6 +28,16 @@ struct termios elm327_termios_original;
 unsigned int elm327_timeout_seconds = 1;
 
 
+#ifdef ELM327_HAVE_PROBES
+/* Probe semaphores, raised by the kernel while a tracer is attached */
+ELM327_PROBE_SEMAPHORE(send);
+ELM327_PROBE_SEMAPHORE(recv);
+ELM327_PROBE_SEMAPHORE(decode);
+ELM327_PROBE_SEMAPHORE(output);
+ELM327_PROBE_SEMAPHORE(sink_write);
+#endif
+
+
 /*
  * Defined
  */
@@ -31,12 +47,18 @@ int elm327_init(const char *device_path)
 {
     int fd;
 
+    if (!strncmp(device_path, "loopback:", 9))
+      return elm327_loopback_load(device_path + 9);
+
     if ((fd = open(device_path, O_RDWR)) == -1)
       return -1;
 
     /* Save original terminal settings (so we can restore at shutdown) */
     if (tcgetattr(fd, &elm327_termios_original) == -1)
-      return -1;
+    {
+        close(fd);
+        return -1;
+    }
 
     /* Set just the baud to 38400 */
     memcpy(&elm327_termios, &elm327_termios_original, sizeof(struct termios));
@@ -66,7 +88,10 @@ int elm327_init(const char *device_path)
     elm327_termios.c_lflag &= ~ECHO;
 
     if (tcsetattr(fd, TCSANOW, &elm327_termios) == -1)
-      return -1;
+    {
+        close(fd);
+        return -1;
+    }
 
     /* What the toilet says... */
     elm327_flush(fd);
@@ -79,6 +104,11 @@ void elm327_shutdown(int fd)
 {
     if (fd == -1)
       return;
+    if (ELM327_IS_LOOPBACK(fd))
+    {
+        elm327_loopback_close(fd);
+        return;
+    }
 
     tcsetattr(fd, TCSANOW, &elm327_termios_original);
     close(fd);
@@ -142,6 +172,7 @@ void elm327_ascii_to_msg(const elm327_msg_as_ascii_t ascii, elm327_msg_t msg)
 int elm327_send_msg(int fd, elm327_msg_t msg)
 {
     elm327_msg_as_ascii_t ascii;
+    ssize_t               n;
 
     /* Assuming that all messages for OBD-II are 2 bytes or represented by elm
      * as 4 ascii characters
@@ -155,54 +186,275 @@ int elm327_send_msg(int fd, elm327_msg_t msg)
 #endif
 
     /* 4 hex digits + carriage return */
-    return write(fd, ascii, 5);
+    n = elm327_write(fd, ascii, 5);
+    ELM327_PROBE3(send, msg[0], msg[1], n);
+    ELM327_METRIC_ADD(requests, 1);
+    if (n > 0)
+      ELM327_METRIC_ADD(bytes_out, n);
+
+    return n;
 }
 
 
-elm327_msg_t *elm327_recv_msgs(int fd, int *n_msgs, int ascii)
+ssize_t elm327_read(int fd, void *buf, size_t len)
 {
-    int                    msg_idx, char_idx, i, n_lines;
-    char                   c, prev, *st, *look, buf[256] = {0};
-    fd_set                 recv_fds;
-    struct timeval         timeout;
-    elm327_msg_t          *msgs;
-    elm327_msg_as_ascii_t *ascii_msgs;
+    ssize_t n = ELM327_IS_LOOPBACK(fd) ? elm327_loopback_read(fd, buf, len) : read(fd, buf, len);
 
-    if (n_msgs)
-      n_msgs = 0;
+    ELM327_CAPTURE('r', buf, n);
 
-    /* Wait until we find some data on the line */
-    if (elm327_timeout_seconds > 0)
+    return n;
+}
+
+
+ssize_t elm327_write(int fd, const void *buf, size_t len)
+{
+    ssize_t n = ELM327_IS_LOOPBACK(fd) ? elm327_loopback_write(fd, buf, len) : write(fd, buf, len);
+
+    ELM327_CAPTURE('w', buf, n);
+
+    /* On the virtual clock it is on its way to the simulated adapter */
+    if ((n > 0) && !ELM327_IS_LOOPBACK(fd))
+      elm327_clock_sent(n);
+
+    return n;
+}
+
+
+int elm327_flush(int fd)
+{
+    if (ELM327_IS_LOOPBACK(fd))
     {
-        FD_ZERO(&recv_fds);
-        FD_SET(fd, &recv_fds);
-        timeout = (struct timeval){elm327_timeout_seconds, 0};
-        if (select(fd + 1, &recv_fds, NULL, NULL, &timeout) <= 0)
-          return NULL;
+        elm327_loopback_flush(fd);
+        return 0;
     }
 
-    /* Recieve the data */
-    prev = 0;
+    /* A simulated adapter has the commands before they can be thrown away */
+    elm327_clock_sync();
+
+    return tcflush(fd, TCIOFLUSH);
+}
+
+
+int elm327_wait_readable(int fd, int timeout_ms)
+{
+    /* A loopback adapter answers as it is written to, what is not there
+     * never comes
+     */
+    if (ELM327_IS_LOOPBACK(fd))
+    {
+        ssize_t n = elm327_loopback_pending(fd);
+
+        return (n < 0) ? -1 : (n > 0);
+    }
+
+    /* poll() unless time is virtual */
+    return elm327_clock_wait_readable(fd, timeout_ms);
+}
+
+
+int elm327_send_cmd(int fd, const char *cmd)
+{
+    char   line[64];
+    size_t len = strlen(cmd);
+
+    if (len > sizeof(line) - 1)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(line, cmd, len);
+    line[len++] = '\r';
+
+    return (elm327_write(fd, line, len) == (ssize_t)len) ? 0 : -1;
+}
+
+
+int elm327_wait_prompt(int fd, int timeout_ms)
+{
+    char c, prev = 0;
+    int  r;
+
+    for (;;)
+    {
+        if ((r = elm327_wait_readable(fd, timeout_ms)) <= 0)
+        {
+            if (r == 0)
+              errno = ETIMEDOUT;
+            return -1;
+        }
+        if (elm327_read(fd, &c, 1) != 1)
+        {
+            errno = EIO;
+            return -1;
+        }
+        if ((c == '>') || ((c == '\n') && (prev == '\n')))
+          return 0;
+        prev = c;
+    }
+}
+
+
+int elm327_read_response(int fd, char *buf, size_t len, int timeout_ms)
+{
+    char    chunk[64], c, prev = 0;
+    size_t  n = 0, n_read = 0;
+    ssize_t r;
+    int     k, done = 0, overflow = 0;
+
+    while (!done)
+    {
+        if ((k = elm327_wait_readable(fd, timeout_ms)) <= 0)
+        {
+            if (k == 0)
+            {
+                ELM327_METRIC_ADD(timeouts, 1);
+                errno = ETIMEDOUT;
+            }
+            return -1;
+        }
+        if ((r = elm327_read(fd, chunk, sizeof(chunk))) <= 0)
+        {
+            errno = EIO;
+            return -1;
+        }
+        n_read += r;
+
+        for (k = 0; (k < r) && !done; ++k)
+        {
+            c = (chunk[k] == '\r') ? '\n' : chunk[k];
+
+            /* Nothing yet: the previous prompt, blank lines */
+            if ((n == 0) && !overflow && ((c == '>') || (c == '\n')))
+              continue;
+
+            if ((c == '>') || ((c == '\n') && (prev == '\n')))
+              done = 1;
+            else if (n < len - 1)
+              buf[n++] = c;
+            else
+              overflow = 1;
+            prev = c;
+        }
+    }
+    buf[n] = '\0';
+    ELM327_METRIC_ADD(bytes_in, n_read);
+
+    if (overflow)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    return (int)n;
+}
+
+
+elm327_msg_t *elm327_recv_msgs(int fd, int *n_msgs, int ascii)
+{
+    int                    char_idx, done, k;
+    char                   c, prev, buf[256] = {0}, chunk[64];
+    ssize_t                n;
+    size_t                 n_read = 0;
+    uint64_t               t_start = 0, t_first = 0;
+
+    if (n_msgs)
+      *n_msgs = 0;
+
+    if (ELM327_PROBE_ENABLED(recv))
+      t_start = elm327_probe_ns();
+
+    /* Recieve the data.  The ELM is half duplex, nothing follows the prompt
+     * until we send again, so it is safe to read more than we need.  Every
+     * read waits at most the timeout, an adapter that stops half way through
+     * a response is noticed like one that never answers.
+     */
+    c = prev = 0;
     char_idx = 0;
-    while ((read(fd, &c, 1) > 0) && (char_idx < sizeof(buf)))
+    done = 0;
+    while (!done && (char_idx < sizeof(buf) - 1))
     {
-        if (c == '>')
-          break;
-        else if ((prev == '\n') && (c == '\n'))
-          break;
-        /* Ignore "UNSUPPORTED, NODATA, and SEARCHING..." */
-        else if ((char_idx == 0) && (c=='U' || c=='N' || c=='S'))
+        if ((k = elm327_wait_readable(fd, elm327_timeout_seconds ? elm327_timeout_seconds * 1000 : -1)) <= 0)
+        {
+            if (k == 0)
+            {
+                ELM327_METRIC_ADD(timeouts, 1);
+                errno = ETIMEDOUT;
+            }
+            return NULL;
+        }
+        if ((n = elm327_read(fd, chunk, sizeof(chunk))) <= 0)
           break;
+        n_read += n;
 
-        buf[char_idx++] = c;
-        prev = c;
+        for (k = 0; (k < n) && !done && (char_idx < sizeof(buf) - 1); ++k)
+        {
+            c = chunk[k];
+
+            if ((char_idx == 0) && (prev == 0))
+            {
+                ELM327_TRACE_MARK(ELM327_TRACE_FIRST_BYTE, 0);
+                if (ELM327_PROBE_ENABLED(recv))
+                  t_first = elm327_probe_ns();
+            }
+
+            if (c == '>')
+            {
+                ELM327_TRACE_MARK(ELM327_TRACE_LAST_BYTE, 0);
+                ELM327_TRACE_MARK(ELM327_TRACE_PROMPT, 0);
+                done = 1;
+            }
+            else if ((prev == '\n') && (c == '\n'))
+            {
+                ELM327_TRACE_MARK(ELM327_TRACE_LAST_BYTE, 0);
+                done = 1;
+            }
+            /* Ignore "UNSUPPORTED" and "NODATA", "SEARCHING..." is
+             * followed by the answer, elm327_parse_msgs() skips it
+             */
+            else if ((char_idx == 0) && (c=='U' || c=='N'))
+              done = 1;
+            else
+            {
+                buf[char_idx++] = c;
+                prev = c;
+            }
+        }
+    }
+
+    ELM327_METRIC_ADD(bytes_in, n_read);
+
+    if (ELM327_PROBE_ENABLED(recv))
+    {
+        uint64_t t_end = elm327_probe_ns();
+
+        if (!t_first)
+          t_first = t_end;
+        ELM327_PROBE4(recv, char_idx, c == '>', t_first - t_start, t_end - t_first);
     }
 
+    return elm327_parse_msgs(buf, n_msgs, ascii);
+}
+
+
+elm327_msg_t *elm327_parse_msgs(const char *buf, int *n_msgs, int ascii)
+{
+    int                    msg_idx, char_idx, i, n_lines;
+    const char            *st, *look;
+    elm327_msg_t          *msgs;
+    elm327_msg_as_ascii_t *ascii_msgs;
+
     /* Remove the echo'd command from the buffer */
     if (!(st = strchr(buf, '\n')))
-      return NULL;
+    {
+        errno = EPROTO;
+        return NULL;
+    }
     ++st;
 
+    /* The first request after ATSP0 makes the ELM search for the protocol */
+    if (!strncmp(st, "SEARCHING", 9) && (look = strchr(st, '\n')))
+      st = look + 1;
+
     /* Count number of messages */
     n_lines = 0;
     look = st;
@@ -280,6 +532,108 @@ unsigned char elm327_hexascii_to_digit(unsigned char hex)
 }
 
 
+#define X ELM327_HEX_INVALID
+const unsigned char elm327_hex_lut[256] =
+{
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,  /* '0'-'9' */
+    X,10,11,12,13,14,15, X, X, X, X, X, X, X, X, X,  /* 'A'-'F' */
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X,10,11,12,13,14,15, X, X, X, X, X, X, X, X, X,  /* 'a'-'f' */
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+#undef X
+
+
+int elm327_hex_to_bytes(
+    const char    *src,
+    int            len,
+    unsigned char *dst,
+    int            max)
+{
+    const unsigned char *p = (const unsigned char *)src;
+    const unsigned char *end = p + len;
+    unsigned char        high, low;
+    int                  n = 0;
+
+    while (p < end)
+    {
+        if (*p == ' ')
+        {
+            ++p;
+            continue;
+        }
+
+        if ((p + 1 >= end) ||
+            ((high = elm327_hex_lut[p[0]]) == ELM327_HEX_INVALID) ||
+            ((low = elm327_hex_lut[p[1]]) == ELM327_HEX_INVALID))
+          return -1;
+
+        if (n < max)
+          dst[n] = (high << 4) | low;
+        ++n;
+        p += 2;
+    }
+
+    return (n > max) ? max : n;
+}
+
+
+int elm327_parse_monitor_line(
+    const char         *line,
+    int                 len,
+    elm327_can_frame_t *frame)
+{
+    const unsigned char *p = (const unsigned char *)line;
+    unsigned int         id = 0;
+    int                  i, id_len, n;
+
+    /* Tolerate the '\r' the adapter ends lines with and leading blanks */
+    while ((len > 0) && ((p[len-1] == '\r') || (p[len-1] == ' ')))
+      --len;
+    while ((len > 0) && (*p == ' '))
+    {
+        ++p;
+        --len;
+    }
+
+    /* The header is the first token, 3 digits for 11 bit and 8 for 29 bit */
+    for (id_len=0; (id_len < len) && (p[id_len] != ' '); ++id_len)
+      ;
+    if ((id_len != 3) && (id_len != 8))
+      return -1;
+
+    for (i=0; i<id_len; ++i)
+    {
+        if (elm327_hex_lut[p[i]] == ELM327_HEX_INVALID)
+          return -1;
+        id = (id << 4) | elm327_hex_lut[p[i]];
+    }
+
+    n = elm327_hex_to_bytes((const char *)p + id_len, len - id_len,
+                            frame->data, OBD_MAX_MSG_SIZE);
+    if (n < 0)
+      return -1;
+
+    frame->id = id;
+    frame->extended = (id_len == 8);
+    frame->dlc = n;
+    memset(frame->data + n, 0, OBD_MAX_MSG_SIZE - n);
+
+    return 0;
+}
+
+
 unsigned char elm327_digit_to_hexascii(unsigned char dig)
 {
     if (dig >= 10)
@@ -2,6 +2,11 @@
 #define _ELM327_H
 
 #include <termios.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 
 /* NOTE: This library assumes that the ELM 327 chip is being used.  Therefore,
@@ -58,7 +63,9 @@ typedef unsigned char elm327_msg_t[OBD_MAX_MSG_SIZE];
 typedef unsigned char elm327_msg_as_ascii_t[OBD_MAX_ASCII_MSG_SIZE];
 
 
-/* Returns file descriptor */
+/* Returns file descriptor.  "loopback:<table>" opens an in-memory adapter
+ * answering from a response table (elm327loopback.h).
+ */
 extern int elm327_init(const char *device_path);
 
 
@@ -108,13 +115,61 @@ extern int elm327_send_msg(int fd, elm327_msg_t msg);
  * format.
  */
 extern elm327_msg_t *elm327_recv_msgs(int fd, int *n_msgs, int ascii);
+
+
+/* The parsing half of elm327_recv_msgs(): 'buf' is the NUL terminated text
+ * read from the ELM up to (not including) the prompt, echo first and lines
+ * ending in '\n'.
+ */
+extern elm327_msg_t *elm327_parse_msgs(const char *buf, int *n_msgs, int ascii);
 extern void elm327_destroy_recv_msgs(elm327_msg_t *msgs);
 
 
+/* Descriptors from here up are loopback adapters, served by function calls
+ * in the process instead of the kernel
+ */
+#define ELM327_LOOPBACK_FD_BASE 0x40000000
+#define ELM327_IS_LOOPBACK(_fd) ((_fd) >= ELM327_LOOPBACK_FD_BASE)
+
+
+/* read() and write() of the adapter, whichever kind it is */
+extern ssize_t elm327_read(int fd, void *buf, size_t len);
+extern ssize_t elm327_write(int fd, const void *buf, size_t len);
+
+
+/* Wait up to 'timeout_ms' (-1 for ever) for data from the ELM.  Returns 1
+ * when there is some, 0 on timeout and -1 on error (EIO when the device is
+ * gone).
+ */
+extern int elm327_wait_readable(int fd, int timeout_ms);
+
+
+/* Send a raw command line ("ATWS", "0100"), the carriage return is added.
+ * Returns 0 or -1 with errno set.
+ */
+extern int elm327_send_cmd(int fd, const char *cmd);
+
+
+/* Discard input until the ELM is ready for a command: the '>' prompt, or
+ * the blank line that ends a response when the tty holds the prompt back.
+ * Returns 0, or -1 with errno ETIMEDOUT or EIO.
+ */
+extern int elm327_wait_prompt(int fd, int timeout_ms);
+
+
+/* Read a whole response as text, up to the prompt or the blank line before
+ * it.  Carriage returns become '\n', a prompt left over from the previous
+ * response is skipped.  Every read waits at most 'timeout_ms'.  Returns the
+ * length of the NUL terminated text in 'buf', or -1 with errno ETIMEDOUT,
+ * EIO or EMSGSIZE (the response was consumed but did not fit).
+ */
+extern int elm327_read_response(int fd, char *buf, size_t len, int timeout_ms);
+
+
 /* Flush both input and output buffers to/from ELM327
  * _fd: File descriptor to flush
  */
-#define elm327_flush(_fd) tcflush(_fd, TCIOFLUSH)
+extern int elm327_flush(int fd);
 
 
 /* Convert either a ascii character(hexadecimal) to ascii decimal
@@ -124,4 +179,46 @@ unsigned char elm327_hexascii_to_digit(unsigned char hex);
 unsigned char elm327_digit_to_hexascii(unsigned char dig);
 
 
+/* Table driven hex decoding.  Entries are the nybble value of a hex digit
+ * (either case) and ELM327_HEX_INVALID for everything else.
+ */
+#define ELM327_HEX_INVALID 0xFF
+extern const unsigned char elm327_hex_lut[256];
+
+
+/* Decode up to 'max' bytes of ELM style hex ("41 0D 32" or "410D32") from
+ * the 'len' characters at 'src'.  Spaces are skipped.  Returns the number of
+ * bytes decoded or -1 if a non hex character (or an odd digit) is found.
+ */
+extern int elm327_hex_to_bytes(
+    const char    *src,
+    int            len,
+    unsigned char *dst,
+    int            max);
+
+
+/* A frame as printed by the ELM327 in monitor mode (ATMA) with headers on */
+typedef struct _elm327_can_frame
+{
+    unsigned int  id;
+    unsigned char extended;   /* 29 bit identifier */
+    unsigned char dlc;
+    unsigned char data[OBD_MAX_MSG_SIZE];
+} elm327_can_frame_t;
+
+
+/* Parse one monitor line ("7E8 03 41 0D 32" or "18DAF110 03 41 0D 32"), the
+ * line terminator is not part of 'len'.  Returns 0 on success and -1 if the
+ * line is not a frame (prompt, "BUFFER FULL", garbage...).
+ */
+extern int elm327_parse_monitor_line(
+    const char         *line,
+    int                 len,
+    elm327_can_frame_t *frame);
+
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* _ELM327_H */
@@ -0,0 +1,737 @@
+#ifndef _ELM327_HPP
+#define _ELM327_HPP
+
+/* C++20 coroutine client over elm327.h, for collectors that embed the
+ * library.
+ *
+ * The C calls block a thread per adapter until the ELM answers.  Here the
+ * adapter descriptor is non-blocking and a query is a coroutine: it writes the
+ * command and suspends until epoll reports the reply readable (or its timeout
+ * expires), so one thread drives as many adapters and outstanding requests as
+ * there are.
+ *
+ *   elm327::task<> log_rpm(elm327::client &car)
+ *   {
+ *       elm327::messages rpm = co_await car.query(OBD_MODE_1, 0x0C);
+ *       ...
+ *   }
+ *
+ *   elm327::loop   loop;
+ *   elm327::client car(loop, elm327::device("/dev/ttyUSB0"));
+ *
+ *   loop.spawn(log_rpm(car));
+ *   loop.run();
+ *
+ * An adapter is half duplex: the requests of a client queue up and go out
+ * one at a time, in order.  A loop and its clients belong to the thread that
+ * runs it; to use more cores run a loop per thread, coroutines move between
+ * loops with co_await other.schedule().  Errors are std::system_error with
+ * the errno of the C library (ETIMEDOUT when the ELM does not answer).
+ *
+ * Link with the library (make libelm327.a) and the Makefile's LDLIBS
+ * (-lpthread -lm, -lsqlite3 when it was built with SQLite).
+ */
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "elm327.h"
+
+
+namespace elm327
+{
+
+using clock = std::chrono::steady_clock;
+
+
+[[noreturn]] inline void throw_errno(int error, const char *what)
+{
+    throw std::system_error(error, std::generic_category(), what);
+}
+
+
+/* An adapter set up by elm327_init(), put back by elm327_shutdown() */
+class device
+{
+public:
+    explicit device(const char *path) : fd_(elm327_init(path))
+    {
+        int flags;
+
+        if (fd_ == -1)
+          throw_errno(errno, path);
+        if (((flags = fcntl(fd_, F_GETFL)) == -1) || (fcntl(fd_, F_SETFL, flags | O_NONBLOCK) == -1))
+        {
+            int error = errno;
+
+            elm327_shutdown(fd_);
+            throw_errno(error, path);
+        }
+    }
+
+    device(device &&other) noexcept : fd_(std::exchange(other.fd_, -1)) {}
+
+    device &operator=(device &&other) noexcept
+    {
+        if (this != &other)
+        {
+            elm327_shutdown(fd_);
+            fd_ = std::exchange(other.fd_, -1);
+        }
+        return *this;
+    }
+
+    device(const device &) = delete;
+    device &operator=(const device &) = delete;
+
+    ~device() { elm327_shutdown(fd_); }
+
+    int fd() const noexcept { return fd_; }
+
+private:
+    int fd_;
+};
+
+
+/* Text of one reply, NUL terminated, owned by one holder at a time */
+class buffer
+{
+public:
+    explicit buffer(size_t capacity = 0) :
+        data_(capacity ? new char[capacity + 1] : nullptr), size_(0), capacity_(capacity)
+    {
+        if (data_)
+          data_[0] = '\0';
+    }
+
+    buffer(buffer &&) noexcept = default;
+    buffer &operator=(buffer &&) noexcept = default;
+    buffer(const buffer &) = delete;
+    buffer &operator=(const buffer &) = delete;
+
+    /* false when full */
+    bool push_back(char c) noexcept
+    {
+        if (size_ == capacity_)
+          return false;
+        data_[size_++] = c;
+        data_[size_] = '\0';
+        return true;
+    }
+
+    const char      *c_str() const noexcept { return data_ ? data_.get() : ""; }
+    std::string_view view() const noexcept { return std::string_view(c_str(), size_); }
+    size_t           size() const noexcept { return size_; }
+    bool             empty() const noexcept { return !size_; }
+
+private:
+    std::unique_ptr<char[]> data_;
+    size_t                  size_;
+    size_t                  capacity_;
+};
+
+
+/* Decoded answers of elm327_parse_msgs(), one per ECU that replied */
+class messages
+{
+public:
+    messages() noexcept : n_(0) {}
+    messages(elm327_msg_t *msgs, int n) noexcept : msgs_(msgs), n_(n) {}
+
+    messages(messages &&) noexcept = default;
+    messages &operator=(messages &&) noexcept = default;
+    messages(const messages &) = delete;
+    messages &operator=(const messages &) = delete;
+
+    int                 size() const noexcept { return n_; }
+    bool                empty() const noexcept { return !n_; }
+    const elm327_msg_t &operator[](int i) const noexcept { return msgs_[i]; }
+    const elm327_msg_t *begin() const noexcept { return msgs_.get(); }
+    const elm327_msg_t *end() const noexcept { return msgs_.get() + n_; }
+
+private:
+    struct destroy
+    {
+        void operator()(elm327_msg_t *msgs) const noexcept { elm327_destroy_recv_msgs(msgs); }
+    };
+
+    std::unique_ptr<elm327_msg_t[], destroy> msgs_;
+    int                                      n_;
+};
+
+
+namespace detail
+{
+
+struct final_awaiter
+{
+    bool await_ready() const noexcept { return false; }
+
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) const noexcept
+    {
+        std::coroutine_handle<> next = h.promise().continuation;
+
+        return next ? next : std::noop_coroutine();
+    }
+
+    void await_resume() const noexcept {}
+};
+
+
+struct promise_base
+{
+    std::coroutine_handle<> continuation;
+    std::exception_ptr      error;
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    final_awaiter       final_suspend() const noexcept { return {}; }
+    void                unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+
+template <typename T>
+struct promise : promise_base
+{
+    std::optional<T> value;
+
+    template <typename U>
+    void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+
+    T result()
+    {
+        if (error)
+          std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+
+template <>
+struct promise<void> : promise_base
+{
+    void return_void() noexcept {}
+
+    void result()
+    {
+        if (error)
+          std::rethrow_exception(error);
+    }
+};
+
+
+/* Started right away and gone when done, for loop::spawn() */
+struct detached
+{
+    struct promise_type
+    {
+        detached            get_return_object() const noexcept { return {}; }
+        std::suspend_never  initial_suspend() const noexcept { return {}; }
+        std::suspend_never  final_suspend() const noexcept { return {}; }
+        void                return_void() const noexcept {}
+        void                unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+} // namespace detail
+
+
+/* A coroutine that starts when awaited and resumes its awaiter when done */
+template <typename T = void>
+class task
+{
+public:
+    struct promise_type : detail::promise<T>
+    {
+        task get_return_object() noexcept
+        {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+
+    task(task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+
+    task &operator=(task &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (h_)
+              h_.destroy();
+            h_ = std::exchange(other.h_, {});
+        }
+        return *this;
+    }
+
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+
+    ~task()
+    {
+        if (h_)
+          h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        h_.promise().continuation = awaiter;
+        return h_;
+    }
+
+    T await_resume() { return h_.promise().result(); }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h) noexcept : h_(h) {}
+
+    std::coroutine_handle<promise_type> h_;
+};
+
+
+/* epoll, timers and a run queue.  Everything but post(), schedule() and
+ * stop() is for the thread in run().
+ */
+class loop
+{
+public:
+    struct waiter;
+    using timers = std::multimap<clock::time_point, waiter *>;
+
+    /* A suspended coroutine waiting for a descriptor, a deadline or both */
+    struct waiter
+    {
+        std::coroutine_handle<> h;
+        int                     fd = -1;
+        bool                    timed_out = false;
+        bool                    timed = false;
+        timers::iterator        timer;
+    };
+
+    loop() : epfd_(epoll_create1(EPOLL_CLOEXEC)), evfd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    {
+        struct epoll_event ev = {};
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        if ((epfd_ == -1) || (evfd_ == -1) || (epoll_ctl(epfd_, EPOLL_CTL_ADD, evfd_, &ev) == -1))
+        {
+            int error = errno;
+
+            close_fds();
+            throw_errno(error, "loop");
+        }
+    }
+
+    loop(const loop &) = delete;
+    loop &operator=(const loop &) = delete;
+
+    ~loop() { close_fds(); }
+
+    /* Run 'work' up to its first suspension, run() does the rest */
+    void spawn(task<> work)
+    {
+        ++active_;
+        drive(std::move(work));
+    }
+
+    /* Until every spawned task is done and nothing waits here, or stop().
+     * The first exception a spawned task let out is rethrown.
+     */
+    void run()
+    {
+        struct epoll_event evs[64];
+        int                n, i, timeout;
+
+        stopped_ = false;
+        while (!stopped_ && (active_ || waiting_ || !ready_.empty()))
+        {
+            timeout = ready_.empty() ? next_timeout() : 0;
+            if ((n = epoll_wait(epfd_, evs, 64, timeout)) == -1)
+            {
+                if (errno == EINTR)
+                  continue;
+                throw_errno(errno, "epoll_wait");
+            }
+
+            for (i = 0; i < n; ++i)
+            {
+                waiter *w = static_cast<waiter *>(evs[i].data.ptr);
+
+                if (!w)
+                {
+                    take_posted();
+                    continue;
+                }
+                if (w->timed)
+                  timers_.erase(w->timer);
+                w->timed = false;
+                --waiting_;
+                ready_.push_back(w->h);
+            }
+
+            expire(clock::now());
+
+            /* Resumed in order, whatever they queue goes to the next round */
+            for (size_t k = ready_.size(); k; --k)
+            {
+                std::coroutine_handle<> h = ready_.front();
+
+                ready_.pop_front();
+                h.resume();
+            }
+
+            if (error_)
+              std::rethrow_exception(std::exchange(error_, nullptr));
+        }
+    }
+
+    /* From any thread */
+    void stop()
+    {
+        stopped_ = true;
+        wake();
+    }
+
+    /* Resume 'h' on this loop, from any thread */
+    void post(std::coroutine_handle<> h)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            posted_.push_back(h);
+        }
+        wake();
+    }
+
+    /* co_await loop.schedule(): continue on this loop */
+    auto schedule()
+    {
+        struct awaiter
+        {
+            loop &l;
+
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) { l.post(h); }
+            void await_resume() const noexcept {}
+        };
+
+        return awaiter{ *this };
+    }
+
+    /* Resume 'h' on the next round, loop thread only */
+    void defer(std::coroutine_handle<> h) { ready_.push_back(h); }
+
+    /* co_await: true when 'fd' is ready for 'events', false at 'deadline' */
+    auto wait(int fd, uint32_t events, clock::time_point deadline)
+    {
+        struct awaiter
+        {
+            loop             &l;
+            int               fd;
+            uint32_t          events;
+            clock::time_point deadline;
+            waiter            w;
+
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(std::coroutine_handle<> h)
+            {
+                w.h = h;
+                w.fd = fd;
+                l.arm(w, events, deadline);
+            }
+
+            bool await_resume() const noexcept { return !w.timed_out; }
+        };
+
+        return awaiter{ *this, fd, events, deadline, {} };
+    }
+
+    auto sleep_until(clock::time_point deadline) { return wait(-1, 0, deadline); }
+    auto sleep_for(clock::duration d) { return wait(-1, 0, clock::now() + d); }
+
+private:
+    detail::detached drive(task<> work)
+    {
+        try
+        {
+            co_await std::move(work);
+        }
+        catch (...)
+        {
+            if (!error_)
+              error_ = std::current_exception();
+        }
+        --active_;
+    }
+
+    void arm(waiter &w, uint32_t events, clock::time_point deadline)
+    {
+        if (w.fd != -1)
+        {
+            struct epoll_event ev = {};
+
+            ev.events = events | EPOLLONESHOT;
+            ev.data.ptr = &w;
+            if ((epoll_ctl(epfd_, EPOLL_CTL_MOD, w.fd, &ev) == -1) &&
+                ((errno != ENOENT) || (epoll_ctl(epfd_, EPOLL_CTL_ADD, w.fd, &ev) == -1)))
+              throw_errno(errno, "epoll_ctl");
+        }
+        if (deadline != clock::time_point::max())
+        {
+            w.timer = timers_.emplace(deadline, &w);
+            w.timed = true;
+        }
+        ++waiting_;
+    }
+
+    void expire(clock::time_point now)
+    {
+        while (!timers_.empty() && (timers_.begin()->first <= now))
+        {
+            waiter *w = timers_.begin()->second;
+
+            timers_.erase(timers_.begin());
+            w->timed = false;
+            w->timed_out = true;
+            if (w->fd != -1)
+            {
+                struct epoll_event ev = {};
+
+                ev.data.ptr = w;
+                epoll_ctl(epfd_, EPOLL_CTL_MOD, w->fd, &ev);
+            }
+            --waiting_;
+            ready_.push_back(w->h);
+        }
+    }
+
+    int next_timeout() const
+    {
+        if (timers_.empty())
+          return -1;
+
+        auto left = timers_.begin()->first - clock::now();
+        if (left <= clock::duration::zero())
+          return 0;
+
+        /* Rounded up, waking early would only spin */
+        return (int)std::chrono::ceil<std::chrono::milliseconds>(left).count();
+    }
+
+    void take_posted()
+    {
+        uint64_t n;
+
+        if (read(evfd_, &n, sizeof(n)) == -1)
+          return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (!posted_.empty())
+        {
+            ready_.push_back(posted_.front());
+            posted_.pop_front();
+        }
+    }
+
+    void wake()
+    {
+        uint64_t one = 1;
+
+        if (write(evfd_, &one, sizeof(one)) == -1)
+          return;
+    }
+
+    void close_fds()
+    {
+        if (epfd_ != -1)
+          close(epfd_);
+        if (evfd_ != -1)
+          close(evfd_);
+    }
+
+    int                                 epfd_;
+    int                                 evfd_;
+    timers                              timers_;
+    std::deque<std::coroutine_handle<>> ready_;
+    size_t                              active_ = 0;
+    size_t                              waiting_ = 0;
+    std::exception_ptr                  error_;
+    std::atomic<bool>                   stopped_ = false;
+    std::mutex                          mutex_;
+    std::deque<std::coroutine_handle<>> posted_;
+};
+
+
+/* One adapter on a loop.  Requests queue up and are sent one at a time. */
+class client
+{
+public:
+    /* Largest reply kept, a full Mode 09 multi-frame answer fits */
+    static constexpr size_t max_reply = 4096;
+
+    client(loop &l, device dev, std::chrono::milliseconds timeout = std::chrono::seconds(3)) :
+        loop_(l), dev_(std::move(dev)), timeout_(timeout)
+    {
+    }
+
+    client(const client &) = delete;
+    client &operator=(const client &) = delete;
+
+    loop &get_loop() noexcept { return loop_; }
+
+    /* Send 'cmd' (e.g. "ATRV", "0902") and return the reply as the ELM
+     * wrote it, echo first, up to the prompt
+     */
+    task<buffer> command(std::string cmd)
+    {
+        co_await turn{ *this };
+        release_on_exit release{ *this };
+
+        cmd += '\r';
+        for (size_t off = 0; off < cmd.size(); )
+        {
+            ssize_t w = ::write(dev_.fd(), cmd.data() + off, cmd.size() - off);
+
+            if (w > 0)
+              off += w;
+            else if (errno == EAGAIN)
+            {
+                if (!co_await loop_.wait(dev_.fd(), EPOLLOUT, clock::now() + timeout_))
+                  throw_errno(ETIMEDOUT, "write");
+            }
+            else if (errno != EINTR)
+              throw_errno(errno, "write");
+        }
+
+        /* The rules of elm327_read_response(): a leading prompt or blank
+         * lines belong to the previous reply, the reply ends at the prompt or
+         * a blank line
+         */
+        buffer reply(max_reply);
+        char   chunk[256], prev = 0;
+        bool   done = false;
+
+        while (!done)
+        {
+            ssize_t r = ::read(dev_.fd(), chunk, sizeof(chunk));
+
+            if (r == 0)
+              throw_errno(EIO, "read");
+            if (r == -1)
+            {
+                if (errno == EINTR)
+                  continue;
+                if (errno != EAGAIN)
+                  throw_errno(errno, "read");
+                if (!co_await loop_.wait(dev_.fd(), EPOLLIN, clock::now() + timeout_))
+                  throw_errno(ETIMEDOUT, "read");
+                continue;
+            }
+
+            for (ssize_t k = 0; (k < r) && !done; ++k)
+            {
+                char c = (chunk[k] == '\r') ? '\n' : chunk[k];
+
+                if (reply.empty() && ((c == '>') || (c == '\n')))
+                  continue;
+                if ((c == '>') || ((c == '\n') && (prev == '\n')))
+                  done = true;
+                else if (!reply.push_back(c))
+                  throw_errno(EMSGSIZE, "read");
+                prev = c;
+            }
+        }
+
+        co_return reply;
+    }
+
+    /* Request 'pid' of 'mode', no answers for NO DATA */
+    task<messages> query(OBD_MODE mode, OBD_PARAM pid)
+    {
+        char cmd[8];
+
+        snprintf(cmd, sizeof(cmd), "%02X%02X", (unsigned)mode & 0xFF, pid & 0xFF);
+        buffer reply = co_await command(cmd);
+
+        /* Past the echo and a protocol search to the first answer */
+        const char *line = strchr(reply.c_str(), '\n');
+        line = line ? line + 1 : reply.c_str();
+        if (!strncmp(line, "SEARCHING", 9) && strchr(line, '\n'))
+          line = strchr(line, '\n') + 1;
+        if (!strncmp(line, "NO DATA", 7))
+          co_return messages();
+        if (elm327_hex_lut[(unsigned char)*line] == ELM327_HEX_INVALID)
+          throw std::system_error(EPROTO, std::generic_category(), line);
+
+        int           n = 0;
+        elm327_msg_t *msgs = elm327_parse_msgs(reply.c_str(), &n, 0);
+
+        if (!msgs)
+          throw_errno(errno, cmd);
+        co_return messages(msgs, n);
+    }
+
+private:
+    /* Waits for the adapter to be free, FIFO */
+    struct turn
+    {
+        client &c;
+
+        bool await_ready() const noexcept
+        {
+            if (c.busy_)
+              return false;
+            c.busy_ = true;
+            return true;
+        }
+
+        void await_suspend(std::coroutine_handle<> h) { c.queue_.push_back(h); }
+        void await_resume() const noexcept {}
+    };
+
+    /* Hands the adapter to the next in line, which runs on the next round */
+    struct release_on_exit
+    {
+        client &c;
+
+        ~release_on_exit()
+        {
+            if (c.queue_.empty())
+            {
+                c.busy_ = false;
+                return;
+            }
+            c.loop_.defer(c.queue_.front());
+            c.queue_.pop_front();
+        }
+    };
+
+    loop                               &loop_;
+    device                              dev_;
+    std::chrono::milliseconds           timeout_;
+    bool                                busy_ = false;
+    std::deque<std::coroutine_handle<>> queue_;
+};
+
+} // namespace elm327
+
+
+#endif /* _ELM327_HPP */
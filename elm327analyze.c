@@ -0,0 +1,432 @@
+/*
+ * elm327analyze.c
+ *
+ * Offline per channel statistics over binary sample logs.
+ *
+ * Every log is memory mapped and cut into runs of whole blocks.  Each run is a
+ * task on the work stealing pool, and each worker folds the records it sees
+ * into its own channel table, so the hot loop takes no locks and shares no
+ * cache lines.  The per-worker tables are merged once all tasks are done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "elm327log.h"
+#include "elm327pool.h"
+#include "elm327cmd.h"
+
+
+/* Blocks handed to a worker at a time (1MiB) */
+#define ANALYZE_CHUNK_BLOCKS 256
+
+
+/* Running statistics for one channel (Welford) */
+typedef struct _channel_stats
+{
+    uint32_t channel;
+    uint32_t used;
+    uint64_t count;
+    double   mean;
+    double   m2;
+    double   min;
+    double   max;
+    uint64_t first_us;
+    uint64_t last_us;
+} channel_stats_t;
+
+
+/* Open addressed channel -> stats table, one per worker */
+typedef struct _stats_table
+{
+    channel_stats_t *slots;
+    size_t           cap;      /* Power of two */
+    size_t           n_used;
+    uint64_t         samples;
+    uint64_t         lost;     /* Not folded in for want of memory */
+} __attribute__((aligned(64))) stats_table_t;
+
+
+typedef struct _analyze_task
+{
+    const elm327_log_map_t *map;
+    size_t                  first_block;
+    size_t                  n_blocks;
+    stats_table_t          *tables;
+} analyze_task_t;
+
+
+static size_t channel_hash(uint32_t channel, size_t cap)
+{
+    return ((channel * 2654435761u) >> 7) & (cap - 1);
+}
+
+
+static int table_init(stats_table_t *t, size_t cap)
+{
+    memset(t, 0, sizeof(stats_table_t));
+    if (!(t->slots = calloc(cap, sizeof(channel_stats_t))))
+      return -1;
+    t->cap = cap;
+
+    return 0;
+}
+
+
+static channel_stats_t *table_slot(stats_table_t *t, uint32_t channel);
+
+
+static int table_grow(stats_table_t *t)
+{
+    stats_table_t    bigger;
+    channel_stats_t *slot;
+    size_t           i;
+
+    if (table_init(&bigger, t->cap * 2) == -1)
+      return -1;
+
+    for (i=0; i<t->cap; ++i)
+    {
+        if (!t->slots[i].used)
+          continue;
+
+        slot = table_slot(&bigger, t->slots[i].channel);
+        *slot = t->slots[i];
+    }
+
+    bigger.samples = t->samples;
+    bigger.lost = t->lost;
+    free(t->slots);
+    *t = bigger;
+
+    return 0;
+}
+
+
+/* Find or insert the slot of 'channel', NULL when out of memory */
+static channel_stats_t *table_slot(stats_table_t *t, uint32_t channel)
+{
+    size_t           i;
+    channel_stats_t *slot;
+
+    for (;;)
+    {
+        i = channel_hash(channel, t->cap);
+        for (;;)
+        {
+            slot = &t->slots[i];
+            if (slot->used && (slot->channel == channel))
+              return slot;
+            if (!slot->used)
+              break;
+            i = (i + 1) & (t->cap - 1);
+        }
+
+        /* Keep the load factor under a half */
+        if ((t->n_used + 1) * 2 <= t->cap)
+          break;
+        if (table_grow(t) == -1)
+          return NULL;
+    }
+
+    slot->used = 1;
+    slot->channel = channel;
+    slot->min = INFINITY;
+    slot->max = -INFINITY;
+    ++t->n_used;
+
+    return slot;
+}
+
+
+static void stats_add(channel_stats_t *s, uint64_t ts, double v)
+{
+    double delta;
+
+    ++s->count;
+    delta = v - s->mean;
+    s->mean += delta / s->count;
+    s->m2 += delta * (v - s->mean);
+
+    if (v < s->min)
+      s->min = v;
+    if (v > s->max)
+      s->max = v;
+    if (!s->first_us || (ts < s->first_us))
+      s->first_us = ts;
+    if (ts > s->last_us)
+      s->last_us = ts;
+}
+
+
+/* Fold 'b' into 'a' (Chan et al. pairwise update) */
+static void stats_merge(channel_stats_t *a, const channel_stats_t *b)
+{
+    uint64_t n;
+    double   delta;
+
+    if (b->count == 0)
+      return;
+
+    n = a->count + b->count;
+    delta = b->mean - a->mean;
+    a->mean += delta * b->count / n;
+    a->m2 += b->m2 + delta * delta * ((double)a->count * b->count / n);
+    a->count = n;
+
+    if (b->min < a->min)
+      a->min = b->min;
+    if (b->max > a->max)
+      a->max = b->max;
+    if (!a->first_us || (b->first_us && (b->first_us < a->first_us)))
+      a->first_us = b->first_us;
+    if (b->last_us > a->last_us)
+      a->last_us = b->last_us;
+}
+
+
+static void analyze_chunk(void *arg, int worker)
+{
+    analyze_task_t            *task = arg;
+    stats_table_t             *t = &task->tables[worker];
+    const elm327_log_record_t *rec, *end;
+    channel_stats_t           *slot = NULL;
+
+    rec = elm327_log_map_block(task->map, task->first_block);
+    end = rec + task->n_blocks * ELM327_LOG_BLOCK_RECORDS;
+
+    for (; rec<end; ++rec)
+    {
+        /* Padding at the end of a block */
+        if (rec->timestamp_us == 0)
+          continue;
+
+        /* Logs cycle through channels, but repeats are common enough */
+        if (!slot || (slot->channel != rec->channel))
+          if (!(slot = table_slot(t, rec->channel)))
+          {
+              ++t->lost;
+              continue;
+          }
+
+        stats_add(slot, rec->timestamp_us, rec->value);
+        ++t->samples;
+    }
+}
+
+
+static int stats_cmp(const void *a, const void *b)
+{
+    const channel_stats_t *sa = a, *sb = b;
+
+    return (sa->channel > sb->channel) - (sa->channel < sb->channel);
+}
+
+
+static double elapsed_seconds(const struct timespec *st)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - st->tv_sec) + (now.tv_nsec - st->tv_nsec) / 1e9;
+}
+
+
+static void analyze_usage(const char *prog)
+{
+    printf("Usage:\n");
+    printf("  %s analyze [-j <threads>] <log> [<log>...]\n", prog);
+    printf("Options:\n");
+    printf("  -j <int>     worker threads (default: one per cpu)\n");
+}
+
+
+int elm327_cmd_analyze(int argc, char *argv[])
+{
+    int               i, n_threads = 0, n_files, err = 0;
+    size_t            n_tasks, t, blk, slot;
+    uint64_t          samples = 0;
+    double            secs, stddev;
+    struct timespec   start;
+    elm327_log_map_t *maps;
+    analyze_task_t   *tasks;
+    stats_table_t    *tables, merged;
+    channel_stats_t  *out, *dst;
+    elm327_pool_t    *pool;
+
+    for (i=1; i<argc; ++i)
+    {
+        if (!strcmp(argv[i], "-j") && (i < argc-1))
+          n_threads = atoi(argv[++i]);
+        else if (argv[i][0] == '-')
+        {
+            analyze_usage("elm327diag");
+            return 1;
+        }
+        else
+          break;
+    }
+
+    if ((n_files = argc - i) <= 0)
+    {
+        analyze_usage("elm327diag");
+        return 1;
+    }
+    argv += i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Map everything up front so chunks can be sized */
+    if (!(maps = calloc(n_files, sizeof(elm327_log_map_t))))
+      return 1;
+
+    n_tasks = 0;
+    for (i=0; i<n_files; ++i)
+    {
+        if (elm327_log_map(argv[i], &maps[i]) == -1)
+        {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+            err = 1;
+            continue;
+        }
+        n_tasks += (maps[i].n_blocks + ANALYZE_CHUNK_BLOCKS - 1) / ANALYZE_CHUNK_BLOCKS;
+    }
+
+    /* Statistics without a log would pass for those of all of them */
+    if (err)
+      goto done_maps;
+
+    if (!(pool = elm327_pool_create(n_threads)))
+    {
+        fprintf(stderr, "unable to start worker threads\n");
+        err = 1;
+        goto done_maps;
+    }
+    n_threads = elm327_pool_size(pool);
+
+    tasks = calloc(n_tasks ? n_tasks : 1, sizeof(analyze_task_t));
+    tables = aligned_alloc(64, n_threads * sizeof(stats_table_t));
+    if (!tasks || !tables)
+    {
+        err = 1;
+        goto done_pool;
+    }
+    memset(tables, 0, n_threads * sizeof(stats_table_t));
+    for (i=0; i<n_threads; ++i)
+    {
+        if (table_init(&tables[i], 64) == -1)
+        {
+            fprintf(stderr, "analyze: %s\n", strerror(ENOMEM));
+            err = 1;
+            goto done_tables;
+        }
+    }
+
+    t = 0;
+    for (i=0; !err && (i<n_files); ++i)
+    {
+        for (blk=0; maps[i].base && (blk<maps[i].n_blocks); blk+=ANALYZE_CHUNK_BLOCKS)
+        {
+            tasks[t].map = &maps[i];
+            tasks[t].first_block = blk;
+            tasks[t].n_blocks = maps[i].n_blocks - blk;
+            if (tasks[t].n_blocks > ANALYZE_CHUNK_BLOCKS)
+              tasks[t].n_blocks = ANALYZE_CHUNK_BLOCKS;
+            tasks[t].tables = tables;
+
+            if (elm327_pool_submit(pool, analyze_chunk, &tasks[t]) == -1)
+            {
+                fprintf(stderr, "analyze: unable to queue work: %s\n", strerror(ENOMEM));
+                err = 1;
+                break;
+            }
+            ++t;
+        }
+    }
+
+    /* Even on error, the tasks queued must be done with the tables */
+    elm327_pool_wait(pool);
+    if (err)
+      goto done_tables;
+
+    /* Merge the per worker partial aggregates */
+    if (table_init(&merged, 256) == -1)
+    {
+        fprintf(stderr, "analyze: %s\n", strerror(ENOMEM));
+        err = 1;
+        goto done_tables;
+    }
+    for (i=0; i<n_threads; ++i)
+    {
+        samples += tables[i].samples;
+        for (slot=0; slot<tables[i].cap; ++slot)
+        {
+            if (!tables[i].slots[slot].used)
+              continue;
+            if ((dst = table_slot(&merged, tables[i].slots[slot].channel)))
+              stats_merge(dst, &tables[i].slots[slot]);
+            else
+              merged.lost += tables[i].slots[slot].count;
+        }
+        merged.lost += tables[i].lost;
+    }
+
+    /* Partial statistics would pass for complete ones */
+    if (merged.lost)
+    {
+        fprintf(stderr, "analyze: %llu samples lost: %s\n",
+                (unsigned long long)merged.lost, strerror(ENOMEM));
+        free(merged.slots);
+        err = 1;
+        goto done_tables;
+    }
+
+    secs = elapsed_seconds(&start);
+
+    /* Compact and order by channel for output */
+    out = merged.slots;
+    for (slot=0, t=0; slot<merged.cap; ++slot)
+      if (merged.slots[slot].used)
+        out[t++] = merged.slots[slot];
+    qsort(out, t, sizeof(channel_stats_t), stats_cmp);
+
+    printf("mode, pid, count, min, max, mean, stddev, first_us, last_us\n");
+    for (slot=0; slot<t; ++slot)
+    {
+        stddev = (out[slot].count > 1) ? sqrt(out[slot].m2 / (out[slot].count - 1)) : 0;
+        printf("%02X, %04X, %llu, %f, %f, %f, %f, %llu, %llu\n",
+               ELM327_CHANNEL_MODE(out[slot].channel),
+               ELM327_CHANNEL_ID(out[slot].channel),
+               (unsigned long long)out[slot].count,
+               out[slot].min, out[slot].max, out[slot].mean, stddev,
+               (unsigned long long)out[slot].first_us,
+               (unsigned long long)out[slot].last_us);
+    }
+
+    fprintf(stderr, "analyzed %llu samples from %d logs in %.3f s "
+            "(%.0f samples/s, %d threads)\n",
+            (unsigned long long)samples, n_files, secs,
+            secs > 0 ? samples / secs : 0.0, n_threads);
+
+    free(merged.slots);
+
+done_tables:
+    for (i=0; tables && i<n_threads; ++i)
+      free(tables[i].slots);
+done_pool:
+    elm327_pool_destroy(pool);
+    free(tables);
+    free(tasks);
+done_maps:
+    for (i=0; i<n_files; ++i)
+      elm327_log_unmap(&maps[i]);
+    free(maps);
+
+    return err;
+}
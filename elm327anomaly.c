@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "elm327anomaly.h"
+
+
+/* Open addressing over the channels, twice their number */
+#define ANOMALY_SLOTS 512
+
+
+const char *elm327_anomaly_names[ELM327_ANOMALY_KINDS] = { "ewma", "cusum", "robust_z" };
+
+
+typedef struct _anomaly_channel
+{
+    uint32_t channel;
+    uint32_t n;
+    double   prev;
+    double   res;            /* smallest change seen, 0 before any */
+
+    /* ewma */
+    double   mean, var;
+
+    /* cusum: baseline (Welford), its inverse deviation for 'inv_res' */
+    uint32_t base_n;
+    double   base_mean, base_m2;
+    double   inv_sd, inv_res;
+    double   s_hi, s_lo;
+
+    /* robust_z */
+    double   med, mad;
+
+    uint8_t  alarm[ELM327_ANOMALY_KINDS];
+    char     names[ELM327_ANOMALY_KINDS][64];
+} anomaly_channel_t;
+
+
+struct _elm327_anomaly
+{
+    elm327_anomaly_params_t p;
+    double                  ewma_k2;     /* ewma_k squared */
+    double                  robust_kmad; /* robust_k / 0.6745, in MADs */
+
+    int                     all;
+    uint8_t                 pids[256];   /* Mode 01 PIDs followed */
+
+    uint16_t                slots[ANOMALY_SLOTS];   /* channel index + 1 */
+    anomaly_channel_t      *channels;
+    int                     n_channels;
+    uint64_t                n_events;
+};
+
+
+void elm327_anomaly_defaults(elm327_anomaly_params_t *p)
+{
+    p->warmup = 30;
+    p->cusum_warmup = 300;
+    p->ewma_alpha = 0.05;
+    p->ewma_k = 4.0;
+    p->cusum_k = 0.5;
+    p->cusum_h = 16.0;
+    p->robust_eta = 0.02;
+    p->robust_k = 3.5;
+}
+
+
+elm327_anomaly_t *elm327_anomaly_create(const char *pids, const elm327_anomaly_params_t *p)
+{
+    elm327_anomaly_t *a;
+    const char       *c;
+    char             *end;
+    unsigned long     pid;
+
+    if (!(a = calloc(1, sizeof(elm327_anomaly_t))) ||
+        !(a->channels = calloc(ELM327_ANOMALY_CHANNELS, sizeof(anomaly_channel_t))))
+    {
+        free(a);
+        return NULL;
+    }
+
+    if (p)
+      a->p = *p;
+    else
+      elm327_anomaly_defaults(&a->p);
+    if (a->p.warmup < 2)
+      a->p.warmup = 2;
+    if (a->p.cusum_warmup < a->p.warmup)
+      a->p.cusum_warmup = a->p.warmup;
+    a->ewma_k2 = a->p.ewma_k * a->p.ewma_k;
+    a->robust_kmad = a->p.robust_k / 0.6745;
+
+    if (!pids || !strcmp(pids, "all"))
+    {
+        a->all = 1;
+        return a;
+    }
+    for (c = pids; *c; c = (*end == ',') ? end + 1 : end)
+    {
+        pid = strtoul(c, &end, 16);
+        if ((end == c) || (pid > 0xFF) || ((*end != ',') && (*end != '\0')))
+        {
+            elm327_anomaly_destroy(a);
+            errno = EINVAL;
+            return NULL;
+        }
+        a->pids[pid] = 1;
+    }
+
+    return a;
+}
+
+
+/* The state of the sample's channel, NULL when it is not followed */
+static anomaly_channel_t *anomaly_channel(elm327_anomaly_t *a, const elm327_sample_t *s)
+{
+    anomaly_channel_t *c;
+    uint32_t           h = (s->channel * 2654435761u) >> 23;   /* 9 bits */
+    int                k;
+
+    for (; a->slots[h]; h = (h + 1) & (ANOMALY_SLOTS - 1))
+      if (a->channels[a->slots[h] - 1].channel == s->channel)
+        return &a->channels[a->slots[h] - 1];
+
+    if ((a->n_channels == ELM327_ANOMALY_CHANNELS) ||
+        (!a->all && ((ELM327_CHANNEL_MODE(s->channel) != 1) || !a->pids[ELM327_CHANNEL_ID(s->channel) & 0xFF])))
+      return NULL;
+
+    c = &a->channels[a->n_channels++];
+    a->slots[h] = a->n_channels;
+    c->channel = s->channel;
+    for (k = 0; k < ELM327_ANOMALY_KINDS; ++k)
+    {
+        if (s->name)
+          snprintf(c->names[k], sizeof(c->names[k]), "%s: %s", s->name, elm327_anomaly_names[k]);
+        else
+          snprintf(c->names[k], sizeof(c->names[k]), "%02X %02X: %s", ELM327_CHANNEL_MODE(s->channel),
+                   ELM327_CHANNEL_ID(s->channel), elm327_anomaly_names[k]);
+    }
+
+    return c;
+}
+
+
+static size_t anomaly_event(
+    elm327_anomaly_t      *a,
+    anomaly_channel_t     *c,
+    const elm327_sample_t *s,
+    elm327_anomaly_kind_t  kind,
+    double                 value,
+    elm327_sample_t       *e)
+{
+    e->timestamp_us = s->timestamp_us;
+    e->channel = ELM327_ANOMALY_CHANNEL(kind, s->channel);
+    e->value = value;
+    e->name = c->names[kind];
+    ++a->n_events;
+
+    return 1;
+}
+
+
+size_t elm327_anomaly_update(
+    elm327_anomaly_t      *a,
+    const elm327_sample_t *s,
+    elm327_sample_t        events[ELM327_ANOMALY_KINDS])
+{
+    const elm327_anomaly_params_t *p = &a->p;
+    anomaly_channel_t             *c;
+    double                         x = s->value, d, v, floor2, mad;
+    size_t                         n = 0;
+
+    if (!isfinite(x) || !(c = anomaly_channel(a, s)))
+      return 0;
+
+    if (c->n++ == 0)
+    {
+        c->prev = c->mean = c->med = c->base_mean = x;
+        c->base_n = 1;
+        return 0;
+    }
+
+    /* Resolution: no deviation is taken to be smaller than a step */
+    d = fabs(x - c->prev);
+    if ((d > 0) && ((d < c->res) || (c->res == 0)))
+      c->res = d;
+    c->prev = x;
+    floor2 = c->res * c->res;
+
+    /* ewma: judged against the mean so far, then folded in */
+    d = x - c->mean;
+    v = (c->var > floor2) ? c->var : floor2;
+    if (c->n > p->warmup)
+    {
+        if (d * d > a->ewma_k2 * v)
+        {
+            if (!c->alarm[ELM327_ANOMALY_EWMA])
+            {
+                c->alarm[ELM327_ANOMALY_EWMA] = 1;
+                n += anomaly_event(a, c, s, ELM327_ANOMALY_EWMA, d / sqrt(v), &events[n]);
+            }
+        }
+        else if (d * d < 0.25 * a->ewma_k2 * v)
+          c->alarm[ELM327_ANOMALY_EWMA] = 0;
+    }
+    c->mean += p->ewma_alpha * d;
+    c->var = (1.0 - p->ewma_alpha) * (c->var + p->ewma_alpha * d * d);
+
+    /* cusum: learn the baseline, then sum the standardized distance */
+    if (c->base_n < p->cusum_warmup)
+    {
+        ++c->base_n;
+        d = x - c->base_mean;
+        c->base_mean += d / c->base_n;
+        c->base_m2 += d * (x - c->base_mean);
+        c->inv_res = -1;
+    }
+    else
+    {
+        if (c->inv_res != c->res)
+        {
+            v = c->base_m2 / (c->base_n - 1);
+            v = (v > floor2) ? v : floor2;
+            c->inv_sd = (v > 0) ? 1.0 / sqrt(v) : 0;
+            c->inv_res = c->res;
+        }
+        d = (x - c->base_mean) * c->inv_sd;
+        c->s_hi = (c->s_hi + d - p->cusum_k > 0) ? c->s_hi + d - p->cusum_k : 0;
+        c->s_lo = (c->s_lo - d - p->cusum_k > 0) ? c->s_lo - d - p->cusum_k : 0;
+        if ((c->s_hi > p->cusum_h) || (c->s_lo > p->cusum_h))
+        {
+            n += anomaly_event(a, c, s, ELM327_ANOMALY_CUSUM, (c->s_hi > p->cusum_h) ? c->s_hi : -c->s_lo, &events[n]);
+
+            /* Where the channel is now is the new normal */
+            c->s_hi = c->s_lo = 0;
+            c->base_n = 0;
+            c->base_mean = c->base_m2 = 0;
+        }
+    }
+
+    /* robust_z: mean and mean deviation to start, then median and MAD by
+     * steps toward each sample
+     */
+    d = x - c->med;
+    if (c->n <= p->warmup)
+    {
+        c->med += d / c->n;
+        c->mad += (fabs(d) - c->mad) / c->n;
+    }
+    else
+    {
+        mad = (c->mad > c->res) ? c->mad : c->res;
+        if (fabs(d) > a->robust_kmad * mad)
+        {
+            if (!c->alarm[ELM327_ANOMALY_ROBUST_Z])
+            {
+                c->alarm[ELM327_ANOMALY_ROBUST_Z] = 1;
+                n += anomaly_event(a, c, s, ELM327_ANOMALY_ROBUST_Z, 0.6745 * d / mad, &events[n]);
+            }
+        }
+        else if (fabs(d) < 0.5 * a->robust_kmad * mad)
+          c->alarm[ELM327_ANOMALY_ROBUST_Z] = 0;
+
+        c->med += (d > 0) ? p->robust_eta * mad : ((d < 0) ? -p->robust_eta * mad : 0);
+        c->mad += (fabs(d) > c->mad) ? p->robust_eta * mad : -p->robust_eta * mad;
+        if (c->mad < 0)
+          c->mad = 0;
+    }
+
+    return n;
+}
+
+
+uint64_t elm327_anomaly_events(const elm327_anomaly_t *a)
+{
+    return a->n_events;
+}
+
+
+void elm327_anomaly_destroy(elm327_anomaly_t *a)
+{
+    if (!a)
+      return;
+
+    free(a->channels);
+    free(a);
+}
@@ -0,0 +1,106 @@
+#ifndef _ELM327ANOMALY_H
+#define _ELM327ANOMALY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "elm327log.h"
+#include "elm327sink.h"
+
+
+/* Streaming anomaly detection, per channel, in constant memory.
+ *
+ * Every decoded sample updates three detectors of its channel:
+ *
+ *   ewma      distance from an exponentially weighted mean, in its
+ *             exponentially weighted standard deviations: sudden jumps
+ *   cusum     two sided CUSUM of the standardized distance from a baseline
+ *             learned over the first 'cusum_warmup' samples: slow drift
+ *             (coolant creeping up, fuel trims walking lean), relearned
+ *             after each alarm.  The baseline is longer than the warmup:
+ *             the sum carries the error of the baseline mean along with
+ *             every sample, and a short one makes stationary noise drift
+ *   robust_z  0.6745 (x - median) / MAD, the median and MAD tracked by
+ *             stochastic approximation: outliers, not fooled by them
+ *
+ * None of them starts judging before 'warmup' samples.  A channel's
+ * standard deviations never go below its resolution (the smallest change
+ * seen), so a quantized sensor sitting still does not make every step an
+ * alarm.  Past the warmup an update is a handful of multiplications and
+ * compares, no division or square root unless an event is raised or the
+ * resolution gets finer.
+ *
+ * Events go out with the samples: a sample on the channel
+ * ELM327_ANOMALY_CHANNEL(kind, channel), named "<channel name>: <kind>",
+ * whose value is the statistic that crossed its threshold, negative when
+ * the channel went low.  ewma and robust_z raise an event when the channel
+ * enters alarm, not again until it has come back under half the threshold.
+ */
+typedef enum _elm327_anomaly_kind
+{
+    ELM327_ANOMALY_EWMA = 0,
+    ELM327_ANOMALY_CUSUM,
+    ELM327_ANOMALY_ROBUST_Z,
+    ELM327_ANOMALY_KINDS
+} elm327_anomaly_kind_t;
+
+
+extern const char *elm327_anomaly_names[ELM327_ANOMALY_KINDS];
+
+
+/* Event channels have the top bit of the mode set, the detector above the
+ * source mode
+ */
+#define ELM327_ANOMALY_CHANNEL(_kind, _ch) \
+    ELM327_CHANNEL(0x8000 | ((_kind) << 8) | (ELM327_CHANNEL_MODE(_ch) & 0xFF), ELM327_CHANNEL_ID(_ch))
+#define ELM327_IS_ANOMALY(_ch) (ELM327_CHANNEL_MODE(_ch) & 0x8000)
+
+
+/* Channels followed, samples of any more are not looked at */
+#define ELM327_ANOMALY_CHANNELS 256
+
+
+typedef struct _elm327_anomaly_params
+{
+    uint32_t warmup;        /* samples before judging */
+    uint32_t cusum_warmup;  /* samples of the CUSUM baseline, at least 'warmup' */
+    double   ewma_alpha;    /* weight of a new sample */
+    double   ewma_k;        /* alarm at this many standard deviations */
+    double   cusum_k;       /* slack, in standard deviations */
+    double   cusum_h;       /* alarm when the sum passes this */
+    double   robust_eta;    /* step of the median and MAD trackers */
+    double   robust_k;      /* alarm at this robust z */
+} elm327_anomaly_params_t;
+
+
+typedef struct _elm327_anomaly elm327_anomaly_t;
+
+
+extern void elm327_anomaly_defaults(elm327_anomaly_params_t *p);
+
+
+/* Detectors for the channels of 'pids' (Mode 01 PIDs, comma separated
+ * hex: "05,07,09,42"), or for every channel when it is NULL or "all".
+ * 'p' NULL for the defaults.  NULL on error with errno set.
+ */
+extern elm327_anomaly_t *elm327_anomaly_create(const char *pids, const elm327_anomaly_params_t *p);
+
+
+/* Feed a sample, write the events it raised (up to ELM327_ANOMALY_KINDS)
+ * to 'events' and return how many.  Event names stay valid as long as the
+ * detectors.
+ */
+extern size_t elm327_anomaly_update(
+    elm327_anomaly_t      *a,
+    const elm327_sample_t *s,
+    elm327_sample_t        events[ELM327_ANOMALY_KINDS]);
+
+
+/* Events raised so far */
+extern uint64_t elm327_anomaly_events(const elm327_anomaly_t *a);
+
+
+extern void elm327_anomaly_destroy(elm327_anomaly_t *a);
+
+
+#endif /* _ELM327ANOMALY_H */
@@ -0,0 +1,1024 @@
+/*
+ * elm327bench.c
+ *
+ * Micro benchmarks for the software side of the logger, run with
+ * "elm327diag bench [<name>...]".  Each benchmark prints one line per variant
+ * with its throughput.
+ */
+
+/* posix_openpt(), ptsname() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "elm327.h"
+#include "elm327buf.h"
+#include "elm327num.h"
+#include "elm327pids.h"
+#include "elm327log.h"
+#include "elm327sink.h"
+#include "elm327sqlite.h"
+#include "elm327trace.h"
+#include "elm327loopback.h"
+#include "elm327uring.h"
+#include "elm327anomaly.h"
+#include "elm327cmd.h"
+
+
+/* Values formatted per variant, and per batch (about one pass over PIDs) */
+#define BENCH_FORMAT_VALUES  4000000
+#define BENCH_FORMAT_BATCH   30
+
+/* Marks recorded per variant of the trace benchmark */
+#define BENCH_TRACE_MARKS  10000000
+
+/* Rows for the SQLite sink, and for the (much slower) autocommit reference */
+#define BENCH_SQLITE_ROWS             1000000
+#define BENCH_SQLITE_AUTOCOMMIT_ROWS  2000
+
+/* Transactions against the loopback adapter, and clock reads to calibrate */
+#define BENCH_LOOPBACK_SAMPLES  1000000
+#define BENCH_CLOCK_READS       1000000
+
+/* Adapters on ptys and the passes over all of them, for the I/O engines */
+#define BENCH_IO_ADAPTERS  8
+#define BENCH_IO_PASSES    4000
+#define BENCH_IO_TIMEOUT   1000
+
+/* Samples through the anomaly detectors, over this many channels */
+#define BENCH_ANOMALY_SAMPLES   4000000
+#define BENCH_ANOMALY_CHANNELS  32
+
+
+typedef struct _bench
+{
+    const char *name;
+    int (*run) (const char *out_path);
+    const char *description;
+} bench_t;
+
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void bench_report(const char *name, const char *variant, double n, const char *unit, double secs)
+{
+    printf("%-10s %-28s %12.0f %s/s  (%.3f s)\n", name, variant, n / secs, unit, secs);
+}
+
+
+/* CSV text output: the existing stdio path against buffer + fast format */
+static int bench_format(const char *out_path)
+{
+    struct obdpid  o[OBDPID_TABLE_SIZE];
+    const char    *names[BENCH_FORMAT_BATCH];
+    size_t         name_lens[BENCH_FORMAT_BATCH];
+    double        *values;
+    elm327_buf_t   buf;
+    FILE          *fp;
+    char          *w;
+    int            fd, i, j, n_names = 0;
+    double         t0;
+
+    obdpid_init_table(o);
+    for (i = 0; (i < OBDPID_TABLE_SIZE) && (n_names < BENCH_FORMAT_BATCH); ++i)
+      if (o[i].bytes)
+        names[n_names++] = o[i].commandname;
+    for (i = 0; i < n_names; ++i)
+      name_lens[i] = strlen(names[i]);
+
+    /* Plausible sensor values: a few integer digits, some fraction */
+    if (!(values = malloc(BENCH_FORMAT_VALUES * sizeof(double))))
+      return -1;
+    srand(327);
+    for (i = 0; i < BENCH_FORMAT_VALUES; ++i)
+      values[i] = (rand() % 800000) / 100.0 - 40;
+
+    if (!(fp = fopen(out_path, "w")))
+    {
+        free(values);
+        return -1;
+    }
+    t0 = bench_now();
+    for (i = 0; i < BENCH_FORMAT_VALUES; ++i)
+    {
+        fprintf(fp, "%s, %f\n", names[i % n_names], values[i]);
+        if ((i % BENCH_FORMAT_BATCH) == BENCH_FORMAT_BATCH - 1)
+          fflush(fp);
+    }
+    fclose(fp);
+    bench_report("format", "fprintf(\"%s, %f\")", BENCH_FORMAT_VALUES, "values", bench_now() - t0);
+
+    if (((fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) ||
+        (elm327_buf_init(&buf, 4096) == -1))
+    {
+        if (fd != -1)
+          close(fd);
+        free(values);
+        return -1;
+    }
+    t0 = bench_now();
+    for (i = 0; i < BENCH_FORMAT_VALUES; i += BENCH_FORMAT_BATCH)
+    {
+        for (j = i; (j < i + BENCH_FORMAT_BATCH) && (j < BENCH_FORMAT_VALUES); ++j)
+        {
+            w = elm327_buf_reserve(&buf, name_lens[j % n_names] + ELM327_FMT_MAX + 3);
+            memcpy(w, names[j % n_names], name_lens[j % n_names]);
+            w += name_lens[j % n_names];
+            *w++ = ',';
+            *w++ = ' ';
+            w = elm327_fmt_fixed(w, values[j], 6);
+            *w++ = '\n';
+            elm327_buf_commit(&buf, w);
+        }
+        elm327_buf_write(&buf, fd);
+    }
+    close(fd);
+    bench_report("format", "elm327_fmt_fixed + buffer", BENCH_FORMAT_VALUES, "values", bench_now() - t0);
+
+    elm327_buf_free(&buf);
+    free(values);
+
+    return 0;
+}
+
+
+/* Cost of a transaction mark, tracing off (a branch) and on (clock + store) */
+static int bench_trace(const char *out_path)
+{
+    int    i;
+    double t0;
+
+    (void)out_path;
+
+    t0 = bench_now();
+    for (i = 0; i < BENCH_TRACE_MARKS; ++i)
+      ELM327_TRACE_MARK(i & 7, i);
+    bench_report("trace", "disabled", BENCH_TRACE_MARKS, "marks", bench_now() - t0);
+
+    if (elm327_trace_enable(ELM327_TRACE_DEFAULT_EVENTS) == -1)
+      return -1;
+    t0 = bench_now();
+    for (i = 0; i < BENCH_TRACE_MARKS; ++i)
+      ELM327_TRACE_MARK(i & 7, i);
+    bench_report("trace", "enabled", BENCH_TRACE_MARKS, "marks", bench_now() - t0);
+    elm327_trace_disable();
+
+    return 0;
+}
+
+
+static uint64_t bench_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+typedef struct _bench_loopback
+{
+    struct obdpid o[OBDPID_TABLE_SIZE];
+    int           pids[OBDPID_TABLE_SIZE];
+    int           by_pid[256];
+    int           n_pids;
+    int           fd;
+    elm327_buf_t  buf;
+    size_t        failed;
+} bench_loopback_t;
+
+
+/* One sample as the sampling loop takes it.  With 't', the clock is read
+ * before the first stage and after each.
+ */
+static void loopback_sample(bench_loopback_t *lb, int i, uint64_t t[5])
+{
+    elm327_msg_t  send_msg, *msgs;
+    double        value = 0;
+    size_t        len;
+    char         *w;
+    int           n_msgs, s = -1;
+
+    if (t)
+      t[0] = bench_ns();
+    elm327_create_msg(send_msg, OBD_MODE_1, lb->o[lb->pids[i % lb->n_pids]].command);
+    elm327_send_msg(lb->fd, send_msg);
+    if (t)
+      t[1] = bench_ns();
+
+    msgs = elm327_recv_msgs(lb->fd, &n_msgs, 0);
+    if (t)
+      t[2] = bench_ns();
+
+    if (msgs && (n_msgs > 0) && (msgs[0][0] == 0x41) && ((s = lb->by_pid[msgs[0][1]]) != -1))
+      value = lb->o[s].calculate((double)msgs[0][2], (double)msgs[0][3]);
+    if (msgs)
+      elm327_destroy_recv_msgs(msgs);
+    else
+      ++lb->failed;
+    if (t)
+      t[3] = bench_ns();
+
+    if (s != -1)
+    {
+        if (lb->buf.len > lb->buf.cap / 2)
+          elm327_buf_reset(&lb->buf);
+        len = strlen(lb->o[s].commandname);
+        w = elm327_buf_reserve(&lb->buf, len + ELM327_FMT_MAX + 3);
+        memcpy(w, lb->o[s].commandname, len);
+        w += len;
+        *w++ = ',';
+        *w++ = ' ';
+        w = elm327_fmt_fixed(w, value, 6);
+        *w++ = '\n';
+        elm327_buf_commit(&lb->buf, w);
+    }
+    if (t)
+      t[4] = bench_ns();
+}
+
+
+/* A whole sample with the adapter in memory: what the program itself costs,
+ * stage by stage, with no system call in the way.
+ *
+ *   encode  request message built and sent (elm327_create_msg, _send_msg)
+ *   parse   response read and parsed (elm327_recv_msgs)
+ *   decode  value through the PID table, messages freed
+ *   output  CSV line formatted into the output buffer
+ *
+ * Stages are timed one sample at a time, with the measured cost of a clock
+ * read taken off.  The loop without clock reads gives the total, and the
+ * adapter alone (a write and the reads of its answer) how much of it is the
+ * loopback's own.
+ */
+static int bench_loopback(const char *out_path)
+{
+    static const char       *stages[] = { "encode", "parse", "decode", "output" };
+    bench_loopback_t         lb = { .n_pids = 0 };
+    elm327_loopback_entry_t  table[OBDPID_TABLE_SIZE];
+    char                     req[OBDPID_TABLE_SIZE][8], resp[OBDPID_TABLE_SIZE][24], line[8], chunk[64];
+    uint64_t                 stage_ns[4] = {0}, t[5], clock_ns;
+    double                   t0, secs;
+    size_t                   len;
+    int                      i, k;
+
+    (void)out_path;
+
+    obdpid_init_table(lb.o);
+    for (i = 0; i < 256; ++i)
+      lb.by_pid[i] = -1;
+    srand(327);
+    for (i = 0; i < OBDPID_TABLE_SIZE; ++i)
+    {
+        if (!lb.o[i].bytes)
+          continue;
+        snprintf(req[lb.n_pids], sizeof(req[0]), "01%02X", lb.o[i].command);
+        len = snprintf(resp[lb.n_pids], sizeof(resp[0]), "41 %02X", lb.o[i].command);
+        for (k = 0; (k < (int)lb.o[i].bytes) && (k < 4); ++k)
+          len += snprintf(resp[lb.n_pids] + len, sizeof(resp[0]) - len, " %02X", rand() & 0xFF);
+        table[lb.n_pids].request = req[lb.n_pids];
+        table[lb.n_pids].response = resp[lb.n_pids];
+        lb.by_pid[lb.o[i].command & 0xFF] = i;
+        lb.pids[lb.n_pids++] = i;
+    }
+
+    if ((lb.fd = elm327_loopback_open(table, lb.n_pids)) == -1)
+      return -1;
+    if (elm327_buf_init(&lb.buf, 4096) == -1)
+    {
+        elm327_loopback_close(lb.fd);
+        return -1;
+    }
+
+    /* What a clock read costs */
+    t0 = bench_now();
+    for (i = 0; i < BENCH_CLOCK_READS; ++i)
+      t[0] = bench_ns();
+    clock_ns = (uint64_t)((bench_now() - t0) * 1e9 / BENCH_CLOCK_READS);
+
+    for (i = 0; i < BENCH_LOOPBACK_SAMPLES; ++i)
+    {
+        loopback_sample(&lb, i, t);
+        for (k = 0; k < 4; ++k)
+          stage_ns[k] += (t[k + 1] - t[k] > clock_ns) ? t[k + 1] - t[k] - clock_ns : 0;
+    }
+
+    t0 = bench_now();
+    for (i = 0; i < BENCH_LOOPBACK_SAMPLES; ++i)
+      loopback_sample(&lb, i, NULL);
+    secs = bench_now() - t0;
+
+    for (k = 0; k < 4; ++k)
+      printf("%-10s %-28s %12.1f ns/sample\n", "loopback", stages[k],
+             (double)stage_ns[k] / BENCH_LOOPBACK_SAMPLES);
+    printf("%-10s %-28s %12.1f ns/read\n", "loopback", "clock (taken off the above)", (double)clock_ns);
+    bench_report("loopback", "sample, no clock reads", BENCH_LOOPBACK_SAMPLES, "samples", secs);
+
+    /* The adapter's share: request in, answer out */
+    t0 = bench_now();
+    for (i = 0; i < BENCH_LOOPBACK_SAMPLES; ++i)
+    {
+        len = snprintf(line, sizeof(line), "%s\r", req[i % lb.n_pids]);
+        elm327_loopback_write(lb.fd, line, len);
+        while (elm327_loopback_read(lb.fd, chunk, sizeof(chunk)) > 0)
+          ;
+    }
+    bench_report("loopback", "adapter only", BENCH_LOOPBACK_SAMPLES, "samples", bench_now() - t0);
+
+    elm327_buf_free(&lb.buf);
+    elm327_loopback_close(lb.fd);
+    if (lb.failed)
+    {
+        fprintf(stderr, "loopback: %zu of %d samples failed\n", lb.failed, 2 * BENCH_LOOPBACK_SAMPLES);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Adapters for the I/O engines: pty pairs, the program on the slaves as on
+ * serial ports, one thread on the masters answering like an ELM (echo on,
+ * as after a reset).  Its CPU time is kept apart from the engine's.
+ */
+typedef struct _bench_fleet
+{
+    int       n;
+    int       master[BENCH_IO_ADAPTERS];
+    int       slave[BENCH_IO_ADAPTERS];
+    int       stop[2];
+    int       started;       /* The responder is running */
+    pthread_t responder;
+    clockid_t responder_clock;
+} bench_fleet_t;
+
+
+static void *fleet_respond(void *arg)
+{
+    bench_fleet_t      *f = arg;
+    struct epoll_event  ev, events[BENCH_IO_ADAPTERS + 1];
+    char                line[BENCH_IO_ADAPTERS][16], buf[256], reply[48];
+    size_t              len[BENCH_IO_ADAPTERS] = {0};
+    unsigned int        mode, pid;
+    int                 ep, i, k, n, r, j;
+
+    if ((ep = epoll_create1(EPOLL_CLOEXEC)) == -1)
+      return NULL;
+    for (i = 0; i <= f->n; ++i)
+    {
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, (i < f->n) ? f->master[i] : f->stop[0], &ev);
+    }
+
+    for (;;)
+    {
+        if ((n = epoll_wait(ep, events, f->n + 1, -1)) == -1)
+          continue;
+        for (k = 0; k < n; ++k)
+        {
+            if ((i = events[k].data.u32) == f->n)
+            {
+                close(ep);
+                return NULL;
+            }
+            while ((r = read(f->master[i], buf, sizeof(buf))) > 0)
+              for (j = 0; j < r; ++j)
+              {
+                  if (buf[j] != '\r')
+                  {
+                      if (len[i] < sizeof(line[i]) - 1)
+                        line[i][len[i]++] = buf[j];
+                      continue;
+                  }
+                  line[i][len[i]] = '\0';
+                  len[i] = 0;
+                  if ((sscanf(line[i], "%2x%2x", &mode, &pid) == 2) && (mode == 1))
+                    r = snprintf(reply, sizeof(reply), "%s\r41 %02X %02X %02X\r\r>",
+                                 line[i], pid, pid ^ 0x5A, pid * 7 & 0xFF);
+                  else
+                    r = snprintf(reply, sizeof(reply), "%s\r?\r\r>", line[i]);
+                  if (write(f->master[i], reply, r) != r)
+                    break;
+                  r = 0;
+              }
+        }
+    }
+}
+
+
+static int fleet_open(bench_fleet_t *f, int n)
+{
+    int i;
+
+    /* Whatever was opened when this fails is closed by fleet_close() */
+    memset(f, 0, sizeof(*f));
+    f->stop[0] = f->stop[1] = -1;
+    for (i = 0; i < BENCH_IO_ADAPTERS; ++i)
+      f->master[i] = f->slave[i] = -1;
+
+    for (i = 0; i < n; ++i)
+    {
+        f->n = i + 1;
+        if (((f->master[i] = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) == -1) ||
+            (grantpt(f->master[i]) == -1) || (unlockpt(f->master[i]) == -1) ||
+            ((f->slave[i] = elm327_init(ptsname(f->master[i]))) == -1))
+          return -1;
+    }
+    if ((pipe(f->stop) == -1) ||
+        (pthread_create(&f->responder, NULL, fleet_respond, f) != 0))
+      return -1;
+    f->started = 1;
+    if (pthread_getcpuclockid(f->responder, &f->responder_clock) != 0)
+      return -1;
+
+    return 0;
+}
+
+
+static void fleet_close(bench_fleet_t *f)
+{
+    int i;
+
+    if (f->started && (write(f->stop[1], "", 1) == 1))
+      pthread_join(f->responder, NULL);
+    if (f->stop[0] != -1)
+      close(f->stop[0]);
+    if (f->stop[1] != -1)
+      close(f->stop[1]);
+    for (i = 0; i < f->n; ++i)
+    {
+        if (f->slave[i] != -1)
+          elm327_shutdown(f->slave[i]);
+        if (f->master[i] != -1)
+          close(f->master[i]);
+    }
+}
+
+
+/* What every engine does with a response, and its log */
+typedef struct _bench_io
+{
+    struct obdpid        o[OBDPID_TABLE_SIZE];
+    int                  pids[OBDPID_TABLE_SIZE];
+    int                  n_pids;
+    int                  log_fd;
+    elm327_log_record_t *records;
+    size_t               n_records, n_written;
+    size_t               failed;
+
+    /* Response framing, per adapter */
+    char                 text[BENCH_IO_ADAPTERS][ELM327_URING_RESPONSE_MAX];
+    size_t               len[BENCH_IO_ADAPTERS];
+    char                 prev[BENCH_IO_ADAPTERS];
+} bench_io_t;
+
+
+static void io_sample(bench_io_t *io, const char *text)
+{
+    elm327_msg_t        *msgs;
+    elm327_log_record_t *rec = &io->records[io->n_records];
+    int                  n_msgs;
+
+    if (!(msgs = elm327_parse_msgs(text, &n_msgs, 0)))
+    {
+        ++io->failed;
+        return;
+    }
+    if ((n_msgs > 0) && (msgs[0][0] == 0x41))
+    {
+        rec->timestamp_us = io->n_records + 1;
+        rec->channel = ELM327_CHANNEL(1, msgs[0][1]);
+        rec->value = io->o[msgs[0][1] % OBDPID_TABLE_SIZE].calculate((double)msgs[0][2], (double)msgs[0][3]);
+        ++io->n_records;
+    }
+    else
+      ++io->failed;
+    elm327_destroy_recv_msgs(msgs);
+}
+
+
+/* Whole log blocks not yet written, and where the next one goes */
+#define io_log_ready(_io) \
+    ((_io)->n_records / ELM327_LOG_BLOCK_RECORDS > (_io)->n_written)
+#define io_log_block(_io) \
+    (&(_io)->records[(_io)->n_written * ELM327_LOG_BLOCK_RECORDS])
+#define io_log_offset(_io) \
+    (((_io)->n_written + 1) * (uint64_t)ELM327_LOG_BLOCK_SIZE)
+
+
+/* Framing as elm327_read_response(), returns 1 when the response is whole */
+static int io_feed(bench_io_t *io, int i, const char *buf, size_t n)
+{
+    size_t k;
+    char   c;
+    int    done = 0;
+
+    for (k = 0; k < n; ++k)
+    {
+        c = (buf[k] == '\r') ? '\n' : buf[k];
+        if ((io->len[i] == 0) && ((c == '>') || (c == '\n')))
+          continue;
+        if ((c == '>') || ((c == '\n') && (io->prev[i] == '\n')))
+        {
+            io->text[i][io->len[i]] = '\0';
+            io_sample(io, io->text[i]);
+            io->len[i] = 0;
+            io->prev[i] = 0;
+            ++done;
+            continue;
+        }
+        if (io->len[i] < ELM327_URING_RESPONSE_MAX - 1)
+          io->text[i][io->len[i]++] = c;
+        io->prev[i] = c;
+    }
+
+    return done;
+}
+
+
+static void io_request(bench_io_t *io, int pass, int i, char cmd[8])
+{
+    snprintf(cmd, 8, "01%02X", io->o[io->pids[(pass + i) % io->n_pids]].command);
+}
+
+
+/* The library's way: one adapter after the other, a write, then a poll and
+ * a read per line; a write per log block
+ */
+static int io_blocking(bench_io_t *io, bench_fleet_t *f, uint64_t *syscalls)
+{
+    char    cmd[8], chunk[64];
+    ssize_t r;
+    int     pass, i, done;
+
+    for (pass = 0; pass < BENCH_IO_PASSES; ++pass)
+    {
+        for (i = 0; i < f->n; ++i)
+        {
+            struct pollfd pfd = { .fd = f->slave[i], .events = POLLIN };
+
+            io_request(io, pass, i, cmd);
+            strcat(cmd, "\r");
+            ++*syscalls;
+            if (write(f->slave[i], cmd, 5) != 5)
+              return -1;
+            for (done = 0; !done; )
+            {
+                *syscalls += 2;
+                if ((poll(&pfd, 1, BENCH_IO_TIMEOUT) != 1) ||
+                    ((r = read(f->slave[i], chunk, sizeof(chunk))) <= 0))
+                  return -1;
+                done = io_feed(io, i, chunk, r);
+            }
+        }
+        while (io_log_ready(io))
+        {
+            ++*syscalls;
+            if (pwrite(io->log_fd, io_log_block(io), ELM327_LOG_BLOCK_SIZE, io_log_offset(io)) != ELM327_LOG_BLOCK_SIZE)
+              return -1;
+            ++io->n_written;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Readiness: every command written, then epoll_wait and a read per line
+ * for whichever adapter has one
+ */
+static int io_epoll(bench_io_t *io, bench_fleet_t *f, uint64_t *syscalls)
+{
+    struct epoll_event ev, events[BENCH_IO_ADAPTERS];
+    char               cmd[8], chunk[64];
+    ssize_t            r;
+    int                ep, pass, i, k, n, left, err = -1;
+
+    if ((ep = epoll_create1(EPOLL_CLOEXEC)) == -1)
+      return -1;
+    for (i = 0; i < f->n; ++i)
+    {
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, f->slave[i], &ev) == -1)
+          goto out;
+    }
+
+    for (pass = 0; pass < BENCH_IO_PASSES; ++pass)
+    {
+        for (i = 0; i < f->n; ++i)
+        {
+            io_request(io, pass, i, cmd);
+            strcat(cmd, "\r");
+            ++*syscalls;
+            if (write(f->slave[i], cmd, 5) != 5)
+              goto out;
+        }
+        for (left = f->n; left > 0; )
+        {
+            ++*syscalls;
+            if ((n = epoll_wait(ep, events, f->n, BENCH_IO_TIMEOUT)) <= 0)
+              goto out;
+            for (k = 0; k < n; ++k)
+            {
+                i = events[k].data.u32;
+                ++*syscalls;
+                if ((r = read(f->slave[i], chunk, sizeof(chunk))) <= 0)
+                  goto out;
+                left -= io_feed(io, i, chunk, r);
+            }
+        }
+        while (io_log_ready(io))
+        {
+            ++*syscalls;
+            if (pwrite(io->log_fd, io_log_block(io), ELM327_LOG_BLOCK_SIZE, io_log_offset(io)) != ELM327_LOG_BLOCK_SIZE)
+              goto out;
+            ++io->n_written;
+        }
+    }
+    err = 0;
+
+out:
+    close(ep);
+    return err;
+}
+
+
+static void io_uring_response(void *arg, int adapter, const char *text, int len)
+{
+    bench_io_t *io = arg;
+
+    if (len < 0)
+      ++io->failed;
+    else
+      io_sample(io, text);
+}
+
+
+/* Reads always posted; the commands of a pass go in with the log blocks of
+ * the last and the wait, in one system call
+ */
+static int io_uring(bench_io_t *io, bench_fleet_t *f, uint64_t *syscalls)
+{
+    elm327_uring_t *u;
+    char            cmd[8];
+    double          deadline;
+    int             pass, i, r, left, err = -1;
+
+    if (!(u = elm327_uring_open(64, f->n, io_uring_response, io)))
+      return -1;
+    for (i = 0; i < f->n; ++i)
+      if (elm327_uring_add(u, f->slave[i]) == -1)
+        goto out;
+
+    for (pass = 0; pass < BENCH_IO_PASSES; ++pass)
+    {
+        for (i = 0; i < f->n; ++i)
+        {
+            io_request(io, pass, i, cmd);
+            if (elm327_uring_send(u, i, cmd) == -1)
+              goto out;
+        }
+        /* Every adapter still waiting has at least one completion coming */
+        deadline = bench_now() + BENCH_IO_TIMEOUT / 1e3;
+        for (left = f->n; left > 0; left -= r)
+          if (((r = elm327_uring_run(u, left, BENCH_IO_TIMEOUT)) == -1) ||
+              ((r == 0) && (bench_now() > deadline)))
+          {
+              errno = r ? errno : ETIMEDOUT;
+              goto out;
+          }
+        while (io_log_ready(io))
+        {
+            if (elm327_uring_append(u, io->log_fd, io_log_block(io), ELM327_LOG_BLOCK_SIZE, io_log_offset(io)) == -1)
+              goto out;
+            ++io->n_written;
+        }
+    }
+    while (elm327_uring_appends(u))
+      if (elm327_uring_run(u, 1, BENCH_IO_TIMEOUT) == -1)
+        goto out;
+    err = 0;
+
+out:
+    *syscalls = elm327_uring_syscalls(u);
+    elm327_uring_close(u);
+    return err;
+}
+
+
+static double cpu_seconds(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Samples from BENCH_IO_ADAPTERS adapters into a log, per I/O engine: system
+ * calls and CPU time per sample (the responder's taken off, the kernel's
+ * io_uring workers counted in)
+ */
+static int bench_io(const char *out_path)
+{
+    static const struct
+    {
+        const char *name;
+        int (*run) (bench_io_t *, bench_fleet_t *, uint64_t *);
+    } engines[] =
+    {
+        { "blocking, poll + read", io_blocking },
+        { "epoll",                 io_epoll    },
+        { "io_uring",              io_uring    },
+    };
+    bench_fleet_t  f;
+    bench_io_t    *io;
+    char           path[256];
+    const char    *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    size_t         n_samples = (size_t)BENCH_IO_ADAPTERS * BENCH_IO_PASSES;
+    uint64_t       syscalls;
+    double         t0, cpu0, secs, cpu;
+    int            e, i, err = 0;
+
+    (void)out_path;
+
+    if (!(io = calloc(1, sizeof(bench_io_t))) ||
+        !(io->records = malloc((n_samples + ELM327_LOG_BLOCK_RECORDS) * sizeof(elm327_log_record_t))))
+    {
+        free(io);
+        return -1;
+    }
+    obdpid_init_table(io->o);
+    for (i = 0; i < OBDPID_TABLE_SIZE; ++i)
+      if (io->o[i].bytes)
+        io->pids[io->n_pids++] = i;
+
+    if (fleet_open(&f, BENCH_IO_ADAPTERS) == -1)
+    {
+        fprintf(stderr, "io: adapters: %s\n", strerror(errno));
+        fleet_close(&f);
+        free(io->records);
+        free(io);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/elm327bench-%d.log", tmp, (int)getpid());
+
+    for (e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e)
+    {
+        memset(io->records, 0, (n_samples + ELM327_LOG_BLOCK_RECORDS) * sizeof(elm327_log_record_t));
+        io->n_records = io->n_written = io->failed = 0;
+        if ((io->log_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+        {
+            err = -1;
+            break;
+        }
+
+        syscalls = 0;
+        t0 = bench_now();
+        cpu0 = cpu_seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu_seconds(f.responder_clock);
+        if (engines[e].run(io, &f, &syscalls) == -1)
+        {
+            close(io->log_fd);
+            if (errno == ENOSYS)
+            {
+                printf("%-10s %-28s not available\n", "io", engines[e].name);
+                continue;
+            }
+            fprintf(stderr, "io: %s: %s\n", engines[e].name, strerror(errno));
+            err = -1;
+            continue;
+        }
+        cpu = cpu_seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu_seconds(f.responder_clock) - cpu0;
+        secs = bench_now() - t0;
+        close(io->log_fd);
+
+        if (io->failed || (io->n_records != n_samples))
+        {
+            fprintf(stderr, "io: %s: %zu of %zu samples\n", engines[e].name, io->n_records, n_samples);
+            err = -1;
+        }
+        printf("%-10s %-28s %12.0f samples/s  %6.2f syscalls  %6.2f us cpu per sample\n",
+               "io", engines[e].name, n_samples / secs, (double)syscalls / n_samples, cpu * 1e6 / n_samples);
+    }
+
+    unlink(path);
+    fleet_close(&f);
+    free(io->records);
+    free(io);
+
+    return err;
+}
+
+
+/* Detector updates per second: noisy quantized channels, with a spike now
+ * and then and a slow drift over the second half
+ */
+static int bench_anomaly(const char *out_path)
+{
+    elm327_anomaly_t *a;
+    elm327_sample_t  *samples, events[ELM327_ANOMALY_KINDS];
+    uint64_t          kinds[ELM327_ANOMALY_KINDS] = {0};
+    size_t            n, k;
+    int               i;
+    double            t0;
+    const char       *variants[] = { "not followed", "all channels" };
+    int               v;
+
+    (void)out_path;
+
+    if (!(samples = malloc(BENCH_ANOMALY_SAMPLES * sizeof(elm327_sample_t))))
+      return -1;
+    srand(327);
+    for (i = 0; i < BENCH_ANOMALY_SAMPLES; ++i)
+    {
+        int ch = i % BENCH_ANOMALY_CHANNELS;
+        double x = 50 + 10 * ch + (rand() % 9) - 4;
+
+        if ((rand() % 20000) == 0)
+          x += 40;
+        if (i > BENCH_ANOMALY_SAMPLES / 2)
+          x += 20.0 * (i - BENCH_ANOMALY_SAMPLES / 2) / (BENCH_ANOMALY_SAMPLES / 2);
+        samples[i].timestamp_us = 1000 + i;
+        samples[i].channel = ELM327_CHANNEL(1, ch);
+        samples[i].value = x;
+        samples[i].name = NULL;
+    }
+
+    /* Mode 01 PID FF is not among the channels: the lookup alone */
+    for (v = 0; v < 2; ++v)
+    {
+        if (!(a = elm327_anomaly_create(v ? "all" : "FF", NULL)))
+        {
+            free(samples);
+            return -1;
+        }
+        t0 = bench_now();
+        for (i = 0; i < BENCH_ANOMALY_SAMPLES; ++i)
+        {
+            n = elm327_anomaly_update(a, &samples[i], events);
+            for (k = 0; k < n; ++k)
+              kinds[(ELM327_CHANNEL_MODE(events[k].channel) >> 8) & 0x7F]++;
+        }
+        bench_report("anomaly", variants[v], BENCH_ANOMALY_SAMPLES, "samples", bench_now() - t0);
+        elm327_anomaly_destroy(a);
+    }
+    printf("anomaly    events:");
+    for (k = 0; k < ELM327_ANOMALY_KINDS; ++k)
+      printf(" %s %llu", elm327_anomaly_names[k], (unsigned long long)kinds[k]);
+    printf("\n");
+
+    free(samples);
+
+    return 0;
+}
+
+
+#ifdef HAVE_SQLITE
+/* Rows per second into SQLite: one autocommitted statement per row against
+ * the sink (prepared insert, WAL, time bounded transactions, own thread).
+ */
+static int bench_sqlite(const char *out_path)
+{
+    char                 path[256], wal[300];
+    const char          *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    elm327_sqlite_t     *db;
+    elm327_sinks_t      *sinks;
+    elm327_sample_t      batch[BENCH_FORMAT_BATCH];
+    elm327_log_record_t  rec = {0};
+    int                  i, j;
+    double               t0;
+
+    snprintf(path, sizeof(path), "%s/elm327bench-%d.db", tmp, (int)getpid());
+    snprintf(wal, sizeof(wal), "%s-wal", path);
+
+    if (!(db = elm327_sqlite_open(path)))
+      return -1;
+    t0 = bench_now();
+    for (i = 0; i < BENCH_SQLITE_AUTOCOMMIT_ROWS; ++i)
+    {
+        rec.timestamp_us = 1000 + i;
+        rec.channel = ELM327_CHANNEL(1, 0x0C);
+        rec.value = i * 0.25;
+        if (elm327_sqlite_insert_autocommit(db, &rec) == -1)
+          break;
+    }
+    bench_report("sqlite", "autocommit per row", i, "rows", bench_now() - t0);
+    elm327_sqlite_close(db);
+    unlink(path);
+    unlink(wal);
+
+    if (!(sinks = elm327_sinks_create(0)))
+      return -1;
+    snprintf(wal, sizeof(wal), "sqlite:%s,block", path);
+    if (elm327_sinks_add(sinks, wal) == -1)
+    {
+        elm327_sinks_destroy(sinks);
+        return -1;
+    }
+
+    t0 = bench_now();
+    for (i = 0; i < BENCH_SQLITE_ROWS; i += BENCH_FORMAT_BATCH)
+    {
+        for (j = 0; j < BENCH_FORMAT_BATCH; ++j)
+        {
+            batch[j].timestamp_us = 1000 + i + j;
+            batch[j].channel = ELM327_CHANNEL(1, j);
+            batch[j].value = (i + j) * 0.25;
+            batch[j].name = NULL;
+        }
+        elm327_sinks_write(sinks, batch, BENCH_FORMAT_BATCH);
+    }
+    elm327_sinks_destroy(sinks);
+    bench_report("sqlite", "sink, batched transactions", i, "rows", bench_now() - t0);
+
+    unlink(path);
+    snprintf(wal, sizeof(wal), "%s-wal", path);
+    unlink(wal);
+    snprintf(wal, sizeof(wal), "%s-shm", path);
+    unlink(wal);
+
+    return 0;
+}
+#endif
+
+
+static const bench_t benches[] =
+{
+    { "format", bench_format, "CSV value formatting, stdio against elm327_fmt_fixed" },
+    { "trace",  bench_trace,  "transaction timeline marks, tracing off and on" },
+    { "loopback", bench_loopback, "a sample per stage, adapter in memory (no system calls)" },
+    { "io",     bench_io,     "adapters on ptys into a log: blocking, epoll and io_uring" },
+    { "anomaly", bench_anomaly, "samples through the ewma, cusum and robust z detectors" },
+#ifdef HAVE_SQLITE
+    { "sqlite", bench_sqlite, "SQLite rows/s, autocommit against the batched sink" },
+#endif
+    { NULL, NULL, NULL }
+};
+
+
+int elm327_cmd_bench(int argc, char *argv[])
+{
+    const char    *out_path = "/dev/null";
+    const bench_t *b;
+    int            i, ran = 0, err = 0;
+
+    for (i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-o") && (i < argc-1))
+          out_path = argv[++i];
+        else
+          break;
+    }
+
+    for (b = benches; b->name; ++b)
+    {
+        int selected = (i == argc);
+
+        for (int k = i; k < argc; ++k)
+          if (!strcmp(argv[k], b->name))
+            selected = 1;
+        if (!selected)
+          continue;
+
+        ++ran;
+        if (b->run(out_path) == -1)
+        {
+            fprintf(stderr, "%s: failed\n", b->name);
+            err = 1;
+        }
+    }
+
+    if (!ran)
+    {
+        printf("Usage:\n");
+        printf("  elm327diag bench [-o <file>] [<name>...]\n");
+        printf("Benchmarks:\n");
+        for (b = benches; b->name; ++b)
+          printf("  %-12s %s\n", b->name, b->description);
+        return 1;
+    }
+
+    return err;
+}
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "elm327buf.h"
+
+
+int elm327_buf_init(elm327_buf_t *buf, size_t cap)
+{
+    buf->len = 0;
+    buf->cap = cap;
+    if (!(buf->data = malloc(cap)))
+    {
+        buf->cap = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void elm327_buf_free(elm327_buf_t *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->cap = 0;
+}
+
+
+char *elm327_buf_reserve(elm327_buf_t *buf, size_t n)
+{
+    char   *grown;
+    size_t  cap;
+
+    if (buf->len + n <= buf->cap)
+      return buf->data + buf->len;
+
+    for (cap = buf->cap ? buf->cap : 256; cap < buf->len + n; cap *= 2)
+      ;
+    if (!(grown = realloc(buf->data, cap)))
+      return NULL;
+
+    buf->data = grown;
+    buf->cap = cap;
+
+    return buf->data + buf->len;
+}
+
+
+int elm327_buf_append(elm327_buf_t *buf, const void *src, size_t n)
+{
+    char *o;
+
+    if (!(o = elm327_buf_reserve(buf, n)))
+      return -1;
+    memcpy(o, src, n);
+    buf->len += n;
+
+    return 0;
+}
+
+
+int elm327_buf_write(elm327_buf_t *buf, int fd)
+{
+    size_t  off = 0;
+    ssize_t n;
+
+    while (off < buf->len)
+    {
+        if ((n = write(fd, buf->data + off, buf->len - off)) == -1)
+        {
+            if (errno == EINTR)
+              continue;
+
+            /* Keep what did not make it */
+            memmove(buf->data, buf->data + off, buf->len - off);
+            buf->len -= off;
+            return -1;
+        }
+        off += n;
+    }
+
+    buf->len = 0;
+
+    return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef _ELM327BUF_H
+#define _ELM327BUF_H
+
+#include <stddef.h>
+
+
+/* Reusable output buffer.  Text for a whole batch of samples is built here
+ * and handed to the kernel with a single write, the memory is kept for the
+ * next batch.
+ */
+typedef struct _elm327_buf
+{
+    char   *data;
+    size_t  len;
+    size_t  cap;
+} elm327_buf_t;
+
+
+/* Returns 0 on success and -1 if the initial allocation fails */
+extern int elm327_buf_init(elm327_buf_t *buf, size_t cap);
+extern void elm327_buf_free(elm327_buf_t *buf);
+
+
+/* Make room for 'n' more bytes and return where they go, NULL when out of
+ * memory.  Write through the pointer and then elm327_buf_commit() the end.
+ */
+extern char *elm327_buf_reserve(elm327_buf_t *buf, size_t n);
+#define elm327_buf_commit(_buf, _end) ((_buf)->len = (_end) - (_buf)->data)
+
+
+extern int elm327_buf_append(elm327_buf_t *buf, const void *src, size_t n);
+
+
+/* Write everything buffered to 'fd' and empty the buffer.  Returns 0 on
+ * success, -1 on error with errno set (the data is kept).
+ */
+extern int elm327_buf_write(elm327_buf_t *buf, int fd);
+
+
+#define elm327_buf_reset(_buf) ((_buf)->len = 0)
+
+
+#endif /* _ELM327BUF_H */
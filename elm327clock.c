@@ -0,0 +1,341 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "elm327clock.h"
+
+
+/* Data between the program and the sources is waited for byte by byte, not
+ * for a while: a pty hands it over through the kernel's workqueue, which on a
+ * loaded host takes as long as it takes.  Only data that has not turned up
+ * after CLOCK_SYNC_MS of real time is given up on, as a deadlock.
+ */
+#define CLOCK_SYNC_MS     10000
+#define CLOCK_PUMP_MS     10
+#define CLOCK_MAX_SOURCES 4
+
+
+typedef struct _clock_event
+{
+    uint64_t             when_ns;
+    uint64_t             seq;       /* same time: in the order queued */
+    elm327_clock_event_t fn;
+    void                *arg;
+} clock_event_t;
+
+
+/* Virtual time, untouched while on the real clock */
+static struct
+{
+    int            on;
+    uint64_t       now_ns;
+    uint64_t       epoch_us;
+    uint64_t       seq;
+    clock_event_t *heap;
+    size_t         n, cap;
+    struct
+    {
+        elm327_clock_source_t fn;
+        void                 *arg;
+    }              sources[CLOCK_MAX_SOURCES];
+    int            n_sources;
+    size_t         in_flight;   /* sent to the sources, not taken yet */
+} vclock;
+
+
+static int event_before(const clock_event_t *a, const clock_event_t *b)
+{
+    return (a->when_ns < b->when_ns) || ((a->when_ns == b->when_ns) && (a->seq < b->seq));
+}
+
+
+static void heap_pop(clock_event_t *top)
+{
+    clock_event_t last;
+    size_t        i = 0, c;
+
+    *top = vclock.heap[0];
+    last = vclock.heap[--vclock.n];
+    while ((c = 2 * i + 1) < vclock.n)
+    {
+        if ((c + 1 < vclock.n) && event_before(&vclock.heap[c + 1], &vclock.heap[c]))
+          ++c;
+        if (!event_before(&vclock.heap[c], &last))
+          break;
+        vclock.heap[i] = vclock.heap[c];
+        i = c;
+    }
+    vclock.heap[i] = last;
+}
+
+
+/* Let the sources queue what they have, for at most 'real_ms' */
+static int pump_sources(int real_ms)
+{
+    int i, n = 0;
+
+    for (i = 0; i < vclock.n_sources; ++i)
+      n += vclock.sources[i].fn(vclock.sources[i].arg, real_ms);
+
+    return n;
+}
+
+
+static uint64_t real_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* Let the sources take all that was sent to them, however long that takes */
+static int take_sent(void)
+{
+    uint64_t start = real_ms();
+
+    while (vclock.in_flight)
+    {
+        pump_sources(CLOCK_PUMP_MS);
+        if (vclock.in_flight && (real_ms() - start > CLOCK_SYNC_MS))
+        {
+            vclock.in_flight = 0;
+            errno = EDEADLK;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Run the earliest event if it is due by 'until_ns', moving time to it */
+static int run_next(uint64_t until_ns, int *woke)
+{
+    clock_event_t e;
+
+    if (!vclock.n || (vclock.heap[0].when_ns > until_ns))
+      return 0;
+
+    heap_pop(&e);
+    if (e.when_ns > vclock.now_ns)
+      vclock.now_ns = e.when_ns;
+    *woke = e.fn(e.arg);
+
+    return 1;
+}
+
+
+uint64_t elm327_clock_now_ns(void)
+{
+    struct timespec ts;
+
+    if (vclock.on)
+      return vclock.now_ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+uint64_t elm327_clock_wall_us(void)
+{
+    struct timespec ts;
+
+    if (vclock.on)
+      return vclock.epoch_us + vclock.now_ns / 1000;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+
+void elm327_clock_sleep_ns(uint64_t ns)
+{
+    struct timespec ts = { ns / 1000000000ull, ns % 1000000000ull };
+    uint64_t        until;
+    int             woke;
+
+    if (!vclock.on)
+    {
+        nanosleep(&ts, NULL);
+        return;
+    }
+
+    until = vclock.now_ns + ns;
+    do
+    {
+        take_sent();
+        pump_sources(0);
+    }
+    while (run_next(until, &woke));
+    vclock.now_ns = until;
+}
+
+
+static int poll_readable(int fd, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int           r;
+
+    while (((r = poll(&pfd, 1, timeout_ms)) == -1) && (errno == EINTR))
+      ;
+    if ((r == 1) && !(pfd.revents & POLLIN))
+    {
+        /* POLLERR/POLLHUP: the device went away */
+        errno = EIO;
+        return -1;
+    }
+
+    return r;
+}
+
+
+int elm327_clock_wait_readable(int fd, int timeout_ms)
+{
+    uint64_t deadline;
+    int      r, woke = 0;
+
+    if (!vclock.on)
+      return poll_readable(fd, timeout_ms);
+
+    deadline = (timeout_ms < 0) ? UINT64_MAX : vclock.now_ns + (uint64_t)timeout_ms * 1000000;
+    for (;;)
+    {
+        if (take_sent() == -1)
+          return -1;
+        pump_sources(0);
+
+        /* Data an event wrote is on its way, time stands still until it is here */
+        if ((r = poll_readable(fd, woke ? CLOCK_SYNC_MS : 0)) != 0)
+          return r;
+        if (woke)
+        {
+            errno = EDEADLK;
+            return -1;
+        }
+
+        if (!vclock.n)
+        {
+            if (deadline == UINT64_MAX)
+            {
+                /* Nobody will ever answer */
+                errno = EDEADLK;
+                return -1;
+            }
+            vclock.now_ns = deadline;
+            return 0;
+        }
+
+        if (!run_next(deadline, &woke))
+        {
+            vclock.now_ns = deadline;
+            return 0;
+        }
+    }
+}
+
+
+void elm327_clock_sent(size_t n)
+{
+    if (vclock.on)
+      vclock.in_flight += n;
+}
+
+
+void elm327_clock_taken(size_t n)
+{
+    vclock.in_flight = (n < vclock.in_flight) ? vclock.in_flight - n : 0;
+}
+
+
+int elm327_clock_sync(void)
+{
+    return vclock.on ? take_sent() : 0;
+}
+
+
+int elm327_clock_virtual(uint64_t epoch_us)
+{
+    if (vclock.on)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    vclock.on = 1;
+    vclock.now_ns = 0;
+    vclock.epoch_us = epoch_us;
+
+    return 0;
+}
+
+
+int elm327_clock_is_virtual(void)
+{
+    return vclock.on;
+}
+
+
+int elm327_clock_at(uint64_t when_ns, elm327_clock_event_t fn, void *arg)
+{
+    clock_event_t e = { when_ns, vclock.seq++, fn, arg };
+    size_t        i, p;
+
+    if (!vclock.on)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (vclock.n == vclock.cap)
+    {
+        size_t         cap = vclock.cap ? 2 * vclock.cap : 64;
+        clock_event_t *heap = realloc(vclock.heap, cap * sizeof(clock_event_t));
+
+        if (!heap)
+          return -1;
+        vclock.heap = heap;
+        vclock.cap = cap;
+    }
+
+    for (i = vclock.n++; i && event_before(&e, &vclock.heap[p = (i - 1) / 2]); i = p)
+      vclock.heap[i] = vclock.heap[p];
+    vclock.heap[i] = e;
+
+    return 0;
+}
+
+
+int elm327_clock_add_source(elm327_clock_source_t fn, void *arg)
+{
+    if (vclock.n_sources == CLOCK_MAX_SOURCES)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    vclock.sources[vclock.n_sources].fn = fn;
+    vclock.sources[vclock.n_sources].arg = arg;
+    ++vclock.n_sources;
+
+    return 0;
+}
+
+
+void elm327_clock_remove_source(elm327_clock_source_t fn, void *arg)
+{
+    int i;
+
+    for (i = 0; i < vclock.n_sources; ++i)
+      if ((vclock.sources[i].fn == fn) && (vclock.sources[i].arg == arg))
+      {
+          vclock.sources[i] = vclock.sources[--vclock.n_sources];
+          return;
+      }
+}
@@ -0,0 +1,87 @@
+#ifndef _ELM327CLOCK_H
+#define _ELM327CLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/* Time as the receive path and the scheduler see it.
+ *
+ * Waiting for the adapter, sleeping until the next PID is due, sample and
+ * trace timestamps all go through here.  By default that is the kernel's
+ * clocks.  elm327_clock_virtual() switches the process to a virtual clock
+ * that only moves when the program waits: a wait runs the queued events in
+ * time order and jumps straight to the next one, so a simulated adapter
+ * (elm327sim.h) answering after modelled latencies gives hours of driving in
+ * seconds, with the same timings on every run.
+ *
+ * The virtual clock is for a single sampling thread, events and sources run
+ * on the thread that waits.  What the program and the sources write to each
+ * other is counted, and time does not move while any of it is still on its
+ * way, so the timings do not depend on how quickly the host passes it on.
+ */
+
+/* An event, nonzero when it made data readable for a waiter */
+typedef int (*elm327_clock_event_t)(void *arg);
+
+/* A source of events, e.g. a simulated adapter picking up commands.  Gets up
+ * to 'real_ms' of real time to look for input, reports what it read with
+ * elm327_clock_taken() and returns how many events it queued.
+ */
+typedef int (*elm327_clock_source_t)(void *arg, int real_ms);
+
+
+/* Monotonic nanoseconds */
+extern uint64_t elm327_clock_now_ns(void);
+
+
+/* Microseconds since the epoch, for timestamps */
+extern uint64_t elm327_clock_wall_us(void);
+
+
+extern void elm327_clock_sleep_ns(uint64_t ns);
+
+
+/* poll() for POLLIN with the clock: 1 readable, 0 timeout, -1 with errno set
+ * (EIO when the device went away).  A negative timeout waits for ever.
+ */
+extern int elm327_clock_wait_readable(int fd, int timeout_ms);
+
+
+/* Switch to virtual time, starting at 'epoch_us' wall clock.  0, or -1 with
+ * errno EBUSY when already virtual.
+ */
+extern int elm327_clock_virtual(uint64_t epoch_us);
+
+
+extern int elm327_clock_is_virtual(void);
+
+
+/* Run 'fn' at virtual time 'when_ns' (now when in the past).  0, or -1 with
+ * errno set (EINVAL on the real clock).
+ */
+extern int elm327_clock_at(uint64_t when_ns, elm327_clock_event_t fn, void *arg);
+
+
+/* Bytes written to a source, by elm327_write().  Nothing on the real clock. */
+extern void elm327_clock_sent(size_t n);
+
+
+/* Bytes a source read of what was sent to it */
+extern void elm327_clock_taken(size_t n);
+
+
+/* Wait until the sources have taken all that was sent to them: 0, or -1 with
+ * errno EDEADLK when some of it never turned up
+ */
+extern int elm327_clock_sync(void);
+
+
+/* Register a source, asked for events whenever time is about to move */
+extern int elm327_clock_add_source(elm327_clock_source_t fn, void *arg);
+
+
+extern void elm327_clock_remove_source(elm327_clock_source_t fn, void *arg);
+
+
+#endif /* _ELM327CLOCK_H */
@@ -0,0 +1,38 @@
+#ifndef _ELM327CMD_H
+#define _ELM327CMD_H
+
+
+/* Subcommands of elm327diag.  Each takes the argument vector starting at the
+ * subcommand name (argv[0] is e.g. "analyze") and returns the process exit
+ * status.
+ */
+
+/* Fleet-wide per channel statistics over binary logs */
+extern int elm327_cmd_analyze(int argc, char *argv[]);
+
+/* Monitor mode capture to CAN frames, on all cores */
+extern int elm327_cmd_decode(int argc, char *argv[]);
+
+/* K-way merge of sorted logs into an indexed fleet store */
+extern int elm327_cmd_merge(int argc, char *argv[]);
+
+/* Legacy carstats.csv files to a binary log */
+extern int elm327_cmd_import(int argc, char *argv[]);
+
+/* Micro benchmarks (elm327bench.c) */
+extern int elm327_cmd_bench(int argc, char *argv[]);
+
+/* Per stage cost of the sampling path with hardware counters */
+extern int elm327_cmd_profile(int argc, char *argv[]);
+
+/* Depot inspection: VIN, DTCs, readiness, odometer and Mode 06 in one go */
+extern int elm327_cmd_inspect(int argc, char *argv[]);
+
+/* J1939: broadcast monitoring, PGN requests for the rest, SPN decoding */
+extern int elm327_cmd_j1939(int argc, char *argv[]);
+
+/* PID definitions to a memory mapped perfect hash pack */
+extern int elm327_cmd_pack(int argc, char *argv[]);
+
+
+#endif /* _ELM327CMD_H */
@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "elm327config.h"
+#include "elm327clock.h"
+
+
+/* Editors write in bursts, the file is read once it has been quiet this long */
+#define CONFIG_SETTLE_MS 50
+#define CONFIG_LINE_MAX  512
+
+
+struct _elm327_config
+{
+    char                         path[PATH_MAX];
+    const char                  *base;        /* file name within 'path' */
+    struct obdpid                o[OBDPID_TABLE_SIZE];
+    int                          fd;          /* inotify */
+    int                          stop[2];     /* pipe, written to stop */
+    pthread_t                    thread;
+    unsigned int                 generation;
+    _Atomic(elm327_schedule_t *) pending;
+};
+
+
+uint64_t elm327_schedule_now_ms(void)
+{
+    return elm327_clock_now_ns() / 1000000;
+}
+
+
+elm327_schedule_t *elm327_schedule_default(const struct obdpid o[OBDPID_TABLE_SIZE])
+{
+    elm327_schedule_t *s;
+    int                i;
+
+    if (!(s = calloc(1, sizeof(elm327_schedule_t))))
+      return NULL;
+    for (i = 0; i < OBDPID_TABLE_SIZE; ++i)
+      if (o[i].bytes > 0)
+        s->entries[s->n++].idx = i;
+
+    return s;
+}
+
+
+elm327_schedule_t *elm327_schedule_load(const char *path, const struct obdpid o[OBDPID_TABLE_SIZE])
+{
+    elm327_schedule_t *s;
+    FILE              *fp;
+    char               line[CONFIG_LINE_MAX], pack[CONFIG_LINE_MAX], file[PATH_MAX], *p, *end;
+    const char        *slash;
+    unsigned long      pid, interval;
+    int                lineno = 0, n, k;
+
+    if (!(s = calloc(1, sizeof(elm327_schedule_t))))
+      return NULL;
+    if (!(fp = fopen(path, "r")))
+    {
+        free(s);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        ++lineno;
+        if ((p = strchr(line, '#')))
+          *p = '\0';
+        for (end = line + strlen(line); (end > line) && isspace((unsigned char)end[-1]); --end)
+          ;
+        *end = '\0';
+        for (p = line; isspace((unsigned char)*p); ++p)
+          ;
+        if (!*p)
+          continue;
+
+        if (!strncmp(p, "pack", 4) && isspace((unsigned char)p[4]))
+        {
+            if ((sscanf(p + 4, " %s%n", pack, &n) != 1) || p[4 + n] || s->pack)
+              goto syntax;
+
+            /* A relative pack is next to the configuration, wherever we run */
+            if ((pack[0] != '/') && (slash = strrchr(path, '/')))
+              n = snprintf(file, sizeof(file), "%.*s/%s", (int)(slash - path), path, pack);
+            else
+              n = snprintf(file, sizeof(file), "%s", pack);
+            if (n >= (int)sizeof(file))
+            {
+                fprintf(stderr, "%s:%d: %s: %s\n", path, lineno, pack, strerror(ENAMETOOLONG));
+                errno = ENAMETOOLONG;
+                goto fail;
+            }
+            if (!(s->pack = elm327_pack_open(file)))
+            {
+                fprintf(stderr, "%s:%d: %s: %s\n", path, lineno, file, strerror(errno));
+                goto fail;
+            }
+            continue;
+        }
+
+        interval = 0;
+        pid = strtoul(p, &end, 16);
+        if ((end == p) || (*end && !isspace((unsigned char)*end)) || (pid >= OBDPID_TABLE_SIZE) || !o[pid].bytes)
+        {
+            fprintf(stderr, "%s:%d: '%s' is not a PID that can be read\n", path, lineno, p);
+            errno = EINVAL;
+            goto fail;
+        }
+        for (p = end; isspace((unsigned char)*p); ++p)
+          ;
+        if (*p)
+        {
+            /* The interval and nothing after it */
+            errno = 0;
+            interval = isdigit((unsigned char)*p) ? strtoul(p, &end, 10) : 0;
+            if (!isdigit((unsigned char)*p) || *end || errno || (interval > UINT32_MAX))
+            {
+                fprintf(stderr, "%s:%d: '%s' is not an interval in ms\n", path, lineno, p);
+                errno = EINVAL;
+                goto fail;
+            }
+        }
+        for (k = 0; (k < s->n) && (s->entries[k].idx != (int)pid); ++k)
+          ;
+        if (k < s->n)
+        {
+            fprintf(stderr, "%s:%d: PID %02lX listed twice\n", path, lineno, pid);
+            errno = EINVAL;
+            goto fail;
+        }
+        s->entries[s->n].idx = pid;
+        s->entries[s->n].interval_ms = interval;
+        s->n++;
+    }
+    if (!s->n)
+    {
+        fprintf(stderr, "%s: no PIDs to read\n", path);
+        errno = EINVAL;
+        goto fail;
+    }
+    fclose(fp);
+
+    return s;
+
+syntax:
+    fprintf(stderr, "%s:%d: expected <pid> [<interval ms>] or pack <file>\n", path, lineno);
+    errno = EINVAL;
+fail:
+    fclose(fp);
+    elm327_schedule_free(s);
+
+    return NULL;
+}
+
+
+void elm327_schedule_carry(elm327_schedule_t *to, const elm327_schedule_t *from)
+{
+    int i, k;
+
+    for (i = 0; i < to->n; ++i)
+      for (k = 0; k < from->n; ++k)
+        if (from->entries[k].idx == to->entries[i].idx)
+        {
+            to->entries[i].due_ms = from->entries[k].due_ms;
+            break;
+        }
+}
+
+
+int elm327_schedule_due(elm327_schedule_t *s, int k, uint64_t now_ms)
+{
+    elm327_schedule_entry_t *e = &s->entries[k];
+
+    if (e->due_ms > now_ms)
+      return 0;
+
+    if (e->n_queries++)
+    {
+        e->late_ms_sum += now_ms - e->due_ms;
+        if (now_ms - e->due_ms > e->late_ms_max)
+          e->late_ms_max = now_ms - e->due_ms;
+    }
+
+    /* A late channel does not make up for it with a burst */
+    e->due_ms += e->interval_ms;
+    if (e->due_ms <= now_ms)
+      e->due_ms = now_ms + e->interval_ms;
+
+    return 1;
+}
+
+
+uint64_t elm327_schedule_next(const elm327_schedule_t *s)
+{
+    uint64_t next = UINT64_MAX;
+    int      k;
+
+    for (k = 0; k < s->n; ++k)
+      if (s->entries[k].due_ms < next)
+        next = s->entries[k].due_ms;
+
+    return next;
+}
+
+
+void elm327_schedule_free(elm327_schedule_t *s)
+{
+    if (!s)
+      return;
+
+    elm327_pack_close(s->pack);
+    free(s);
+}
+
+
+/* Whether the events in 'buf' are about our file */
+static int config_touched(const elm327_config_t *c, const char *buf, ssize_t len)
+{
+    const struct inotify_event *ev;
+    const char                 *p;
+    int                         touched = 0;
+
+    for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len)
+    {
+        ev = (const struct inotify_event *)p;
+        if (ev->len && !strcmp(ev->name, c->base))
+          touched = 1;
+    }
+
+    return touched;
+}
+
+
+static void *config_watch(void *arg)
+{
+    elm327_config_t   *c = arg;
+    elm327_schedule_t *s;
+    struct pollfd      fds[2];
+    char               buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t            len;
+    int                changed = 0;
+
+    fds[0].fd = c->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = c->stop[0];
+    fds[1].events = POLLIN;
+
+    for (;;)
+    {
+        /* After a change, wait for the writer to be done */
+        if (poll(fds, 2, changed ? CONFIG_SETTLE_MS : -1) == -1)
+        {
+            if (errno == EINTR)
+              continue;
+            break;
+        }
+        if (fds[1].revents)
+          break;
+
+        if (fds[0].revents & POLLIN)
+        {
+            if ((len = read(c->fd, buf, sizeof(buf))) > 0)
+              changed |= config_touched(c, buf, len);
+            continue;
+        }
+        if (!changed)
+          continue;
+        changed = 0;
+
+        if (!(s = elm327_schedule_load(c->path, c->o)))
+        {
+            fprintf(stderr, "%s: %s, keeping the running configuration\n", c->path, strerror(errno));
+            continue;
+        }
+        s->generation = ++c->generation;
+
+        /* Replaces one the sampling loop never took */
+        elm327_schedule_free(atomic_exchange_explicit(&c->pending, s, memory_order_acq_rel));
+    }
+
+    return NULL;
+}
+
+
+elm327_config_t *elm327_config_watch(const char *path, const struct obdpid o[OBDPID_TABLE_SIZE])
+{
+    elm327_config_t *c;
+    char             dir[PATH_MAX], *slash;
+
+    if (!(c = calloc(1, sizeof(elm327_config_t))))
+      return NULL;
+    snprintf(c->path, sizeof(c->path), "%s", path);
+    memcpy(c->o, o, sizeof(c->o));
+    atomic_init(&c->pending, NULL);
+    c->stop[0] = c->stop[1] = -1;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    if ((slash = strrchr(dir, '/')))
+    {
+        c->base = c->path + (slash - dir) + 1;
+        *(slash == dir ? slash + 1 : slash) = '\0';
+    }
+    else
+    {
+        c->base = c->path;
+        strcpy(dir, ".");
+    }
+
+    if (((c->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) ||
+        (inotify_add_watch(c->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) ||
+        (pipe(c->stop) == -1) ||
+        (errno = pthread_create(&c->thread, NULL, config_watch, c)))
+    {
+        int saved = errno;
+
+        if (c->fd != -1)
+          close(c->fd);
+        if (c->stop[0] != -1)
+        {
+            close(c->stop[0]);
+            close(c->stop[1]);
+        }
+        free(c);
+        errno = saved;
+        return NULL;
+    }
+
+    return c;
+}
+
+
+elm327_schedule_t *elm327_config_take(elm327_config_t *c)
+{
+    /* The common case is a plain load, no write to the shared line */
+    if (!c || !atomic_load_explicit(&c->pending, memory_order_relaxed))
+      return NULL;
+
+    return atomic_exchange_explicit(&c->pending, NULL, memory_order_acq_rel);
+}
+
+
+void elm327_config_close(elm327_config_t *c)
+{
+    if (!c)
+      return;
+
+    if (write(c->stop[1], "", 1) == 1)
+      pthread_join(c->thread, NULL);
+    close(c->stop[0]);
+    close(c->stop[1]);
+    close(c->fd);
+    elm327_schedule_free(atomic_load(&c->pending));
+    free(c);
+}
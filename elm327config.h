@@ -0,0 +1,99 @@
+#ifndef _ELM327CONFIG_H
+#define _ELM327CONFIG_H
+
+#include <stdint.h>
+
+#include "elm327pids.h"
+#include "elm327pack.h"
+
+
+/* What the sampling loop reads and how often, reloaded while it runs.
+ *
+ * The configuration file (-c) has one PID per line with an optional
+ * interval, and optionally a pack that overrides the decoding:
+ *
+ *   # pid  interval_ms (none or 0: every pass)
+ *   0C     100
+ *   05     1000
+ *   0D
+ *   pack   /etc/elm327diag/WVW.pack
+ *
+ * A relative pack path is taken from the configuration file's directory.
+ * Anything after a line's value, other than a comment, is an error.
+ *
+ * A watcher thread follows the file with inotify (the directory, so an
+ * editor's rename counts), parses a changed file into a new schedule and
+ * leaves it in a single pending slot.  The sampling loop takes it between
+ * transactions with one atomic exchange; the adapter is not touched, and
+ * channels in both schedules keep their due times.  A file that does not
+ * parse is reported and the running schedule stays.
+ */
+typedef struct _elm327_schedule_entry
+{
+    int      idx;           /* in the PID table, which is the PID */
+    uint32_t interval_ms;   /* 0 every pass */
+    uint64_t due_ms;        /* next query, elm327_clock_now_ns() / 1e6 */
+
+    /* How well the schedule was kept */
+    uint64_t n_queries;
+    uint64_t late_ms_sum;
+    uint64_t late_ms_max;
+} elm327_schedule_entry_t;
+
+
+typedef struct _elm327_schedule
+{
+    int                     n;
+    elm327_schedule_entry_t entries[OBDPID_TABLE_SIZE];
+    elm327_pack_t          *pack;          /* owned, NULL to keep -k */
+    unsigned int            generation;
+} elm327_schedule_t;
+
+
+typedef struct _elm327_config elm327_config_t;
+
+
+/* Every PID of 'o' that is read, each pass: the schedule without -c */
+extern elm327_schedule_t *elm327_schedule_default(const struct obdpid o[OBDPID_TABLE_SIZE]);
+
+
+/* Parse a configuration file.  NULL on error with errno set, syntax errors
+ * are reported on stderr with the line.
+ */
+extern elm327_schedule_t *elm327_schedule_load(const char *path, const struct obdpid o[OBDPID_TABLE_SIZE]);
+
+
+/* Carry the due times of channels 'from' also has over to 'to' */
+extern void elm327_schedule_carry(elm327_schedule_t *to, const elm327_schedule_t *from);
+
+
+/* Whether entry 'k' is due at 'now_ms', and if it is move it to its next
+ * due time
+ */
+extern int elm327_schedule_due(elm327_schedule_t *s, int k, uint64_t now_ms);
+
+
+/* Earliest due time over the entries, UINT64_MAX when empty */
+extern uint64_t elm327_schedule_next(const elm327_schedule_t *s);
+
+
+extern uint64_t elm327_schedule_now_ms(void);
+
+
+extern void elm327_schedule_free(elm327_schedule_t *s);
+
+
+/* Watch 'path' for changes.  NULL on error with errno set. */
+extern elm327_config_t *elm327_config_watch(const char *path, const struct obdpid o[OBDPID_TABLE_SIZE]);
+
+
+/* The schedule of the last change, NULL when nothing changed since the last
+ * call.  Lock free, the caller owns the result.
+ */
+extern elm327_schedule_t *elm327_config_take(elm327_config_t *c);
+
+
+extern void elm327_config_close(elm327_config_t *c);
+
+
+#endif /* _ELM327CONFIG_H */
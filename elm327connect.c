@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "elm327.h"
+#include "elm327connect.h"
+#include "elm327clock.h"
+
+
+/* Weight of one connect of a vehicle with the same WMI against one of any
+ * vehicle
+ */
+#define CONNECT_WMI_WEIGHT  20
+
+#define CONNECT_REPLY_MAX   512
+
+/* Silence that ends a stopped attempt */
+#define CONNECT_QUIET_MS    100
+
+
+const char *elm327_protocol_names[ELM327_PROTOCOLS + 1] =
+{
+    "none",
+    "SAE J1850 PWM",
+    "SAE J1850 VPW",
+    "ISO 9141-2",
+    "ISO 14230-4 KWP (5 baud init)",
+    "ISO 14230-4 KWP (fast init)",
+    "ISO 15765-4 CAN (11 bit, 500 kbaud)",
+    "ISO 15765-4 CAN (29 bit, 500 kbaud)",
+    "ISO 15765-4 CAN (11 bit, 250 kbaud)",
+    "ISO 15765-4 CAN (29 bit, 250 kbaud)"
+};
+
+
+/* Before any statistics: most of what is on the road since 2008 is CAN 11
+ * bit at 500 kbaud, the rest about even
+ */
+static const double protocol_prior[ELM327_PROTOCOLS + 1] =
+{
+    0, 1, 1, 1, 1, 1, 8, 2, 1, 1
+};
+
+
+/* What a failed attempt costs, milliseconds.  The 5 baud init alone takes
+ * two seconds before the ELM knows.  Also the read timeout of an attempt,
+ * times three.
+ */
+static const int protocol_cost_ms[ELM327_PROTOCOLS + 1] =
+{
+    0, 300, 300, 3000, 3000, 600, 150, 150, 150, 150
+};
+
+
+static double connect_now_ms(void)
+{
+    return elm327_clock_now_ns() / 1e6;
+}
+
+
+void elm327_connect_order(const char *stats_path, const char *wmi, int order[ELM327_PROTOCOLS])
+{
+    double  score[ELM327_PROTOCOLS + 1];
+    char    line[128], who[32];
+    FILE   *fp;
+    long    epoch;
+    int     i, j, t, p, attempts;
+    double  ms;
+
+    for (p = 1; p <= ELM327_PROTOCOLS; ++p)
+      score[p] = protocol_prior[p];
+
+    if (stats_path && (fp = fopen(stats_path, "r")))
+    {
+        while (fgets(line, sizeof(line), fp))
+        {
+            if ((sscanf(line, "%ld %31s %x %lf %d", &epoch, who, &p, &ms, &attempts) != 5) ||
+                (p < 1) || (p > ELM327_PROTOCOLS))
+              continue;
+            score[p] += 1;
+            if (wmi && (strlen(wmi) >= 3) && !strncasecmp(who, wmi, 3))
+              score[p] += CONNECT_WMI_WEIGHT;
+        }
+        fclose(fp);
+    }
+
+    /* Likelihood per millisecond spent, the best expected search time */
+    for (p = 1; p <= ELM327_PROTOCOLS; ++p)
+    {
+        score[p] /= protocol_cost_ms[p];
+        order[p - 1] = p;
+    }
+    for (i = 1; i < ELM327_PROTOCOLS; ++i)
+      for (j = i; (j > 0) && (score[order[j]] > score[order[j - 1]]); --j)
+      {
+          t = order[j];
+          order[j] = order[j - 1];
+          order[j - 1] = t;
+      }
+
+    /* A KWP ECU that does 5 baud init mostly does fast init too, and that
+     * is seconds quicker to find out
+     */
+    for (i = 0; order[i] != 5; ++i)
+      if ((order[i] == 3) || (order[i] == 4))
+      {
+          for (j = i; order[j] != 5; ++j)
+            ;
+          for (; j > i; --j)
+            order[j] = order[j - 1];
+          order[i] = 5;
+          break;
+      }
+}
+
+
+/* Count the "41 00" answers, skipping the echo and "SEARCHING..." */
+static int count_answers(const char *reply)
+{
+    unsigned char  data[8];
+    const char    *p, *end;
+    int            n = 0;
+
+    for (p = reply; *p; p = *end ? end + 1 : end)
+    {
+        if (!(end = strchr(p, '\n')))
+          end = p + strlen(p);
+        if ((elm327_hex_to_bytes(p, end - p, data, sizeof(data)) >= 2) &&
+            (data[0] == 0x41) && (data[1] == 0x00))
+          ++n;
+    }
+
+    return n;
+}
+
+
+int elm327_connect(
+    int                      fd,
+    const char              *stats_path,
+    const char              *wmi,
+    elm327_connect_result_t *res)
+{
+    int    order[ELM327_PROTOCOLS];
+    char   cmd[8], reply[CONNECT_REPLY_MAX];
+    double t0 = connect_now_ms();
+    int    i, p;
+
+    memset(res, 0, sizeof(*res));
+    elm327_connect_order(stats_path, wmi, order);
+
+    elm327_flush(fd);
+    for (i = 0; i < ELM327_PROTOCOLS; ++i)
+    {
+        p = order[i];
+        ++res->attempts;
+
+        snprintf(cmd, sizeof(cmd), "ATSP%X", p);
+        if ((elm327_send_cmd(fd, cmd) == -1) ||
+            (elm327_read_response(fd, reply, sizeof(reply), 1000) == -1) ||
+            (elm327_send_cmd(fd, "0100") == -1))
+          break;
+
+        if (elm327_read_response(fd, reply, sizeof(reply), 3 * protocol_cost_ms[p]) == -1)
+        {
+            if (errno != ETIMEDOUT)
+              break;
+
+            /* Still initialising: any character stops the ELM.  Whatever
+             * it still had to say goes, until the line is quiet.
+             */
+            if ((elm327_send_cmd(fd, "") == -1) || (elm327_wait_prompt(fd, 1000) == -1))
+              break;
+            while (elm327_wait_readable(fd, CONNECT_QUIET_MS) == 1)
+              if (elm327_read(fd, reply, sizeof(reply)) <= 0)
+                break;
+            continue;
+        }
+
+        if ((res->n_ecus = count_answers(reply)) > 0)
+        {
+            res->protocol = p;
+            res->ms = connect_now_ms() - t0;
+            return 0;
+        }
+    }
+
+    res->ms = connect_now_ms() - t0;
+    if (i == ELM327_PROTOCOLS)
+      errno = ENODEV;
+
+    return -1;
+}
+
+
+int elm327_connect_log(
+    const char                    *stats_path,
+    const char                    *wmi,
+    const elm327_connect_result_t *res)
+{
+    FILE *fp;
+    char  who[4] = "-";
+    int   i;
+
+    if (wmi && (strlen(wmi) >= 3))
+      for (i = 0; i < 3; ++i)
+        who[i] = toupper((unsigned char)wmi[i]);
+
+    if (!(fp = fopen(stats_path, "a")))
+      return -1;
+    fprintf(fp, "%ld %s %X %.0f %d\n", (long)(elm327_clock_wall_us() / 1000000), who, res->protocol, res->ms, res->attempts);
+
+    return fclose(fp);
+}
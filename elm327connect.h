@@ -0,0 +1,61 @@
+#ifndef _ELM327CONNECT_H
+#define _ELM327CONNECT_H
+
+
+/* Cold connect without the adapter's own search.
+ *
+ * ATSP0 walks the protocols in a fixed order and a vehicle on ISO 9141 or
+ * 5 baud KWP pays for every CAN and J1850 attempt before its own.  Instead
+ * each protocol is set explicitly (ATSPn) and tried with 0100, most likely
+ * first: what the fleet answered on before (per WMI when the VIN is known,
+ * then overall) weighed against what a failed attempt costs.  ISO 14230 fast
+ * init always goes before 5 baud init.  An attempt ends at the first answer
+ * from the ELM, NO DATA, UNABLE TO CONNECT and the bus errors are final.
+ *
+ * Statistics are a log, one line per connect:
+ *
+ *   <epoch> <wmi|-> <protocol> <ms> <attempts>
+ *
+ * appended by elm327_connect_log(), so the ordering follows the fleet.
+ */
+#define ELM327_PROTOCOLS 9   /* ATSP1 to ATSP9 */
+
+
+typedef struct _elm327_connect_result
+{
+    int    protocol;   /* ATSP number, 0 when nothing answered */
+    int    n_ecus;     /* that answered 0100 */
+    int    attempts;
+    double ms;
+} elm327_connect_result_t;
+
+
+extern const char *elm327_protocol_names[ELM327_PROTOCOLS + 1];
+
+
+/* Attempt order for a vehicle whose VIN (or WMI) starts with 'wmi', NULL
+ * when unknown, from the log at 'stats_path' (NULL or missing: built in
+ * priors only).  Fills 'order' with ELM327_PROTOCOLS protocol numbers.
+ */
+extern void elm327_connect_order(const char *stats_path, const char *wmi, int order[ELM327_PROTOCOLS]);
+
+
+/* Try the protocols in order until one answers 0100.  The found protocol
+ * stays set on the adapter.  Returns 0, or -1 with errno ENODEV when none
+ * answered, or the error of the adapter; 'res' is filled either way.
+ */
+extern int elm327_connect(
+    int                      fd,
+    const char              *stats_path,
+    const char              *wmi,
+    elm327_connect_result_t *res);
+
+
+/* Append 'res' to the log, 0 or -1 with errno set */
+extern int elm327_connect_log(
+    const char                    *stats_path,
+    const char                    *wmi,
+    const elm327_connect_result_t *res);
+
+
+#endif /* _ELM327CONNECT_H */
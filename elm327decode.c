@@ -0,0 +1,388 @@
+/*
+ * elm327decode.c
+ *
+ * Parallel decoding of raw monitor mode (ATMA) captures.
+ *
+ * The capture is memory mapped and cut into chunks whose boundaries are moved
+ * forward to the next line feed, so no line is ever split.  Chunks are
+ * decoded on the worker pool into private output buffers with the table
+ * driven hex path, and written out strictly in capture order.  Work proceeds
+ * in waves of a few chunks per worker so memory stays bounded no matter how
+ * large the capture is.
+ *
+ * Output is one CSV line per frame: id, dlc, data, and for single frame OBD
+ * responses the mode and pid they answer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "elm327.h"
+#include "elm327pool.h"
+#include "elm327cmd.h"
+
+
+#define DECODE_CHUNK_SIZE     (4 * 1024 * 1024)
+#define DECODE_WAVE_PER_CPU   2
+
+/* Worst case output for one frame: "18DAF110, 8, 0011223344556677, 01, 0D\n" */
+#define DECODE_MAX_OUT_LINE   48
+
+
+typedef struct _decode_task
+{
+    const char    *start;
+    const char    *end;
+    int            emit;       /* 0 when benchmarking the decode alone */
+    char          *out;
+    size_t         out_len;
+    size_t         out_cap;
+    unsigned long  lines;
+    unsigned long  frames;
+    int            error;      /* errno when the output is incomplete */
+} decode_task_t;
+
+
+/* Move 'p' just past the next line feed (or to 'end') */
+static const char *next_line(const char *p, const char *end)
+{
+    const char *nl = memchr(p, '\n', end - p);
+
+    return nl ? nl + 1 : end;
+}
+
+
+static char *put_hex8(char *o, unsigned char b)
+{
+    *o++ = elm327_digit_to_hexascii(b >> 4);
+    *o++ = elm327_digit_to_hexascii(b & 0x0F);
+
+    return o;
+}
+
+
+static char *format_frame(char *o, const elm327_can_frame_t *f)
+{
+    int i, shift;
+
+    /* Identifier, 3 or 8 digits as the adapter printed it */
+    for (shift = f->extended ? 28 : 8; shift >= 0; shift -= 4)
+      *o++ = elm327_digit_to_hexascii((f->id >> shift) & 0x0F);
+
+    *o++ = ',';
+    *o++ = ' ';
+    *o++ = '0' + f->dlc;
+    *o++ = ',';
+    *o++ = ' ';
+    for (i=0; i<f->dlc; ++i)
+      o = put_hex8(o, f->data[i]);
+
+    /* Single frame OBD response from an ECU (7E8-7EF or 18DAF1xx) */
+    if ((f->dlc >= 3) && (f->data[0] < 8) &&
+        (f->data[1] >= 0x41) && (f->data[1] <= 0x4A) &&
+        ((!f->extended && ((f->id & 0x7F8) == 0x7E8)) ||
+         (f->extended && ((f->id & 0x1FFFFF00) == 0x18DAF100))))
+    {
+        *o++ = ',';
+        *o++ = ' ';
+        o = put_hex8(o, f->data[1] - 0x40);
+        *o++ = ',';
+        *o++ = ' ';
+        o = put_hex8(o, f->data[2]);
+    }
+
+    *o++ = '\n';
+
+    return o;
+}
+
+
+/* Make room for one more formatted frame, returns the (moved) cursor */
+static char *reserve_out(decode_task_t *task, char *o)
+{
+    size_t  used = o - task->out, cap;
+    char   *grown;
+
+    if (task->out && (used + DECODE_MAX_OUT_LINE <= task->out_cap))
+      return o;
+
+    cap = task->out_cap ? task->out_cap * 2 : 2 * (task->end - task->start) + DECODE_MAX_OUT_LINE;
+    if (!(grown = realloc(task->out, cap)))
+      return NULL;
+    task->out = grown;
+    task->out_cap = cap;
+
+    return grown + used;
+}
+
+
+static void decode_chunk(void *arg, int worker)
+{
+    decode_task_t      *task = arg;
+    const char         *line, *eol, *next;
+    elm327_can_frame_t  frame;
+    char               *o = task->out;
+
+    task->out_len = 0;
+    task->lines = task->frames = 0;
+    task->error = 0;
+
+    for (line = task->start; line < task->end; line = next)
+    {
+        next = next_line(line, task->end);
+        eol = (next[-1] == '\n') ? next - 1 : next;
+        ++task->lines;
+
+        if (elm327_parse_monitor_line(line, eol - line, &frame) == -1)
+          continue;
+
+        ++task->frames;
+        if (!task->emit)
+          continue;
+
+        /* Output is usually about 1.5x the text, the buffer is reused */
+        if (!(o = reserve_out(task, o)))
+        {
+            task->error = ENOMEM;
+            return;
+        }
+        o = format_frame(o, &frame);
+    }
+
+    if (task->emit)
+      task->out_len = o - task->out;
+}
+
+
+/* Reference: the pre-existing per message path, one core */
+static unsigned long decode_baseline(const char *p, const char *end)
+{
+    elm327_msg_as_ascii_t ascii;
+    elm327_msg_t          msg;
+    const char           *next, *c;
+    unsigned long         lines = 0;
+    unsigned int          sink = 0;
+    int                   n;
+
+    for (; p < end; p = next)
+    {
+        next = next_line(p, end);
+        ++lines;
+
+        /* Skip the header token, then squeeze spaces like elm327_recv_msgs */
+        for (c = p; (c < next) && (*c != ' '); ++c)
+          ;
+        memset(ascii, 0, sizeof(ascii));
+        for (n = 0; (c < next) && (n < OBD_MAX_ASCII_MSG_SIZE); ++c)
+          if ((*c != ' ') && (*c != '\r') && (*c != '\n'))
+            ascii[n++] = *c;
+
+        elm327_ascii_to_msg(ascii, msg);
+        sink += msg[0];
+    }
+
+    /* Keep the compiler from dropping the loop */
+    if (sink == 0xFFFFFFFF)
+      fprintf(stderr, " ");
+
+    return lines;
+}
+
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Decode the whole capture, in waves, optionally writing to 'out' */
+static int decode_capture(
+    elm327_pool_t *pool,
+    const char    *base,
+    size_t         size,
+    FILE          *out,
+    unsigned long *lines,
+    unsigned long *frames)
+{
+    decode_task_t *tasks;
+    const char    *p, *end = base + size, *cut;
+    int            i, n_wave, n, err = 0;
+
+    n_wave = elm327_pool_size(pool) * DECODE_WAVE_PER_CPU;
+    if (!(tasks = calloc(n_wave, sizeof(decode_task_t))))
+      return -1;
+
+    *lines = *frames = 0;
+    for (p = base; (p < end) && !err;)
+    {
+        for (n = 0; (n < n_wave) && (p < end); ++n)
+        {
+            cut = ((size_t)(end - p) > DECODE_CHUNK_SIZE) ? p + DECODE_CHUNK_SIZE : end;
+            if (cut < end)
+              cut = next_line(cut, end);
+
+            tasks[n].start = p;
+            tasks[n].end = cut;
+            tasks[n].emit = (out != NULL);
+
+            /* The queue is full or out of memory: do it here */
+            if (elm327_pool_submit(pool, decode_chunk, &tasks[n]) == -1)
+              decode_chunk(&tasks[n], 0);
+            p = cut;
+        }
+        elm327_pool_wait(pool);
+
+        /* Ordered output */
+        for (i = 0; i < n; ++i)
+        {
+            if (tasks[i].error && !err)
+            {
+                errno = tasks[i].error;
+                err = -1;
+            }
+            *lines += tasks[i].lines;
+            *frames += tasks[i].frames;
+            if (out && !err && tasks[i].out_len &&
+                (fwrite(tasks[i].out, tasks[i].out_len, 1, out) != 1))
+              err = -1;
+        }
+    }
+
+    for (i = 0; i < n_wave; ++i)
+      free(tasks[i].out);
+    free(tasks);
+
+    return err;
+}
+
+
+static void decode_usage(const char *prog)
+{
+    printf("Usage:\n");
+    printf("  %s decode [-j <threads>] [-o <file>] [-B] <capture>\n", prog);
+    printf("Options:\n");
+    printf("  -j <int>     worker threads (default: one per cpu)\n");
+    printf("  -o <string>  output file (default: stdout)\n");
+    printf("  -B           benchmark against elm327_ascii_to_msg, no output\n");
+}
+
+
+int elm327_cmd_decode(int argc, char *argv[])
+{
+    int            i, fd, n_threads = 0, bench = 0, err = 0;
+    const char    *out_path = NULL;
+    struct stat    st;
+    char          *base;
+    FILE          *out = stdout;
+    elm327_pool_t *pool;
+    unsigned long  lines, frames;
+    double         t0, secs;
+
+    for (i=1; i<argc; ++i)
+    {
+        if (!strcmp(argv[i], "-j") && (i < argc-1))
+          n_threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-o") && (i < argc-1))
+          out_path = argv[++i];
+        else if (!strcmp(argv[i], "-B"))
+          bench = 1;
+        else
+          break;
+    }
+
+    if (i != argc-1)
+    {
+        decode_usage("elm327diag");
+        return 1;
+    }
+
+    if (((fd = open(argv[i], O_RDONLY)) == -1) || (fstat(fd, &st) == -1))
+    {
+        fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+        if (fd != -1)
+          close(fd);
+        return 1;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+        return 1;
+    }
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    if (!(pool = elm327_pool_create(n_threads)))
+    {
+        munmap(base, st.st_size);
+        return 1;
+    }
+    n_threads = elm327_pool_size(pool);
+
+    if (bench)
+    {
+        /* Fault the whole capture in first so every run sees the same cache */
+        decode_baseline(base, base + st.st_size);
+
+        t0 = now_seconds();
+        lines = decode_baseline(base, base + st.st_size);
+        secs = now_seconds() - t0;
+        printf("elm327_ascii_to_msg, 1 thread:  %lu lines in %.3f s (%.0f lines/s)\n",
+               lines, secs, lines / secs);
+
+        t0 = now_seconds();
+        decode_capture(pool, base, st.st_size, NULL, &lines, &frames);
+        secs = now_seconds() - t0;
+        printf("fast hex path, %d thread(s):%lu lines in %.3f s (%.0f lines/s)\n",
+               n_threads, lines, secs, lines / secs);
+    }
+    else
+    {
+        if (out_path && !(out = fopen(out_path, "w")))
+        {
+            fprintf(stderr, "%s: %s\n", out_path, strerror(errno));
+            err = 1;
+        }
+        else
+        {
+            t0 = now_seconds();
+            if (decode_capture(pool, base, st.st_size, out, &lines, &frames) == -1)
+            {
+                fprintf(stderr, "%s: %s\n", out_path ? out_path : "output", strerror(errno));
+                err = 1;
+            }
+            secs = now_seconds() - t0;
+            fprintf(stderr, "decoded %lu frames from %lu lines in %.3f s "
+                    "(%.0f lines/s, %d threads)\n",
+                    frames, lines, secs, secs > 0 ? lines / secs : 0.0, n_threads);
+
+            if ((out != stdout) && (fclose(out) != 0) && !err)
+            {
+                fprintf(stderr, "%s: %s\n", out_path, strerror(errno));
+                err = 1;
+            }
+        }
+    }
+
+    elm327_pool_destroy(pool);
+    munmap(base, st.st_size);
+
+    return err;
+}
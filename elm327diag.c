@@ -30,46 +30,79 @@
 #include <errno.h>
 #include <termios.h>
 #include <byteswap.h>
+#include <limits.h>
+#include <signal.h>
 
 #include "elm327.h"
+#include "elm327log.h"
+#include "elm327pids.h"
+#include "elm327sink.h"
+#include "elm327tui.h"
+#include "elm327trace.h"
+#include "elm327probe.h"
+#include "elm327metrics.h"
+#include "elm327session.h"
+#include "elm327hotplug.h"
+#include "elm327connect.h"
+#include "elm327pack.h"
+#include "elm327config.h"
+#include "elm327clock.h"
+#include "elm327sim.h"
+#include "elm327replay.h"
+#include "elm327anomaly.h"
+#include "elm327cmd.h"
 
 /* Default values for the options */
 #define DEFAULT_DEVICE_NAME "/dev/pts/8"
 #define DEFAULT_OUTPUT_FILE      "carstats.csv"
 
+/* -d virtual: an hour of driving, from 2020-01-01 */
+#define VIRTUAL_DEFAULT_SECONDS 3600
+#define VIRTUAL_EPOCH_US        1577836800000000ull
+
 /* Options */
 const char* device_name = DEFAULT_DEVICE_NAME;
 const char* output_file = DEFAULT_OUTPUT_FILE;
-
-
-typedef enum
+const char* binary_log_file = NULL;
+unsigned int vehicle_id = 0;
+char csv_spec[PATH_MAX + 8];
+int dashboard = 0;
+const char* trace_file = NULL;
+const char* metrics_spec = NULL;
+const char* protocol_stats = NULL;
+const char* vin_hint = NULL;
+const char* pack_dir = NULL;
+const char* config_file = NULL;
+const char* capture_file = NULL;
+const char* anomaly_pids = NULL;
+int n_passes = 1;
+
+/* Extra output sinks (-s), see elm327sink.h */
+#define MAX_SINK_SPECS 8
+const char* sink_specs[MAX_SINK_SPECS];
+int n_sink_specs = 0;
+
+
+/* Subcommands, selected by the first argument */
+struct subcommand
 {
-    INTEGER    = 0,
-    DOUBLE     = 1,
-}
-DataType;
-
-typedef enum
-{
-    PERCENT           = 0,
-    RPM               = 1,
-    CELSIUS           = 2,
-    PASCALS           = 3,
-    KILOMETERSPERHOUR = 4
-}
-Units;
+    const char* name;
+    int (*run) (int, char**);
+    const char* description;
+};
 
-struct obdpid
+static const struct subcommand subcommands[] =
 {
-    int command;
-    double min;
-    double max;
-    size_t bytes;;
-    DataType datatype;
-    Units units;
-    double (*calculate) (double, double);
-    //char* command;
-    char* commandname;
+    { "analyze", elm327_cmd_analyze, "per channel statistics over binary logs" },
+    { "decode",  elm327_cmd_decode,  "decode a monitor mode capture into CAN frames" },
+    { "merge",   elm327_cmd_merge,   "merge sorted logs into an indexed fleet store" },
+    { "import",  elm327_cmd_import,  "convert carstats.csv files into a binary log" },
+    { "bench",   elm327_cmd_bench,   "run the built in micro benchmarks" },
+    { "profile", elm327_cmd_profile, "per stage cost of parse, decode and format (also --profile)" },
+    { "inspect", elm327_cmd_inspect, "depot inspection: VIN, DTCs, readiness, odometer, Mode 06" },
+    { "j1939",   elm327_cmd_j1939,   "heavy duty J1939: listen to broadcasts, request the rest" },
+    { "pack",    elm327_cmd_pack,    "compile PID definitions into a pack for -k" },
+    { NULL, NULL, NULL }
 };
 
 
@@ -105,6 +138,155 @@ void parse_args(int argc, char* argv[])
                     help = 1;
                 }
             }
+            else
+                if (!strcmp(argv[i],"-b"))
+                {
+                    if (i<argc-1)
+                    {
+                        binary_log_file = argv[++i];
+                    }
+                    else
+                    {
+                        help = 1;
+                    }
+                }
+                else
+                    if (!strcmp(argv[i],"-v"))
+                    {
+                        if (i<argc-1)
+                        {
+                            vehicle_id = strtoul(argv[++i], NULL, 0);
+                        }
+                        else
+                        {
+                            help = 1;
+                        }
+                    }
+                    else
+                        if (!strcmp(argv[i],"-s"))
+                        {
+                            if (i<argc-1 && n_sink_specs<MAX_SINK_SPECS)
+                            {
+                                sink_specs[n_sink_specs++] = argv[++i];
+                            }
+                            else
+                            {
+                                help = 1;
+                            }
+                        }
+                        else
+                            if (!strcmp(argv[i],"-n"))
+                            {
+                                if (i<argc-1)
+                                {
+                                    n_passes = atoi(argv[++i]);
+                                }
+                                else
+                                {
+                                    help = 1;
+                                }
+                            }
+                            else
+                                if (!strcmp(argv[i],"-t"))
+                                {
+                                    dashboard = 1;
+                                }
+                                else
+                                    if (!strcmp(argv[i],"-T"))
+                                    {
+                                        if (i<argc-1)
+                                        {
+                                            trace_file = argv[++i];
+                                        }
+                                        else
+                                        {
+                                            help = 1;
+                                        }
+                                    }
+                                    else
+                                        if (!strcmp(argv[i],"-m"))
+                                        {
+                                            if (i<argc-1)
+                                            {
+                                                metrics_spec = argv[++i];
+                                            }
+                                            else
+                                            {
+                                                help = 1;
+                                            }
+                                        }
+                                        else
+                                            if (!strcmp(argv[i],"-p"))
+                                            {
+                                                if (i<argc-1)
+                                                {
+                                                    protocol_stats = argv[++i];
+                                                }
+                                                else
+                                                {
+                                                    help = 1;
+                                                }
+                                            }
+                                            else
+                                                if (!strcmp(argv[i],"-w"))
+                                                {
+                                                    if (i<argc-1)
+                                                    {
+                                                        vin_hint = argv[++i];
+                                                    }
+                                                    else
+                                                    {
+                                                        help = 1;
+                                                    }
+                                                }
+                                                else
+                                                    if (!strcmp(argv[i],"-k"))
+                                                    {
+                                                        if (i<argc-1)
+                                                        {
+                                                            pack_dir = argv[++i];
+                                                        }
+                                                        else
+                                                        {
+                                                            help = 1;
+                                                        }
+                                                    }
+                                                    else
+                                                        if (!strcmp(argv[i],"-c"))
+                                                        {
+                                                            if (i<argc-1)
+                                                            {
+                                                                config_file = argv[++i];
+                                                            }
+                                                            else
+                                                            {
+                                                                help = 1;
+                                                            }
+                                                        }
+                                                        else
+                                                            if (!strcmp(argv[i],"-R"))
+                                                            {
+                                                                if (i<argc-1)
+                                                                {
+                                                                    capture_file = argv[++i];
+                                                                }
+                                                                else
+                                                                {
+                                                                    help = 1;
+                                                                }
+                                                            }
+                                                            else
+                                                                if (!strcmp(argv[i],"-a"))
+                                                                {
+                                                                    if (i<argc-1)
+                                                                    {
+                                                                        anomaly_pids = argv[++i];
+                                                                    }
+                                                                    else
+                                                                    {
+                                                                        help = 1;
+                                                                    }
+                                                                }
 
     }
 
@@ -117,301 +299,38 @@ void parse_args(int argc, char* argv[])
         printf("  read diagnostic data through a vehicle's ODBII port.\n");
         printf("Usage:\n");
         printf("  %s <option> [<option>...]\n",argv[0]);
+        printf("  %s <subcommand> [<argument>...]\n",argv[0]);
         printf("Options:\n");
-        printf("  -d <string>  device name (default: %s)\n",DEFAULT_DEVICE_NAME);
+        printf("  -d <string>  device name (default: %s), or auto[:<glob>] to use\n",DEFAULT_DEVICE_NAME);
+        printf("               whichever adapter is plugged in, or virtual[:<seconds>] to drive\n");
+        printf("               the built in simulator on a virtual clock (default: %d s), or\n", VIRTUAL_DEFAULT_SECONDS);
+        printf("               replay:<capture>[,<scale>] to serve a capture (-R) with its timing\n");
         printf("  -f <string>  output file name (default: %s)\n",DEFAULT_OUTPUT_FILE);
+        printf("  -b <string>  also append samples to a binary log\n");
+        printf("  -v <int>     vehicle id stamped on binary log records (default: 0)\n");
+        printf("  -s <spec>    additional output, <csv|ndjson|log>:<-|unix:path|path>[,drop|,block]\n");
+        printf("  -n <int>     passes over the pids, 0 until interrupted (default: 1)\n");
+        printf("  -t           live dashboard on the terminal while sampling\n");
+        printf("  -T <string>  write a timeline of every transaction (Chrome trace JSON)\n");
+        printf("  -m <spec>    serve OpenMetrics on unix:<path> or [localhost:]<port>\n");
+        printf("  -p <string>  protocol statistics file, orders the protocol search and logs it\n");
+        printf("  -w <string>  VIN or WMI of the vehicle, a hint for the protocol search\n");
+        printf("  -k <string>  directory of PID packs, <WMI>.pack of -w or the VIN read, else default.pack\n");
+        printf("  -c <string>  PIDs and their intervals, reloaded when the file changes\n");
+        printf("  -R <string>  capture everything sent to and read from the adapter\n");
+        printf("  -a <string>  anomaly events (ewma, cusum, robust z) for these PIDs, hex\n");
+        printf("               comma separated, or all\n");
         printf("  -o           dummy option (useful because at least one option is needed)\n");
+        printf("Subcommands:\n");
+        for (const struct subcommand* c = subcommands; c->name; c++)
+        {
+            printf("  %-12s %s\n", c->name, c->description);
+        }
         exit(1);
     }
 }
 
 
-double rpmcalc(double a, double b)
-{
-    return ((a*256)+b)/4;
-}
-
-double stdcalc(double a, double b)
-{
-    return a;
-}
-
-void setupcommands(struct obdpid o[25]) {
-
-
-//3	03	Fuel system status	31	16	1	0		Encoded
-
-    o[3].datatype = 0;
-    o[3].command = 0x03;
-    o[3].commandname = "Fuel System Status";
-    o[3].bytes = 1;
-
-//4	04	Calculated engine load	31	8	1/2.55	0	0 | 100	%
-
-    o[4].datatype = 0;
-    o[4].command = 0x04;
-    o[4].commandname = "Calculated Engine Load";
-    o[4].min = 0;
-    o[4].max = 100;
-    o[4].units = PERCENT;
-    o[4].bytes = 1;
-
-//5	05	Engine coolant temperature	31	8	1	-40	-40 | 215	degC
-
-    o[5].datatype = 0;
-    o[5].command = 0x05;
-    o[5].commandname = "Engine Coolant Temperature";
-    o[5].min = -40;
-    o[5].max = 215;
-    o[5].units = CELSIUS;
-    o[5].bytes = 1;
-
-//6	06	Short term fuel trim (bank 1)	31	8	1/1.28	-100	-100 | 99	%
-//7	07	Long term fuel trim (bank 1)	31	8	1/1.28	-100	-100 | 99	%
-//8	08	Short term fuel trim (bank 2)	31	8	1/1.28	-100	-100 | 99	%
-//9	09	Long term fuel trim (bank 2)	31	8	1/1.28	-100	-100 | 99	%
-//10	0A	Fuel pressure (gauge pressure)	31	8	3	0	0 | 765	kPa
-
-    o[10].datatype = 0;
-    o[10].command = 0x0A;
-    o[10].commandname = "Fuel Gauge Pressure";
-    o[10].min = 0;
-    o[10].max = 765;
-    o[10].units = PASCALS;
-    o[10].bytes = 1;
-
-//11	0B	Intake manifold absolute pressure	31	8	1	0	0 | 255	kPa
-
-    o[11].datatype = 0;
-    o[11].command = 0x0B;
-    o[11].commandname = "Intake Manifold Absolute Pressure";
-    o[11].min = 0;
-    o[11].max = 255;
-    o[11].units = PASCALS;
-    o[11].bytes = 1;
-
-//12	0C	Engine speed	31	16	0.25	0	0 | 16384	rpm
-
-    o[12].datatype = 1;
-    o[12].command = 0x0C;
-    o[12].commandname = "Engine Speed";
-    o[12].min = 0;
-    o[12].max = 16383.75;
-    o[12].units = RPM;
-    o[12].bytes = 2;
-    o[12].calculate = rpmcalc;
-
-//13	0D	Vehicle speed	31	8	1	0	0 | 255	km/h
-
-    o[13].datatype = 0;
-    o[13].command = 0x0D;
-    o[13].commandname = "Vehicle Speed";
-    o[13].min = 0;
-    o[13].max = 255;
-    o[13].units = KILOMETERSPERHOUR;
-    o[13].bytes = 1;
-
-
-//14	0E	Timing advance	31	8	0.5	-64	-64 | 64	deg
-//15	0F	Intake air temperature	31	8	1	-40	-40 | 215	degC
-//16	10	Mass air flow sensor air flow rate	31	16	0.01	0	0 | 655	grams/sec
-//17	11	Throttle position	31	8	1/2.55	0	0 | 100	%
-//18	12	Commanded secondary air status	31	8	1	0		Encoded
-//19	13	Oxygen sensors present (2 banks)
-//20	14	Oxygen sensor 1 (voltage)	31	8	0.005	0	0 | 1	volts
-//Oxygen sensor 1 (short term fuel trim)	39	8	1/1.28	-100	-100 | 99	%
-//21	15	Oxygen sensor 2 (voltage)	31	8	0.005	0	0 | 1	volts
-//Oxygen sensor 2 (short term fuel trim)	39	8	1/1.28	-100	-100 | 99	%
-//22	16	Oxygen sensor 3 (voltage)	31	8	0.005	0	0 | 1	volts
-//Oxygen sensor 3 (short term fuel trim)	39	8	1/1.28	-100	-100 | 99	%
-//23	17	Oxygen sensor 4 (voltage)	31	8	0.005	0	0 | 1	volts
-//Oxygen sensor 4 (short term fuel trim)	39	8	1/1.28	-100	-100 | 99	%
-//24	18	Oxygen sensor 5 (voltage)	31	8	0.005	0	0 | 1	volts
-//Oxygen sensor 5 (short term fuel trim)	39	8	1/1.28	-100	-100 | 99	%
-//25	19	Oxygen sensor 6 (voltage)	31	8	0.005	0	0 | 1	volts
-//Oxygen sensor 6 (short term fuel trim)	39	8	1/1.28	-100	-100 | 99	%
-//26	1A	Oxygen sensor 7 (voltage)	31	8	0.005	0	0 | 1	volts
-//Oxygen sensor 7 (short term fuel trim)	39	8	1/1.28	-100	-100 | 99	%
-//27	1B	Oxygen sensor 8 (voltage)	31	8	0.005	0	0 | 1	volts
-//Oxygen sensor 9 (short term fuel trim)	39	8	1/1.28	-100	-100 | 99	%
-//28	1C	OBD standards the vehicle conforms to	31	8	1	0		Encoded
-//29	1D	Oxygen sensors present (4 banks)
-//30	1E	Auxiliary input status
-//31	1F	Run time since engine start	31	16	1	0	0 | 65535	seconds
-//32	20	PIDs supported [21 - 40]	31	32	1	0		Encoded
-//33	21	Distance traveled with MIL on	31	16	1	0	0 | 65535	km
-//34	22	Fuel rail pres. (rel. to manifold vacuum)	31	16	0.079	0	0 | 5177	kPa
-//35	23	Fuel rail gauge pres. (diesel, gas inject)	31	16	10	0	0 | 655350	kPa
-//36	24	Oxygen sensor 1 (air-fuel equiv. ratio)	31	16	1/32768	0	0 | 2	ratio
-//Oxygen sensor 1 (voltage)	47	16	1/8192	0	0 | 2	volts
-//37	25	Oxygen sensor 2 (air-fuel equiv. ratio)	31	16	1/32768	0	0 | 2	ratio
-//Oxygen sensor 2 (voltage)	47	16	1/8192	0	0 | 8	volts
-//38	26	Oxygen sensor 3 (air-fuel equiv. ratio)	31	16	1/32768	0	0 | 2	ratio
-//Oxygen sensor 3 (voltage)	47	16	1/8192	0	0 | 8	volts
-//39	27	Oxygen sensor 4 (air-fuel equiv. ratio)	31	16	1/32768	0	0 | 2	ratio
-//Oxygen sensor 4 (voltage)	47	16	1/8192	0	0 | 8	volts
-//40	28	Oxygen sensor 5 (air-fuel equiv. ratio)	31	16	1/32768	0	0 | 2	ratio
-//Oxygen sensor 5 (voltage)	47	16	1/8192	0	0 | 8	volts
-//41	29	Oxygen sensor 6 (air-fuel equiv. ratio)	31	16	1/32768	0	0 | 2	ratio
-//Oxygen sensor 6 (voltage)	47	16	1/8192	0	0 | 8	volts
-//42	2A	Oxygen sensor 7 (air-fuel equiv. ratio)	31	16	1/32768	0	0 | 2	ratio
-//Oxygen sensor 7 (voltage)	47	16	1/8192	0	0 | 8	volts
-//43	2B	Oxygen sensor 8 (air-fuel equiv. ratio)	31	16	1/32768	0	0 | 2	ratio
-//Oxygen sensor 8 (voltage)	47	16	1/8192	0	0 | 8	volts
-//44	2C	Commanded EGR	31	8	1/2.55	0	0 | 100	%
-//45	2D	EGR Error	31	8	1/1.28	-100	-100 | 99	%
-//46	2E	Commanded evaporative purge	31	8	1/2.55	0	0 | 100	%
-//47	2F	Fuel tank level input	31	8	1/2.55	0	0 | 100	%
-//48	30	Warmups since DTCs cleared	31	8	1	0	0 | 255	count
-//49	31	Distance traveled since DTCs cleared	31	16	1	0	0 | 65535	km
-//50	32	Evap. system vapor pressure	31	16	0.25	0	-8192 | 8192	Pa
-//51	33	Absolute barometric pressure	31	8	1	0	0 | 255	kPa
-//52	34	Oxygen sensor 1 (air-fuel equiv. ratio)	31	16	1/32768	0	0 | 2	ratio
-//Oxygen sensor 1 (current)	47	16	1/256	-128	-128 | 128	mA
-//53	35	Oxygen sensor 2 (air-fuel equiv. ratio)	31	16	1/32768	0	0 | 2	ratio
-//Oxygen sensor 2 (current)	47	16	1/256	-128	-128 | 128	mA
-//54	36	Oxygen sensor 3 (air-fuel equiv. ratio)	31	16	1/32768	0	0 | 2	ratio
-//Oxygen sensor 3 (current)	47	16	1/256	-128	-128 | 128	mA
-//55	37	Oxygen sensor 4 (air-fuel equiv. ratio)	31	16	1/32768	0	0 | 2	ratio
-//Oxygen sensor 4 (current)	47	16	1/256	-128	-128 | 128	mA
-//56	38	Oxygen sensor 5 (air-fuel equiv. ratio)	31	16	1/32768	0	0 | 2	ratio
-//Oxygen sensor 5 (current)	47	16	1/256	-128	-128 | 128	mA
-//57	39	Oxygen sensor 6 (air-fuel equiv. ratio)	31	16	1/32768	0	0 | 2	ratio
-//Oxygen sensor 6 (current)	47	16	1/256	-128	-128 | 128	mA
-//58	3A	Oxygen sensor 7 (air-fuel equiv. ratio)	31	16	1/32768	0	0 | 2	ratio
-//Oxygen sensor 7 (current)	47	16	1/256	-128	-128 | 128	mA
-//59	3B	Oxygen sensor 8 (air-fuel equiv. ratio)	31	16	1/32768	0	0 | 2	ratio
-//Oxygen sensor 8 (current)	47	16	1/256	-128	-128 | 128	mA
-//60	3C	Catalyst temperature (bank 1, sensor 1)	31	16	0.1	-40	-40 | 6514	degC
-//61	3D	Catalyst temperature (bank 2, sensor 1)	31	16	0.1	-40	-40 | 6514	degC
-//62	3E	Catalyst temperature (bank 1, sensor 2)	31	16	0.1	-40	-40 | 6514	degC
-//63	3F	Catalyst temperature (bank 2, sensor 2)	31	16	0.1	-40	-40 | 6514	degC
-//64	40	PIDs supported [41 - 60]	31	32	1	0		Encoded
-//65	41	Monitor status this drive cycle	31	32	1	0		Encoded
-//66	42	Control module voltage	31	16	0.001	0	0 | 66	V
-//67	43	Absolute load value	31	16	1/2.55	0	0 | 25700	%
-//68	44	Commanded air-fuel equiv. ratio	31	16	1/32768	0	0 | 2	ratio
-//69	45	Relative throttle position	31	8	1/2.55	0	0 | 100	%
-//70	46	Ambient air temperature	31	8	1	-40	-40 | 215	degC
-//71	47	Absolute throttle position B	31	8	1/2.55	0	0 | 100	%
-//72	48	Absolute throttle position C	31	8	1/2.55	0	0 | 100	%
-//73	49	Accelerator pedal position D	31	8	1/2.55	0	0 | 100	%
-//74	4A	Accelerator pedal position E	31	8	1/2.55	0	0 | 100	%
-//75	4B	Accelerator pedal position F	31	8	1/2.55	0	0 | 100	%
-//76	4C	Commanded throttle actuator	31	8	1/2.55	0	0 | 100	%
-//77	4D	Time run with MIL on	31	16	1	0	0 | 65535	minutes
-//78	4E	Time since DTCs cleared	31	16	1	0	0 | 65535	minutes
-//79	4F	Max fuel-air equiv. ratio	31	8	1	0	0 | 255	ratio
-//Max oxygen sensor voltage	39	8	1	0	0 | 255	V
-//Max oxygen sensor current	47	8	1	0	0 | 255	mA
-//Max intake manifold absolute pressure	55	8	10	0	0 | 2550	kPa
-//80	50	Max air flow rate from MAF sensor	31	8	10	0	0 | 2550	g/s
-//81	51	Fuel type	31	8	1	0		Encoded
-//82	52	Ethanol fuel percentage	31	8	1/2.55	0	0 | 100	%
-//83	53	Absolute evap system vapor pressure	31	16	0.005	0	0 | 328	kPa
-//84	54	Evap system vapor pressure	31	16	1	-32767	-32767 | 32768	Pa
-//85	55	Short term sec. oxygen trim (bank 1)	31	8	1/1.28	-100	-100 | 99	%
-//Short term sec. oxygen trim (bank 3)	39	8	1/1.28	-100	-100 | 99	%
-//86	56	Long term sec. oxygen trim (bank 1)	31	8	1/1.28	-100	-100 | 99	%
-//Long term sec. oxygen trim (bank 3)	39	8	1/1.28	-100	-100 | 99	%
-//87	57	Short term sec. oxygen trim (bank 2)	31	8	1/1.28	-100	-100 | 99	%
-//Short term sec. oxygen trim (bank 4)	39	8	1/1.28	-100	-100 | 99	%
-//88	58	Long term sec. oxygen trim (bank 2)	31	8	1/1.28	-100	-100 | 99	%
-//Long term sec. oxygen trim (bank 4)	39	8	1/1.28	-100	-100 | 99	%
-//89	59	Fuel rail absolute pressure	31	16	10	0	0 | 655350	kPa
-//90	5A	Relative accelerator pedal position	31	8	1/2.55	0	0 | 100	%
-//91	5B	Hybrid battery pack remaining life	31	8	1/2.55	0	0 | 100	%
-//92	5C	Engine oil temperature	31	8	1	-40	-40 | 215	degC
-//93	5D	Fuel injection timing	31	16	1/128	-210	-210 | 302	deg
-//94	5E	Engine fuel rate	31	16	0.05	0	0 | 3277	L/h
-//95	5F	Emission requirements	31	8	1	0		Encoded
-//96	60	PIDs supported [61 - 80]	31	32	1	0		Encoded
-//97	61	Demanded engine percent torque	31	8	1	-125	-125 | 130	%
-//98	62	Actual engine percent torque	31	8	1	-125	-125 | 130	%
-//99	63	Engine reference torque	31	16	1	0	0 | 65535	Nm
-//100	64	Engine pct. torque (idle)	31	8	1	-125	-125 | 130	%
-//Engine pct. torque (engine point 1)	39	8	1	-125	-125 | 130	%
-//Engine pct. torque (engine point 2)	47	8	1	-125	-125 | 130	%
-//Engine pct. torque (engine point 3)	55	8	1	-125	-125 | 130	%
-//Engine pct. torque (engine point 4)	63	8	1	-125	-125 | 130	%
-//101	65	Auxiliary input/output supported	31	8	1	0		Encoded
-//102	66	Mass air flow sensor (A)	39	16	1/32	0	0 | 2048	grams/sec
-//Mass air flow sensor (B)	55	16	1/32	0	0 | 2048	grams/sec
-//103	67	Engine coolant temperature (sensor 1)	39	8	1	-40	-40 | 215	degC
-//Engine coolant temperature (sensor 2)	47	8	1	-40	-40 | 215	degC
-//104	68	Intake air temperature (sensor 1)	39	8	1	-40	-40 | 215	degC
-//Intake air temperature (sensor 2)	47	8	1	-40	-40 | 215	degC
-//105	69	Commanded EGR and EGR error
-//106	6A	Com. diesel intake air flow ctr/position
-//107	6B	Exhaust gas recirculation temperature
-//108	6C	Com. throttle actuator ctr./position
-//109	6D	Fuel pressure control system
-//110	6E	Injection pressure control system
-//111	6F	Turbocharger compressor inlet pres.
-//112	70	Boost pressure control
-//113	71	Variable geometry turbo control
-//114	72	Wastegate control
-//115	73	Exhaust pressure
-//116	74	Turbocharger RPM
-//117	75	Turbocharger temperature
-//118	76	Turbocharger temperature
-//119	77	Charge air cooler temperature
-//120	78	EGT (bank 1)
-//121	79	EGT (bank 2)
-//122	7A	Diesel particulate filter - diff. pressure
-//123	7B	Diesel particulate filter
-//124	7C	Diesel particulate filter - temperature	31	16	0.1	-40	-40 | 6514	degC
-//125	7D	NOx NTE control area status
-//126	7E	PM NTE control area status
-//127	7F	Engine run time						seconds
-//128	80	PIDs supported [81 - A0]	31	32	1	0		Encoded
-//129	81	Engine run time for AECD
-//130	82	Engine run time for AECD
-//131	83	NOx sensor
-//132	84	Manifold surface temperature
-//133	85	NOx reagent system
-//134	86	Particulate matter sensor
-//135	87	Intake manifold absolute pressure
-//136	88	SCR induce system
-//137	89	Run time for AECD #11-#15
-//138	8A	Run time for AECD #16-#20
-//139	8B	Diesel aftertreatment
-//140	8C	O2 sensor (wide range)
-//141	8D	Throttle position G	31	8	1/2.55	0	0 | 100	%
-//142	8E	Engine friction percent torque	31	8	1	-125	-125 | 130	%
-//143	8F	Particulate matter sensor (bank 1 & 2)
-//144	90	WWH-OBD vehicle OBD system Info						hours
-//145	91	WWH-OBD vehicle OBD system Info						hours
-//146	92	Fuel system control
-//147	93	WWH-OBD counters support						hours
-//148	94	NOx warning and inducement system
-//152	98	EGT sensor
-//153	99	EGT sensor
-//154	9A	Hybrid/EV sys. data, battery, voltage
-//155	9B	Diesel exhaust fluid sensor data
-//156	9C	O2 sensor data
-//157	9D	Engine fuel rate						g/s
-//158	9E	Engine exhaust flow rate						kg/h
-//159	9F	Fuel system percentage use
-//160	A0	PIDs supported [A1 - C0]	31	32	1	0		Encoded
-//161	A1	NOx sensor corrected data						ppm
-//162	A2	Cylinder fuel rate	31	16	1/32	0	0 | 2048	mg/stroke
-//163	A3	Evap system vapor pressure
-//164	A4	Transmission actual gear	47	16	0.001	0	0 | 66	ratio
-//165	A5	Cmd. diesel exhaust fluid dosing	39	8	0.5	0	0 | 128	%
-//166	A6	Odometer	31	32	0.1	0	0 | 429496730	km
-//167	A7	NOx concentration 3, 4
-//168	A8	NOx corrected concentration (3, 4)
-//192	C0	PIDs supported [C1 - E0]	31	32	1	0		Encoded
-
-
-
-
-
-
-
-}
-
 int query_elm(
     int            elm327_mod_fd,
     OBD_MODE       mode,
@@ -422,15 +341,24 @@ int query_elm(
 {
     elm327_msg_t send_msg;
 
+    ELM327_TRACE_MARK(ELM327_TRACE_BEGIN, ELM327_CHANNEL(mode, pid));
     elm327_create_msg(send_msg, mode, pid);
+    ELM327_TRACE_MARK(ELM327_TRACE_ENCODED, 0);
 
     /* Send */
     if (elm327_send_msg(elm327_mod_fd, send_msg) == -1)
-      return 1;
+    {
+        ELM327_METRIC_ADD(errors, 1);
+        return 1;
+    }
+    ELM327_TRACE_MARK(ELM327_TRACE_WRITTEN, 0);
 
     /* Receive */
     if ((*msgs = elm327_recv_msgs(elm327_mod_fd, n_msgs, 0)) == NULL)
-      return 2;
+    {
+        ELM327_METRIC_ADD(errors, 1);
+        return 2;
+    }
 
     /* Flush */
     elm327_flush(elm327_mod_fd);
@@ -438,75 +366,559 @@ int query_elm(
     return 0;
 }
 
-#define QUERY_OR_ERR(_fd, _mode, _pid, _recv, _n_recv, _ascii)           \
-{                                                                   \
-    int _err;                                               \
-                                                                    \
-    if ((_err = query_elm(                                          \
-            _fd, _mode, _pid, _recv, _n_recv, _ascii)) != 0) \
-    {                                                               \
-        elm327_destroy_recv_msgs(*_recv);                           \
-        return _err;                                                \
-    }                                                               \
+/* Query a PID through the session.  When the adapter does not answer, or
+ * answers out of step (a late response to an earlier request) or with
+ * garbage, let the watchdog recover it and ask once more.  A well formed
+ * answer for something else ("NO DATA") just fails the query.
+ */
+int query_or_recover(
+    elm327_session_t  *s,
+    OBD_MODE           mode,
+    OBD_PARAM          pid,
+    elm327_msg_t     **msgs)
+{
+    elm327_recovery_t step;
+    int               attempt, err = 0, n, e;
+
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        *msgs = NULL;
+        n = 0;
+        if ((err = query_elm(s->fd, mode, pid, msgs, &n, 0)) == 0)
+        {
+            if ((n > 0) && ((*msgs)[0][0] == (0x40 | mode)) && ((*msgs)[0][1] == pid))
+              return 0;
+
+            err = 3;
+            if ((n == 0) || ((*msgs)[0][0] != (0x40 | mode)))
+            {
+                elm327_destroy_recv_msgs(*msgs);
+                *msgs = NULL;
+                return err;
+            }
+            errno = EPROTO;
+        }
+
+        e = errno;
+        elm327_destroy_recv_msgs(*msgs);
+        *msgs = NULL;
+
+        if ((step = elm327_session_recover(s, e)) == ELM327_RECOVER_FAILED)
+          return err;
+        fprintf(stderr, "adapter: %s, recovered by %s\n", strerror(e), elm327_recovery_names[step]);
+    }
+
+    return err;
+}
+
+
+/* Set from SIGINT, ends the sampling loop after the current pass */
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_sigint(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+
+/* Give the terminal back on every way out of main */
+static elm327_tui_t* tui = NULL;
+
+static void stop_dashboard(void)
+{
+    elm327_tui_stop(tui);
+    tui = NULL;
+}
+
+
+/* Find the vehicle's protocol and keep it set through recoveries.  When
+ * nothing answers the adapter is left to search on its own.
+ */
+void connect_vehicle(elm327_session_t* session)
+{
+    elm327_connect_result_t found;
+    char                    cmd[8];
+
+    if (elm327_connect(session->fd, protocol_stats, vin_hint, &found) == -1)
+    {
+        fprintf(stderr, "no protocol answered (%s), leaving the search to the adapter\n", strerror(errno));
+        elm327_session_at(session, "ATSP0");
+    }
+    else
+    {
+        fprintf(stderr, "%s after %d attempt%s, %.0f ms\n", elm327_protocol_names[found.protocol],
+                found.attempts, (found.attempts == 1) ? "" : "s", found.ms);
+        snprintf(cmd, sizeof(cmd), "ATSP%X", found.protocol);
+        elm327_session_at(session, cmd);
+    }
+
+    if (protocol_stats && (elm327_connect_log(protocol_stats, vin_hint, &found) == -1))
+      fprintf(stderr, "%s: %s\n", protocol_stats, strerror(errno));
+}
+
+
+/* Read the VIN (Mode 09 PID 02) into 'vin'.  CAN answers "0: 49 02 01 ..."
+ * then numbered lines, the older protocols "49 02 <n>" and four bytes per
+ * line; padding and the message bytes are not VIN characters, which leaves
+ * the last 17 that are.  0, or -1 with errno set.
+ */
+int read_vin(int fd, char vin[18])
+{
+    char          text[512], chars[128], *line, *end, *p;
+    unsigned char data[16];
+    int           i, n, k = 0;
+
+    elm327_flush(fd);
+    if ((elm327_send_cmd(fd, "0902") == -1) ||
+        (elm327_read_response(fd, text, sizeof(text), 2000) == -1))
+      return -1;
+    elm327_flush(fd);
+
+    for (line = text; *line; line = *end ? end + 1 : end)
+    {
+        if (!(end = strchr(line, '\n')))
+          end = line + strlen(line);
+        p = memchr(line, ':', end - line) ? (char *)memchr(line, ':', end - line) + 1 : line;
+        if ((n = elm327_hex_to_bytes(p, end - p, data, sizeof(data))) <= 0)
+          continue;
+        i = ((n > 3) && (data[0] == 0x49) && (data[1] == 0x02)) ? 3 : 0;
+        for (; (i < n) && (k < (int)sizeof(chars)); ++i)
+          if ((((data[i] >= '0') && (data[i] <= '9')) || ((data[i] >= 'A') && (data[i] <= 'Z'))) &&
+              (data[i] != 'I') && (data[i] != 'O') && (data[i] != 'Q'))
+            chars[k++] = data[i];
+    }
+
+    if (k < 17)
+    {
+        errno = ENODATA;
+        return -1;
+    }
+    memcpy(vin, chars + k - 17, 17);
+    vin[17] = '\0';
+
+    return 0;
+}
+
+
+/* Hot-plug: release the session when its device goes away and start one on
+ * the first adapter that answers when there is none.  Adapters that came
+ * while a session was up are looked at again once it goes.  Waits up to
+ * 'timeout_ms' for the first event.
+ */
+elm327_session_t* hotplug_service(elm327_hotplug_t* hp, elm327_session_t* session, int timeout_ms)
+{
+    char path[PATH_MAX];
+    elm327_hotplug_event_t ev;
+
+    while ((ev = elm327_hotplug_next(hp, path, sizeof(path), timeout_ms)) != ELM327_HOTPLUG_NONE)
+    {
+        timeout_ms = 0;
+        if (ev == ELM327_HOTPLUG_REMOVED)
+        {
+            if (session && !strcmp(session->device, path))
+            {
+                fprintf(stderr, "adapter %s removed\n", path);
+                elm327_session_close(session);
+                session = NULL;
+                elm327_hotplug_rescan(hp);
+            }
+        }
+        else if (!session && (elm327_hotplug_probe(path) == 0))
+        {
+            if ((session = elm327_session_open(path)))
+            {
+                fprintf(stderr, "adapter on %s\n", path);
+                connect_vehicle(session);
+            }
+        }
+    }
+
+    return session;
 }
 
 
 int main(int argc, char* argv[])
 {
+    if (argc > 1)
+    {
+        for (const struct subcommand* c = subcommands; c->name; c++)
+        {
+            /* Also accepted as "--<name>" */
+            if (!strcmp(argv[1], c->name) ||
+                (!strncmp(argv[1], "--", 2) && !strcmp(argv[1] + 2, c->name)))
+            {
+                return c->run(argc-1, argv+1);
+            }
+        }
+    }
+
     parse_args(argc,argv);
+    snprintf(csv_spec, sizeof(csv_spec), "csv:%s", output_file);
+
+    /* From the first byte, the reset and protocol search included */
+    if (capture_file && (elm327_capture_start(capture_file) == -1))
+    {
+        perror(capture_file);
+        return 1;
+    }
+
+    /* Events go to the sinks along with the samples */
+    elm327_anomaly_t *anomaly = NULL;
+    if (anomaly_pids && !(anomaly = elm327_anomaly_create(anomaly_pids, NULL)))
+    {
+        perror(anomaly_pids);
+        return 1;
+    }
 
     /* Open the device */
     fprintf(stdout, "initializing connection\n");
-    int elm_fd = elm327_init(device_name);
+    elm327_session_t *session = NULL;
+    elm327_hotplug_t *hotplug = NULL;
+    elm327_sim_t *sim = NULL;
+    elm327_replay_t *replay = NULL;
+    uint64_t virtual_end_ns = 0;
+    if (!strncmp(device_name, "virtual", 7) && (device_name[7] == '\0' || device_name[7] == ':'))
+    {
+        /* The built in adapter on a clock that jumps from answer to answer */
+        virtual_end_ns = (uint64_t)((device_name[7] ? atof(device_name + 8) : VIRTUAL_DEFAULT_SECONDS) * 1e9);
+        if ((elm327_clock_virtual(VIRTUAL_EPOCH_US) == -1) || !(sim = elm327_sim_open()) ||
+            !(session = elm327_session_open(elm327_sim_path(sim))))
+        {
+            fprintf(stderr, "%s: %s\n", device_name, strerror(errno));
+            elm327_sim_close(sim);
+            return 1;
+        }
+        connect_vehicle(session);
+    }
+    else if (!strncmp(device_name, "replay:", 7))
+    {
+        /* A recorded vehicle, at its own pace or scaled */
+        char capture[PATH_MAX];
+        const char *comma = strrchr(device_name + 7, ',');
+        snprintf(capture, sizeof(capture), "%.*s", comma ? (int)(comma - device_name - 7) : PATH_MAX - 1, device_name + 7);
+        if (!(replay = elm327_replay_open(capture, comma ? atof(comma + 1) : 1.0)) ||
+            !(session = elm327_session_open(elm327_replay_path(replay))))
+        {
+            fprintf(stderr, "%s: %s\n", capture, strerror(errno));
+            elm327_replay_close(replay);
+            return 1;
+        }
+        fprintf(stderr, "replay: %zu transactions, %zu requests from %s\n",
+                elm327_replay_transactions(replay), elm327_replay_requests(replay), capture);
+        connect_vehicle(session);
+    }
+    else if (!strncmp(device_name, "auto", 4) && (device_name[4] == '\0' || device_name[4] == ':'))
+    {
+        if (!(hotplug = elm327_hotplug_open(device_name[4] ? device_name + 5 : NULL)))
+        {
+            fprintf(stderr, "%s: %s\n", device_name, strerror(errno));
+            return 1;
+        }
+    }
+    else if (!(session = elm327_session_open(device_name)))
+    {
+        fprintf(stderr, "%s: %s\n", device_name, strerror(errno));
+        return 1;
+    }
+    else
+    {
+        connect_vehicle(session);
+    }
 
-    int timeout = 3000;
+    /* Seconds, an adapter quiet for this long is considered stuck */
+    int timeout = 3;
     elm327_set_timeout(timeout);
 
     fprintf(stdout, "initializing vehicle info pids\n");
-    struct obdpid o[25];
-    for (int i = 0; i < 25; i++)
+    struct obdpid o[OBDPID_TABLE_SIZE];
+    obdpid_init_table(o);
+
+    /* Manufacturer decoding of the vehicle, picked by the VIN of -w or
+     * the one the vehicle reports
+     */
+    elm327_pack_t *pack = NULL;
+    static char vin_read[18];
+    if (pack_dir && !vin_hint && session)
     {
-        o[i].bytes = 0;
-        o[i].calculate = stdcalc;
+        if (read_vin(session->fd, vin_read) == 0)
+        {
+            vin_hint = vin_read;
+            fprintf(stdout, "VIN %s\n", vin_read);
+        }
+        else
+        {
+            fprintf(stderr, "VIN not read: %s\n", strerror(errno));
+        }
+    }
+    if (pack_dir)
+    {
+        if (!(pack = elm327_pack_select(pack_dir, vin_hint)))
+        {
+            fprintf(stderr, "%s: no pack for %s: %s\n", pack_dir, vin_hint ? vin_hint : "this vehicle", strerror(errno));
+        }
+        else
+        {
+            fprintf(stdout, "%u pid definitions from %s\n", elm327_pack_header(pack)->n_entries, pack_dir);
+        }
+    }
+
+    /* What is read and how often, -c can change it while we run */
+    elm327_schedule_t *schedule = config_file ? elm327_schedule_load(config_file, o) : elm327_schedule_default(o);
+    elm327_config_t *config = NULL;
+    if (!schedule)
+    {
+        fprintf(stderr, "%s: %s\n", config_file, strerror(errno));
+        elm327_session_close(session);
+        elm327_hotplug_close(hotplug);
+        elm327_pack_close(pack);
+        return 1;
+    }
+    if (config_file && !(config = elm327_config_watch(config_file, o)))
+    {
+        fprintf(stderr, "%s: not watched for changes: %s\n", config_file, strerror(errno));
     }
-    setupcommands(o);
 
 
     // TODO: Ensure and put device into known good state
 
     //elm327_msg_t *recv_msg = NULL;
-    //QUERY_OR_ERR(elm_fd, OBD_MODE_1, 0x0D, &recv_msg, NULL, 0);
+    //query_or_recover(session, OBD_MODE_1, 0x0D, &recv_msg);
     //double b = (double)((*recv_msg)[2]);
     //elm327_destroy_recv_msgs(recv_msg);
 
     {
 
         fprintf(stdout, "gathering data...\n");
-        FILE *out = fopen(output_file, "w");
-        for(int j = 0; j < 25; j++)
+        elm327_sinks_t *sinks = elm327_sinks_create(vehicle_id);
+
+        /* Nothing recorded is not a successful run: every output must open */
+        int sinks_ok = sinks && (elm327_sinks_add(sinks, csv_spec) == 0);
+        if (sinks_ok && binary_log_file)
+        {
+            char log_spec[PATH_MAX + 8];
+            snprintf(log_spec, sizeof(log_spec), "log:%s", binary_log_file);
+            sinks_ok = (elm327_sinks_add(sinks, log_spec) == 0);
+        }
+        for (int i = 0; sinks_ok && i < n_sink_specs; i++)
+        {
+            sinks_ok = (elm327_sinks_add(sinks, sink_specs[i]) == 0);
+        }
+        if (!sinks_ok)
+        {
+            elm327_sinks_destroy(sinks);
+            elm327_session_close(session);
+            elm327_hotplug_close(hotplug);
+            elm327_config_close(config);
+            elm327_schedule_free(schedule);
+            elm327_pack_close(pack);
+            elm327_sim_close(sim);
+            elm327_replay_close(replay);
+            elm327_anomaly_destroy(anomaly);
+            elm327_capture_stop();
+            return 1;
+        }
+
+        if (trace_file && elm327_trace_enable(ELM327_TRACE_DEFAULT_EVENTS) == -1)
+        {
+            perror("trace");
+            trace_file = NULL;
+        }
+
+        elm327_metrics_server_t *metrics = NULL;
+        if (metrics_spec)
+        {
+            metrics = elm327_metrics_start(metrics_spec, o, sinks);
+        }
+
+        signal(SIGINT, on_sigint);
+        if (dashboard)
         {
-            if (o[j].bytes > 0)
+            fflush(stdout);
+            tui = elm327_tui_start(STDOUT_FILENO, o, ELM327_TUI_MAX_HZ);
+            atexit(stop_dashboard);
+        }
+
+        struct timespec wall_start;
+        clock_gettime(CLOCK_MONOTONIC, &wall_start);
+        for (int pass = 0; (n_passes <= 0 || pass < n_passes) && !stop_requested &&
+                           !(sim && elm327_clock_now_ns() >= virtual_end_ns); )
+        {
+            /* Passes only count with an adapter to sample */
+            if (hotplug)
             {
+                session = hotplug_service(hotplug, session, session ? 0 : 1000);
+                if (!session)
+                {
+                    continue;
+                }
+            }
+
+            /* A reloaded configuration takes over between transactions */
+            elm327_schedule_t *reloaded = elm327_config_take(config);
+            if (reloaded)
+            {
+                elm327_schedule_carry(reloaded, schedule);
+                elm327_schedule_free(schedule);
+                schedule = reloaded;
+                fprintf(stderr, "%s: reloaded (%d pids)\n", config_file, schedule->n);
+            }
+            elm327_pack_t *decoder = schedule->pack ? schedule->pack : pack;
+
+            /* Nothing due, sleep until something is (or a reload) */
+            uint64_t now_ms = elm327_schedule_now_ms();
+            uint64_t next_ms = elm327_schedule_next(schedule);
+            if (next_ms > now_ms)
+            {
+                uint64_t wait_ms = (next_ms - now_ms < 100) ? next_ms - now_ms : 100;
+                elm327_clock_sleep_ns(wait_ms * 1000000);
+                continue;
+            }
+
+            elm327_sample_t samples[OBDPID_TABLE_SIZE * (1 + ELM327_ANOMALY_KINDS)];
+            size_t n_samples = 0;
+            for (int k = 0; k < schedule->n; k++)
+            {
+                int j = schedule->entries[k].idx;
+                if (elm327_schedule_due(schedule, k, elm327_schedule_now_ms()))
+                {
+
+                    /* A PID the adapter could not be brought back for is
+                     * left out of this pass, the next one tries again
+                     */
+                    elm327_msg_t *recv_msg = NULL;
+                    if (query_or_recover(session, OBD_MODE_1, o[j].command, &recv_msg) != 0)
+                    {
+                        /* Maybe the adapter was unplugged, look before the next PID */
+                        if (hotplug && elm327_hotplug_pending(hotplug))
+                        {
+                            break;
+                        }
+                        continue;
+                    }
+
+                    uint64_t t_decode = ELM327_PROBE_ENABLED(decode) ? elm327_probe_ns() : 0;
+                    const elm327_pack_entry_t *def = decoder ? elm327_pack_lookup(decoder, OBD_MODE_1, o[j].command) : NULL;
+                    double r;
+                    if (def)
+                    {
+                        r = elm327_pack_decode(def, &(*recv_msg)[2], OBD_MAX_MSG_SIZE - 2);
+                    }
+                    else
+                    {
+                        double b1 = (double)((*recv_msg)[2]);
+                        double b2 = (double)((*recv_msg)[3]);
+                        r = o[j].calculate(b1, b2);
+                    }
+
+                    elm327_destroy_recv_msgs(recv_msg);
+                    ELM327_TRACE_MARK(ELM327_TRACE_DECODED, 0);
+                    if (ELM327_PROBE_ENABLED(decode))
+                    {
+                        ELM327_PROBE4(decode, OBD_MODE_1, o[j].command, (int64_t)(r * 1000),
+                                      elm327_probe_ns() - t_decode);
+                    }
+
+                    samples[n_samples].timestamp_us = elm327_log_now_us();
+                    samples[n_samples].channel = ELM327_CHANNEL(OBD_MODE_1, o[j].command);
+                    samples[n_samples].value = r;
+                    samples[n_samples].name = o[j].commandname;
+                    n_samples++;
+                    ELM327_METRIC_ADD(samples[o[j].command & 0xFF], 1);
+
+                    /* Only an atomic store, drawing happens on its own thread */
+                    elm327_tui_update(tui, j, r);
+                }
+            }
 
-                elm327_msg_t *recv_msg = NULL;
-                QUERY_OR_ERR(elm_fd, OBD_MODE_1, o[j].command, &recv_msg, NULL, 0);
+            /* The events of the pass after its samples */
+            if (anomaly)
+            {
+                for (size_t k = 0, n = n_samples; k < n; k++)
+                {
+                    n_samples += elm327_anomaly_update(anomaly, &samples[k], &samples[n_samples]);
+                }
+            }
 
-                double b1 = (double)((*recv_msg)[2]);
-                double b2 = (double)((*recv_msg)[3]);
-                double r = o[j].calculate(b1, b2);
+            /* One batch per pass, serialized once per format */
+            ELM327_TRACE_MARK(ELM327_TRACE_BEGIN, 0);
+            uint64_t t_output = ELM327_PROBE_ENABLED(output) ? elm327_probe_ns() : 0;
+            elm327_sinks_write(sinks, samples, n_samples);
+            ELM327_TRACE_MARK(ELM327_TRACE_SUNK, 0);
+            if (ELM327_PROBE_ENABLED(output))
+            {
+                ELM327_PROBE2(output, n_samples, elm327_probe_ns() - t_output);
+            }
+            elm327_tui_pass(tui);
+            ELM327_METRIC_ADD(passes, 1);
+            pass++;
+        }
 
-                elm327_destroy_recv_msgs(recv_msg);
+        stop_dashboard();
+        elm327_metrics_stop(metrics);
 
-                fprintf(out, "%s, %f\n", o[j].commandname, r);
+        /* Timings are exact on the virtual clock, worth a report */
+        if (sim)
+        {
+            struct timespec wall_end;
+            clock_gettime(CLOCK_MONOTONIC, &wall_end);
+            fprintf(stderr, "virtual: %.3f s of driving in %.3f s, %llu requests\n",
+                    elm327_clock_now_ns() / 1e9,
+                    (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9,
+                    (unsigned long long)elm327_sim_requests(sim));
+            for (int k = 0; k < schedule->n; k++)
+            {
+                const elm327_schedule_entry_t *e = &schedule->entries[k];
+                fprintf(stderr, "  %-34s every %5u ms: %7llu samples, late %8.2f ms mean, %5llu ms max\n",
+                        o[e->idx].commandname, e->interval_ms, (unsigned long long)e->n_queries,
+                        (e->n_queries > 1) ? (double)e->late_ms_sum / (e->n_queries - 1) : 0.0,
+                        (unsigned long long)e->late_ms_max);
             }
         }
 
+        if (trace_file)
+        {
+            if (elm327_trace_export(trace_file) == -1)
+            {
+                perror(trace_file);
+            }
+            elm327_trace_disable();
+        }
+        elm327_sinks_destroy(sinks);
 
         fprintf(stdout, "done\n");
-        fclose(out);
 
     }
 
-    elm327_shutdown(elm_fd);
+    for (int k = ELM327_RECOVER_RESYNC; session && k <= ELM327_RECOVER_REOPEN; k++)
+    {
+        if (session->recoveries[k])
+        {
+            fprintf(stderr, "adapter: %lu recoveries by %s\n", session->recoveries[k], elm327_recovery_names[k]);
+        }
+    }
+    elm327_session_close(session);
+    elm327_hotplug_close(hotplug);
+    elm327_config_close(config);
+    elm327_schedule_free(schedule);
+    elm327_pack_close(pack);
+    elm327_sim_close(sim);
+    if (replay)
+    {
+        fprintf(stderr, "replay: %llu requests answered from the capture, %llu not\n",
+                (unsigned long long)elm327_replay_served(replay), (unsigned long long)elm327_replay_misses(replay));
+    }
+    elm327_replay_close(replay);
+    if (anomaly)
+    {
+        fprintf(stderr, "anomaly: %llu events\n", (unsigned long long)elm327_anomaly_events(anomaly));
+    }
+    elm327_anomaly_destroy(anomaly);
+    if (elm327_capture_stop() == -1)
+    {
+        perror(capture_file);
+    }
+
+    return 0;
 
 }
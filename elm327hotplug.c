@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "elm327.h"
+#include "elm327hotplug.h"
+
+
+#define HOTPLUG_MAX_PATTERNS 8
+#define HOTPLUG_MAX_PENDING  32
+
+#define HOTPLUG_OPEN_RETRIES  5
+#define HOTPLUG_OPEN_RETRY_MS 100
+
+
+typedef struct _hotplug_pending
+{
+    elm327_hotplug_event_t event;
+    char                   name[NAME_MAX + 1];
+} hotplug_pending_t;
+
+
+struct _elm327_hotplug
+{
+    int               fd;
+    char              dir[PATH_MAX];
+    char              patterns[HOTPLUG_MAX_PATTERNS][NAME_MAX + 1];
+    int               n_patterns;
+
+    /* Events read but not handed out yet, a ring */
+    hotplug_pending_t pending[HOTPLUG_MAX_PENDING];
+    int               head;
+    int               n_pending;
+};
+
+
+static const char *default_patterns[] = { ELM327_HOTPLUG_PATTERNS };
+
+
+static int hotplug_match(const elm327_hotplug_t *hp, const char *name)
+{
+    int i;
+
+    for (i = 0; i < hp->n_patterns; ++i)
+      if (fnmatch(hp->patterns[i], name, 0) == 0)
+        return 1;
+
+    return 0;
+}
+
+
+static void hotplug_push(elm327_hotplug_t *hp, elm327_hotplug_event_t event, const char *name)
+{
+    hotplug_pending_t *p;
+
+    /* A flood of nodes we cannot keep up with loses the oldest */
+    if (hp->n_pending == HOTPLUG_MAX_PENDING)
+    {
+        hp->head = (hp->head + 1) % HOTPLUG_MAX_PENDING;
+        --hp->n_pending;
+    }
+
+    p = &hp->pending[(hp->head + hp->n_pending) % HOTPLUG_MAX_PENDING];
+    p->event = event;
+    snprintf(p->name, sizeof(p->name), "%s", name);
+    ++hp->n_pending;
+}
+
+
+/* Move whatever inotify has for us to the pending ring */
+static void hotplug_drain(elm327_hotplug_t *hp)
+{
+    char                        buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t                     n;
+    char                       *p;
+
+    while ((n = read(hp->fd, buf, sizeof(buf))) > 0)
+    {
+        for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len)
+        {
+            ev = (const struct inotify_event *)p;
+            if (!ev->len || (ev->mask & IN_ISDIR) || !hotplug_match(hp, ev->name))
+              continue;
+
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+              hotplug_push(hp, ELM327_HOTPLUG_REMOVED, ev->name);
+            else
+              hotplug_push(hp, ELM327_HOTPLUG_ADDED, ev->name);
+        }
+    }
+}
+
+
+elm327_hotplug_t *elm327_hotplug_open(const char *spec)
+{
+    elm327_hotplug_t *hp;
+    const char       *slash;
+    size_t            i;
+
+    if (!(hp = calloc(1, sizeof(elm327_hotplug_t))))
+      return NULL;
+
+    if (!spec || !*spec)
+    {
+        snprintf(hp->dir, sizeof(hp->dir), "%s", ELM327_HOTPLUG_DIR);
+        for (i = 0; i < sizeof(default_patterns) / sizeof(default_patterns[0]); ++i)
+          snprintf(hp->patterns[hp->n_patterns++], NAME_MAX + 1, "%s", default_patterns[i]);
+    }
+    else if (!(slash = strrchr(spec, '/')) || (slash == spec) || !slash[1])
+    {
+        free(hp);
+        errno = EINVAL;
+        return NULL;
+    }
+    else
+    {
+        snprintf(hp->dir, sizeof(hp->dir), "%.*s", (int)(slash - spec), spec);
+        snprintf(hp->patterns[hp->n_patterns++], NAME_MAX + 1, "%s", slash + 1);
+    }
+
+    if (((hp->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) ||
+        (inotify_add_watch(hp->fd, hp->dir,
+                           IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM) == -1))
+    {
+        int err = errno;
+
+        if (hp->fd != -1)
+          close(hp->fd);
+        free(hp);
+        errno = err;
+        return NULL;
+    }
+
+    /* What is already plugged in, after the watch so nothing falls between */
+    elm327_hotplug_rescan(hp);
+
+    return hp;
+}
+
+
+void elm327_hotplug_rescan(elm327_hotplug_t *hp)
+{
+    DIR           *d;
+    struct dirent *de;
+
+    if (!(d = opendir(hp->dir)))
+      return;
+    while ((de = readdir(d)))
+      if ((de->d_name[0] != '.') && hotplug_match(hp, de->d_name))
+        hotplug_push(hp, ELM327_HOTPLUG_ADDED, de->d_name);
+    closedir(d);
+}
+
+
+elm327_hotplug_event_t elm327_hotplug_next(
+    elm327_hotplug_t *hp,
+    char             *path,
+    size_t            len,
+    int               timeout_ms)
+{
+    struct pollfd      pfd = { .fd = hp->fd, .events = POLLIN };
+    hotplug_pending_t *p;
+
+    if (!hp->n_pending)
+    {
+        if (poll(&pfd, 1, timeout_ms) <= 0)
+          return ELM327_HOTPLUG_NONE;
+        hotplug_drain(hp);
+        if (!hp->n_pending)
+          return ELM327_HOTPLUG_NONE;
+    }
+
+    p = &hp->pending[hp->head];
+    hp->head = (hp->head + 1) % HOTPLUG_MAX_PENDING;
+    --hp->n_pending;
+    snprintf(path, len, "%s/%s", hp->dir, p->name);
+
+    return p->event;
+}
+
+
+int elm327_hotplug_pending(elm327_hotplug_t *hp)
+{
+    hotplug_drain(hp);
+
+    return hp->n_pending > 0;
+}
+
+
+int elm327_hotplug_probe(const char *path)
+{
+    char buf[128];
+    int  fd, n = 0, r;
+
+    /* A node can show up a moment before it can be opened (permissions not
+     * set yet, the driver still binding), give it a few tries
+     */
+    for (r = 0; (fd = elm327_init(path)) == -1; ++r)
+    {
+        struct timespec ts = { 0, HOTPLUG_OPEN_RETRY_MS * 1000000L };
+
+        if ((r == HOTPLUG_OPEN_RETRIES) ||
+            ((errno != EIO) && (errno != EACCES) && (errno != EBUSY) && (errno != ENXIO)))
+          return -1;
+        nanosleep(&ts, NULL);
+    }
+
+    /* Anything up to the prompt that names the chip will do */
+    elm327_flush(fd);
+    if (elm327_send_cmd(fd, "ATI") == 0)
+    {
+        while ((n < (int)sizeof(buf) - 1) &&
+               (elm327_wait_readable(fd, ELM327_HOTPLUG_PROBE_MS) == 1) &&
+               ((r = read(fd, buf + n, sizeof(buf) - 1 - n)) > 0))
+        {
+            n += r;
+            buf[n] = '\0';
+            if (strchr(buf, '>') || strstr(buf, "ELM"))
+              break;
+        }
+    }
+    buf[n] = '\0';
+    elm327_shutdown(fd);
+
+    if (!strstr(buf, "ELM"))
+    {
+        errno = ENODEV;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void elm327_hotplug_close(elm327_hotplug_t *hp)
+{
+    if (!hp)
+      return;
+
+    close(hp->fd);
+    free(hp);
+}
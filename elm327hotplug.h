@@ -0,0 +1,67 @@
+#ifndef _ELM327HOTPLUG_H
+#define _ELM327HOTPLUG_H
+
+#include <stddef.h>
+
+
+/* Adapter hot-plug through inotify on the device directory.
+ *
+ * Serial nodes matching the patterns (ttyUSB*, ttyACM* and rfcomm* in /dev
+ * by default) are reported as they appear and disappear.  Nodes already
+ * present when watching starts are reported as added first.  udev creates a
+ * node before it sets its permissions, so a change of attributes reports the
+ * node again, a probe that failed on the bare node gets a second chance.
+ */
+#define ELM327_HOTPLUG_DIR        "/dev"
+#define ELM327_HOTPLUG_PATTERNS   "ttyUSB*", "ttyACM*", "rfcomm*"
+
+/* Time an adapter gets to answer ATI when probed */
+#define ELM327_HOTPLUG_PROBE_MS   1000
+
+
+typedef enum _elm327_hotplug_event
+{
+    ELM327_HOTPLUG_NONE = 0,
+    ELM327_HOTPLUG_ADDED,
+    ELM327_HOTPLUG_REMOVED
+} elm327_hotplug_event_t;
+
+
+typedef struct _elm327_hotplug elm327_hotplug_t;
+
+
+/* Watch 'spec': NULL or "" for the defaults, else a glob such as
+ * "/dev/ttyUSB[0-3]" (directory and one name pattern).  Returns NULL
+ * on error with errno set.
+ */
+extern elm327_hotplug_t *elm327_hotplug_open(const char *spec);
+
+
+/* Next event, waiting up to 'timeout_ms' (-1 for ever).  The device path is
+ * copied to 'path'.  Returns ELM327_HOTPLUG_NONE on timeout or interruption.
+ */
+extern elm327_hotplug_event_t elm327_hotplug_next(
+    elm327_hotplug_t *hp,
+    char             *path,
+    size_t            len,
+    int               timeout_ms);
+
+
+/* Report every matching node present now as added again, for a caller
+ * that ignored additions while it had an adapter
+ */
+extern void elm327_hotplug_rescan(elm327_hotplug_t *hp);
+
+
+/* True when an event is waiting, without consuming it */
+extern int elm327_hotplug_pending(elm327_hotplug_t *hp);
+
+
+/* Open 'path' and ask ATI, 0 when an ELM327 answered */
+extern int elm327_hotplug_probe(const char *path);
+
+
+extern void elm327_hotplug_close(elm327_hotplug_t *hp);
+
+
+#endif /* _ELM327HOTPLUG_H */
@@ -0,0 +1,321 @@
+/*
+ * elm327import.c
+ *
+ * Bulk import of legacy carstats.csv files into a binary log.
+ *
+ * The old text output is one "<commandname>, <value>" line per PID and pass,
+ * with no timestamp, so the file modification time stands in for one.  Files
+ * are ordered by that time so the resulting log is a sorted segment that
+ * 'merge' can take, then parsed on the worker pool a wave at a time and
+ * appended in order.  Names are mapped back to PIDs through a small hash
+ * table built from the PID definitions, numbers go through the locale free
+ * parser.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "elm327.h"
+#include "elm327log.h"
+#include "elm327num.h"
+#include "elm327pids.h"
+#include "elm327pool.h"
+#include "elm327cmd.h"
+
+
+#define IMPORT_NAME_SLOTS   64      /* Power of two, > 2x the PID table */
+#define IMPORT_WAVE_PER_CPU 16
+
+
+typedef struct _import_name
+{
+    const char *name;
+    size_t      len;
+    int         pid;
+} import_name_t;
+
+
+typedef struct _import_file
+{
+    const char          *path;
+    uint64_t             mtime_us;
+    size_t               size;
+    elm327_log_record_t *recs;
+    size_t               n_recs;
+    unsigned long        unknown;
+    int                  failed;
+} import_file_t;
+
+
+/* Read only after setup, shared by all workers */
+static import_name_t import_names[IMPORT_NAME_SLOTS];
+static uint32_t      import_vehicle;
+
+
+static uint32_t name_hash(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    while (len--)
+      h = (h ^ (unsigned char)*s++) * 16777619u;
+
+    return h;
+}
+
+
+static void names_build(const struct obdpid o[OBDPID_TABLE_SIZE])
+{
+    size_t i, len, slot;
+
+    memset(import_names, 0, sizeof(import_names));
+    for (i=0; i<OBDPID_TABLE_SIZE; ++i)
+    {
+        if (!o[i].bytes || !o[i].commandname)
+          continue;
+
+        len = strlen(o[i].commandname);
+        slot = name_hash(o[i].commandname, len) & (IMPORT_NAME_SLOTS - 1);
+        while (import_names[slot].name)
+          slot = (slot + 1) & (IMPORT_NAME_SLOTS - 1);
+
+        import_names[slot].name = o[i].commandname;
+        import_names[slot].len = len;
+        import_names[slot].pid = o[i].command;
+    }
+}
+
+
+static int names_lookup(const char *name, size_t len)
+{
+    size_t slot = name_hash(name, len) & (IMPORT_NAME_SLOTS - 1);
+
+    for (; import_names[slot].name; slot = (slot + 1) & (IMPORT_NAME_SLOTS - 1))
+      if ((import_names[slot].len == len) &&
+          !memcmp(import_names[slot].name, name, len))
+        return import_names[slot].pid;
+
+    return -1;
+}
+
+
+static void import_one(void *arg, int worker)
+{
+    import_file_t *f = arg;
+    const char    *base, *p, *end, *eol, *comma;
+    size_t         cap;
+    double         value;
+    int            fd, pid;
+
+    f->n_recs = 0;
+    f->recs = NULL;
+    if (f->size == 0)
+      return;
+
+    if ((fd = open(f->path, O_RDONLY)) == -1)
+    {
+        f->failed = errno;
+        return;
+    }
+    base = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        f->failed = errno;
+        return;
+    }
+
+    /* Every line is at least "x, 0\n" */
+    cap = f->size / 5 + 1;
+    if (!(f->recs = malloc(cap * sizeof(elm327_log_record_t))))
+    {
+        f->failed = ENOMEM;
+        munmap((void *)base, f->size);
+        return;
+    }
+
+    end = base + f->size;
+    for (p = base; p < end; p = eol + 1)
+    {
+        if (!(eol = memchr(p, '\n', end - p)))
+          eol = end;
+
+        /* Names have no commas, the value follows the last one */
+        for (comma = eol; (comma > p) && (comma[-1] != ','); --comma)
+          ;
+        if (comma == p)
+          continue;
+
+        if ((pid = names_lookup(p, comma - 1 - p)) == -1)
+        {
+            ++f->unknown;
+            continue;
+        }
+        if (!elm327_parse_double(comma, eol, &value))
+        {
+            ++f->unknown;
+            continue;
+        }
+
+        f->recs[f->n_recs].timestamp_us = f->mtime_us;
+        f->recs[f->n_recs].value = value;
+        f->recs[f->n_recs].vehicle = import_vehicle;
+        f->recs[f->n_recs].channel = ELM327_CHANNEL(OBD_MODE_1, pid);
+        f->recs[f->n_recs].flags = 0;
+        f->recs[f->n_recs].reserved = 0;
+        ++f->n_recs;
+    }
+
+    munmap((void *)base, f->size);
+}
+
+
+static int file_cmp(const void *a, const void *b)
+{
+    const import_file_t *fa = a, *fb = b;
+
+    return (fa->mtime_us > fb->mtime_us) - (fa->mtime_us < fb->mtime_us);
+}
+
+
+static void import_usage(const char *prog)
+{
+    printf("Usage:\n");
+    printf("  %s import -o <log> [-v <int>] [-j <threads>] <csv> [<csv>...]\n", prog);
+    printf("Options:\n");
+    printf("  -o <string>  binary log to write\n");
+    printf("  -v <int>     vehicle id stamped on the records (default: 0)\n");
+    printf("  -j <int>     worker threads (default: one per cpu)\n");
+}
+
+
+int elm327_cmd_import(int argc, char *argv[])
+{
+    int              i, n_files, n_threads = 0, err = 0, missed = 0;
+    size_t           first, n, k, r, n_wave;
+    const char      *log_path = NULL;
+    struct stat      st;
+    struct obdpid    o[OBDPID_TABLE_SIZE];
+    import_file_t   *files;
+    elm327_pool_t   *pool;
+    elm327_log_t    *log;
+    uint64_t         bytes = 0, n_records = 0;
+    unsigned long    unknown = 0;
+    struct timespec  t0, t1;
+    double           secs;
+
+    for (i=1; i<argc; ++i)
+    {
+        if (!strcmp(argv[i], "-o") && (i < argc-1))
+          log_path = argv[++i];
+        else if (!strcmp(argv[i], "-v") && (i < argc-1))
+          import_vehicle = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-j") && (i < argc-1))
+          n_threads = atoi(argv[++i]);
+        else
+          break;
+    }
+
+    if (!log_path || ((n_files = argc - i) <= 0))
+    {
+        import_usage("elm327diag");
+        return 1;
+    }
+    argv += i;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    obdpid_init_table(o);
+    names_build(o);
+
+    if (!(files = calloc(n_files, sizeof(import_file_t))))
+      return 1;
+
+    for (i=0, n=0; i<n_files; ++i)
+    {
+        if (stat(argv[i], &st) == -1)
+        {
+            fprintf(stderr, "%s: %s, skipped\n", argv[i], strerror(errno));
+            ++missed;
+            continue;
+        }
+        files[n].path = argv[i];
+        files[n].size = st.st_size;
+        files[n].mtime_us = (uint64_t)st.st_mtim.tv_sec * 1000000 + st.st_mtim.tv_nsec / 1000;
+        bytes += st.st_size;
+        ++n;
+    }
+    qsort(files, n, sizeof(import_file_t), file_cmp);
+
+    if (!(pool = elm327_pool_create(n_threads)))
+    {
+        free(files);
+        return 1;
+    }
+    n_threads = elm327_pool_size(pool);
+    n_wave = n_threads * IMPORT_WAVE_PER_CPU;
+
+    if (!(log = elm327_log_create(log_path, import_vehicle)))
+    {
+        fprintf(stderr, "%s: %s\n", log_path, strerror(errno));
+        elm327_pool_destroy(pool);
+        free(files);
+        return 1;
+    }
+
+    for (first = 0; first < n; first += n_wave)
+    {
+        /* A file the pool cannot take is read here */
+        for (k = first; (k < n) && (k < first + n_wave); ++k)
+          if (elm327_pool_submit(pool, import_one, &files[k]) == -1)
+            import_one(&files[k], 0);
+        elm327_pool_wait(pool);
+
+        for (k = first; (k < n) && (k < first + n_wave); ++k)
+        {
+            if (files[k].failed)
+            {
+                fprintf(stderr, "%s: %s, skipped\n", files[k].path, strerror(files[k].failed));
+                ++missed;
+            }
+
+            for (r = 0; !err && (r < files[k].n_recs); ++r)
+              if (elm327_log_append_record(log, &files[k].recs[r]) == -1)
+                err = 1;
+
+            n_records += files[k].n_recs;
+            unknown += files[k].unknown;
+            free(files[k].recs);
+            files[k].recs = NULL;
+        }
+    }
+
+    if (elm327_log_close(log) == -1)
+      err = 1;
+    if (err)
+      fprintf(stderr, "%s: %s\n", log_path, strerror(errno));
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    if (unknown)
+      fprintf(stderr, "warning: %lu lines with an unknown name or value\n", unknown);
+    fprintf(stderr, "imported %llu samples from %zu files in %.3f s "
+            "(%.1f MB/s, %d threads)\n",
+            (unsigned long long)n_records, n, secs,
+            secs > 0 ? bytes / secs / 1e6 : 0.0, n_threads);
+    if (missed)
+      fprintf(stderr, "%d of %d files not imported\n", missed, n_files);
+
+    elm327_pool_destroy(pool);
+    free(files);
+
+    return err || missed;
+}
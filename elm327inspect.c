@@ -0,0 +1,763 @@
+/*
+ * elm327inspect.c
+ *
+ * Depot inspection: "elm327diag inspect <device>" connects, finds the
+ * protocol (elm327connect.c), reads the VIN, readiness, odometer, stored and pending
+ * DTCs and a Mode 06 summary, disconnects and appends one record:
+ *
+ *   vin,protocol,mil,dtcs,pending,monitors,odometer_km,mode06,ms,error
+ *
+ * monitors is "complete/supported", mode06 "tests/failed" (CAN only).  A
+ * vehicle that could not be inspected still gets its record, with what went
+ * wrong in error.
+ *
+ * The adapter is half duplex, the wire cannot be overlapped, so the time
+ * goes into not waiting:
+ *
+ *   - echo and spaces off and adaptive timing (AT E0 S0 AT2); headers go
+ *     on once the protocol is found, the replies of several ECUs can come
+ *     interleaved and are told apart by them
+ *   - on CAN the number of ECUs that answered 0100 is appended to Mode
+ *     01/03/07 requests, so the ELM returns as soon as they have all
+ *     answered instead of waiting out its timeout
+ *   - on CAN readiness and odometer share one request (0101A6)
+ *   - the next request is written before the previous reply is decoded,
+ *     the adapter works while we parse
+ *
+ * The time of every stage goes to stderr, against a five second target.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "elm327.h"
+#include "elm327connect.h"
+#include "elm327cmd.h"
+
+
+#define INSPECT_TARGET_MS      5000
+
+/* Per read */
+#define INSPECT_REPLY_MS       2000
+
+/* Room for every Mode 06 MID and the rest */
+#define INSPECT_MAX_REQUESTS   288
+#define INSPECT_MAX_MSGS       16
+#define INSPECT_MSG_MAX        256
+#define INSPECT_REPLY_MAX      4096
+#define INSPECT_MAX_DTCS       32
+
+
+typedef enum _inspect_stage
+{
+    STAGE_CONNECT = 0,
+    STAGE_PROTOCOL,
+    STAGE_VIN,
+    STAGE_STATUS,
+    STAGE_DTC,
+    STAGE_MODE06,
+    INSPECT_N_STAGES
+} inspect_stage_t;
+
+
+static const char *stage_names[INSPECT_N_STAGES] =
+{
+    "connect", "protocol", "vin", "status", "dtc", "mode06"
+};
+
+
+/* One response, ISO-TP frames of a CAN reply joined, and the ECU that sent
+ * it (CAN identifier, or the source byte of the older protocols)
+ */
+typedef struct _inspect_msg
+{
+    long          ecu;
+    int           expect;         /* bytes still to come */
+    int           len;
+    unsigned char data[INSPECT_MSG_MAX];
+} inspect_msg_t;
+
+
+typedef struct _inspect inspect_t;
+
+typedef void (*inspect_handler_t)(inspect_t *ins, const inspect_msg_t *msgs, int n);
+
+
+typedef struct _inspect_request
+{
+    char              cmd[16];
+    inspect_stage_t   stage;
+    inspect_handler_t handler;
+    int               timeout_ms;
+} inspect_request_t;
+
+
+struct _inspect
+{
+    inspect_request_t queue[INSPECT_MAX_REQUESTS];
+    int               n_queue;
+    int               dropped;        /* requests past the queue */
+    double            stage_ms[INSPECT_N_STAGES];
+    char              error[64];      /* why the inspection fell short */
+
+    int               protocol;       /* ATSP number, 0 unknown */
+    int               n_ecus;         /* that answered 0100 */
+
+    char              vin[18];
+    int               have_status;
+    int               mil;
+    unsigned int      supported;      /* readiness monitors, bit per monitor */
+    unsigned int      incomplete;
+    int               have_odometer;
+    double            odometer_km;
+    char              dtcs[INSPECT_MAX_DTCS][6];
+    int               n_dtcs;
+    char              pending[INSPECT_MAX_DTCS][6];
+    int               n_pending;
+    int               have_mode06;
+    unsigned char     mids[256 / 8];  /* Mode 06 MIDs asked for */
+    int               mode06_tests;
+    int               mode06_failed;
+};
+
+
+static void inspect_usage(const char *prog)
+{
+    printf("Usage:\n");
+    printf("  %s inspect [-o <file>] [-p <file>] [-w <vin>] <device>\n", prog);
+    printf("Options:\n");
+    printf("  -o <file>    append the record here (default: standard output)\n");
+    printf("  -p <file>    protocol statistics, ordering the search and logging it\n");
+    printf("  -w <vin>     VIN or WMI of the vehicle, when known beforehand\n");
+}
+
+
+static double inspect_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+
+static void inspect_push(
+    inspect_t         *ins,
+    inspect_stage_t    stage,
+    inspect_handler_t  handler,
+    int                timeout_ms,
+    const char        *fmt,
+    ...)
+{
+    inspect_request_t *rq;
+    va_list            ap;
+
+    if (ins->n_queue == INSPECT_MAX_REQUESTS)
+    {
+        ++ins->dropped;
+        return;
+    }
+
+    rq = &ins->queue[ins->n_queue++];
+    va_start(ap, fmt);
+    vsnprintf(rq->cmd, sizeof(rq->cmd), fmt, ap);
+    va_end(ap);
+    rq->stage = stage;
+    rq->handler = handler;
+    rq->timeout_ms = timeout_ms;
+}
+
+
+static int is_can(const inspect_t *ins)
+{
+    return ins->protocol >= 6;
+}
+
+
+/* Response count hint for requests every OBD ECU answers, "" off CAN */
+static const char *ecu_hint(const inspect_t *ins)
+{
+    static char hint[2];
+
+    if (!is_can(ins) || (ins->n_ecus < 1) || (ins->n_ecus > 15))
+      return "";
+    hint[0] = "0123456789ABCDEF"[ins->n_ecus];
+
+    return hint;
+}
+
+
+/* The ECU of a header line: the CAN identifier (3 or 8 digits), or the
+ * source, third byte of the older protocols' header.  -1 if not hex.
+ */
+static long header_ecu(const char *line, size_t digits)
+{
+    long   ecu = 0;
+    size_t i;
+
+    for (i = 0; i < digits; ++i)
+    {
+        if (elm327_hex_lut[(unsigned char)line[i]] == ELM327_HEX_INVALID)
+          return -1;
+        ecu = (ecu << 4) | elm327_hex_lut[(unsigned char)line[i]];
+    }
+
+    return ecu;
+}
+
+
+/* Split a reply with headers on (ATH1) into messages, one per ECU and
+ * response.  On CAN the frames are ISO-TP: single frames, first frames and
+ * the consecutive frames that go with them, which several ECUs may send
+ * interleaved; they are joined per identifier.  The older protocols answer
+ * one line per message, three header bytes and a checksum around the data.
+ * Messages come out grouped by ECU, in the order the ECUs first answered.
+ * Returns the number of messages (0 for NO DATA) or -1 with errno ENODEV
+ * (no vehicle) or EPROTO.
+ */
+static int inspect_parse(const char *text, const char *cmd, int can, inspect_msg_t *msgs, int max)
+{
+    inspect_msg_t  grouped[INSPECT_MAX_MSGS];
+    char           line[INSPECT_MSG_MAX * 3];
+    unsigned char  frame[INSPECT_MSG_MAX];
+    const char    *p, *end;
+    size_t         len, i, hdr;
+    int            n = 0, k, j, r, total, incomplete = 0;
+    long           ecu;
+    inspect_msg_t *m;
+
+    for (p = text; *p; p = *end ? end + 1 : end)
+    {
+        if (!(end = strchr(p, '\n')))
+          end = p + strlen(p);
+
+        for (i = 0, len = 0; (p + i < end) && (len < sizeof(line) - 1); ++i)
+          if (p[i] != ' ')
+            line[len++] = p[i];
+        line[len] = '\0';
+
+        if (!len || !strcmp(line, cmd) || !strncmp(line, "SEARCHING", 9))
+          continue;
+        if (!strncmp(line, "BUSINIT", 7))
+        {
+            if (strstr(line, "ERROR"))
+            {
+                errno = ENODEV;
+                return -1;
+            }
+            continue;
+        }
+        if (!strcmp(line, "NODATA"))
+          return 0;
+        if (!strcmp(line, "UNABLETOCONNECT"))
+        {
+            errno = ENODEV;
+            return -1;
+        }
+
+        /* An 11 bit identifier leaves an odd number of digits, 29 bits even */
+        hdr = can ? ((len & 1) ? 3 : 8) : 0;
+        if ((len <= hdr) || ((ecu = header_ecu(line, hdr)) == -1) ||
+            ((r = elm327_hex_to_bytes(line + hdr, len - hdr, frame, sizeof(frame))) < (can ? 1 : 5)))
+        {
+            /* "?", "CAN ERROR", "BUFFER FULL", "STOPPED"... */
+            errno = EPROTO;
+            return -1;
+        }
+
+        if (!can)
+        {
+            if (n == max)
+              break;
+            m = &msgs[n++];
+            m->ecu = frame[2];
+            m->expect = 0;
+            m->len = r - 4;
+            memcpy(m->data, frame + 3, m->len);
+            continue;
+        }
+
+        switch (frame[0] >> 4)
+        {
+        case 0:    /* Single frame */
+            if ((frame[0] & 0x0F) > r - 1)
+            {
+                errno = EPROTO;
+                return -1;
+            }
+            if (n == max)
+              break;
+            m = &msgs[n++];
+            m->ecu = ecu;
+            m->expect = 0;
+            m->len = frame[0] & 0x0F;
+            memcpy(m->data, frame + 1, m->len);
+            break;
+
+        case 1:    /* First frame: length, then the start of the data */
+            total = ((frame[0] & 0x0F) << 8) | frame[1];
+            if ((r < 2) || (total > INSPECT_MSG_MAX))
+            {
+                errno = EPROTO;
+                return -1;
+            }
+            if (n == max)
+              break;
+            m = &msgs[n++];
+            m->ecu = ecu;
+            m->len = (r - 2 < total) ? r - 2 : total;
+            m->expect = total - m->len;
+            memcpy(m->data, frame + 2, m->len);
+            break;
+
+        case 2:    /* Consecutive frame, to the open message of its ECU */
+            for (k = 0; (k < n) && !((msgs[k].ecu == ecu) && msgs[k].expect); ++k)
+              ;
+            if (k == n)
+              break;
+            r = (r - 1 < msgs[k].expect) ? r - 1 : msgs[k].expect;
+            memcpy(msgs[k].data + msgs[k].len, frame + 1, r);
+            msgs[k].len += r;
+            msgs[k].expect -= r;
+            break;
+
+        default:   /* Flow control, ours */
+            break;
+        }
+    }
+
+    /* Whole messages only, each ECU's together */
+    for (k = 0, r = 0; k < n; ++k)
+    {
+        if (msgs[k].expect || (msgs[k].len < 1))
+          ++incomplete;
+        for (j = 0; (j < k) && (msgs[j].ecu != msgs[k].ecu); ++j)
+          ;
+        if (j < k)
+          continue;
+        for (j = k; j < n; ++j)
+          if ((msgs[j].ecu == msgs[k].ecu) && !msgs[j].expect && (msgs[j].len >= 1))
+            grouped[r++] = msgs[j];
+    }
+    memcpy(msgs, grouped, r * sizeof(inspect_msg_t));
+    if (incomplete)
+      fprintf(stderr, "inspect: %s: %d incomplete message%s dropped\n", cmd, incomplete,
+              (incomplete == 1) ? "" : "s");
+
+    return r;
+}
+
+
+static void dtc_format(char out[6], unsigned char a, unsigned char b)
+{
+    snprintf(out, 6, "%c%d%X%02X", "PCBU"[a >> 6], (a >> 4) & 3, a & 0xF, b);
+}
+
+
+static void on_protocol(inspect_t *ins, const inspect_msg_t *msgs, int n);
+static void on_vin(inspect_t *ins, const inspect_msg_t *msgs, int n);
+static void on_status(inspect_t *ins, const inspect_msg_t *msgs, int n);
+static void on_dtcs(inspect_t *ins, const inspect_msg_t *msgs, int n);
+static void on_mode06(inspect_t *ins, const inspect_msg_t *msgs, int n);
+
+
+static void on_protocol(inspect_t *ins, const inspect_msg_t *msgs, int n)
+{
+    (void)msgs;
+    (void)n;
+
+    /* Everything else waits for the protocol, it decides the requests */
+    inspect_push(ins, STAGE_CONNECT, NULL, INSPECT_REPLY_MS, "ATH1");
+    inspect_push(ins, STAGE_VIN, on_vin, INSPECT_REPLY_MS, "0902");
+    if (is_can(ins))
+      inspect_push(ins, STAGE_STATUS, on_status, INSPECT_REPLY_MS, "0101A6%s", ecu_hint(ins));
+    else
+    {
+        inspect_push(ins, STAGE_STATUS, on_status, INSPECT_REPLY_MS, "0101");
+        inspect_push(ins, STAGE_STATUS, on_status, INSPECT_REPLY_MS, "01A6");
+    }
+    inspect_push(ins, STAGE_DTC, on_dtcs, INSPECT_REPLY_MS, "03%s", ecu_hint(ins));
+    inspect_push(ins, STAGE_DTC, on_dtcs, INSPECT_REPLY_MS, "07%s", ecu_hint(ins));
+
+    /* Mode 06 before CAN was a different, manufacturer defined layout */
+    if (is_can(ins))
+    {
+        ins->mids[0] |= 1;
+        inspect_push(ins, STAGE_MODE06, on_mode06, INSPECT_REPLY_MS, "0600");
+    }
+}
+
+
+/* CAN sends the VIN as one message after a count byte, the older protocols
+ * as numbered lines of four bytes.  Either way the characters follow the
+ * "49 02 xx" of each message.
+ */
+static void on_vin(inspect_t *ins, const inspect_msg_t *msgs, int n)
+{
+    char chars[INSPECT_MAX_MSGS * INSPECT_MSG_MAX];
+    int  i, j, k = 0;
+
+    for (i = 0; i < n; ++i)
+      if ((msgs[i].len > 3) && (msgs[i].data[0] == 0x49) && (msgs[i].data[1] == 0x02))
+        for (j = 3; j < msgs[i].len; ++j)
+          if ((msgs[i].data[j] > ' ') && (msgs[i].data[j] < 0x7F))
+            chars[k++] = msgs[i].data[j];
+
+    if (k >= 17)
+    {
+        memcpy(ins->vin, chars + k - 17, 17);
+        ins->vin[17] = '\0';
+    }
+}
+
+
+/* PID 01 and A6, alone or together in one answer, from every ECU */
+static void on_status(inspect_t *ins, const inspect_msg_t *msgs, int n)
+{
+    const unsigned char *d;
+    int                  i, j;
+
+    for (i = 0; i < n; ++i)
+    {
+        if ((msgs[i].len < 2) || (msgs[i].data[0] != 0x41))
+          continue;
+
+        d = msgs[i].data;
+        for (j = 1; j + 4 < msgs[i].len; j += 5)
+        {
+            if (d[j] == 0x01)
+            {
+                ins->have_status = 1;
+                ins->mil |= d[j + 1] >> 7;
+
+                /* Misfire, fuel system, components, then the spark or
+                 * compression ignition set in C/D
+                 */
+                ins->supported |= (d[j + 2] & 0x07) | (d[j + 3] << 3);
+                ins->incomplete |= ((d[j + 2] >> 4) & d[j + 2] & 0x07) | ((d[j + 4] & d[j + 3]) << 3);
+            }
+            else if ((d[j] == 0xA6) && !ins->have_odometer)
+            {
+                ins->have_odometer = 1;
+                ins->odometer_km = ((unsigned long)d[j + 1] << 24 | d[j + 2] << 16 |
+                                    d[j + 3] << 8 | d[j + 4]) / 10.0;
+            }
+            else
+              break;
+        }
+    }
+}
+
+
+static void on_dtcs(inspect_t *ins, const inspect_msg_t *msgs, int n)
+{
+    char (*list)[6];
+    int   *count, i, j, k, first;
+    char   code[6];
+
+    for (i = 0; i < n; ++i)
+    {
+        if ((msgs[i].len < 1) || ((msgs[i].data[0] != 0x43) && (msgs[i].data[0] != 0x47)))
+          continue;
+
+        list = (msgs[i].data[0] == 0x43) ? ins->dtcs : ins->pending;
+        count = (msgs[i].data[0] == 0x43) ? &ins->n_dtcs : &ins->n_pending;
+
+        /* CAN puts the number of codes first */
+        first = is_can(ins) ? 2 : 1;
+        for (j = first; j + 1 < msgs[i].len; j += 2)
+        {
+            if (!msgs[i].data[j] && !msgs[i].data[j + 1])
+              continue;
+            dtc_format(code, msgs[i].data[j], msgs[i].data[j + 1]);
+            for (k = 0; (k < *count) && strcmp(list[k], code); ++k)
+              ;
+            if ((k == *count) && (*count < INSPECT_MAX_DTCS))
+              strcpy(list[(*count)++], code);
+        }
+    }
+}
+
+
+/* MIDs 00, 20, 40... list the supported MIDs of the next 32, the others
+ * are results: MID, TID, unit and scaling, then value, minimum and maximum
+ * of two bytes each.
+ */
+static void on_mode06(inspect_t *ins, const inspect_msg_t *msgs, int n)
+{
+    const unsigned char *d;
+    unsigned int         value, min, max;
+    int                  i, j, b, mid;
+
+    ins->have_mode06 = 1;
+    for (i = 0; i < n; ++i)
+    {
+        d = msgs[i].data;
+        if ((msgs[i].len < 2) || (d[0] != 0x46))
+          continue;
+
+        if ((d[1] & 0x1F) == 0)
+        {
+            for (b = 0; (b < 32) && (msgs[i].len >= 6); ++b)
+            {
+                mid = d[1] + b + 1;
+                if (!(d[2 + b / 8] & (0x80 >> (b % 8))) || (mid > 0xFF) ||
+                    (ins->mids[mid / 8] & (1 << (mid % 8))))
+                  continue;
+                ins->mids[mid / 8] |= 1 << (mid % 8);
+                inspect_push(ins, STAGE_MODE06, on_mode06, INSPECT_REPLY_MS, "06%02X", mid);
+            }
+            continue;
+        }
+
+        for (j = 1; j + 9 <= msgs[i].len; j += 9)
+        {
+            value = d[j + 3] << 8 | d[j + 4];
+            min = d[j + 5] << 8 | d[j + 6];
+            max = d[j + 7] << 8 | d[j + 8];
+            ++ins->mode06_tests;
+            if ((value < min) || (value > max))
+              ++ins->mode06_failed;
+        }
+    }
+}
+
+
+static void write_dtcs(FILE *fp, const char list[][6], int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i)
+      fprintf(fp, "%s%s", i ? " " : "", list[i]);
+}
+
+
+static int write_record(const inspect_t *ins, const char *path, double total_ms)
+{
+    FILE *fp = path ? fopen(path, "a") : stdout;
+    int   i, n_supported = 0, n_incomplete = 0;
+
+    if (!fp)
+      return -1;
+
+    for (i = 0; i < 32; ++i)
+    {
+        n_supported += (ins->supported >> i) & 1;
+        n_incomplete += (ins->incomplete >> i) & 1;
+    }
+
+    if (path && (ftell(fp) == 0))
+      fprintf(fp, "vin,protocol,mil,dtcs,pending,monitors,odometer_km,mode06,ms,error\n");
+
+    fprintf(fp, "%s,%X,", ins->vin, ins->protocol);
+    if (ins->have_status)
+      fprintf(fp, "%d", ins->mil);
+    fputc(',', fp);
+    write_dtcs(fp, (const char (*)[6])ins->dtcs, ins->n_dtcs);
+    fputc(',', fp);
+    write_dtcs(fp, (const char (*)[6])ins->pending, ins->n_pending);
+    fputc(',', fp);
+    if (ins->have_status)
+      fprintf(fp, "%d/%d", n_supported - n_incomplete, n_supported);
+    fputc(',', fp);
+    if (ins->have_odometer)
+      fprintf(fp, "%.1f", ins->odometer_km);
+    fputc(',', fp);
+    if (ins->have_mode06)
+      fprintf(fp, "%d/%d", ins->mode06_tests, ins->mode06_failed);
+    fprintf(fp, ",%.0f,%s\n", total_ms, ins->error);
+
+    if (path)
+      return fclose(fp);
+    fflush(fp);
+
+    return 0;
+}
+
+
+/* Run the queue.  A request goes out as soon as the previous reply is in,
+ * before that reply is decoded; a handler that adds requests (the protocol,
+ * Mode 06 ranges) holds the next one back until it has run.
+ */
+static int inspect_run(inspect_t *ins, int fd)
+{
+    inspect_msg_t msgs[INSPECT_MAX_MSGS];
+    char          reply[INSPECT_REPLY_MAX];
+    double        t_sent[INSPECT_MAX_REQUESTS], t;
+    int           i, n, sent = 0;
+
+    if (ins->n_queue)
+    {
+        elm327_flush(fd);
+        if (elm327_send_cmd(fd, ins->queue[0].cmd) == -1)
+          return -1;
+        t_sent[sent++] = inspect_now_ms();
+    }
+
+    for (i = 0; i < ins->n_queue; ++i)
+    {
+        const inspect_request_t *rq = &ins->queue[i];
+
+        if (elm327_read_response(fd, reply, sizeof(reply), rq->timeout_ms) == -1)
+        {
+            fprintf(stderr, "inspect: %s: %s\n", rq->cmd, strerror(errno));
+            if (errno != EMSGSIZE)
+            {
+                snprintf(ins->error, sizeof(ins->error), "%s: %s", rq->cmd, strerror(errno));
+                return -1;
+            }
+            reply[0] = '\0';
+        }
+        t = inspect_now_ms();
+        ins->stage_ms[rq->stage] += t - t_sent[i];
+
+        if (sent < ins->n_queue)
+        {
+            if (elm327_send_cmd(fd, ins->queue[sent].cmd) == -1)
+              return -1;
+            t_sent[sent++] = t;
+        }
+
+        if (rq->handler)
+        {
+            if ((n = inspect_parse(reply, rq->cmd, is_can(ins), msgs, INSPECT_MAX_MSGS)) == -1)
+            {
+                if (errno == ENODEV)
+                {
+                    fprintf(stderr, "inspect: %s: no vehicle answers\n", rq->cmd);
+                    snprintf(ins->error, sizeof(ins->error), "%s: no vehicle answers", rq->cmd);
+                    return -1;
+                }
+                fprintf(stderr, "inspect: %s: %s\n", rq->cmd, strerror(errno));
+                n = 0;
+            }
+            rq->handler(ins, msgs, n);
+        }
+
+        if ((sent == i + 1) && (sent < ins->n_queue))
+        {
+            if (elm327_send_cmd(fd, ins->queue[sent].cmd) == -1)
+              return -1;
+            t_sent[sent++] = inspect_now_ms();
+        }
+    }
+
+    return 0;
+}
+
+
+int elm327_cmd_inspect(int argc, char *argv[])
+{
+    static const char      *setup[] = { "ATD", "ATE0", "ATS0", "ATH0", "ATAT2" };
+    inspect_t               *ins;
+    elm327_connect_result_t  found;
+    const char              *device = NULL, *output = NULL, *stats = NULL, *wmi = NULL;
+    char                     reply[64];
+    double                   t0, t;
+    size_t                   k;
+    int                      i, fd, status = 0;
+
+    for (i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-o") && (i < argc-1))
+          output = argv[++i];
+        else if (!strcmp(argv[i], "-p") && (i < argc-1))
+          stats = argv[++i];
+        else if (!strcmp(argv[i], "-w") && (i < argc-1))
+          wmi = argv[++i];
+        else if ((argv[i][0] != '-') && !device)
+          device = argv[i];
+        else
+        {
+            inspect_usage("elm327diag");
+            return 1;
+        }
+    }
+    if (!device)
+    {
+        inspect_usage("elm327diag");
+        return 1;
+    }
+    if (!(ins = calloc(1, sizeof(inspect_t))))
+      return 1;
+
+    /* Connect.  Whatever fails, the vehicle gets its record */
+    t0 = inspect_now_ms();
+    memset(&found, 0, sizeof(found));
+    if ((fd = elm327_init(device)) == -1)
+    {
+        fprintf(stderr, "%s: %s\n", device, strerror(errno));
+        snprintf(ins->error, sizeof(ins->error), "%s", strerror(errno));
+        status = 1;
+    }
+    else
+    {
+        elm327_flush(fd);
+        for (k = 0; !status && (k < sizeof(setup) / sizeof(setup[0])); ++k)
+        {
+            if ((elm327_send_cmd(fd, setup[k]) == -1) ||
+                (elm327_read_response(fd, reply, sizeof(reply), INSPECT_REPLY_MS) == -1))
+            {
+                fprintf(stderr, "inspect: %s: %s\n", setup[k], strerror(errno));
+                snprintf(ins->error, sizeof(ins->error), "%s: %s", setup[k], strerror(errno));
+                status = 1;
+            }
+        }
+        ins->stage_ms[STAGE_CONNECT] = inspect_now_ms() - t0;
+    }
+
+    /* Protocol search, then whatever it allows */
+    if (!status && (elm327_connect(fd, stats, wmi, &found) == -1))
+    {
+        snprintf(ins->error, sizeof(ins->error), "%s", (errno == ENODEV) ? "no vehicle answers" : strerror(errno));
+        fprintf(stderr, "inspect: %s\n", ins->error);
+        status = 1;
+    }
+    else if (!status)
+    {
+        ins->protocol = found.protocol;
+        ins->n_ecus = found.n_ecus;
+        fprintf(stderr, "%s after %d attempt%s\n", elm327_protocol_names[found.protocol],
+                found.attempts, (found.attempts == 1) ? "" : "s");
+        on_protocol(ins, NULL, 0);
+        if (inspect_run(ins, fd) == -1)
+          status = 1;
+    }
+    ins->stage_ms[STAGE_PROTOCOL] = found.ms;
+
+    if (fd != -1)
+      elm327_shutdown(fd);
+    t = inspect_now_ms() - t0;
+
+    /* Not expected to happen, INSPECT_MAX_REQUESTS has room for every MID */
+    if (ins->dropped)
+    {
+        fprintf(stderr, "inspect: %d requests over the limit of %d not sent, mode06 incomplete\n",
+                ins->dropped, INSPECT_MAX_REQUESTS);
+        if (!ins->error[0])
+          snprintf(ins->error, sizeof(ins->error), "mode06 truncated");
+    }
+
+    for (i = 0; i < INSPECT_N_STAGES; ++i)
+      fprintf(stderr, "%-9s %7.0f ms\n", stage_names[i], ins->stage_ms[i]);
+    fprintf(stderr, "%-9s %7.0f ms%s\n", "total", t, (t > INSPECT_TARGET_MS) ? " (over target)" : "");
+
+    /* The VIN read is the better WMI hint for next time */
+    if (stats && found.attempts && (elm327_connect_log(stats, ins->vin[0] ? ins->vin : wmi, &found) == -1))
+      fprintf(stderr, "%s: %s\n", stats, strerror(errno));
+
+    if (write_record(ins, output, t) == -1)
+    {
+        fprintf(stderr, "%s: %s\n", output, strerror(errno));
+        status = 1;
+    }
+    free(ins);
+
+    return status;
+}
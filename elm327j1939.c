@@ -0,0 +1,706 @@
+/*
+ * elm327j1939.c
+ *
+ * J1939 support and "elm327diag j1939 [-l <seconds>] [-r <pgn>,...] <device>":
+ * select protocol A, listen to the broadcast traffic for a while, then
+ * request only the PGNs (of the SPN table, the VIN, DM1, and those given with
+ * -r) the bus did not carry, and print every SPN decoded.
+ *
+ * The ELM is set to show 29 bit headers as four bytes (ATJHF0, ATH1),
+ * which only j1939_parse_line() reads; both monitor output and answers to
+ * requests go through it.  A PGN request is the PGN as three bytes,
+ * which the ELM sends as PGN 59904 to the global address.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "elm327.h"
+#include "elm327j1939.h"
+#include "elm327cmd.h"
+
+
+#define J1939_DEFAULT_LISTEN_S  2
+#define J1939_REQUEST_MS        1500
+#define J1939_MAX_REQUESTS      32
+#define J1939_MAX_DTCS          32
+#define J1939_QUIET_MS          100
+
+/* TP.CM control bytes */
+#define TP_CM_RTS    0x10
+#define TP_CM_CTS    0x11
+#define TP_CM_ACK    0x13
+#define TP_CM_BAM    0x20
+#define TP_CM_ABORT  0xFF
+
+
+/* Sorted by PGN.  Temperatures in C, pressures in kPa. */
+const elm327_spn_t elm327_j1939_spns[] =
+{
+    {   91, 0xF003,  8,  8, 0.4,      0,    "%",    "Accelerator pedal position 1" },
+    {   92, 0xF003, 16,  8, 1,        0,    "%",    "Engine percent load at current speed" },
+    {  512, 0xF004,  8,  8, 1,        -125, "%",    "Driver's demand engine percent torque" },
+    {  513, 0xF004, 16,  8, 1,        -125, "%",    "Actual engine percent torque" },
+    {  190, 0xF004, 24, 16, 0.125,    0,    "rpm",  "Engine speed" },
+    {  917, 0xFEC1,  0, 32, 0.005,    0,    "km",   "Total vehicle distance (high resolution)" },
+    {  247, 0xFEE5,  0, 32, 0.05,     0,    "h",    "Engine total hours of operation" },
+    {  250, 0xFEE9, 32, 32, 0.5,      0,    "L",    "Engine total fuel used" },
+    {  110, 0xFEEE,  0,  8, 1,        -40,  "C",    "Engine coolant temperature" },
+    {  174, 0xFEEE,  8,  8, 1,        -40,  "C",    "Engine fuel temperature 1" },
+    {  175, 0xFEEE, 16, 16, 0.03125,  -273, "C",    "Engine oil temperature 1" },
+    {   94, 0xFEEF,  0,  8, 4,        0,    "kPa",  "Engine fuel delivery pressure" },
+    {   98, 0xFEEF, 16,  8, 0.4,      0,    "%",    "Engine oil level" },
+    {  100, 0xFEEF, 24,  8, 4,        0,    "kPa",  "Engine oil pressure" },
+    {   84, 0xFEF1,  8, 16, 1.0/256,  0,    "km/h", "Wheel-based vehicle speed" },
+    {  183, 0xFEF2,  0, 16, 0.05,     0,    "L/h",  "Engine fuel rate" },
+    {  184, 0xFEF2, 16, 16, 1.0/512,  0,    "km/L", "Engine instantaneous fuel economy" },
+    {  108, 0xFEF5,  0,  8, 0.5,      0,    "kPa",  "Barometric pressure" },
+    {  171, 0xFEF5, 24, 16, 0.03125,  -273, "C",    "Ambient air temperature" },
+    {  102, 0xFEF6,  8,  8, 2,        0,    "kPa",  "Engine intake manifold 1 pressure" },
+    {  105, 0xFEF6, 16,  8, 1,        -40,  "C",    "Engine intake manifold 1 temperature" },
+    {  168, 0xFEF7, 32, 16, 0.05,     0,    "V",    "Battery potential / power input 1" },
+    {   96, 0xFEFC,  8,  8, 0.4,      0,    "%",    "Fuel level 1" },
+};
+
+const int elm327_j1939_n_spns = sizeof(elm327_j1939_spns) / sizeof(elm327_j1939_spns[0]);
+
+
+typedef struct _j1939_session
+{
+    int           active;
+    unsigned char sa;
+    unsigned char da;
+    unsigned int  pgn;
+    int           size;
+    int           n_packets;
+    int           received;
+    unsigned char seen[32];   /* packets in, a bit per sequence number */
+    unsigned char data[ELM327_J1939_MAX_LEN];
+} j1939_session_t;
+
+
+struct _elm327_j1939
+{
+    elm327_j1939_handler_t handler;
+    void                  *arg;
+    j1939_session_t        sessions[ELM327_J1939_MAX_SESSIONS];
+};
+
+
+unsigned int elm327_j1939_pgn(unsigned int id, unsigned char *da)
+{
+    unsigned int pf = (id >> 16) & 0xFF, ps = (id >> 8) & 0xFF;
+    unsigned int dp = (id >> 24) & 0x03;
+
+    /* PDU1 (PF below 240) addresses a node, the PS byte is not in the PGN */
+    if (pf < 240)
+    {
+        if (da)
+          *da = ps;
+        return (dp << 16) | (pf << 8);
+    }
+
+    if (da)
+      *da = 0xFF;
+
+    return (dp << 16) | (pf << 8) | ps;
+}
+
+
+elm327_j1939_t *elm327_j1939_create(elm327_j1939_handler_t handler, void *arg)
+{
+    elm327_j1939_t *j;
+
+    if (!(j = calloc(1, sizeof(elm327_j1939_t))))
+      return NULL;
+    j->handler = handler;
+    j->arg = arg;
+
+    return j;
+}
+
+
+static j1939_session_t *session_find(elm327_j1939_t *j, unsigned char sa, unsigned char da, int create)
+{
+    j1939_session_t *free_slot = NULL;
+    int              i;
+
+    for (i = 0; i < ELM327_J1939_MAX_SESSIONS; ++i)
+    {
+        if (j->sessions[i].active && (j->sessions[i].sa == sa) && (j->sessions[i].da == da))
+          return &j->sessions[i];
+        if (!j->sessions[i].active && !free_slot)
+          free_slot = &j->sessions[i];
+    }
+
+    /* All busy: the first one gives way, a transfer we lost track of */
+    if (create && !free_slot)
+      free_slot = &j->sessions[0];
+
+    return create ? free_slot : NULL;
+}
+
+
+static void tp_cm(elm327_j1939_t *j, const elm327_can_frame_t *frame, unsigned char da)
+{
+    const unsigned char *d = frame->data;
+    unsigned char        sa = frame->id & 0xFF;
+    j1939_session_t     *s;
+
+    if (frame->dlc < 8)
+      return;
+
+    switch (d[0])
+    {
+        case TP_CM_BAM:
+        case TP_CM_RTS:
+            if (!(s = session_find(j, sa, da, 1)))
+              return;
+            memset(s, 0, offsetof(j1939_session_t, data));
+            s->size = d[1] | (d[2] << 8);
+            s->n_packets = d[3];
+            s->pgn = d[5] | (d[6] << 8) | ((d[7] & 0x03) << 16);
+            if ((s->size < 9) || (s->size > ELM327_J1939_MAX_LEN) ||
+                (s->n_packets != (s->size + 6) / 7))
+              return;
+            s->sa = sa;
+            s->da = da;
+            s->active = 1;
+            break;
+
+        case TP_CM_ABORT:
+            /* Sent by either end, the receiver's abort names the sender */
+            if ((s = session_find(j, sa, da, 0)) || (s = session_find(j, da, sa, 0)))
+              s->active = 0;
+            break;
+
+        default:
+            /* CTS and end of message ack only pace the transfer */
+            break;
+    }
+}
+
+
+static void tp_dt(elm327_j1939_t *j, const elm327_can_frame_t *frame, unsigned char da)
+{
+    elm327_j1939_msg_t msg;
+    j1939_session_t   *s;
+    int                seq = frame->data[0], n;
+
+    if (!(s = session_find(j, frame->id & 0xFF, da, 0)) ||
+        (seq < 1) || (seq > s->n_packets) || (frame->dlc < 2))
+      return;
+
+    /* A packet sent again after a CTS asked for it is not new */
+    if (!(s->seen[seq / 8] & (1 << (seq % 8))))
+    {
+        s->seen[seq / 8] |= 1 << (seq % 8);
+        n = (seq * 7 <= s->size) ? 7 : s->size - (seq - 1) * 7;
+        if (n > frame->dlc - 1)
+          n = frame->dlc - 1;
+        memcpy(s->data + (seq - 1) * 7, frame->data + 1, n);
+        ++s->received;
+    }
+
+    if (s->received == s->n_packets)
+    {
+        s->active = 0;
+        msg.pgn = s->pgn;
+        msg.priority = (frame->id >> 26) & 0x07;
+        msg.sa = s->sa;
+        msg.da = s->da;
+        msg.len = s->size;
+        msg.data = s->data;
+        j->handler(&msg, j->arg);
+    }
+}
+
+
+void elm327_j1939_feed(elm327_j1939_t *j, const elm327_can_frame_t *frame)
+{
+    elm327_j1939_msg_t msg;
+    unsigned char      da;
+
+    if (!frame->extended)
+      return;
+
+    msg.pgn = elm327_j1939_pgn(frame->id, &da);
+    if (msg.pgn == ELM327_J1939_PGN_TP_CM)
+      tp_cm(j, frame, da);
+    else if (msg.pgn == ELM327_J1939_PGN_TP_DT)
+      tp_dt(j, frame, da);
+    else
+    {
+        msg.priority = (frame->id >> 26) & 0x07;
+        msg.sa = frame->id & 0xFF;
+        msg.da = da;
+        msg.len = frame->dlc;
+        msg.data = frame->data;
+        j->handler(&msg, j->arg);
+    }
+}
+
+
+void elm327_j1939_destroy(elm327_j1939_t *j)
+{
+    free(j);
+}
+
+
+const elm327_spn_t *elm327_j1939_spns_of(unsigned int pgn, int *n)
+{
+    int lo = 0, hi = elm327_j1939_n_spns, mid, end;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (elm327_j1939_spns[mid].pgn < pgn)
+          lo = mid + 1;
+        else
+          hi = mid;
+    }
+    for (end = lo; (end < elm327_j1939_n_spns) && (elm327_j1939_spns[end].pgn == pgn); ++end)
+      ;
+
+    *n = end - lo;
+
+    return *n ? &elm327_j1939_spns[lo] : NULL;
+}
+
+
+int elm327_j1939_spn_value(
+    const elm327_spn_t  *spn,
+    const unsigned char *data,
+    int                  len,
+    double              *value)
+{
+    unsigned long long raw = 0, limit;
+    int                i, bytes;
+
+    if ((spn->start + spn->bits + 7) / 8 > len)
+      return -1;
+
+    /* Little endian, least significant byte first */
+    bytes = (spn->start % 8 + spn->bits + 7) / 8;
+    for (i = bytes - 1; i >= 0; --i)
+      raw = (raw << 8) | data[spn->start / 8 + i];
+    raw = (raw >> (spn->start % 8)) & ((1ULL << spn->bits) - 1);
+
+    /* The top of the range (0xFB.. up) is reserved, error and not available.
+     * Fields under a byte only have all ones for not available.
+     */
+    if (spn->bits >= 8)
+      limit = (0xFBULL << (spn->bits - 8)) - 1;
+    else
+      limit = (1ULL << spn->bits) - 2;
+    if (raw > limit)
+      return -1;
+
+    *value = raw * spn->scale + spn->offset;
+
+    return 0;
+}
+
+
+int elm327_j1939_dm1(
+    const unsigned char *data,
+    int                  len,
+    int                 *mil,
+    elm327_j1939_dtc_t  *dtcs,
+    int                  max)
+{
+    const unsigned char *d;
+    int                  i, n = 0;
+
+    if (len < 2)
+      return 0;
+    *mil = ((data[0] >> 6) & 0x03) == 1;
+
+    /* SPN conversion method 4: 19 bits, the top 3 in the third byte */
+    for (i = 2; (i + 4 <= len) && (n < max); i += 4)
+    {
+        d = data + i;
+        if (!d[0] && !d[1] && !d[2])
+          continue;
+        if ((d[0] == 0xFF) && (d[1] == 0xFF) && (d[2] == 0xFF))
+          continue;
+        dtcs[n].spn = d[0] | (d[1] << 8) | ((d[2] & 0xE0) << 11);
+        dtcs[n].fmi = d[2] & 0x1F;
+        dtcs[n].oc = d[3] & 0x7F;
+        ++n;
+    }
+
+    return n;
+}
+
+
+/*
+ * The j1939 subcommand
+ */
+
+typedef struct _j1939_scan
+{
+    unsigned char      seen[(1 << 18) / 8];   /* PGNs heard, a bit each */
+    int                requested;             /* messages now come from a request */
+    int                have[sizeof(elm327_j1939_spns) / sizeof(elm327_j1939_spns[0])];
+    double             value[sizeof(elm327_j1939_spns) / sizeof(elm327_j1939_spns[0])];
+    unsigned char      sa[sizeof(elm327_j1939_spns) / sizeof(elm327_j1939_spns[0])];
+    char               vin[32];
+    int                have_dm1;
+    int                mil;
+    elm327_j1939_dtc_t dtcs[J1939_MAX_DTCS];
+    unsigned char      dtc_sa[J1939_MAX_DTCS];
+    int                n_dtcs;
+    unsigned long      n_frames;
+    unsigned long      n_messages;
+} j1939_scan_t;
+
+
+static void j1939_usage(const char *prog)
+{
+    printf("Usage:\n");
+    printf("  %s j1939 [-l <seconds>] [-r <pgn>[,<pgn>...]] <device>\n", prog);
+    printf("Options:\n");
+    printf("  -l <int>     seconds to listen to broadcasts first (default: %d)\n", J1939_DEFAULT_LISTEN_S);
+    printf("  -r <list>    also request these PGNs when not broadcast (hex with 0x)\n");
+}
+
+
+static double j1939_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+
+static void on_message(const elm327_j1939_msg_t *msg, void *arg)
+{
+    j1939_scan_t       *scan = arg;
+    const elm327_spn_t *spns;
+    elm327_j1939_dtc_t  dtcs[J1939_MAX_DTCS];
+    int                 i, k, n, mil;
+    double              v;
+
+    ++scan->n_messages;
+    scan->seen[(msg->pgn & 0x3FFFF) / 8] |= 1 << (msg->pgn % 8);
+
+    if ((spns = elm327_j1939_spns_of(msg->pgn, &n)))
+    {
+        for (i = 0; i < n; ++i)
+        {
+            k = spns - elm327_j1939_spns + i;
+            if (elm327_j1939_spn_value(&spns[i], msg->data, msg->len, &v) == 0)
+            {
+                scan->have[k] = scan->requested ? 2 : 1;
+                scan->value[k] = v;
+                scan->sa[k] = msg->sa;
+            }
+        }
+    }
+    else if (msg->pgn == ELM327_J1939_PGN_VI)
+    {
+        /* ASCII, ended by '*' */
+        for (i = 0; (i < msg->len) && (i < (int)sizeof(scan->vin) - 1) && (msg->data[i] != '*'); ++i)
+          scan->vin[i] = msg->data[i];
+        scan->vin[i] = '\0';
+    }
+    else if (msg->pgn == ELM327_J1939_PGN_DM1)
+    {
+        scan->have_dm1 = 1;
+        n = elm327_j1939_dm1(msg->data, msg->len, &mil, dtcs, J1939_MAX_DTCS);
+        scan->mil |= mil;
+        for (i = 0; i < n; ++i)
+        {
+            for (k = 0; k < scan->n_dtcs; ++k)
+              if ((scan->dtc_sa[k] == msg->sa) && (scan->dtcs[k].spn == dtcs[i].spn) &&
+                  (scan->dtcs[k].fmi == dtcs[i].fmi))
+                break;
+            if (k == J1939_MAX_DTCS)
+              break;
+            scan->dtcs[k] = dtcs[i];
+            scan->dtc_sa[k] = msg->sa;
+            if (k == scan->n_dtcs)
+              ++scan->n_dtcs;
+        }
+    }
+}
+
+
+/* One line with the header as four bytes ("18 FE EE 00 8C 00 ..."), or in
+ * the forms elm327_parse_monitor_line() reads.  0, or -1 if it is not a frame.
+ */
+static int j1939_parse_line(const char *line, int len, elm327_can_frame_t *frame)
+{
+    const unsigned char *p = (const unsigned char *)line;
+    unsigned int         id = 0;
+    int                  i, n;
+
+    while ((len > 0) && ((p[len-1] == '\r') || (p[len-1] == ' ')))
+      --len;
+    while ((len > 0) && (*p == ' '))
+    {
+        ++p;
+        --len;
+    }
+
+    if ((len < 11) || (p[2] != ' ') || ((len > 11) && (p[11] != ' ')))
+      return elm327_parse_monitor_line((const char *)p, len, frame);
+
+    for (i=0; i<4; ++i)
+    {
+        if ((elm327_hex_lut[p[3*i]] == ELM327_HEX_INVALID) ||
+            (elm327_hex_lut[p[3*i+1]] == ELM327_HEX_INVALID) ||
+            ((i < 3) && (p[3*i+2] != ' ')))
+          return -1;
+        id = (id << 8) | (elm327_hex_lut[p[3*i]] << 4) | elm327_hex_lut[p[3*i+1]];
+    }
+
+    if ((n = elm327_hex_to_bytes((const char *)p + 11, len - 11, frame->data, OBD_MAX_MSG_SIZE)) < 0)
+      return -1;
+
+    frame->id = id;
+    frame->extended = 1;
+    frame->dlc = n;
+    memset(frame->data + n, 0, OBD_MAX_MSG_SIZE - n);
+
+    return 0;
+}
+
+
+/* Frames in 'text', one per line */
+static void feed_lines(elm327_j1939_t *j, j1939_scan_t *scan, const char *text)
+{
+    elm327_can_frame_t  frame;
+    const char         *p, *end;
+
+    for (p = text; *p; p = *end ? end + 1 : end)
+    {
+        if (!(end = strchr(p, '\n')))
+          end = p + strlen(p);
+        if (j1939_parse_line(p, end - p, &frame) == 0)
+        {
+            ++scan->n_frames;
+            elm327_j1939_feed(j, &frame);
+        }
+    }
+}
+
+
+/* Monitor everything for 'ms'.  The ELM ends monitoring by itself when its
+ * buffer fills up (a busy bus and a slow serial link), it is started again.
+ * Any character stops it, what is still on the way is read until the line
+ * goes quiet.
+ */
+static int j1939_listen(int fd, elm327_j1939_t *j, j1939_scan_t *scan, int ms)
+{
+    char    buf[4096], line[128];
+    double  deadline = j1939_now_ms() + ms, left;
+    ssize_t r;
+    int     i, n = 0, k, stopped = 0;
+
+    if (elm327_send_cmd(fd, "ATMA") == -1)
+      return -1;
+
+    for (;;)
+    {
+        left = stopped ? J1939_QUIET_MS : deadline - j1939_now_ms();
+        if ((k = (left > 0) ? elm327_wait_readable(fd, (int)left + 1) : 0) == -1)
+          return -1;
+        if (k == 0)
+        {
+            if (stopped)
+              break;
+            if (elm327_send_cmd(fd, "") == -1)
+              return -1;
+            stopped = 1;
+            continue;
+        }
+        if ((r = elm327_read(fd, buf, sizeof(buf))) <= 0)
+        {
+            /* End of file: the adapter went away */
+            if (r == 0)
+              errno = EIO;
+            return -1;
+        }
+
+        for (i = 0; i < r; ++i)
+        {
+            if ((buf[i] == '\n') || (buf[i] == '\r'))
+            {
+                line[n] = '\0';
+                n = 0;
+                if (!stopped && !strcmp(line, "BUFFER FULL") && (elm327_send_cmd(fd, "ATMA") == -1))
+                  return -1;
+                feed_lines(j, scan, line);
+            }
+            else if ((buf[i] != '>') && (n < (int)sizeof(line) - 1))
+              line[n++] = buf[i];
+        }
+    }
+
+    return 0;
+}
+
+
+static int j1939_request(int fd, elm327_j1939_t *j, j1939_scan_t *scan, unsigned int pgn)
+{
+    char cmd[8], reply[4096];
+
+    /* The PGN least significant byte last, the ELM reverses it (ATJE) */
+    snprintf(cmd, sizeof(cmd), "%06X", pgn & 0x3FFFF);
+    if ((elm327_send_cmd(fd, cmd) == -1) ||
+        (elm327_read_response(fd, reply, sizeof(reply), J1939_REQUEST_MS) == -1))
+      return -1;
+    feed_lines(j, scan, reply);
+
+    return 0;
+}
+
+
+static int pgn_seen(const j1939_scan_t *scan, unsigned int pgn)
+{
+    return (scan->seen[(pgn & 0x3FFFF) / 8] >> (pgn % 8)) & 1;
+}
+
+
+int elm327_cmd_j1939(int argc, char *argv[])
+{
+    static const char *setup[] = { "ATD", "ATE0", "ATS1", "ATH1", "ATJE", "ATJHF0", "ATSPA" };
+    j1939_scan_t      *scan;
+    elm327_j1939_t    *j;
+    const char        *device = NULL;
+    unsigned int       wanted[J1939_MAX_REQUESTS];
+    char               reply[64], *p, *end;
+    int                i, k, fd, n_wanted = 0, listen_s = J1939_DEFAULT_LISTEN_S, n_requests = 0, err = 0;
+    double             t0;
+
+    for (i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-l") && (i < argc-1))
+          listen_s = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-r") && (i < argc-1))
+        {
+            for (p = argv[++i]; *p && (n_wanted < J1939_MAX_REQUESTS); p = (*end == ',') ? end + 1 : end)
+            {
+                wanted[n_wanted++] = strtoul(p, &end, 0);
+                if (end == p)
+                {
+                    j1939_usage("elm327diag");
+                    return 1;
+                }
+            }
+        }
+        else if ((argv[i][0] != '-') && !device)
+          device = argv[i];
+        else
+        {
+            j1939_usage("elm327diag");
+            return 1;
+        }
+    }
+    if (!device || (listen_s < 0))
+    {
+        j1939_usage("elm327diag");
+        return 1;
+    }
+
+    /* What the table decodes, identification and the active DTCs */
+    for (i = 0; (i < elm327_j1939_n_spns) && (n_wanted < J1939_MAX_REQUESTS); ++i)
+      if (!i || (elm327_j1939_spns[i].pgn != elm327_j1939_spns[i - 1].pgn))
+        wanted[n_wanted++] = elm327_j1939_spns[i].pgn;
+    if (n_wanted < J1939_MAX_REQUESTS)
+      wanted[n_wanted++] = ELM327_J1939_PGN_VI;
+    if (n_wanted < J1939_MAX_REQUESTS)
+      wanted[n_wanted++] = ELM327_J1939_PGN_DM1;
+
+    if (!(scan = calloc(1, sizeof(j1939_scan_t))) || !(j = elm327_j1939_create(on_message, scan)))
+    {
+        free(scan);
+        return 1;
+    }
+
+    if ((fd = elm327_init(device)) == -1)
+    {
+        fprintf(stderr, "%s: %s\n", device, strerror(errno));
+        elm327_j1939_destroy(j);
+        free(scan);
+        return 1;
+    }
+    elm327_flush(fd);
+    for (k = 0; k < (int)(sizeof(setup) / sizeof(setup[0])); ++k)
+    {
+        if ((elm327_send_cmd(fd, setup[k]) == -1) ||
+            (elm327_read_response(fd, reply, sizeof(reply), J1939_REQUEST_MS) == -1))
+        {
+            fprintf(stderr, "j1939: %s: %s\n", setup[k], strerror(errno));
+            elm327_shutdown(fd);
+            elm327_j1939_destroy(j);
+            free(scan);
+            return 1;
+        }
+        if (strchr(reply, '?'))
+          fprintf(stderr, "j1939: %s not supported by this adapter\n", setup[k]);
+    }
+
+    t0 = j1939_now_ms();
+    if ((listen_s > 0) && (j1939_listen(fd, j, scan, listen_s * 1000) == -1))
+    {
+        fprintf(stderr, "j1939: monitor: %s\n", strerror(errno));
+        err = 1;
+    }
+    fprintf(stderr, "listened %.1f s: %lu frames, %lu messages\n",
+            (j1939_now_ms() - t0) / 1e3, scan->n_frames, scan->n_messages);
+
+    /* Only what was not broadcast costs bus load */
+    scan->requested = 1;
+    for (i = 0; i < n_wanted; ++i)
+    {
+        for (k = 0; (k < i) && (wanted[k] != wanted[i]); ++k)
+          ;
+        if ((k < i) || pgn_seen(scan, wanted[i]))
+          continue;
+        ++n_requests;
+        if (j1939_request(fd, j, scan, wanted[i]) == -1)
+        {
+            fprintf(stderr, "j1939: request %04X: %s\n", wanted[i], strerror(errno));
+            /* A PGN nobody sends is not an error, a dead adapter is */
+            if (errno != ETIMEDOUT)
+            {
+                err = 1;
+                break;
+            }
+        }
+    }
+    fprintf(stderr, "%d PGNs requested\n", n_requests);
+    elm327_shutdown(fd);
+
+    if (scan->vin[0])
+      printf("VIN %s\n", scan->vin);
+    if (scan->have_dm1)
+    {
+        printf("MIL %s, %d active DTC%s\n", scan->mil ? "on" : "off", scan->n_dtcs,
+               (scan->n_dtcs == 1) ? "" : "s");
+        for (i = 0; i < scan->n_dtcs; ++i)
+          printf("  SA %02X SPN %u FMI %u (x%u)\n", scan->dtc_sa[i], scan->dtcs[i].spn,
+                 scan->dtcs[i].fmi, scan->dtcs[i].oc);
+    }
+    printf("%-6s %12s %-5s %-4s %-2s %-9s %s\n", "SPN", "value", "unit", "PGN", "SA", "source", "name");
+    for (i = 0; i < elm327_j1939_n_spns; ++i)
+      if (scan->have[i])
+        printf("%-6u %12.3f %-5s %04X %02X %-9s %s\n", elm327_j1939_spns[i].spn, scan->value[i],
+               elm327_j1939_spns[i].unit, elm327_j1939_spns[i].pgn, scan->sa[i],
+               (scan->have[i] == 1) ? "broadcast" : "request", elm327_j1939_spns[i].name);
+
+    elm327_j1939_destroy(j);
+    free(scan);
+
+    return err;
+}
@@ -0,0 +1,117 @@
+#ifndef _ELM327J1939_H
+#define _ELM327J1939_H
+
+#include "elm327.h"
+
+
+/* SAE J1939 on the ELM327 (protocol A, 29 bit CAN at 250 kbaud).
+ *
+ * Trucks broadcast most of what is worth having: engine speed every 10 ms,
+ * temperatures every second.  Frames are taken from monitor mode and fed
+ * here, multi-packet messages (TP.CM/TP.DT, both BAM and RTS/CTS between
+ * other nodes) are put back together, and complete messages handed to a
+ * callback.  Only what the bus did not offer needs a PGN request.
+ */
+#define ELM327_J1939_PGN_REQUEST  0xEA00
+#define ELM327_J1939_PGN_TP_CM    0xEC00
+#define ELM327_J1939_PGN_TP_DT    0xEB00
+#define ELM327_J1939_PGN_DM1      0xFECA
+#define ELM327_J1939_PGN_VI       0xFEEC
+
+/* Largest transport protocol message, 255 packets of 7 bytes */
+#define ELM327_J1939_MAX_LEN      1785
+
+/* Transfers followed at the same time */
+#define ELM327_J1939_MAX_SESSIONS 16
+
+
+typedef struct _elm327_j1939_msg
+{
+    unsigned int         pgn;
+    unsigned char        priority;
+    unsigned char        sa;        /* source address */
+    unsigned char        da;        /* destination, 0xFF global */
+    int                  len;
+    const unsigned char *data;
+} elm327_j1939_msg_t;
+
+
+typedef void (*elm327_j1939_handler_t)(const elm327_j1939_msg_t *msg, void *arg);
+
+
+typedef struct _elm327_j1939 elm327_j1939_t;
+
+
+/* One entry of the SPN table: where the parameter sits in its PGN and how
+ * the raw value scales.  'start' is the bit offset into the data (byte * 8
+ * + bit, J1939 numbers bytes from 1 but this from 0).
+ */
+typedef struct _elm327_spn
+{
+    unsigned int  spn;
+    unsigned int  pgn;
+    unsigned char start;
+    unsigned char bits;
+    double        scale;
+    double        offset;
+    const char   *unit;
+    const char   *name;
+} elm327_spn_t;
+
+
+/* The table, sorted by PGN */
+extern const elm327_spn_t elm327_j1939_spns[];
+extern const int          elm327_j1939_n_spns;
+
+
+/* A diagnostic trouble code of DM1 */
+typedef struct _elm327_j1939_dtc
+{
+    unsigned int  spn;
+    unsigned char fmi;
+    unsigned char oc;   /* occurrence count */
+} elm327_j1939_dtc_t;
+
+
+/* PGN of a 29 bit identifier, the destination of PDU1 formats (0xFF for
+ * PDU2) goes to 'da' when not NULL
+ */
+extern unsigned int elm327_j1939_pgn(unsigned int id, unsigned char *da);
+
+
+extern elm327_j1939_t *elm327_j1939_create(elm327_j1939_handler_t handler, void *arg);
+
+
+/* Feed one frame as read off the bus, 11 bit frames are ignored */
+extern void elm327_j1939_feed(elm327_j1939_t *j, const elm327_can_frame_t *frame);
+
+
+extern void elm327_j1939_destroy(elm327_j1939_t *j);
+
+
+/* Table entries of 'pgn', NULL when none, their number in 'n' */
+extern const elm327_spn_t *elm327_j1939_spns_of(unsigned int pgn, int *n);
+
+
+/* Value of 'spn' in a message of its PGN.  Returns 0, or -1 when the data is
+ * too short or says "not available" or "error".
+ */
+extern int elm327_j1939_spn_value(
+    const elm327_spn_t  *spn,
+    const unsigned char *data,
+    int                  len,
+    double              *value);
+
+
+/* Decode DM1: the MIL lamp status (1 on) goes to 'mil', up to 'max' codes
+ * to 'dtcs'.  Returns the number of codes.
+ */
+extern int elm327_j1939_dm1(
+    const unsigned char *data,
+    int                  len,
+    int                 *mil,
+    elm327_j1939_dtc_t  *dtcs,
+    int                  max);
+
+
+#endif /* _ELM327J1939_H */
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "elm327log.h"
+#include "elm327clock.h"
+
+
+/*
+ * Writer
+ */
+
+elm327_log_t *elm327_log_create(const char *path, uint32_t vehicle)
+{
+    elm327_log_t        *log;
+    elm327_log_header_t *hdr;
+    char                 block[ELM327_LOG_BLOCK_SIZE] = {0};
+
+    if (!(log = calloc(1, sizeof(elm327_log_t))))
+      return NULL;
+
+    if (!(log->fp = fopen(path, "wb")))
+    {
+        free(log);
+        return NULL;
+    }
+
+    log->vehicle = vehicle;
+
+    /* The header occupies the whole first block */
+    hdr = (elm327_log_header_t *)block;
+    memcpy(hdr->magic, ELM327_LOG_MAGIC, sizeof(hdr->magic));
+    hdr->version = ELM327_LOG_VERSION;
+    hdr->endian = ELM327_LOG_ENDIAN_TAG;
+    hdr->block_size = ELM327_LOG_BLOCK_SIZE;
+    hdr->record_size = sizeof(elm327_log_record_t);
+    hdr->vehicle = vehicle;
+    hdr->created_us = elm327_log_now_us();
+
+    if (fwrite(block, sizeof(block), 1, log->fp) != 1)
+    {
+        fclose(log->fp);
+        free(log);
+        return NULL;
+    }
+
+    return log;
+}
+
+
+int elm327_log_append_record(elm327_log_t *log, const elm327_log_record_t *rec)
+{
+    log->block[log->n_buffered++] = *rec;
+
+    if (log->n_buffered == ELM327_LOG_BLOCK_RECORDS)
+      return elm327_log_flush(log);
+
+    return 0;
+}
+
+
+int elm327_log_append(
+    elm327_log_t *log,
+    uint64_t      timestamp_us,
+    uint32_t      channel,
+    double        value)
+{
+    elm327_log_record_t rec = {0};
+
+    rec.timestamp_us = timestamp_us;
+    rec.value = value;
+    rec.vehicle = log->vehicle;
+    rec.channel = channel;
+
+    return elm327_log_append_record(log, &rec);
+}
+
+
+int elm327_log_flush(elm327_log_t *log)
+{
+    if (log->n_buffered == 0)
+      return 0;
+
+    /* Zero the tail so readers see padding, then write the full block */
+    memset(log->block + log->n_buffered, 0,
+           (ELM327_LOG_BLOCK_RECORDS - log->n_buffered) * sizeof(elm327_log_record_t));
+    log->n_buffered = 0;
+
+    if (fwrite(log->block, sizeof(log->block), 1, log->fp) != 1)
+      return -1;
+    ++log->n_blocks;
+
+    return 0;
+}
+
+
+int elm327_log_close(elm327_log_t *log)
+{
+    int err;
+
+    if (!log)
+      return 0;
+
+    err = elm327_log_flush(log);
+    if (fclose(log->fp) != 0)
+      err = -1;
+    free(log);
+
+    return err;
+}
+
+
+/*
+ * Reader
+ */
+
+int elm327_log_map(const char *path, elm327_log_map_t *map)
+{
+    struct stat st;
+    int         fd, saved;
+
+    memset(map, 0, sizeof(elm327_log_map_t));
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+      return -1;
+
+    if (fstat(fd, &st) == -1)
+      goto err;
+
+    /* Must at least hold a header, and be made of whole blocks */
+    if ((st.st_size < ELM327_LOG_BLOCK_SIZE) ||
+        (st.st_size % ELM327_LOG_BLOCK_SIZE))
+    {
+        errno = EINVAL;
+        goto err;
+    }
+
+    map->size = st.st_size;
+    map->base = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map->base == MAP_FAILED)
+    {
+        map->base = NULL;
+        goto err;
+    }
+
+    /* The mapping holds its own reference to the file */
+    close(fd);
+    fd = -1;
+
+    map->header = map->base;
+    if (memcmp(map->header->magic, ELM327_LOG_MAGIC, sizeof(map->header->magic)) ||
+        (map->header->endian != ELM327_LOG_ENDIAN_TAG) ||
+        (map->header->block_size != ELM327_LOG_BLOCK_SIZE) ||
+        (map->header->record_size != sizeof(elm327_log_record_t)))
+    {
+        errno = EINVAL;
+        goto err;
+    }
+
+    map->records = (const elm327_log_record_t *)
+        ((const char *)map->base + ELM327_LOG_BLOCK_SIZE);
+    map->n_blocks = (map->size / ELM327_LOG_BLOCK_SIZE) - 1;
+
+    /* Blocks are consumed front to back */
+    madvise(map->base, map->size, MADV_SEQUENTIAL);
+
+    return 0;
+
+err:
+    saved = errno;
+    if (fd != -1)
+      close(fd);
+    elm327_log_unmap(map);
+    errno = saved;
+    return -1;
+}
+
+
+void elm327_log_unmap(elm327_log_map_t *map)
+{
+    if (map->base)
+      munmap(map->base, map->size);
+
+    map->base = NULL;
+}
+
+
+uint64_t elm327_log_now_us(void)
+{
+    return elm327_clock_wall_us();
+}
@@ -0,0 +1,164 @@
+#ifndef _ELM327LOG_H
+#define _ELM327LOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+
+/* Binary sample log.
+ *
+ * A log is a sequence of fixed size blocks.  The first block holds the file
+ * header, every following block holds ELM327_LOG_BLOCK_RECORDS records.  The
+ * last block may be partially filled, unused records are zeroed (a record with
+ * a timestamp of zero is padding).  Because records never straddle a block
+ * boundary a reader can split a file on any block boundary and process the
+ * pieces independently.
+ *
+ * All fields are stored in host byte order, the header records which.
+ */
+#define ELM327_LOG_MAGIC         "ELMLOG01"
+#define ELM327_LOG_BLOCK_SIZE    4096
+#define ELM327_LOG_VERSION       1
+#define ELM327_LOG_ENDIAN_TAG    0x01020304u
+
+
+/* A channel packs an OBD mode and the parameter inside that mode, so Mode 01
+ * PID 0x0C is channel 0x0001000C.  This leaves room for 16 bit identifiers
+ * (Mode 22 DIDs) without changing the record layout.
+ */
+#define ELM327_CHANNEL(_mode, _id)   ((((uint32_t)(_mode)) << 16) | ((_id) & 0xFFFF))
+#define ELM327_CHANNEL_MODE(_ch)     (((_ch) >> 16) & 0xFFFF)
+#define ELM327_CHANNEL_ID(_ch)       ((_ch) & 0xFFFF)
+
+
+typedef struct _elm327_log_header
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t block_size;
+    uint32_t record_size;
+    uint32_t vehicle;        /* Vehicle id stamped on every record  */
+    uint32_t reserved;
+    uint64_t created_us;     /* Wall clock time the log was opened  */
+} elm327_log_header_t;
+
+
+typedef struct _elm327_log_record
+{
+    uint64_t timestamp_us;   /* Wall clock, microseconds since epoch */
+    double   value;          /* Decoded (engineering unit) value     */
+    uint32_t vehicle;
+    uint32_t channel;        /* See ELM327_CHANNEL()                 */
+    uint32_t flags;
+    uint32_t reserved;
+} elm327_log_record_t;
+
+
+#define ELM327_LOG_BLOCK_RECORDS \
+    (ELM327_LOG_BLOCK_SIZE / sizeof(elm327_log_record_t))
+
+
+/* Writer, buffers one block at a time */
+typedef struct _elm327_log
+{
+    FILE                *fp;
+    uint32_t             vehicle;
+    uint64_t             n_blocks;     /* Data blocks written so far */
+    size_t               n_buffered;
+    elm327_log_record_t  block[ELM327_LOG_BLOCK_SIZE / sizeof(elm327_log_record_t)];
+} elm327_log_t;
+
+
+/* Create (truncate) a log for writing.  Returns NULL on error, errno set */
+extern elm327_log_t *elm327_log_create(const char *path, uint32_t vehicle);
+
+
+/* Append a sample, returns 0 on success and -1 on error */
+extern int elm327_log_append(
+    elm327_log_t *log,
+    uint64_t      timestamp_us,
+    uint32_t      channel,
+    double        value);
+
+
+/* Append a fully formed record (vehicle is taken from the record) */
+extern int elm327_log_append_record(
+    elm327_log_t              *log,
+    const elm327_log_record_t *rec);
+
+
+/* Pad and write out the current block */
+extern int elm327_log_flush(elm327_log_t *log);
+
+
+/* Flush and close, returns the result of the final flush */
+extern int elm327_log_close(elm327_log_t *log);
+
+
+/* Read-only memory mapped view of a whole log */
+typedef struct _elm327_log_map
+{
+    void                      *base;
+    size_t                     size;
+    const elm327_log_header_t *header;
+    const elm327_log_record_t *records;   /* First record after the header */
+    size_t                     n_blocks;  /* Data blocks (header excluded) */
+} elm327_log_map_t;
+
+
+/* Map a log, validating its header.  The file descriptor is not kept open so
+ * any number of logs can be mapped at once.  Returns 0 on success, -1 on error
+ */
+extern int elm327_log_map(const char *path, elm327_log_map_t *map);
+extern void elm327_log_unmap(elm327_log_map_t *map);
+
+
+/* Records in data block 'blk' of a mapped log */
+#define elm327_log_map_block(_map, _blk) \
+    ((_map)->records + (size_t)(_blk) * ELM327_LOG_BLOCK_RECORDS)
+
+
+/* Fleet store index.
+ *
+ * A store is an ordinary log holding many vehicles (header vehicle is
+ * ELM327_LOG_FLEET), clustered by series: the records of a (vehicle,
+ * channel) fill a run of consecutive blocks on their own, in timestamp
+ * order, the runs in key order.  Next to it lives "<store>.idx": a header
+ * followed by one entry per series, sorted by vehicle then channel, giving
+ * its blocks and time span.  A reader looks up its key and scans only those
+ * blocks, every record in them is of that series.
+ */
+#define ELM327_LOG_FLEET         0xFFFFFFFFu
+#define ELM327_LOG_INDEX_MAGIC   "ELMIDX01"
+#define ELM327_LOG_INDEX_SUFFIX  ".idx"
+
+
+typedef struct _elm327_log_index_header
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t n_entries;
+    uint64_t n_records;
+} elm327_log_index_header_t;
+
+
+typedef struct _elm327_log_index_entry
+{
+    uint32_t vehicle;
+    uint32_t channel;
+    uint64_t count;
+    uint64_t first_us;
+    uint64_t last_us;
+    uint64_t first_block;    /* Data block numbers, inclusive */
+    uint64_t last_block;
+} elm327_log_index_entry_t;
+
+
+/* Wall clock in microseconds, the timestamp used in records */
+extern uint64_t elm327_log_now_us(void);
+
+
+#endif /* _ELM327LOG_H */
@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "elm327.h"
+#include "elm327loopback.h"
+
+
+#define LOOPBACK_LINE_MAX   64
+#define LOOPBACK_OUT_MAX    4096
+#define LOOPBACK_TEXT_MAX   512
+
+
+typedef struct _loopback_answer
+{
+    char   request[LOOPBACK_LINE_MAX];   /* normalized: upper case, no spaces */
+    char  *text;                         /* as the tty hands it over, prompt included */
+    size_t len;
+} loopback_answer_t;
+
+
+typedef struct _loopback
+{
+    loopback_answer_t *answers;          /* sorted by request */
+    size_t             n;
+    loopback_answer_t *fallback;         /* "*" */
+    int                echo;
+    char               line[LOOPBACK_LINE_MAX];
+    size_t             line_len;
+    char               out[LOOPBACK_OUT_MAX];
+    size_t             head, tail;
+    uint64_t           requests;
+} loopback_t;
+
+
+static loopback_t     *adapters[ELM327_LOOPBACK_MAX];
+static pthread_mutex_t adapters_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static loopback_t *loopback_get(int fd)
+{
+    unsigned int i = (unsigned int)fd - ELM327_LOOPBACK_FD_BASE;
+
+    if ((i >= ELM327_LOOPBACK_MAX) || !adapters[i])
+    {
+        errno = EBADF;
+        return NULL;
+    }
+
+    return adapters[i];
+}
+
+
+static void normalize(char *dst, const char *src)
+{
+    size_t n = 0;
+
+    for (; *src && (n < LOOPBACK_LINE_MAX - 1); ++src)
+      if (!isspace((unsigned char)*src))
+        dst[n++] = toupper((unsigned char)*src);
+    dst[n] = '\0';
+}
+
+
+static int by_request(const void *a, const void *b)
+{
+    return strcmp(((const loopback_answer_t *)a)->request, ((const loopback_answer_t *)b)->request);
+}
+
+
+/* Response lines to what the tty hands over: '|' to '\n', blank line, prompt */
+static int render(loopback_answer_t *a, const char *response)
+{
+    size_t len = strlen(response), i;
+
+    if (!(a->text = malloc(len + 4)))
+      return -1;
+    for (i = 0; i < len; ++i)
+      a->text[i] = (response[i] == '|') ? '\n' : response[i];
+    memcpy(a->text + len, "\n\n>", 4);
+    a->len = len + 3;
+
+    return 0;
+}
+
+
+static void loopback_free(loopback_t *lb)
+{
+    size_t i;
+
+    if (!lb)
+      return;
+
+    for (i = 0; i < lb->n; ++i)
+      free(lb->answers[i].text);
+    free(lb->answers);
+    if (lb->fallback)
+      free(lb->fallback->text);
+    free(lb->fallback);
+    free(lb);
+}
+
+
+int elm327_loopback_open(const elm327_loopback_entry_t *table, size_t n)
+{
+    loopback_t *lb;
+    size_t      i;
+    int         slot;
+
+    if (!(lb = calloc(1, sizeof(loopback_t))) ||
+        !(lb->answers = calloc(n ? n : 1, sizeof(loopback_answer_t))))
+    {
+        free(lb);
+        return -1;
+    }
+    lb->echo = 1;
+
+    for (i = 0; i < n; ++i)
+    {
+        loopback_answer_t *a;
+
+        if (!strcmp(table[i].request, "*"))
+        {
+            if (lb->fallback || !(lb->fallback = calloc(1, sizeof(loopback_answer_t))))
+            {
+                errno = lb->fallback ? EINVAL : errno;
+                loopback_free(lb);
+                return -1;
+            }
+            a = lb->fallback;
+        }
+        else
+        {
+            a = &lb->answers[lb->n++];
+            normalize(a->request, table[i].request);
+        }
+        if (render(a, table[i].response) == -1)
+        {
+            loopback_free(lb);
+            return -1;
+        }
+    }
+    qsort(lb->answers, lb->n, sizeof(loopback_answer_t), by_request);
+
+    pthread_mutex_lock(&adapters_lock);
+    for (slot = 0; (slot < ELM327_LOOPBACK_MAX) && adapters[slot]; ++slot)
+      ;
+    if (slot < ELM327_LOOPBACK_MAX)
+      adapters[slot] = lb;
+    pthread_mutex_unlock(&adapters_lock);
+
+    if (slot == ELM327_LOOPBACK_MAX)
+    {
+        loopback_free(lb);
+        errno = EMFILE;
+        return -1;
+    }
+
+    return ELM327_LOOPBACK_FD_BASE + slot;
+}
+
+
+int elm327_loopback_load(const char *path)
+{
+    elm327_loopback_entry_t *table = NULL;
+    FILE                    *fp;
+    char                     line[LOOPBACK_TEXT_MAX], *p, *end, *resp;
+    size_t                   n = 0, cap = 0, i;
+    int                      fd = -1, lineno = 0;
+
+    if (!(fp = fopen(path, "r")))
+      return -1;
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        ++lineno;
+        for (end = line + strlen(line); (end > line) && isspace((unsigned char)end[-1]); --end)
+          ;
+        *end = '\0';
+        for (p = line; isspace((unsigned char)*p); ++p)
+          ;
+        if (!*p || (*p == '#'))
+          continue;
+
+        for (resp = p; *resp && !isspace((unsigned char)*resp); ++resp)
+          ;
+        if (!*resp)
+        {
+            fprintf(stderr, "%s:%d: expected <request> <response>\n", path, lineno);
+            errno = EINVAL;
+            goto out;
+        }
+        *resp++ = '\0';
+        while (isspace((unsigned char)*resp))
+          ++resp;
+
+        if (n == cap)
+        {
+            elm327_loopback_entry_t *grown = realloc(table, (cap ? 2 * cap : 64) * sizeof(*table));
+
+            if (!grown)
+              goto out;
+            table = grown;
+            cap = cap ? 2 * cap : 64;
+        }
+        table[n].request = strdup(p);
+        table[n].response = strdup(resp);
+        if (!table[n].request || !table[n].response)
+        {
+            ++n;
+            goto out;
+        }
+        ++n;
+    }
+
+    fd = elm327_loopback_open(table, n);
+
+out:
+    fclose(fp);
+    for (i = 0; i < n; ++i)
+    {
+        free((char *)table[i].request);
+        free((char *)table[i].response);
+    }
+    free(table);
+
+    return fd;
+}
+
+
+void elm327_loopback_close(int fd)
+{
+    loopback_t *lb;
+
+    if (!(lb = loopback_get(fd)))
+      return;
+
+    pthread_mutex_lock(&adapters_lock);
+    adapters[fd - ELM327_LOOPBACK_FD_BASE] = NULL;
+    pthread_mutex_unlock(&adapters_lock);
+    loopback_free(lb);
+}
+
+
+static void put(loopback_t *lb, const char *s, size_t len)
+{
+    /* Unread output moves to the front before it would run out */
+    if (lb->tail + len > LOOPBACK_OUT_MAX)
+    {
+        memmove(lb->out, lb->out + lb->head, lb->tail - lb->head);
+        lb->tail -= lb->head;
+        lb->head = 0;
+    }
+    if (lb->tail + len > LOOPBACK_OUT_MAX)
+      len = LOOPBACK_OUT_MAX - lb->tail;   /* like a tty, a full buffer drops */
+
+    memcpy(lb->out + lb->tail, s, len);
+    lb->tail += len;
+}
+
+
+/* One complete command line */
+static void answer(loopback_t *lb)
+{
+    loopback_answer_t key, *a;
+    static const char ok[] = "OK\n\n>", unknown[] = "?\n\n>";
+
+    if (lb->echo)
+    {
+        put(lb, lb->line, lb->line_len);
+        put(lb, "\n", 1);
+    }
+
+    lb->line[lb->line_len] = '\0';
+    normalize(key.request, lb->line);
+    ++lb->requests;
+
+    if ((a = bsearch(&key, lb->answers, lb->n, sizeof(loopback_answer_t), by_request)))
+      put(lb, a->text, a->len);
+    else if (!strncmp(key.request, "AT", 2))
+    {
+        if (!strcmp(key.request, "ATE0") || !strcmp(key.request, "ATE1"))
+          lb->echo = key.request[3] == '1';
+        else if (!strcmp(key.request, "ATZ") || !strcmp(key.request, "ATWS"))
+          lb->echo = 1;
+        put(lb, ok, sizeof(ok) - 1);
+    }
+    else if (lb->fallback)
+      put(lb, lb->fallback->text, lb->fallback->len);
+    else
+      put(lb, unknown, sizeof(unknown) - 1);
+}
+
+
+ssize_t elm327_loopback_write(int fd, const void *buf, size_t len)
+{
+    loopback_t *lb;
+    const char *p = buf;
+    size_t      i;
+
+    if (!(lb = loopback_get(fd)))
+      return -1;
+
+    for (i = 0; i < len; ++i)
+    {
+        if (p[i] == '\r')
+        {
+            answer(lb);
+            lb->line_len = 0;
+        }
+        else if (lb->line_len < LOOPBACK_LINE_MAX - 1)
+          lb->line[lb->line_len++] = p[i];
+    }
+
+    return len;
+}
+
+
+ssize_t elm327_loopback_read(int fd, void *buf, size_t len)
+{
+    loopback_t *lb;
+
+    if (!(lb = loopback_get(fd)))
+      return -1;
+    if (lb->head == lb->tail)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (len > lb->tail - lb->head)
+      len = lb->tail - lb->head;
+    memcpy(buf, lb->out + lb->head, len);
+    lb->head += len;
+    if (lb->head == lb->tail)
+      lb->head = lb->tail = 0;
+
+    return len;
+}
+
+
+ssize_t elm327_loopback_pending(int fd)
+{
+    loopback_t *lb = loopback_get(fd);
+
+    return lb ? (ssize_t)(lb->tail - lb->head) : -1;
+}
+
+
+void elm327_loopback_flush(int fd)
+{
+    loopback_t *lb;
+
+    if (!(lb = loopback_get(fd)))
+      return;
+
+    lb->head = lb->tail = 0;
+    lb->line_len = 0;
+}
+
+
+uint64_t elm327_loopback_requests(int fd)
+{
+    loopback_t *lb = loopback_get(fd);
+
+    return lb ? lb->requests : 0;
+}
@@ -0,0 +1,71 @@
+#ifndef _ELM327LOOPBACK_H
+#define _ELM327LOOPBACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/* An adapter in memory, answering from a scripted response table.
+ *
+ * Benchmarks through a tty measure the kernel and the line discipline as
+ * much as the library.  A loopback adapter is a descriptor from
+ * ELM327_LOOPBACK_FD_BASE up (elm327.h); the adapter I/O of elm327.c tells it
+ * from a real one with a single compare and calls in here, so a transaction
+ * is a few function calls and copies, no system calls.  What comes back is
+ * what the tty would hand over: the echo (unless ATE0), the response lines
+ * ending in '\n', a blank line and the prompt.
+ *
+ * Tables are one request per line, the response lines separated by '|':
+ *
+ *   # request  response
+ *   010C       41 0C 1A F8
+ *   0902       014|0: 49 02 01 31 47 31|1: 4A 43 35 34 34 34 52|2: 37 32 35 32 33 36 37
+ *   *          NO DATA
+ *
+ * "*" answers everything else; without it requests not in the table get
+ * "?", AT commands "OK".  elm327_init("loopback:<table>") opens one.
+ */
+#define ELM327_LOOPBACK_MAX 16
+
+
+typedef struct _elm327_loopback_entry
+{
+    const char *request;    /* "010C", spaces and case do not matter */
+    const char *response;   /* lines separated by '|' */
+} elm327_loopback_entry_t;
+
+
+/* A loopback adapter answering from 'table' (copied).  Returns its
+ * descriptor, or -1 with errno set (EMFILE with ELM327_LOOPBACK_MAX open).
+ */
+extern int elm327_loopback_open(const elm327_loopback_entry_t *table, size_t n);
+
+
+/* The same from a table file */
+extern int elm327_loopback_load(const char *path);
+
+
+extern void elm327_loopback_close(int fd);
+
+
+/* read() and write() of the adapter, -1 with EBADF for a descriptor that is
+ * not open, EAGAIN when there is nothing to read
+ */
+extern ssize_t elm327_loopback_read(int fd, void *buf, size_t len);
+extern ssize_t elm327_loopback_write(int fd, const void *buf, size_t len);
+
+
+/* Bytes waiting to be read, -1 with EBADF */
+extern ssize_t elm327_loopback_pending(int fd);
+
+
+/* Drop what is waiting either way */
+extern void elm327_loopback_flush(int fd);
+
+
+/* Requests answered */
+extern uint64_t elm327_loopback_requests(int fd);
+
+
+#endif /* _ELM327LOOPBACK_H */
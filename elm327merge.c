@@ -0,0 +1,507 @@
+/*
+ * elm327merge.c
+ *
+ * K-way merge of per vehicle binary logs into one fleet store.
+ *
+ * The store is clustered by series: every (vehicle, channel) owns a run of
+ * consecutive blocks, in index order, so a reader of one series touches
+ * only its own blocks.  A first pass over the inputs counts the records of
+ * each series, which fixes where every run starts.  Every input segment is
+ * already in timestamp order (records are appended as they are sampled), so
+ * the second pass takes the oldest head record out of a binary min-heap of
+ * segment cursors and appends it to the block of its series, each series
+ * coming out in timestamp order.  Inputs are read strictly front to back
+ * through their mappings and pages that have been consumed are handed back
+ * to the kernel, so memory stays at one heap entry per segment plus the per
+ * series index and one block per series being written, however large the
+ * inputs are.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "elm327log.h"
+#include "elm327cmd.h"
+
+
+/* Release consumed input pages every this many blocks */
+#define MERGE_RELEASE_BLOCKS 256
+
+
+typedef struct _merge_cursor
+{
+    elm327_log_map_t           map;
+    const elm327_log_record_t *rec;       /* Current head record */
+    const elm327_log_record_t *end;
+    size_t                     released;  /* Blocks given back so far */
+    uint32_t                   vehicle;   /* From the header, if records lack it */
+    unsigned long              unordered;
+} merge_cursor_t;
+
+
+/* Where the second pass is in a series' run of blocks */
+typedef struct _merge_series
+{
+    elm327_log_record_t *block;       /* Allocated while the series is open */
+    size_t               n_buffered;
+    uint64_t             n_written;
+    uint64_t             next_block;
+} merge_series_t;
+
+
+typedef struct _merge_index
+{
+    elm327_log_index_entry_t *slots;
+    unsigned char            *used;
+    size_t                    cap;
+    size_t                    n_used;
+} merge_index_t;
+
+
+/* Vehicle of a record, logs from before it was stamped per record take it
+ * from their header
+ */
+static uint32_t cursor_vehicle(const merge_cursor_t *c, const elm327_log_record_t *rec)
+{
+    if ((rec->vehicle == 0) && (c->vehicle != ELM327_LOG_FLEET))
+      return c->vehicle;
+
+    return rec->vehicle;
+}
+
+
+/* Heap order: time, then vehicle and channel so output is deterministic */
+static int cursor_before(const merge_cursor_t *a, const merge_cursor_t *b)
+{
+    if (a->rec->timestamp_us != b->rec->timestamp_us)
+      return a->rec->timestamp_us < b->rec->timestamp_us;
+    if (a->rec->vehicle != b->rec->vehicle)
+      return a->rec->vehicle < b->rec->vehicle;
+
+    return a->rec->channel < b->rec->channel;
+}
+
+
+static void heap_down(merge_cursor_t **heap, size_t n, size_t i)
+{
+    size_t          child;
+    merge_cursor_t *tmp;
+
+    for (;;)
+    {
+        child = 2 * i + 1;
+        if (child >= n)
+          break;
+        if ((child + 1 < n) && cursor_before(heap[child + 1], heap[child]))
+          ++child;
+        if (!cursor_before(heap[child], heap[i]))
+          break;
+
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
+
+
+/* Step past padding, returns 0 once the segment is exhausted */
+static int cursor_skip_padding(merge_cursor_t *c)
+{
+    while ((c->rec < c->end) && (c->rec->timestamp_us == 0))
+      ++c->rec;
+
+    return c->rec < c->end;
+}
+
+
+static int cursor_advance(merge_cursor_t *c)
+{
+    uint64_t prev = c->rec->timestamp_us;
+    size_t   done;
+
+    ++c->rec;
+    if (!cursor_skip_padding(c))
+      return 0;
+
+    if (c->rec->timestamp_us < prev)
+      ++c->unordered;
+
+    /* Drop what we have read behind us, it will not be touched again */
+    done = (c->rec - c->map.records) / ELM327_LOG_BLOCK_RECORDS;
+    if (done >= c->released + MERGE_RELEASE_BLOCKS)
+    {
+        madvise((void *)elm327_log_map_block(&c->map, c->released),
+                (done - c->released) * ELM327_LOG_BLOCK_SIZE, MADV_DONTNEED);
+        c->released = done;
+    }
+
+    return 1;
+}
+
+
+static size_t index_hash(uint32_t vehicle, uint32_t channel, size_t cap)
+{
+    uint64_t key = ((uint64_t)vehicle << 32) | channel;
+
+    return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 40) & (cap - 1);
+}
+
+
+static int index_init(merge_index_t *idx, size_t cap)
+{
+    idx->slots = calloc(cap, sizeof(elm327_log_index_entry_t));
+    idx->used = calloc(cap, 1);
+    idx->cap = cap;
+    idx->n_used = 0;
+
+    return (idx->slots && idx->used) ? 0 : -1;
+}
+
+
+static elm327_log_index_entry_t *index_slot(merge_index_t *idx, uint32_t vehicle, uint32_t channel)
+{
+    merge_index_t             bigger;
+    elm327_log_index_entry_t *e;
+    size_t                    i;
+
+    if ((idx->n_used + 1) * 2 > idx->cap)
+    {
+        if (index_init(&bigger, idx->cap * 2) == -1)
+        {
+            free(bigger.slots);
+            free(bigger.used);
+            return NULL;
+        }
+        for (i=0; i<idx->cap; ++i)
+          if (idx->used[i])
+          {
+              e = index_slot(&bigger, idx->slots[i].vehicle, idx->slots[i].channel);
+              *e = idx->slots[i];
+          }
+        free(idx->slots);
+        free(idx->used);
+        *idx = bigger;
+    }
+
+    for (i = index_hash(vehicle, channel, idx->cap); idx->used[i];
+         i = (i + 1) & (idx->cap - 1))
+      if ((idx->slots[i].vehicle == vehicle) && (idx->slots[i].channel == channel))
+        return &idx->slots[i];
+
+    idx->used[i] = 1;
+    ++idx->n_used;
+    e = &idx->slots[i];
+    memset(e, 0, sizeof(elm327_log_index_entry_t));
+    e->vehicle = vehicle;
+    e->channel = channel;
+
+    return e;
+}
+
+
+/* Lookup only, never grows the table */
+static elm327_log_index_entry_t *index_find(merge_index_t *idx, uint32_t vehicle, uint32_t channel)
+{
+    size_t i;
+
+    for (i = index_hash(vehicle, channel, idx->cap); idx->used[i];
+         i = (i + 1) & (idx->cap - 1))
+      if ((idx->slots[i].vehicle == vehicle) && (idx->slots[i].channel == channel))
+        return &idx->slots[i];
+
+    return NULL;
+}
+
+
+static int entry_cmp(const void *a, const void *b)
+{
+    const elm327_log_index_entry_t *ea = a, *eb = b;
+
+    if (ea->vehicle != eb->vehicle)
+      return (ea->vehicle > eb->vehicle) - (ea->vehicle < eb->vehicle);
+
+    return (ea->channel > eb->channel) - (ea->channel < eb->channel);
+}
+
+
+static int entry_ptr_cmp(const void *a, const void *b)
+{
+    return entry_cmp(*(elm327_log_index_entry_t * const *)a, *(elm327_log_index_entry_t * const *)b);
+}
+
+
+/* Give every series its run of blocks, in index order */
+static int index_layout(merge_index_t *idx, merge_series_t *series)
+{
+    elm327_log_index_entry_t **order;
+    size_t                     i, n;
+    uint64_t                   block = 0;
+
+    if (!(order = malloc((idx->n_used ? idx->n_used : 1) * sizeof(elm327_log_index_entry_t *))))
+      return -1;
+    for (i=0, n=0; i<idx->cap; ++i)
+      if (idx->used[i])
+        order[n++] = &idx->slots[i];
+    qsort(order, n, sizeof(elm327_log_index_entry_t *), entry_ptr_cmp);
+
+    for (i=0; i<n; ++i)
+    {
+        order[i]->first_block = block;
+        block += (order[i]->count + ELM327_LOG_BLOCK_RECORDS - 1) / ELM327_LOG_BLOCK_RECORDS;
+        order[i]->last_block = block - 1;
+        series[order[i] - idx->slots].next_block = order[i]->first_block;
+    }
+    free(order);
+
+    return 0;
+}
+
+
+/* Write out the buffered block of a series at its place in the store */
+static int series_flush(merge_series_t *s, int fd)
+{
+    memset(s->block + s->n_buffered, 0,
+           (ELM327_LOG_BLOCK_RECORDS - s->n_buffered) * sizeof(elm327_log_record_t));
+    if (pwrite(fd, s->block, ELM327_LOG_BLOCK_SIZE,
+               (off_t)(s->next_block + 1) * ELM327_LOG_BLOCK_SIZE) != ELM327_LOG_BLOCK_SIZE)
+      return -1;
+    ++s->next_block;
+    s->n_buffered = 0;
+
+    return 0;
+}
+
+
+static int index_write(merge_index_t *idx, const char *store_path, uint64_t n_records)
+{
+    elm327_log_index_header_t hdr = {{0}};
+    char                     *path;
+    FILE                     *fp;
+    size_t                    i, n;
+    int                       err = 0;
+
+    /* Compact the table in place and sort by key */
+    for (i=0, n=0; i<idx->cap; ++i)
+      if (idx->used[i])
+        idx->slots[n++] = idx->slots[i];
+    qsort(idx->slots, n, sizeof(elm327_log_index_entry_t), entry_cmp);
+
+    if (!(path = malloc(strlen(store_path) + sizeof(ELM327_LOG_INDEX_SUFFIX))))
+      return -1;
+    sprintf(path, "%s%s", store_path, ELM327_LOG_INDEX_SUFFIX);
+
+    if (!(fp = fopen(path, "wb")))
+    {
+        free(path);
+        return -1;
+    }
+
+    memcpy(hdr.magic, ELM327_LOG_INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.version = ELM327_LOG_VERSION;
+    hdr.entry_size = sizeof(elm327_log_index_entry_t);
+    hdr.n_entries = n;
+    hdr.n_records = n_records;
+
+    if ((fwrite(&hdr, sizeof(hdr), 1, fp) != 1) ||
+        (n && (fwrite(idx->slots, sizeof(elm327_log_index_entry_t), n, fp) != n)))
+      err = -1;
+    if (fclose(fp) != 0)
+      err = -1;
+    free(path);
+
+    return err;
+}
+
+
+static void merge_usage(const char *prog)
+{
+    printf("Usage:\n");
+    printf("  %s merge -o <store> [--skip-bad] <log> [<log>...]\n", prog);
+    printf("Options:\n");
+    printf("  -o <string>  fleet store to write, its index goes to <store>%s\n",
+           ELM327_LOG_INDEX_SUFFIX);
+    printf("  --skip-bad   merge the other logs when one cannot be read (default: fail)\n");
+}
+
+
+int elm327_cmd_merge(int argc, char *argv[])
+{
+    int                       i, n_files, n_skipped = 0, err = 0, skip_bad = 0;
+    const char               *store_path = NULL;
+    merge_cursor_t           *cursors, **heap, *top;
+    size_t                    n_heap;
+    merge_index_t             idx;
+    merge_series_t           *series = NULL, *s;
+    elm327_log_index_entry_t *e;
+    const elm327_log_record_t *r;
+    elm327_log_record_t       rec;
+    elm327_log_t             *store = NULL;
+    uint64_t                  n_records = 0;
+    unsigned long             unordered = 0;
+    struct timespec           t0, t1;
+    double                    secs;
+
+    for (i=1; i<argc; ++i)
+    {
+        if (!strcmp(argv[i], "-o") && (i < argc-1))
+          store_path = argv[++i];
+        else if (!strcmp(argv[i], "--skip-bad"))
+          skip_bad = 1;
+        else
+          break;
+    }
+
+    if (!store_path || ((n_files = argc - i) <= 0))
+    {
+        merge_usage("elm327diag");
+        return 1;
+    }
+    argv += i;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    cursors = calloc(n_files, sizeof(merge_cursor_t));
+    heap = calloc(n_files, sizeof(merge_cursor_t *));
+    if (!cursors || !heap || (index_init(&idx, 1024) == -1))
+      return 1;
+
+    /* First pass: the size and time span of every series */
+    n_heap = 0;
+    for (i=0; i<n_files; ++i)
+    {
+        merge_cursor_t *c = &cursors[i];
+
+        /* A store missing a log must not pass for the whole fleet */
+        if (elm327_log_map(argv[i], &c->map) == -1)
+        {
+            fprintf(stderr, "%s: %s%s\n", argv[i], strerror(errno), skip_bad ? ", skipped" : "");
+            if (skip_bad)
+            {
+                ++n_skipped;
+                continue;
+            }
+            err = 1;
+            goto done;
+        }
+
+        c->rec = c->map.records;
+        c->end = c->map.records + c->map.n_blocks * ELM327_LOG_BLOCK_RECORDS;
+        c->vehicle = c->map.header->vehicle;
+
+        for (r = c->rec; r < c->end; ++r)
+        {
+            if (r->timestamp_us == 0)
+              continue;
+            if (!(e = index_slot(&idx, cursor_vehicle(c, r), r->channel)))
+            {
+                fprintf(stderr, "%s: index: %s\n", store_path, strerror(ENOMEM));
+                err = 1;
+                goto done;
+            }
+            if ((e->count++ == 0) || (r->timestamp_us < e->first_us))
+              e->first_us = r->timestamp_us;
+            if (r->timestamp_us > e->last_us)
+              e->last_us = r->timestamp_us;
+        }
+        madvise((void *)c->map.records, c->map.n_blocks * ELM327_LOG_BLOCK_SIZE, MADV_DONTNEED);
+
+        if (cursor_skip_padding(c))
+          heap[n_heap++] = c;
+    }
+
+    if (!(series = calloc(idx.cap, sizeof(merge_series_t))) || (index_layout(&idx, series) == -1))
+    {
+        fprintf(stderr, "%s: index: %s\n", store_path, strerror(ENOMEM));
+        err = 1;
+        goto done;
+    }
+
+    for (i = n_heap / 2; i >= 0; --i)
+      heap_down(heap, n_heap, i);
+
+    if (!(store = elm327_log_create(store_path, ELM327_LOG_FLEET)) || (fflush(store->fp) != 0))
+    {
+        fprintf(stderr, "%s: %s\n", store_path, strerror(errno));
+        elm327_log_close(store);
+        err = 1;
+        goto done;
+    }
+
+    while (n_heap > 0)
+    {
+        top = heap[0];
+        rec = *top->rec;
+        rec.vehicle = cursor_vehicle(top, top->rec);
+
+        /* Second pass: into the series' block, out when full or complete */
+        e = index_find(&idx, rec.vehicle, rec.channel);
+        s = &series[e - idx.slots];
+        if (!s->block && !(s->block = malloc(ELM327_LOG_BLOCK_SIZE)))
+        {
+            fprintf(stderr, "%s: %s\n", store_path, strerror(ENOMEM));
+            err = 1;
+            break;
+        }
+        s->block[s->n_buffered++] = rec;
+        ++s->n_written;
+        ++n_records;
+        if ((s->n_buffered == ELM327_LOG_BLOCK_RECORDS) || (s->n_written == e->count))
+        {
+            if (series_flush(s, fileno(store->fp)) == -1)
+            {
+                fprintf(stderr, "%s: %s\n", store_path, strerror(errno));
+                err = 1;
+                break;
+            }
+            if (s->n_written == e->count)
+            {
+                free(s->block);
+                s->block = NULL;
+            }
+        }
+
+        if (!cursor_advance(top))
+          heap[0] = heap[--n_heap];
+        heap_down(heap, n_heap, 0);
+    }
+
+    if (elm327_log_close(store) == -1)
+      err = 1;
+    if (!err && (index_write(&idx, store_path, n_records) == -1))
+    {
+        fprintf(stderr, "%s%s: %s\n", store_path, ELM327_LOG_INDEX_SUFFIX, strerror(errno));
+        err = 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    for (i=0; i<n_files; ++i)
+      unordered += cursors[i].unordered;
+    if (unordered)
+      fprintf(stderr, "warning: %lu records were out of order in their segment\n", unordered);
+
+    fprintf(stderr, "merged %llu records from %d logs into %zu series in %.3f s "
+            "(%.0f records/s)\n",
+            (unsigned long long)n_records, n_files - n_skipped, idx.n_used, secs,
+            secs > 0 ? n_records / secs : 0.0);
+
+done:
+    for (i=0; i<n_files; ++i)
+      elm327_log_unmap(&cursors[i].map);
+    free(cursors);
+    free(heap);
+    for (i=0; series && ((size_t)i<idx.cap); ++i)
+      free(series[i].block);
+    free(series);
+    free(idx.slots);
+    free(idx.used);
+
+    return err;
+}
@@ -0,0 +1,388 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "elm327buf.h"
+#include "elm327num.h"
+#include "elm327metrics.h"
+
+
+#define METRICS_MAX_SINKS   16
+#define METRICS_REQUEST_MAX 4096
+
+
+elm327_metrics_t elm327_metrics;
+
+
+struct _elm327_metrics_server
+{
+    int             fd;
+    int             is_http;
+    int             stop_pipe[2];
+    char           *unix_path;
+    const char     *names[256];      /* PID names, fixed after start */
+    elm327_sinks_t *sinks;
+    elm327_buf_t    out;
+    pthread_t       thread;
+};
+
+
+/*
+ * Exposition
+ */
+
+static void put(elm327_buf_t *b, const char *s)
+{
+    elm327_buf_append(b, s, strlen(s));
+}
+
+
+static void put_uint(elm327_buf_t *b, uint64_t v)
+{
+    char *w;
+
+    if ((w = elm327_buf_reserve(b, 24)))
+      elm327_buf_commit(b, elm327_fmt_uint(w, v));
+}
+
+
+/* Label values escape '\', '"' and newlines */
+static void put_label(elm327_buf_t *b, const char *s)
+{
+    for (; *s; ++s)
+    {
+        if ((*s == '\\') || (*s == '"'))
+          elm327_buf_append(b, "\\", 1);
+        if (*s == '\n')
+          put(b, "\\n");
+        else
+          elm327_buf_append(b, s, 1);
+    }
+}
+
+
+static void put_family(elm327_buf_t *b, const char *name, const char *type, const char *help)
+{
+    put(b, "# TYPE ");
+    put(b, name);
+    put(b, " ");
+    put(b, type);
+    put(b, "\n# HELP ");
+    put(b, name);
+    put(b, " ");
+    put(b, help);
+    put(b, "\n");
+}
+
+
+static void put_counter(elm327_buf_t *b, const char *name, const char *help, _Atomic uint64_t *v)
+{
+    put_family(b, name, "counter", help);
+    put(b, name);
+    put(b, "_total ");
+    put_uint(b, atomic_load_explicit(v, memory_order_relaxed));
+    put(b, "\n");
+}
+
+
+/* One sample per sink of the stats field at 'offset' */
+static void put_sink_metric(
+    elm327_buf_t              *b,
+    const char                *name,
+    const char                *type,
+    const char                *help,
+    const elm327_sink_stats_t *st,
+    int                        n,
+    size_t                     offset)
+{
+    int i;
+
+    put_family(b, name, type, help);
+    for (i = 0; i < n; ++i)
+    {
+        put(b, name);
+        if (!strcmp(type, "counter"))
+          put(b, "_total");
+        put(b, "{sink=\"");
+        put_label(b, st[i].spec);
+        put(b, "\"} ");
+        put_uint(b, *(const uint64_t *)((const char *)&st[i] + offset));
+        put(b, "\n");
+    }
+}
+
+
+static void metrics_render(elm327_metrics_server_t *srv, elm327_buf_t *b)
+{
+    elm327_sink_stats_t st[METRICS_MAX_SINKS];
+    char                pid[8];
+    int                 i, n;
+
+    put_counter(b, "elm327_adapter_requests", "Requests sent to the adapter.", &elm327_metrics.requests);
+    put_counter(b, "elm327_adapter_timeouts", "Requests the adapter did not answer in time.", &elm327_metrics.timeouts);
+    put_counter(b, "elm327_adapter_errors", "Requests that failed.", &elm327_metrics.errors);
+    put_counter(b, "elm327_adapter_reconnects", "Times the adapter was recovered.", &elm327_metrics.reconnects);
+    put_counter(b, "elm327_adapter_read_bytes", "Bytes read from the adapter.", &elm327_metrics.bytes_in);
+    put_counter(b, "elm327_adapter_written_bytes", "Bytes written to the adapter.", &elm327_metrics.bytes_out);
+    put_counter(b, "elm327_passes", "Completed passes over the PIDs.", &elm327_metrics.passes);
+
+    put_family(b, "elm327_samples", "counter", "Samples taken per PID.");
+    for (i = 0; i < 256; ++i)
+    {
+        if (!srv->names[i])
+          continue;
+        snprintf(pid, sizeof(pid), "0x%02X", i);
+        put(b, "elm327_samples_total{mode=\"01\",pid=\"");
+        put(b, pid);
+        put(b, "\",name=\"");
+        put_label(b, srv->names[i]);
+        put(b, "\"} ");
+        put_uint(b, atomic_load_explicit(&elm327_metrics.samples[i], memory_order_relaxed));
+        put(b, "\n");
+    }
+
+    if (srv->sinks)
+    {
+        n = elm327_sinks_stats(srv->sinks, st, METRICS_MAX_SINKS);
+        put_sink_metric(b, "elm327_sink_queued_bytes", "gauge", "Bytes waiting in the sink queue.",
+                        st, n, offsetof(elm327_sink_stats_t, queued));
+        put_sink_metric(b, "elm327_sink_capacity_bytes", "gauge", "Size of the sink queue.",
+                        st, n, offsetof(elm327_sink_stats_t, capacity));
+        put_sink_metric(b, "elm327_sink_written_bytes", "counter", "Bytes written by the sink.",
+                        st, n, offsetof(elm327_sink_stats_t, written));
+        put_sink_metric(b, "elm327_sink_dropped_batches", "counter", "Batches the sink dropped.",
+                        st, n, offsetof(elm327_sink_stats_t, dropped));
+    }
+
+    put(b, "# EOF\n");
+}
+
+
+/*
+ * Server
+ */
+
+static int write_all(int fd, const char *p, size_t n)
+{
+    ssize_t w;
+
+    while (n > 0)
+    {
+        if ((w = send(fd, p, n, MSG_NOSIGNAL)) == -1)
+        {
+            if (errno == EINTR)
+              continue;
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+
+    return 0;
+}
+
+
+static void metrics_client(elm327_metrics_server_t *srv, int fd)
+{
+    char           req[METRICS_REQUEST_MAX + 1], head[160];
+    size_t         len = 0;
+    ssize_t        r;
+    struct timeval tv = {1, 0};
+
+    if (srv->is_http)
+    {
+        /* Read the request head, the answer is the same for every path */
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        while (len < METRICS_REQUEST_MAX)
+        {
+            if ((r = recv(fd, req + len, METRICS_REQUEST_MAX - len, 0)) <= 0)
+              return;
+            len += r;
+            req[len] = '\0';
+            if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+              break;
+        }
+        if (strncmp(req, "GET ", 4))
+        {
+            put(&srv->out, "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\n\r\n");
+            write_all(fd, srv->out.data, srv->out.len);
+            elm327_buf_reset(&srv->out);
+            return;
+        }
+    }
+
+    metrics_render(srv, &srv->out);
+
+    if (srv->is_http)
+    {
+        snprintf(head, sizeof(head),
+                 "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                 "Content-Length: %zu\r\n\r\n", srv->out.len);
+        if (write_all(fd, head, strlen(head)) == -1)
+        {
+            elm327_buf_reset(&srv->out);
+            return;
+        }
+    }
+    write_all(fd, srv->out.data, srv->out.len);
+    elm327_buf_reset(&srv->out);
+}
+
+
+static void *metrics_serve(void *arg)
+{
+    elm327_metrics_server_t *srv = arg;
+    struct pollfd            pfd[2];
+    int                      fd;
+
+    pfd[0].fd = srv->fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = srv->stop_pipe[0];
+    pfd[1].events = POLLIN;
+
+    for (;;)
+    {
+        if (poll(pfd, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+              continue;
+            break;
+        }
+        if (pfd[1].revents)
+          break;
+        if (!(pfd[0].revents & POLLIN))
+          continue;
+
+        if ((fd = accept(srv->fd, NULL, NULL)) == -1)
+          continue;
+        metrics_client(srv, fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+
+static int metrics_listen(elm327_metrics_server_t *srv, const char *spec)
+{
+    struct sockaddr_un un;
+    struct sockaddr_in in;
+    const char        *port;
+    char              *end;
+    unsigned long      p;
+    int                one = 1;
+
+    if (!strncmp(spec, "unix:", 5))
+    {
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        if (strlen(spec + 5) >= sizeof(un.sun_path))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(un.sun_path, spec + 5);
+        if ((srv->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+          return -1;
+        unlink(un.sun_path);
+        if (bind(srv->fd, (struct sockaddr *)&un, sizeof(un)) == -1)
+          return -1;
+        srv->unix_path = strdup(un.sun_path);
+    }
+    else
+    {
+        port = strncmp(spec, "localhost:", 10) ? spec : spec + 10;
+        p = strtoul(port, &end, 10);
+        if (*end || (end == port) || (p == 0) || (p > 65535))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        memset(&in, 0, sizeof(in));
+        in.sin_family = AF_INET;
+        in.sin_port = htons(p);
+        in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if ((srv->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+          return -1;
+        setsockopt(srv->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(srv->fd, (struct sockaddr *)&in, sizeof(in)) == -1)
+          return -1;
+        srv->is_http = 1;
+    }
+
+    return listen(srv->fd, 8);
+}
+
+
+elm327_metrics_server_t *elm327_metrics_start(
+    const char          *spec,
+    const struct obdpid  o[OBDPID_TABLE_SIZE],
+    elm327_sinks_t      *sinks)
+{
+    elm327_metrics_server_t *srv;
+    int                      i;
+
+    if (!(srv = calloc(1, sizeof(elm327_metrics_server_t))))
+      return NULL;
+    srv->fd = srv->stop_pipe[0] = srv->stop_pipe[1] = -1;
+    srv->sinks = sinks;
+    for (i = 0; i < OBDPID_TABLE_SIZE; ++i)
+      if (o[i].bytes)
+        srv->names[o[i].command & 0xFF] = o[i].commandname;
+
+    if ((elm327_buf_init(&srv->out, 8192) == -1) ||
+        (metrics_listen(srv, spec) == -1) ||
+        (pipe(srv->stop_pipe) == -1) ||
+        (errno = pthread_create(&srv->thread, NULL, metrics_serve, srv)))
+    {
+        fprintf(stderr, "metrics %s: %s\n", spec, strerror(errno));
+        if (srv->fd != -1)
+          close(srv->fd);
+        if (srv->stop_pipe[0] != -1)
+        {
+            close(srv->stop_pipe[0]);
+            close(srv->stop_pipe[1]);
+        }
+        if (srv->unix_path)
+          unlink(srv->unix_path);
+        free(srv->unix_path);
+        elm327_buf_free(&srv->out);
+        free(srv);
+        return NULL;
+    }
+
+    return srv;
+}
+
+
+void elm327_metrics_stop(elm327_metrics_server_t *srv)
+{
+    if (!srv)
+      return;
+
+    (void)!write(srv->stop_pipe[1], "", 1);
+    pthread_join(srv->thread, NULL);
+
+    close(srv->fd);
+    close(srv->stop_pipe[0]);
+    close(srv->stop_pipe[1]);
+    if (srv->unix_path)
+    {
+        unlink(srv->unix_path);
+        free(srv->unix_path);
+    }
+    elm327_buf_free(&srv->out);
+    free(srv);
+}
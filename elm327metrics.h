@@ -0,0 +1,58 @@
+#ifndef _ELM327METRICS_H
+#define _ELM327METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "elm327pids.h"
+#include "elm327sink.h"
+
+
+/* Live counters, exported in OpenMetrics text format.
+ *
+ * The sampling path only does relaxed atomic adds on the global below, the
+ * endpoint reads them (and the sink queue mirrors) with atomic loads, so a
+ * scrape never takes a lock the sampling thread could be waiting on.
+ *
+ * The endpoint is given as
+ *
+ *   unix:<path>        the exposition is written to every connection
+ *   [localhost:]<port> HTTP on 127.0.0.1, any GET is answered
+ */
+typedef struct _elm327_metrics
+{
+    _Atomic uint64_t requests;          /* Sent to the adapter        */
+    _Atomic uint64_t timeouts;          /* No answer in time          */
+    _Atomic uint64_t errors;            /* Failed requests            */
+    _Atomic uint64_t reconnects;
+    _Atomic uint64_t bytes_in;          /* Read from the adapter      */
+    _Atomic uint64_t bytes_out;         /* Written to the adapter     */
+    _Atomic uint64_t passes;
+    _Atomic uint64_t samples[256];      /* Per Mode 01 PID            */
+} elm327_metrics_t;
+
+
+extern elm327_metrics_t elm327_metrics;
+
+
+#define ELM327_METRIC_ADD(_field, _n) \
+    atomic_fetch_add_explicit(&elm327_metrics._field, (_n), memory_order_relaxed)
+
+
+typedef struct _elm327_metrics_server elm327_metrics_server_t;
+
+
+/* Listen on 'spec' and serve from a thread of its own.  'o' names the PIDs,
+ * 'sinks' (may be NULL) must outlive the server.  Returns NULL on error (a
+ * message has been printed).
+ */
+extern elm327_metrics_server_t *elm327_metrics_start(
+    const char          *spec,
+    const struct obdpid  o[OBDPID_TABLE_SIZE],
+    elm327_sinks_t      *sinks);
+
+
+extern void elm327_metrics_stop(elm327_metrics_server_t *srv);
+
+
+#endif /* _ELM327METRICS_H */
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "elm327num.h"
+
+
+/* Powers of ten that are exact in a double */
+static const double pow10_exact[] =
+{
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+#define POW10_EXACT_MAX 22
+
+
+/* Hand the odd case to the C library, on a terminated copy */
+static const char *parse_double_slow(const char *p, const char *end, double *out)
+{
+    char  buf[64], *stop;
+    size_t len = end - p;
+
+    if (len >= sizeof(buf))
+      len = sizeof(buf) - 1;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+
+    *out = strtod(buf, &stop);
+    if (stop == buf)
+      return NULL;
+
+    return p + (stop - buf);
+}
+
+
+const char *elm327_parse_double(const char *p, const char *end, double *out)
+{
+    const char *start;
+    uint64_t    mant = 0;
+    int         neg = 0, digits = 0, exp10 = 0, e = 0, eneg = 0, any = 0;
+    double      v;
+
+    while ((p < end) && ((*p == ' ') || (*p == '\t')))
+      ++p;
+    start = p;
+
+    if ((p < end) && ((*p == '-') || (*p == '+')))
+      neg = (*p++ == '-');
+
+    /* Integer part; digits past what fits in 19 only move the exponent */
+    for (; (p < end) && (*p >= '0') && (*p <= '9'); ++p, any = 1)
+    {
+        if (digits < 19)
+        {
+            mant = mant * 10 + (*p - '0');
+            if (mant)
+              ++digits;
+        }
+        else
+          ++exp10;
+    }
+
+    if ((p < end) && (*p == '.'))
+    {
+        for (++p; (p < end) && (*p >= '0') && (*p <= '9'); ++p, any = 1)
+        {
+            if (digits < 19)
+            {
+                mant = mant * 10 + (*p - '0');
+                if (mant)
+                  ++digits;
+                --exp10;
+            }
+        }
+    }
+
+    if (!any)
+      return parse_double_slow(start, end, out);   /* "inf", "nan" */
+
+    if ((p < end) && ((*p == 'e') || (*p == 'E')))
+    {
+        const char *ep = p + 1;
+
+        if ((ep < end) && ((*ep == '-') || (*ep == '+')))
+          eneg = (*ep++ == '-');
+        if ((ep < end) && (*ep >= '0') && (*ep <= '9'))
+        {
+            for (; (ep < end) && (*ep >= '0') && (*ep <= '9'); ++ep)
+              if (e < 10000)
+                e = e * 10 + (*ep - '0');
+            exp10 += eneg ? -e : e;
+            p = ep;
+        }
+    }
+
+    /* Exact when the mantissa fits in 53 bits and the scale is exact */
+    if ((mant >> 53) || (exp10 > POW10_EXACT_MAX) || (exp10 < -POW10_EXACT_MAX))
+      return parse_double_slow(start, end, out);
+
+    v = (double)mant;
+    if (exp10 < 0)
+      v /= pow10_exact[-exp10];
+    else
+      v *= pow10_exact[exp10];
+
+    *out = neg ? -v : v;
+
+    return p;
+}
+
+
+/*
+ * Formatting
+ */
+
+/* "00".."99", two digits per table lookup halves the divisions */
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+
+/* Write exactly 'width' digits of 'v' (zero padded) */
+static char *fmt_uint_width(char *o, uint64_t v, int width)
+{
+    char *end = o + width, *p = end;
+
+    while (width >= 2)
+    {
+        p -= 2;
+        memcpy(p, &digit_pairs[(v % 100) * 2], 2);
+        v /= 100;
+        width -= 2;
+    }
+    if (width)
+      *--p = '0' + (v % 10);
+
+    return end;
+}
+
+
+char *elm327_fmt_uint(char *o, uint64_t v)
+{
+    char  tmp[20];
+    char *p = tmp + sizeof(tmp);
+    size_t n;
+
+    while (v >= 100)
+    {
+        p -= 2;
+        memcpy(p, &digit_pairs[(v % 100) * 2], 2);
+        v /= 100;
+    }
+    if (v >= 10)
+    {
+        p -= 2;
+        memcpy(p, &digit_pairs[v * 2], 2);
+    }
+    else
+      *--p = '0' + v;
+
+    n = tmp + sizeof(tmp) - p;
+    memcpy(o, p, n);
+
+    return o + n;
+}
+
+
+char *elm327_fmt_int(char *o, int64_t v)
+{
+    if (v < 0)
+    {
+        *o++ = '-';
+        return elm327_fmt_uint(o, -(uint64_t)v);
+    }
+
+    return elm327_fmt_uint(o, v);
+}
+
+
+char *elm327_fmt_fixed(char *o, double v, int decimals)
+{
+    double   a, ip, frac, scaled, err, fl, rem;
+    uint64_t whole, part, scale;
+    int      up;
+
+    if ((decimals < 0) || (decimals > 9))
+      decimals = 6;
+
+    a = fabs(v);
+    if (!isfinite(v) || (a >= 9007199254740992.0))
+      return o + snprintf(o, ELM327_FMT_MAX, "%.*f", decimals, v);
+
+    ip = floor(a);
+    frac = a - ip;                              /* Exact */
+    scaled = frac * pow10_exact[decimals];
+    err = fma(frac, pow10_exact[decimals], -scaled);   /* scaled + err is exact */
+    fl = floor(scaled);
+    rem = scaled - fl;                          /* Exact, scaled < 2^30 */
+
+    if (rem > 0.5)
+      up = 1;
+    else if (rem < 0.5)
+      up = 0;
+    else if (err != 0)
+      up = (err > 0);
+    else                                        /* Tie, round to even */
+      up = decimals ? ((uint64_t)fl & 1) : ((uint64_t)ip & 1);
+
+    whole = (uint64_t)ip;
+    part = (uint64_t)fl + up;
+    scale = (uint64_t)pow10_exact[decimals];
+    if (part >= scale)
+    {
+        part -= scale;
+        ++whole;
+    }
+
+    if (signbit(v))
+      *o++ = '-';
+    o = elm327_fmt_uint(o, whole);
+    if (decimals)
+    {
+        *o++ = '.';
+        o = fmt_uint_width(o, part, decimals);
+    }
+
+    return o;
+}
@@ -0,0 +1,40 @@
+#ifndef _ELM327NUM_H
+#define _ELM327NUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Locale independent number parsing for the text formats we read back.
+ *
+ * Parse a decimal floating point number ("-12.5", "3e4", "0.000123") from
+ * [p, end).  Leading blanks are skipped.  Returns a pointer just past the
+ * number, or NULL if there is no number at 'p'.  Up to 19 significant digits
+ * with a small exponent are converted exactly with one multiply or divide,
+ * anything else falls back to strtod().
+ */
+extern const char *elm327_parse_double(const char *p, const char *end, double *out);
+
+
+/* Locale independent formatting into caller provided memory.  Each returns a
+ * pointer just past the last character written, nothing is terminated.
+ */
+
+/* Worst case length of any single formatted number */
+#define ELM327_FMT_MAX 352
+
+
+/* Decimal integers */
+extern char *elm327_fmt_uint(char *o, uint64_t v);
+extern char *elm327_fmt_int(char *o, int64_t v);
+
+
+/* Fixed point with 'decimals' (0-9) digits after the point.  The result is
+ * identical to printf("%.*f"), including round half to even on exact ties
+ * and "-0.000000", but without the locale and varargs machinery.  Values
+ * beyond 2^53 and non finite values are passed on to snprintf().
+ */
+extern char *elm327_fmt_fixed(char *o, double v, int decimals);
+
+
+#endif /* _ELM327NUM_H */
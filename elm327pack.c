@@ -0,0 +1,655 @@
+/*
+ * elm327pack.c
+ *
+ * PID packs (elm327pack.h) and their compiler, "elm327diag pack".  The
+ * definitions are text, one channel per line:
+ *
+ *   # comment
+ *   wmi WDB WDD WDC
+ *   # mode  id    bytes  scale   offset  unit  name
+ *   01      0C    2      0.25    0       rpm   Engine speed
+ *   22      1940  2s     0.1     -40     C     Transmission fluid temperature
+ *
+ * mode and id are hex, a trailing 's' on bytes (1 to 4) makes the raw value
+ * two's complement.  "wmi" lines name the manufacturers the pack is for.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "elm327pack.h"
+#include "elm327cmd.h"
+
+
+/* Keys per bucket and slots per key, load 0.8 keeps the search short */
+#define PACK_KEYS_PER_BUCKET   4
+#define PACK_MAX_DISPLACEMENT  (1u << 20)
+#define PACK_MAX_SEEDS         64
+#define PACK_LINE_MAX          512
+
+
+struct _elm327_pack
+{
+    const unsigned char        *base;
+    size_t                      size;
+    const elm327_pack_header_t *header;
+    const uint32_t             *displace;
+    const elm327_pack_entry_t  *slots;
+    const char                 *strings;
+};
+
+
+static inline uint32_t pack_hash(uint32_t key, uint32_t seed)
+{
+    uint32_t h = key ^ (seed * 0x9E3779B9u);
+
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+
+    return h;
+}
+
+
+elm327_pack_t *elm327_pack_open(const char *path)
+{
+    elm327_pack_t              *pack;
+    const elm327_pack_header_t *h;
+    struct stat                 st;
+    void                       *base;
+    int                         fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+      return NULL;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size < sizeof(elm327_pack_header_t))
+    {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+      return NULL;
+
+    /* Only the header is checked, the entries are trusted as far as they
+     * point into the file (elm327_pack_string())
+     */
+    h = base;
+    if (memcmp(h->magic, ELM327_PACK_MAGIC, sizeof(h->magic)) ||
+        (h->version != ELM327_PACK_VERSION) ||
+        !h->n_buckets || !h->n_slots || (h->n_wmi > ELM327_PACK_MAX_WMI) ||
+        (h->off_displace + (uint64_t)h->n_buckets * sizeof(uint32_t) > (uint64_t)st.st_size) ||
+        (h->off_slots + (uint64_t)h->n_slots * sizeof(elm327_pack_entry_t) > (uint64_t)st.st_size) ||
+        (h->off_slots % sizeof(uint64_t)) || (h->off_displace % sizeof(uint32_t)) ||
+        !h->strings_size || (h->off_strings + h->strings_size > (uint64_t)st.st_size) ||
+        ((const char *)base)[h->off_strings + h->strings_size - 1])
+    {
+        munmap(base, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (!(pack = calloc(1, sizeof(elm327_pack_t))))
+    {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    pack->base = base;
+    pack->size = st.st_size;
+    pack->header = h;
+    pack->displace = (const uint32_t *)(pack->base + h->off_displace);
+    pack->slots = (const elm327_pack_entry_t *)(pack->base + h->off_slots);
+    pack->strings = (const char *)(pack->base + h->off_strings);
+
+    return pack;
+}
+
+
+elm327_pack_t *elm327_pack_select(const char *dir, const char *vin)
+{
+    elm327_pack_t *pack;
+    char           path[4096];
+    int            i;
+
+    if (vin && (strlen(vin) >= 3))
+    {
+        snprintf(path, sizeof(path), "%s/%c%c%c.pack", dir,
+                 toupper((unsigned char)vin[0]), toupper((unsigned char)vin[1]),
+                 toupper((unsigned char)vin[2]));
+        if ((pack = elm327_pack_open(path)))
+        {
+            /* The file name is only a shortcut, the pack has the last word */
+            for (i = 0; i < (int)pack->header->n_wmi; ++i)
+              if (!strncasecmp(pack->header->wmi[i], vin, 3))
+                return pack;
+            elm327_pack_close(pack);
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/default.pack", dir);
+
+    return elm327_pack_open(path);
+}
+
+
+const elm327_pack_entry_t *elm327_pack_lookup(const elm327_pack_t *pack, unsigned int mode, unsigned int id)
+{
+    const elm327_pack_header_t *h = pack->header;
+    const elm327_pack_entry_t  *e;
+    uint32_t                    key = (mode & 0xFF) << 16 | (id & 0xFFFF);
+
+    e = &pack->slots[pack_hash(key, pack->displace[pack_hash(key, h->seed) % h->n_buckets]) % h->n_slots];
+
+    return (e->key == key) ? e : NULL;
+}
+
+
+const char *elm327_pack_string(const elm327_pack_t *pack, uint32_t offset)
+{
+    return (offset < pack->header->strings_size) ? pack->strings + offset : "";
+}
+
+
+double elm327_pack_decode(const elm327_pack_entry_t *e, const unsigned char *data, int len)
+{
+    int64_t raw = 0;
+    int     i, n = (e->bytes < len) ? e->bytes : len;
+
+    for (i = 0; i < n; ++i)
+      raw = (raw << 8) | data[i];
+    if ((e->flags & ELM327_PACK_SIGNED) && n && (raw & ((int64_t)1 << (8 * n - 1))))
+      raw -= (int64_t)1 << (8 * n);
+
+    return raw * e->scale + e->offset;
+}
+
+
+const elm327_pack_header_t *elm327_pack_header(const elm327_pack_t *pack)
+{
+    return pack->header;
+}
+
+
+void elm327_pack_close(elm327_pack_t *pack)
+{
+    if (!pack)
+      return;
+
+    munmap((void *)pack->base, pack->size);
+    free(pack);
+}
+
+
+/*
+ * The compiler
+ */
+
+typedef struct _pack_def
+{
+    elm327_pack_entry_t entry;
+    char                unit[16];
+    char               *name;
+    int                 line;
+} pack_def_t;
+
+
+typedef struct _pack_source
+{
+    pack_def_t *defs;
+    size_t      n, cap;
+    char        wmi[ELM327_PACK_MAX_WMI][4];
+    int         n_wmi;
+} pack_source_t;
+
+
+static int by_key(const void *a, const void *b)
+{
+    uint32_t ka = ((const pack_def_t *)a)->entry.key, kb = ((const pack_def_t *)b)->entry.key;
+
+    return (ka > kb) - (ka < kb);
+}
+
+
+static void pack_usage(const char *prog)
+{
+    printf("Usage:\n");
+    printf("  %s pack [-o <file> | -d <dir>] <definitions>\n", prog);
+    printf("Options:\n");
+    printf("  -o <file>    write the pack here (default: <definitions>.pack)\n");
+    printf("  -d <dir>     write <dir>/<WMI>.pack and link it for the other WMIs\n");
+}
+
+
+static int pack_parse(pack_source_t *src, const char *path)
+{
+    FILE       *fp;
+    char        line[PACK_LINE_MAX], bytes[8], *p, *end;
+    unsigned    mode, id;
+    int         lineno = 0, n, i;
+    pack_def_t *d;
+    size_t      k;
+
+    if (!(fp = fopen(path, "r")))
+      return -1;
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        ++lineno;
+        for (end = line + strlen(line); (end > line) && isspace((unsigned char)end[-1]); --end)
+          ;
+        *end = '\0';
+        for (p = line; isspace((unsigned char)*p); ++p)
+          ;
+        if (!*p || (*p == '#'))
+          continue;
+
+        if (!strncmp(p, "wmi", 3) && isspace((unsigned char)p[3]))
+        {
+            for (p = strtok(p + 3, " \t"); p; p = strtok(NULL, " \t"))
+            {
+                if ((strlen(p) != 3) || (src->n_wmi == ELM327_PACK_MAX_WMI))
+                {
+                    fprintf(stderr, "%s:%d: bad WMI '%s' (three characters, at most %d)\n",
+                            path, lineno, p, ELM327_PACK_MAX_WMI);
+                    fclose(fp);
+                    errno = EINVAL;
+                    return -1;
+                }
+                for (i = 0; i < 3; ++i)
+                  src->wmi[src->n_wmi][i] = toupper((unsigned char)p[i]);
+                ++src->n_wmi;
+            }
+            continue;
+        }
+
+        if (src->n == src->cap)
+        {
+            pack_def_t *grown = realloc(src->defs, (src->cap ? 2 * src->cap : 256) * sizeof(pack_def_t));
+
+            if (!grown)
+            {
+                fclose(fp);
+                return -1;
+            }
+            src->defs = grown;
+            src->cap = src->cap ? 2 * src->cap : 256;
+        }
+        d = &src->defs[src->n];
+        memset(d, 0, sizeof(*d));
+
+        if ((sscanf(p, "%x %x %7s %lf %lf %15s %n", &mode, &id, bytes, &d->entry.scale,
+                    &d->entry.offset, d->unit, &n) != 6) || !p[n] ||
+            (mode > 0xFF) || (id > 0xFFFF) || (bytes[0] < '1') || (bytes[0] > '4') ||
+            (bytes[1] && strcmp(bytes + 1, "s")))
+        {
+            fprintf(stderr, "%s:%d: expected <mode> <id> <bytes>[s] <scale> <offset> <unit> <name>\n",
+                    path, lineno);
+            fclose(fp);
+            errno = EINVAL;
+            return -1;
+        }
+        d->entry.key = mode << 16 | id;
+        d->entry.bytes = bytes[0] - '0';
+        d->entry.flags = bytes[1] ? ELM327_PACK_SIGNED : 0;
+        if (!(d->name = strdup(p + n)))
+        {
+            fclose(fp);
+            return -1;
+        }
+
+        d->line = lineno;
+        ++src->n;
+    }
+    fclose(fp);
+
+    qsort(src->defs, src->n, sizeof(pack_def_t), by_key);
+    for (k = 1; k < src->n; ++k)
+      if (src->defs[k].entry.key == src->defs[k-1].entry.key)
+      {
+          fprintf(stderr, "%s:%d: %02X %04X defined before, on line %d\n", path,
+                  (src->defs[k].line > src->defs[k-1].line) ? src->defs[k].line : src->defs[k-1].line,
+                  src->defs[k].entry.key >> 16, src->defs[k].entry.key & 0xFFFF,
+                  (src->defs[k].line < src->defs[k-1].line) ? src->defs[k].line : src->defs[k-1].line);
+          errno = EINVAL;
+          return -1;
+      }
+
+    return 0;
+}
+
+
+static const uint32_t *bucket_sizes;
+
+static int by_bucket_size(const void *a, const void *b)
+{
+    uint32_t sa = bucket_sizes[*(const uint32_t *)a], sb = bucket_sizes[*(const uint32_t *)b];
+
+    return (sa < sb) - (sa > sb);
+}
+
+
+/* Hash and displace: the biggest buckets first, each gets the first
+ * displacement that puts all its keys on free slots.  Fills 'displace' and
+ * 'slot_of' (slot of every definition).  Returns 0, or -1 when no seed
+ * works.
+ */
+static int pack_build(
+    const pack_source_t *src,
+    uint32_t             n_buckets,
+    uint32_t             n_slots,
+    uint32_t            *seed,
+    uint32_t            *displace,
+    uint32_t            *slot_of)
+{
+    uint32_t      *size, *start, *members, *order, *fill, *slots;
+    unsigned char *used;
+    uint32_t       b, d, i, k, s;
+    int            ok = 0;
+
+    size = calloc(n_buckets, sizeof(uint32_t));
+    start = calloc(n_buckets + 1, sizeof(uint32_t));
+    fill = calloc(n_buckets, sizeof(uint32_t));
+    order = calloc(n_buckets, sizeof(uint32_t));
+    members = calloc(src->n + 1, sizeof(uint32_t));
+    slots = calloc(PACK_KEYS_PER_BUCKET * 8 + src->n, sizeof(uint32_t));
+    used = calloc(n_slots, 1);
+    if (!size || !start || !fill || !order || !members || !slots || !used)
+      goto out;
+
+    for (*seed = 1; (*seed <= PACK_MAX_SEEDS) && !ok; ++*seed)
+    {
+        memset(size, 0, n_buckets * sizeof(uint32_t));
+        memset(fill, 0, n_buckets * sizeof(uint32_t));
+        memset(used, 0, n_slots);
+
+        for (i = 0; i < src->n; ++i)
+          ++size[pack_hash(src->defs[i].entry.key, *seed) % n_buckets];
+        for (b = 0; b < n_buckets; ++b)
+        {
+            start[b + 1] = start[b] + size[b];
+            order[b] = b;
+        }
+        for (i = 0; i < src->n; ++i)
+        {
+            b = pack_hash(src->defs[i].entry.key, *seed) % n_buckets;
+            members[start[b] + fill[b]++] = i;
+        }
+        bucket_sizes = size;
+        qsort(order, n_buckets, sizeof(uint32_t), by_bucket_size);
+
+        ok = 1;
+        for (k = 0; (k < n_buckets) && ok && size[order[k]]; ++k)
+        {
+            b = order[k];
+            for (d = 0; d < PACK_MAX_DISPLACEMENT; ++d)
+            {
+                for (i = 0; i < size[b]; ++i)
+                {
+                    slots[i] = pack_hash(src->defs[members[start[b] + i]].entry.key, d) % n_slots;
+                    if (used[slots[i]])
+                      break;
+                    for (s = 0; (s < i) && (slots[s] != slots[i]); ++s)
+                      ;
+                    if (s < i)
+                      break;
+                }
+                if (i == size[b])
+                  break;
+            }
+            if (d == PACK_MAX_DISPLACEMENT)
+            {
+                ok = 0;
+                break;
+            }
+
+            displace[b] = d;
+            for (i = 0; i < size[b]; ++i)
+            {
+                used[slots[i]] = 1;
+                slot_of[members[start[b] + i]] = slots[i];
+            }
+        }
+        for (; ok && (k < n_buckets); ++k)
+          displace[order[k]] = 0;
+    }
+    --*seed;
+
+out:
+    free(size);
+    free(start);
+    free(fill);
+    free(order);
+    free(members);
+    free(slots);
+    free(used);
+
+    return ok ? 0 : -1;
+}
+
+
+static int pack_write(const pack_source_t *src, const char *path, size_t *written)
+{
+    elm327_pack_header_t  h;
+    elm327_pack_entry_t  *slots = NULL;
+    uint32_t             *displace = NULL, *slot_of = NULL, seed, i;
+    char                 *pool = NULL, tmp[4096];
+    size_t                pool_size = 1, pool_cap = 4096, len;
+    FILE                 *fp = NULL;
+    int                   status = -1;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, ELM327_PACK_MAGIC, sizeof(h.magic));
+    h.version = ELM327_PACK_VERSION;
+    h.n_entries = src->n;
+    h.n_buckets = src->n / PACK_KEYS_PER_BUCKET + 1;
+    h.n_slots = src->n + src->n / 4 + 1;
+    h.n_wmi = src->n_wmi;
+    memcpy(h.wmi, src->wmi, sizeof(h.wmi));
+
+    displace = calloc(h.n_buckets, sizeof(uint32_t));
+    slot_of = calloc(src->n + 1, sizeof(uint32_t));
+    slots = malloc(h.n_slots * sizeof(elm327_pack_entry_t));
+    pool = calloc(pool_cap, 1);
+    if (!displace || !slot_of || !slots || !pool)
+      goto out;
+
+    if (pack_build(src, h.n_buckets, h.n_slots, &seed, displace, slot_of) == -1)
+    {
+        errno = EDEADLK;
+        goto out;
+    }
+    h.seed = seed;
+
+    for (i = 0; i < h.n_slots; ++i)
+    {
+        memset(&slots[i], 0, sizeof(elm327_pack_entry_t));
+        slots[i].key = ELM327_PACK_EMPTY;
+    }
+
+    /* Offset 0 of the pool is "", names and units follow */
+    for (i = 0; i < src->n; ++i)
+    {
+        elm327_pack_entry_t *e = &slots[slot_of[i]];
+        const char          *str[2] = { src->defs[i].unit, src->defs[i].name };
+        uint32_t            *off[2] = { &e->unit, &e->name };
+        int                  k;
+
+        *e = src->defs[i].entry;
+        for (k = 0; k < 2; ++k)
+        {
+            len = strlen(str[k]) + 1;
+            while (pool_size + len > pool_cap)
+            {
+                char *grown = realloc(pool, 2 * pool_cap);
+
+                if (!grown)
+                  goto out;
+                pool = grown;
+                pool_cap *= 2;
+            }
+            memcpy(pool + pool_size, str[k], len);
+            *off[k] = pool_size;
+            pool_size += len;
+        }
+    }
+
+    h.off_displace = sizeof(h);
+    h.off_slots = (h.off_displace + h.n_buckets * sizeof(uint32_t) + 7) & ~(uint64_t)7;
+    h.off_strings = h.off_slots + (uint64_t)h.n_slots * sizeof(elm327_pack_entry_t);
+    h.strings_size = pool_size;
+
+    /* Written aside and renamed, a process mapping the old pack keeps it */
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (!(fp = fopen(tmp, "wb")))
+      goto out;
+    fwrite(&h, sizeof(h), 1, fp);
+    fwrite(displace, sizeof(uint32_t), h.n_buckets, fp);
+    for (len = h.off_displace + h.n_buckets * sizeof(uint32_t); len < h.off_slots; ++len)
+      fputc(0, fp);
+    fwrite(slots, sizeof(elm327_pack_entry_t), h.n_slots, fp);
+    fwrite(pool, 1, pool_size, fp);
+    if (ferror(fp) | fclose(fp))
+    {
+        fp = NULL;
+        unlink(tmp);
+        goto out;
+    }
+    fp = NULL;
+    if (rename(tmp, path) == -1)
+    {
+        unlink(tmp);
+        goto out;
+    }
+
+    *written = h.off_strings + pool_size;
+    status = 0;
+
+out:
+    if (fp)
+      fclose(fp);
+    free(displace);
+    free(slot_of);
+    free(slots);
+    free(pool);
+
+    return status;
+}
+
+
+/* Every definition must come back from the written pack */
+static int pack_verify(const pack_source_t *src, const char *path)
+{
+    elm327_pack_t             *pack;
+    const elm327_pack_entry_t *e;
+    size_t                     i;
+    int                        bad = 0;
+
+    if (!(pack = elm327_pack_open(path)))
+      return -1;
+    for (i = 0; i < src->n; ++i)
+    {
+        e = elm327_pack_lookup(pack, src->defs[i].entry.key >> 16, src->defs[i].entry.key & 0xFFFF);
+        if (!e || strcmp(elm327_pack_string(pack, e->name), src->defs[i].name))
+          ++bad;
+    }
+    elm327_pack_close(pack);
+
+    if (bad)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int elm327_cmd_pack(int argc, char *argv[])
+{
+    pack_source_t   src;
+    const char     *input = NULL, *output = NULL, *dir = NULL;
+    char            path[4096], link[4096], name[16];
+    struct timespec t0, t1;
+    size_t          written, i;
+    int             k, status = 1;
+
+    for (k = 1; k < argc; ++k)
+    {
+        if (!strcmp(argv[k], "-o") && (k < argc-1))
+          output = argv[++k];
+        else if (!strcmp(argv[k], "-d") && (k < argc-1))
+          dir = argv[++k];
+        else if ((argv[k][0] != '-') && !input)
+          input = argv[k];
+        else
+        {
+            pack_usage("elm327diag");
+            return 1;
+        }
+    }
+    if (!input || (output && dir))
+    {
+        pack_usage("elm327diag");
+        return 1;
+    }
+
+    memset(&src, 0, sizeof(src));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (pack_parse(&src, input) == -1)
+    {
+        fprintf(stderr, "%s: %s\n", input, strerror(errno));
+        goto out;
+    }
+
+    if (dir)
+      snprintf(path, sizeof(path), "%s/%s.pack", dir, src.n_wmi ? src.wmi[0] : "default");
+    else if (output)
+      snprintf(path, sizeof(path), "%s", output);
+    else
+      snprintf(path, sizeof(path), "%s.pack", input);
+
+    if ((pack_write(&src, path, &written) == -1) || (pack_verify(&src, path) == -1))
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        goto out;
+    }
+
+    /* The other WMIs find the same pack by name */
+    for (k = 1; dir && (k < src.n_wmi); ++k)
+    {
+        snprintf(name, sizeof(name), "%s.pack", src.wmi[0]);
+        snprintf(link, sizeof(link), "%s/%s.pack", dir, src.wmi[k]);
+        unlink(link);
+        if (symlink(name, link) == -1)
+          fprintf(stderr, "%s: %s\n", link, strerror(errno));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    printf("%zu definitions, %u slots, %zu bytes to %s in %.3f s\n", src.n,
+           (unsigned)(src.n + src.n / 4 + 1), written, path,
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    status = 0;
+
+out:
+    for (i = 0; i < src.n; ++i)
+      free(src.defs[i].name);
+    free(src.defs);
+
+    return status;
+}
@@ -0,0 +1,97 @@
+#ifndef _ELM327PACK_H
+#define _ELM327PACK_H
+
+#include <stdint.h>
+
+
+/* PID packs: compiled channel definitions, memory mapped.
+ *
+ * Manufacturer channels (Mode 22 DIDs, Mode 01 overrides) are written as
+ * text and compiled offline ("elm327diag pack") into a pack:
+ *
+ *   header          magic, counts, the WMIs the pack is for, offsets
+ *   displacements   uint32_t per bucket
+ *   slots           elm327_pack_entry_t per slot, free ones ELM327_PACK_EMPTY
+ *   string pool     units and names, NUL terminated
+ *
+ * The index is a hash and displace perfect hash: the key (mode << 16 | id)
+ * picks a bucket, the bucket's displacement picks the slot.  A lookup is two
+ * hashes and one compare, opening a pack is an mmap and a header check, both
+ * whatever the number of definitions.
+ */
+#define ELM327_PACK_MAGIC    "ELM327PK"
+#define ELM327_PACK_VERSION  1
+#define ELM327_PACK_MAX_WMI  16
+#define ELM327_PACK_EMPTY    0xFFFFFFFFu
+
+/* Entry flags */
+#define ELM327_PACK_SIGNED   0x01
+
+
+typedef struct _elm327_pack_header
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t n_entries;
+    uint32_t n_buckets;
+    uint32_t n_slots;
+    uint32_t seed;
+    uint32_t n_wmi;
+    char     wmi[ELM327_PACK_MAX_WMI][4];
+    uint64_t off_displace;
+    uint64_t off_slots;
+    uint64_t off_strings;
+    uint64_t strings_size;
+} elm327_pack_header_t;
+
+
+/* value = raw * scale + offset, raw the first 'bytes' data bytes of the
+ * answer, most significant first
+ */
+typedef struct _elm327_pack_entry
+{
+    uint32_t key;
+    uint8_t  bytes;
+    uint8_t  flags;
+    uint16_t reserved;
+    uint32_t unit;      /* string pool offsets */
+    uint32_t name;
+    double   scale;
+    double   offset;
+} elm327_pack_entry_t;
+
+
+typedef struct _elm327_pack elm327_pack_t;
+
+
+/* Map a pack.  NULL on error with errno set (EINVAL for a file that is not
+ * a pack of this version).
+ */
+extern elm327_pack_t *elm327_pack_open(const char *path);
+
+
+/* The pack for a vehicle: <dir>/<WMI>.pack for the first three characters
+ * of 'vin', else <dir>/default.pack.  NULL with errno ENOENT when neither
+ * exists.
+ */
+extern elm327_pack_t *elm327_pack_select(const char *dir, const char *vin);
+
+
+extern const elm327_pack_entry_t *elm327_pack_lookup(const elm327_pack_t *pack, unsigned int mode, unsigned int id);
+
+
+/* A string of the pool, "" for an offset outside it */
+extern const char *elm327_pack_string(const elm327_pack_t *pack, uint32_t offset);
+
+
+/* Decode the data bytes of an answer (after mode and id) */
+extern double elm327_pack_decode(const elm327_pack_entry_t *e, const unsigned char *data, int len);
+
+
+extern const elm327_pack_header_t *elm327_pack_header(const elm327_pack_t *pack);
+
+
+extern void elm327_pack_close(elm327_pack_t *pack);
+
+
+#endif /* _ELM327PACK_H */
@@ -0,0 +1,109 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "elm327perf.h"
+
+
+const char *elm327_perf_names[ELM327_PERF_N_COUNTERS] =
+{
+    "cycles", "instructions", "cache-misses", "ctx-switches"
+};
+
+
+static const struct
+{
+    uint32_t type;
+    uint64_t config;
+} perf_events[ELM327_PERF_N_COUNTERS] =
+{
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+
+int elm327_perf_open(elm327_perf_t *perf)
+{
+    struct perf_event_attr attr;
+    int                    i, n = 0;
+
+    for (i = 0; i < ELM327_PERF_N_COUNTERS; ++i)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        /* This thread, any cpu */
+        perf->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (perf->fd[i] != -1)
+          ++n;
+    }
+
+    return n;
+}
+
+
+void elm327_perf_start(elm327_perf_t *perf)
+{
+    int i;
+
+    for (i = 0; i < ELM327_PERF_N_COUNTERS; ++i)
+    {
+        if (perf->fd[i] == -1)
+          continue;
+        ioctl(perf->fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+
+void elm327_perf_stop(elm327_perf_t *perf)
+{
+    int i;
+
+    for (i = 0; i < ELM327_PERF_N_COUNTERS; ++i)
+      if (perf->fd[i] != -1)
+        ioctl(perf->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+}
+
+
+void elm327_perf_read(elm327_perf_t *perf, uint64_t counts[ELM327_PERF_N_COUNTERS])
+{
+    uint64_t v[3];     /* value, time enabled, time running */
+    int      i;
+
+    for (i = 0; i < ELM327_PERF_N_COUNTERS; ++i)
+    {
+        counts[i] = ELM327_PERF_NA;
+        if ((perf->fd[i] == -1) || (read(perf->fd[i], v, sizeof(v)) != sizeof(v)))
+          continue;
+
+        if (v[2] == 0)
+          counts[i] = 0;
+        else if (v[2] < v[1])
+          counts[i] = (uint64_t)((double)v[0] * v[1] / v[2]);
+        else
+          counts[i] = v[0];
+    }
+}
+
+
+void elm327_perf_close(elm327_perf_t *perf)
+{
+    int i;
+
+    for (i = 0; i < ELM327_PERF_N_COUNTERS; ++i)
+    {
+        if (perf->fd[i] != -1)
+          close(perf->fd[i]);
+        perf->fd[i] = -1;
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef _ELM327PERF_H
+#define _ELM327PERF_H
+
+#include <stdint.h>
+
+
+/* Hardware and software counters of the calling thread (perf_event_open).
+ *
+ * Counters the kernel refuses (no PMU in a VM, perf_event_paranoid too high)
+ * are left out and read as ELM327_PERF_NA, so a profile still runs with what
+ * is there.  Only user space is counted.
+ */
+typedef enum _elm327_perf_counter
+{
+    ELM327_PERF_CYCLES = 0,
+    ELM327_PERF_INSTRUCTIONS,
+    ELM327_PERF_CACHE_MISSES,
+    ELM327_PERF_CONTEXT_SWITCHES,
+    ELM327_PERF_N_COUNTERS
+} elm327_perf_counter_t;
+
+
+#define ELM327_PERF_NA UINT64_MAX
+
+
+typedef struct _elm327_perf
+{
+    int fd[ELM327_PERF_N_COUNTERS];
+} elm327_perf_t;
+
+
+extern const char *elm327_perf_names[ELM327_PERF_N_COUNTERS];
+
+
+/* Open the counters, disabled.  Returns how many could be opened. */
+extern int elm327_perf_open(elm327_perf_t *perf);
+
+
+/* Zero and enable, and disable, every counter */
+extern void elm327_perf_start(elm327_perf_t *perf);
+extern void elm327_perf_stop(elm327_perf_t *perf);
+
+
+/* Read the counts since the last start, scaled when the kernel had to
+ * multiplex counters.  Missing counters read ELM327_PERF_NA.
+ */
+extern void elm327_perf_read(elm327_perf_t *perf, uint64_t counts[ELM327_PERF_N_COUNTERS]);
+
+
+extern void elm327_perf_close(elm327_perf_t *perf);
+
+
+#endif /* _ELM327PERF_H */
@@ -0,0 +1,55 @@
+#ifndef _ELM327PIDS_H
+#define _ELM327PIDS_H
+
+#include <stddef.h>
+
+
+/* Mode 01 PID definitions, indexed by PID */
+#define OBDPID_TABLE_SIZE 25
+
+
+typedef enum
+{
+    INTEGER    = 0,
+    DOUBLE     = 1,
+}
+DataType;
+
+typedef enum
+{
+    PERCENT           = 0,
+    RPM               = 1,
+    CELSIUS           = 2,
+    PASCALS           = 3,
+    KILOMETERSPERHOUR = 4
+}
+Units;
+
+struct obdpid
+{
+    int command;
+    double min;
+    double max;
+    size_t bytes;;
+    DataType datatype;
+    Units units;
+    double (*calculate) (double, double);
+    //char* command;
+    char* commandname;
+};
+
+
+
+double rpmcalc(double a, double b);
+double stdcalc(double a, double b);
+
+
+/* Fill in the PIDs we know how to read, leaves the others untouched */
+void setupcommands(struct obdpid o[OBDPID_TABLE_SIZE]);
+
+
+/* Reset every entry to 'not supported' and then call setupcommands() */
+void obdpid_init_table(struct obdpid o[OBDPID_TABLE_SIZE]);
+
+
+#endif /* _ELM327PIDS_H */
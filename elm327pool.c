@@ -0,0 +1,318 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "elm327pool.h"
+
+
+typedef struct _elm327_task
+{
+    elm327_pool_fn  fn;
+    void           *arg;
+} elm327_task_t;
+
+
+/* Ring buffer deque, owner works the tail, thieves the head */
+typedef struct _elm327_deque
+{
+    pthread_mutex_t  lock;
+    elm327_task_t   *tasks;
+    size_t           cap;
+    size_t           head;
+    size_t           count;
+} elm327_deque_t;
+
+
+struct _elm327_pool
+{
+    int              n_workers;
+    pthread_t       *threads;
+    elm327_deque_t  *deques;
+    unsigned int     next;       /* Round robin submit cursor */
+
+    pthread_mutex_t  lock;
+    pthread_cond_t   work_cv;    /* Signalled on submit/shutdown */
+    pthread_cond_t   idle_cv;    /* Signalled when pending hits 0 */
+    size_t           pending;    /* Submitted but not finished   */
+    size_t           queued;     /* Submitted but not started    */
+    int              stop;
+};
+
+
+typedef struct _elm327_worker_arg
+{
+    elm327_pool_t *pool;
+    int            idx;
+} elm327_worker_arg_t;
+
+
+/*
+ * Deque
+ */
+
+static int deque_push(elm327_deque_t *dq, elm327_task_t task)
+{
+    elm327_task_t *grown;
+    size_t         i, cap;
+
+    pthread_mutex_lock(&dq->lock);
+
+    if (dq->count == dq->cap)
+    {
+        cap = dq->cap ? dq->cap * 2 : 64;
+        if (!(grown = malloc(cap * sizeof(elm327_task_t))))
+        {
+            pthread_mutex_unlock(&dq->lock);
+            return -1;
+        }
+
+        for (i=0; i<dq->count; ++i)
+          grown[i] = dq->tasks[(dq->head + i) % dq->cap];
+
+        free(dq->tasks);
+        dq->tasks = grown;
+        dq->cap = cap;
+        dq->head = 0;
+    }
+
+    dq->tasks[(dq->head + dq->count) % dq->cap] = task;
+    ++dq->count;
+
+    pthread_mutex_unlock(&dq->lock);
+
+    return 0;
+}
+
+
+/* Take from the back (owner) or the front (thief) */
+static int deque_take(elm327_deque_t *dq, elm327_task_t *task, int steal)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&dq->lock);
+
+    if (dq->count > 0)
+    {
+        if (steal)
+        {
+            *task = dq->tasks[dq->head];
+            dq->head = (dq->head + 1) % dq->cap;
+        }
+        else
+          *task = dq->tasks[(dq->head + dq->count - 1) % dq->cap];
+
+        --dq->count;
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&dq->lock);
+
+    return found;
+}
+
+
+/*
+ * Workers
+ */
+
+static int pool_find_task(elm327_pool_t *pool, int idx, elm327_task_t *task)
+{
+    int i;
+
+    if (deque_take(&pool->deques[idx], task, 0))
+      return 1;
+
+    for (i=1; i<pool->n_workers; ++i)
+      if (deque_take(&pool->deques[(idx + i) % pool->n_workers], task, 1))
+        return 1;
+
+    return 0;
+}
+
+
+static void *pool_worker(void *varg)
+{
+    elm327_worker_arg_t *warg = varg;
+    elm327_pool_t       *pool = warg->pool;
+    int                  idx = warg->idx;
+    elm327_task_t        task;
+
+    free(warg);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop && (pool->queued == 0))
+          pthread_cond_wait(&pool->work_cv, &pool->lock);
+
+        if (pool->queued == 0)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (!pool_find_task(pool, idx, &task))
+        {
+            /* Another worker beat us to it */
+            sched_yield();
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        --pool->queued;
+        pthread_mutex_unlock(&pool->lock);
+
+        task.fn(task.arg, idx);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+          pthread_cond_broadcast(&pool->idle_cv);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Pool
+ */
+
+elm327_pool_t *elm327_pool_create(int n_workers)
+{
+    elm327_pool_t       *pool;
+    elm327_worker_arg_t *warg;
+    int                  i;
+
+    if (n_workers <= 0)
+      n_workers = elm327_ncpus();
+
+    if (!(pool = calloc(1, sizeof(elm327_pool_t))))
+      return NULL;
+
+    pool->n_workers = n_workers;
+    pool->threads = calloc(n_workers, sizeof(pthread_t));
+    pool->deques = calloc(n_workers, sizeof(elm327_deque_t));
+    if (!pool->threads || !pool->deques)
+    {
+        free(pool->threads);
+        free(pool->deques);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cv, NULL);
+    pthread_cond_init(&pool->idle_cv, NULL);
+    for (i=0; i<n_workers; ++i)
+      pthread_mutex_init(&pool->deques[i].lock, NULL);
+
+    for (i=0; i<n_workers; ++i)
+    {
+        if (!(warg = malloc(sizeof(elm327_worker_arg_t))))
+          break;
+        warg->pool = pool;
+        warg->idx = i;
+
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, warg) != 0)
+        {
+            free(warg);
+            break;
+        }
+    }
+
+    /* Run with whatever we managed to start, but we need at least one */
+    if (i == 0)
+    {
+        free(pool->threads);
+        free(pool->deques);
+        free(pool);
+        return NULL;
+    }
+    pool->n_workers = i;
+
+    return pool;
+}
+
+
+int elm327_pool_submit(elm327_pool_t *pool, elm327_pool_fn fn, void *arg)
+{
+    elm327_task_t task = {fn, arg};
+    unsigned int  idx;
+
+    pthread_mutex_lock(&pool->lock);
+    idx = pool->next++ % pool->n_workers;
+    ++pool->pending;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (deque_push(&pool->deques[idx], task) == -1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+          pthread_cond_broadcast(&pool->idle_cv);
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    ++pool->queued;
+    pthread_cond_signal(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+
+void elm327_pool_wait(elm327_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+      pthread_cond_wait(&pool->idle_cv, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+void elm327_pool_destroy(elm327_pool_t *pool)
+{
+    int i;
+
+    if (!pool)
+      return;
+
+    elm327_pool_wait(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i=0; i<pool->n_workers; ++i)
+    {
+        pthread_join(pool->threads[i], NULL);
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cv);
+    pthread_cond_destroy(&pool->idle_cv);
+    free(pool->threads);
+    free(pool->deques);
+    free(pool);
+}
+
+
+int elm327_pool_size(const elm327_pool_t *pool)
+{
+    return pool->n_workers;
+}
+
+
+int elm327_ncpus(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (n > 0) ? (int)n : 1;
+}
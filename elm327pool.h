@@ -0,0 +1,44 @@
+#ifndef _ELM327POOL_H
+#define _ELM327POOL_H
+
+
+/* Fixed size worker pool with work stealing.
+ *
+ * Every worker owns a deque.  Submitted tasks are dealt round robin over the
+ * deques, an owner pops from the back of its own deque (most recently pushed,
+ * cache warm) and when that is empty steals from the front of another
+ * worker's deque.  Tasks receive the index of the worker running them so they
+ * can keep per-worker state without locking.
+ */
+
+typedef void (*elm327_pool_fn)(void *arg, int worker);
+
+typedef struct _elm327_pool elm327_pool_t;
+
+
+/* Create a pool of 'n_workers' threads, 0 means one per online cpu.  Returns
+ * NULL on error.
+ */
+extern elm327_pool_t *elm327_pool_create(int n_workers);
+
+
+/* Queue a task, returns 0 on success and -1 on error */
+extern int elm327_pool_submit(elm327_pool_t *pool, elm327_pool_fn fn, void *arg);
+
+
+/* Block until every submitted task has finished */
+extern void elm327_pool_wait(elm327_pool_t *pool);
+
+
+/* Wait for outstanding work, then stop and free the workers */
+extern void elm327_pool_destroy(elm327_pool_t *pool);
+
+
+extern int elm327_pool_size(const elm327_pool_t *pool);
+
+
+/* Number of online cpus (at least 1) */
+extern int elm327_ncpus(void);
+
+
+#endif /* _ELM327POOL_H */
@@ -0,0 +1,82 @@
+#ifndef _ELM327PROBE_H
+#define _ELM327PROBE_H
+
+/* USDT (statically defined tracing) probes, provider "elm327".
+ *
+ * With <sys/sdt.h> (systemtap-sdt-dev / systemtap-sdt-devel) available a
+ * probe is a single NOP plus an ELF note, which bpftrace and perf find by
+ * name without a rebuild:
+ *
+ *   bpftrace -l 'usdt:./elm327diag:elm327:*'
+ *
+ * Arguments that cost something to compute (durations need clock reads) are
+ * only computed while a tracer is attached, ELM327_PROBE_ENABLED() tests the
+ * probe's semaphore.  Without <sys/sdt.h> everything compiles away.
+ *
+ *   send       (mode, pid, bytes)                    request written
+ *   recv       (bytes, prompt, wait_ns, read_ns)     response read
+ *   decode     (mode, pid, value_milli, ns)          value calculated
+ *   output     (samples, ns)                         batch handed to sinks
+ *   sink_write (format, bytes, ns)                   sink writer flushed bytes
+ *
+ * value_milli is the value times 1000 as an integer, bpftrace has no
+ * floating point.  See bpftrace/ for ready made scripts.
+ */
+#if defined(__has_include)
+#  if __has_include(<sys/sdt.h>) && !defined(ELM327_NO_PROBES)
+#    define ELM327_HAVE_PROBES 1
+#  endif
+#endif
+
+
+#ifdef ELM327_HAVE_PROBES
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define ELM327_PROBE_SEMAPHORE(_name) \
+    volatile unsigned short elm327_##_name##_semaphore \
+        __attribute__((unused)) __attribute__((section(".probes")))
+
+#define ELM327_PROBE_ENABLED(_name)   __builtin_expect(elm327_##_name##_semaphore, 0)
+
+#define ELM327_PROBE2(_name, _a, _b)           DTRACE_PROBE2(elm327, _name, _a, _b)
+#define ELM327_PROBE3(_name, _a, _b, _c)       DTRACE_PROBE3(elm327, _name, _a, _b, _c)
+#define ELM327_PROBE4(_name, _a, _b, _c, _d)   DTRACE_PROBE4(elm327, _name, _a, _b, _c, _d)
+
+/* Defined once, in elm327.c */
+extern ELM327_PROBE_SEMAPHORE(send);
+extern ELM327_PROBE_SEMAPHORE(recv);
+extern ELM327_PROBE_SEMAPHORE(decode);
+extern ELM327_PROBE_SEMAPHORE(output);
+extern ELM327_PROBE_SEMAPHORE(sink_write);
+
+#else
+
+#define ELM327_PROBE_ENABLED(_name)            0
+/* sizeof() keeps the arguments "used" without evaluating them */
+#define ELM327_PROBE2(_name, _a, _b) \
+    do { (void)sizeof(_a); (void)sizeof(_b); } while (0)
+#define ELM327_PROBE3(_name, _a, _b, _c) \
+    do { (void)sizeof(_a); (void)sizeof(_b); (void)sizeof(_c); } while (0)
+#define ELM327_PROBE4(_name, _a, _b, _c, _d) \
+    do { (void)sizeof(_a); (void)sizeof(_b); (void)sizeof(_c); (void)sizeof(_d); } while (0)
+
+#endif
+
+
+/* Monotonic nanoseconds, for probe durations */
+#include <stdint.h>
+#include <time.h>
+
+static inline uint64_t elm327_probe_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+#endif /* _ELM327PROBE_H */
@@ -0,0 +1,381 @@
+/*
+ * elm327profile.c
+ *
+ * Self profiling: "elm327diag profile" (or --profile) replays a workload of
+ * adapter responses through the software side of a pass, stage by stage,
+ * and reports what each stage costs per sample in time and in hardware
+ * counters:
+ *
+ *   parse   response text to messages (elm327_parse_msgs)
+ *   decode  message to value through the PID table, message freed
+ *   format  value to a CSV line in an output buffer
+ *
+ * The workload is either a capture of what an adapter sent (the raw bytes,
+ * responses ended by the '>' prompt) or simulated from the PID table.  Each
+ * stage runs over the whole workload between counter reads, so the cost of
+ * reading the counters does not end up in the numbers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "elm327.h"
+#include "elm327buf.h"
+#include "elm327num.h"
+#include "elm327pids.h"
+#include "elm327perf.h"
+#include "elm327cmd.h"
+
+
+#define PROFILE_DEFAULT_REPS     100
+#define PROFILE_DEFAULT_SAMPLES  10000
+
+
+typedef enum _profile_stage
+{
+    PROFILE_PARSE = 0,
+    PROFILE_DECODE,
+    PROFILE_FORMAT,
+    PROFILE_N_STAGES
+} profile_stage_t;
+
+
+static const char *stage_names[PROFILE_N_STAGES] = { "parse", "decode", "format" };
+
+
+typedef struct _profile_workload
+{
+    char   *text;         /* NUL separated responses */
+    char  **responses;
+    size_t  n;
+} profile_workload_t;
+
+
+static void workload_free(profile_workload_t *wl)
+{
+    free(wl->responses);
+    free(wl->text);
+    wl->responses = NULL;
+    wl->text = NULL;
+    wl->n = 0;
+}
+
+
+static void profile_usage(const char *prog)
+{
+    printf("Usage:\n");
+    printf("  %s profile [-n <reps>] [-s <samples>] [<capture>]\n", prog);
+    printf("Options:\n");
+    printf("  -n <int>     replays of the workload (default: %d)\n", PROFILE_DEFAULT_REPS);
+    printf("  -s <int>     simulated responses when no capture is given (default: %d)\n",
+           PROFILE_DEFAULT_SAMPLES);
+    printf("  <capture>    raw adapter output, responses ending in '>'\n");
+}
+
+
+static double profile_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Split raw adapter output on the prompt.  Carriage returns become newlines,
+ * as the tty (ICRNL) hands them to elm327_recv_msgs().
+ */
+static int workload_load(profile_workload_t *wl, const char *path)
+{
+    FILE   *fp;
+    long    size;
+    size_t  i, cap = 64;
+    char   *p, *end;
+
+    if (!(fp = fopen(path, "rb")))
+      return -1;
+    if ((fseek(fp, 0, SEEK_END) == -1) || ((size = ftell(fp)) == -1))
+    {
+        fclose(fp);
+        return -1;
+    }
+    rewind(fp);
+
+    if (!(wl->text = malloc(size + 1)) || !(wl->responses = malloc(cap * sizeof(char *))))
+    {
+        fclose(fp);
+        workload_free(wl);
+        return -1;
+    }
+    if (fread(wl->text, 1, size, fp) != (size_t)size)
+    {
+        /* A read error, or the file got shorter */
+        errno = ferror(fp) ? errno : EIO;
+        fclose(fp);
+        workload_free(wl);
+        return -1;
+    }
+    fclose(fp);
+    wl->text[size] = '\0';
+
+    for (i = 0; i < (size_t)size; ++i)
+      if (wl->text[i] == '\r')
+        wl->text[i] = '\n';
+
+    wl->n = 0;
+    for (p = wl->text; *p; p = end + 1)
+    {
+        while ((*p == '\n') || (*p == ' '))
+          ++p;
+        if (!*p)
+          break;
+        if ((end = strchr(p, '>')))
+          *end = '\0';
+        else
+          end = p + strlen(p) - 1;
+
+        if (wl->n == cap)
+        {
+            char **r = realloc(wl->responses, 2 * cap * sizeof(char *));
+
+            if (!r)
+            {
+                workload_free(wl);
+                return -1;
+            }
+            wl->responses = r;
+            cap *= 2;
+        }
+        wl->responses[wl->n++] = p;
+    }
+
+    return 0;
+}
+
+
+/* "01XX" echo plus a two byte Mode 01 answer, cycling over the PID table */
+static int workload_simulate(profile_workload_t *wl, const struct obdpid o[OBDPID_TABLE_SIZE], size_t n)
+{
+    const size_t line = 24;
+    size_t       i;
+    int          j = 0;
+
+    if (!(wl->text = malloc(n * line)) ||
+        !(wl->responses = malloc(n * sizeof(char *))))
+    {
+        workload_free(wl);
+        return -1;
+    }
+
+    srand(327);
+    for (i = 0; i < n; ++i)
+    {
+        while (!o[j].bytes)
+          j = (j + 1) % OBDPID_TABLE_SIZE;
+
+        wl->responses[i] = wl->text + i * line;
+        snprintf(wl->responses[i], line, "01%02X\n41 %02X %02X %02X\n\n",
+                 o[j].command, o[j].command, rand() & 0xFF, rand() & 0xFF);
+        j = (j + 1) % OBDPID_TABLE_SIZE;
+    }
+    wl->n = n;
+
+    return 0;
+}
+
+
+/* Close a stage: add its time and counts to the totals */
+static void stage_end(elm327_perf_t *perf, double t0, double *secs, uint64_t totals[ELM327_PERF_N_COUNTERS])
+{
+    uint64_t counts[ELM327_PERF_N_COUNTERS];
+    int      c;
+
+    elm327_perf_stop(perf);
+    *secs += profile_now() - t0;
+    elm327_perf_read(perf, counts);
+    for (c = 0; c < ELM327_PERF_N_COUNTERS; ++c)
+      totals[c] = (counts[c] == ELM327_PERF_NA) ? ELM327_PERF_NA : totals[c] + counts[c];
+}
+
+
+static void print_count(uint64_t total, double per)
+{
+    if (total == ELM327_PERF_NA)
+      printf(" %12s", "n/a");
+    else
+      printf(" %12.1f", total / per);
+}
+
+
+int elm327_cmd_profile(int argc, char *argv[])
+{
+    struct obdpid       o[OBDPID_TABLE_SIZE];
+    int                 by_pid[256];
+    profile_workload_t  wl = {0};
+    elm327_msg_t      **msgs;
+    int                *n_msgs;
+    double             *values;
+    const char        **names;
+    elm327_buf_t        buf;
+    elm327_perf_t       perf;
+    uint64_t            totals[PROFILE_N_STAGES][ELM327_PERF_N_COUNTERS] = {{0}};
+    double              secs[PROFILE_N_STAGES] = {0}, t0, per;
+    size_t              k, n_samples = PROFILE_DEFAULT_SAMPLES, bad = 0;
+    int                 i, s, c, reps = PROFILE_DEFAULT_REPS, n_counters, err = 0;
+    const char         *capture = NULL;
+    char               *w;
+
+    for (i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-n") && (i < argc-1))
+          reps = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-s") && (i < argc-1))
+          n_samples = strtoul(argv[++i], NULL, 0);
+        else if ((argv[i][0] != '-') && !capture)
+          capture = argv[i];
+        else
+        {
+            profile_usage("elm327diag");
+            return 1;
+        }
+    }
+    if ((reps <= 0) || (n_samples == 0))
+    {
+        profile_usage("elm327diag");
+        return 1;
+    }
+
+    obdpid_init_table(o);
+    for (i = 0; i < 256; ++i)
+      by_pid[i] = -1;
+    for (i = 0; i < OBDPID_TABLE_SIZE; ++i)
+      if (o[i].bytes)
+        by_pid[o[i].command & 0xFF] = i;
+
+    if (capture ? workload_load(&wl, capture) : workload_simulate(&wl, o, n_samples))
+    {
+        fprintf(stderr, "%s: %s\n", capture ? capture : "workload", strerror(errno));
+        return 1;
+    }
+    if (wl.n == 0)
+    {
+        fprintf(stderr, "%s: no responses\n", capture);
+        workload_free(&wl);
+        return 1;
+    }
+
+    msgs = calloc(wl.n, sizeof(elm327_msg_t *));
+    n_msgs = calloc(wl.n, sizeof(int));
+    values = calloc(wl.n, sizeof(double));
+    names = calloc(wl.n, sizeof(char *));
+    if (!msgs || !n_msgs || !values || !names || (elm327_buf_init(&buf, 64 * wl.n) == -1))
+    {
+        fprintf(stderr, "profile: %s\n", strerror(ENOMEM));
+        free(names);
+        free(values);
+        free(n_msgs);
+        free(msgs);
+        workload_free(&wl);
+        return 1;
+    }
+
+    if ((n_counters = elm327_perf_open(&perf)) < ELM327_PERF_N_COUNTERS)
+      fprintf(stderr, "profile: %d of %d counters available (no PMU, or perf_event_paranoid)\n",
+              n_counters, ELM327_PERF_N_COUNTERS);
+
+    for (i = 0; i < reps; ++i)
+    {
+        /* Parse */
+        t0 = profile_now();
+        elm327_perf_start(&perf);
+        for (k = 0; k < wl.n; ++k)
+          msgs[k] = elm327_parse_msgs(wl.responses[k], &n_msgs[k], 0);
+        stage_end(&perf, t0, &secs[PROFILE_PARSE], totals[PROFILE_PARSE]);
+
+        /* Decode, as the sampling loop does it */
+        t0 = profile_now();
+        elm327_perf_start(&perf);
+        for (k = 0; k < wl.n; ++k)
+        {
+            names[k] = NULL;
+            if (!msgs[k])
+              continue;
+            if ((n_msgs[k] > 0) && (msgs[k][0][0] == 0x41) && ((s = by_pid[msgs[k][0][1]]) != -1))
+            {
+                values[k] = o[s].calculate((double)msgs[k][0][2], (double)msgs[k][0][3]);
+                names[k] = o[s].commandname;
+            }
+            elm327_destroy_recv_msgs(msgs[k]);
+        }
+        stage_end(&perf, t0, &secs[PROFILE_DECODE], totals[PROFILE_DECODE]);
+
+        /* Format, the CSV sink's serialization */
+        t0 = profile_now();
+        elm327_perf_start(&perf);
+        elm327_buf_reset(&buf);
+        for (k = 0; k < wl.n; ++k)
+        {
+            size_t len;
+
+            if (!names[k])
+              continue;
+            len = strlen(names[k]);
+            if (!(w = elm327_buf_reserve(&buf, len + ELM327_FMT_MAX + 3)))
+            {
+                fprintf(stderr, "profile: %s\n", strerror(ENOMEM));
+                err = 1;
+                goto done;
+            }
+            memcpy(w, names[k], len);
+            w += len;
+            *w++ = ',';
+            *w++ = ' ';
+            w = elm327_fmt_fixed(w, values[k], 6);
+            *w++ = '\n';
+            elm327_buf_commit(&buf, w);
+        }
+        stage_end(&perf, t0, &secs[PROFILE_FORMAT], totals[PROFILE_FORMAT]);
+    }
+
+    for (k = 0; k < wl.n; ++k)
+      if (!names[k])
+        ++bad;
+
+    /* Per sample, over every replay */
+    per = (double)wl.n * reps;
+    printf("%zu responses (%s, %zu not decodable) x %d replays\n",
+           wl.n, capture ? capture : "simulated", bad, reps);
+    printf("%-8s %12s", "stage", "ns");
+    for (c = 0; c < ELM327_PERF_N_COUNTERS; ++c)
+      printf(" %12s", elm327_perf_names[c]);
+    printf(" %8s\n", "ipc");
+
+    for (s = 0; s < PROFILE_N_STAGES; ++s)
+    {
+        printf("%-8s %12.1f", stage_names[s], secs[s] * 1e9 / per);
+        for (c = 0; c < ELM327_PERF_N_COUNTERS; ++c)
+          print_count(totals[s][c], per);
+        if ((totals[s][ELM327_PERF_CYCLES] == ELM327_PERF_NA) ||
+            (totals[s][ELM327_PERF_INSTRUCTIONS] == ELM327_PERF_NA) ||
+            (totals[s][ELM327_PERF_CYCLES] == 0))
+          printf(" %8s\n", "n/a");
+        else
+          printf(" %8.2f\n", (double)totals[s][ELM327_PERF_INSTRUCTIONS] / totals[s][ELM327_PERF_CYCLES]);
+    }
+
+done:
+    elm327_perf_close(&perf);
+    elm327_buf_free(&buf);
+    free(names);
+    free(values);
+    free(n_msgs);
+    free(msgs);
+    workload_free(&wl);
+
+    return err;
+}
@@ -0,0 +1,696 @@
+/* posix_openpt(), ptsname_r(), ppoll() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "elm327clock.h"
+#include "elm327replay.h"
+
+
+#define REPLAY_REQUEST_MAX  32
+#define REPLAY_TEXT_MAX     4096
+
+/* Answer to what the capture has not, when it has no responses to time by */
+#define REPLAY_MISS_NS      50000000ull
+
+
+/*
+ * Capture
+ */
+
+int          elm327_capture_on = 0;
+static FILE *capture_fp = NULL;
+
+
+int elm327_capture_start(const char *path)
+{
+    if (capture_fp)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+    if (!(capture_fp = fopen(path, "w")))
+      return -1;
+
+    fprintf(capture_fp, "# elm327diag capture: <wall clock us> <w|r> <bytes>\n");
+    elm327_capture_on = 1;
+
+    return 0;
+}
+
+
+void elm327_capture_chunk(char dir, const void *buf, size_t len)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    const unsigned char *p = buf;
+    char                 line[32 + 4 * 256], *w;
+    size_t               i;
+
+    if (!capture_fp)
+      return;
+
+    /* A line at a time, stdio keeps lines whole */
+    while (len)
+    {
+        w = line + snprintf(line, 32, "%llu %c ", (unsigned long long)elm327_clock_wall_us(), dir);
+        for (i = 0; (i < len) && (i < 256); ++i)
+        {
+            if (p[i] == '\r')
+            {
+                *w++ = '\\';
+                *w++ = 'r';
+            }
+            else if (p[i] == '\n')
+            {
+                *w++ = '\\';
+                *w++ = 'n';
+            }
+            else if (p[i] == '\\')
+            {
+                *w++ = '\\';
+                *w++ = '\\';
+            }
+            else if ((p[i] < 0x20) || (p[i] > 0x7E))
+            {
+                *w++ = '\\';
+                *w++ = 'x';
+                *w++ = hex[p[i] >> 4];
+                *w++ = hex[p[i] & 0xF];
+            }
+            else
+              *w++ = p[i];
+        }
+        *w++ = '\n';
+        fwrite(line, 1, w - line, capture_fp);
+        p += i;
+        len -= i;
+    }
+}
+
+
+int elm327_capture_stop(void)
+{
+    int r;
+
+    if (!capture_fp)
+      return 0;
+
+    elm327_capture_on = 0;
+    r = fclose(capture_fp);
+    capture_fp = NULL;
+
+    return r;
+}
+
+
+/*
+ * Replay
+ */
+
+/* Lines of a response that came in together, as the ELM sent them */
+typedef struct _replay_chunk
+{
+    uint64_t offset_ns;    /* after the request */
+    size_t   text;         /* in the pool */
+    size_t   len;
+} replay_chunk_t;
+
+
+typedef struct _replay_txn
+{
+    char   request[REPLAY_REQUEST_MAX];   /* normalized */
+    size_t order;
+    size_t first, n;                      /* chunks */
+} replay_txn_t;
+
+
+/* Transactions of one request, answered in turn */
+typedef struct _replay_key
+{
+    const char *request;
+    size_t      first, n, next;
+} replay_key_t;
+
+
+/* Serving: a response going out */
+typedef struct _replay_pending
+{
+    const replay_chunk_t *chunks;
+    size_t                n, i;
+    uint64_t              t0;
+} replay_pending_t;
+
+
+struct _elm327_replay
+{
+    int             master;
+    int             slave;     /* kept open, the pty hangs up when the last closes */
+    char            path[64];
+    double          scale;
+    int             stop[2];
+    pthread_t       thread;
+    int             running;
+
+    char           *pool;
+    size_t          pool_len, pool_cap;
+    replay_chunk_t *chunks;
+    size_t          n_chunks, chunks_cap;
+    replay_txn_t   *txns;
+    size_t          n_txns, txns_cap;
+    replay_key_t   *keys;
+    size_t          n_keys;
+
+    /* What the capture does not have */
+    replay_chunk_t  ok, id, no_data, stopped;
+
+    /* Serving state, the thread's */
+    int             echo;
+    char            line[REPLAY_REQUEST_MAX];
+    size_t          line_len;
+    char            last[REPLAY_REQUEST_MAX];
+
+    uint64_t        served, misses;
+};
+
+
+static void normalize(char *dst, const char *src, size_t len)
+{
+    size_t n = 0, i;
+
+    for (i = 0; (i < len) && (n < REPLAY_REQUEST_MAX - 1); ++i)
+      if (!isspace((unsigned char)src[i]))
+        dst[n++] = toupper((unsigned char)src[i]);
+    dst[n] = '\0';
+}
+
+
+static void *grow(void *p, size_t *cap, size_t need, size_t size)
+{
+    size_t n = *cap ? *cap : 64;
+    void  *q;
+
+    if (need <= *cap)
+      return p;
+    while (n < need)
+      n *= 2;
+    if (!(q = realloc(p, n * size)))
+      return NULL;
+    *cap = n;
+
+    return q;
+}
+
+
+static int pool_add(elm327_replay_t *r, const char *text, size_t len, size_t *at)
+{
+    char *p;
+
+    if (!(p = grow(r->pool, &r->pool_cap, r->pool_len + len, 1)))
+      return -1;
+    r->pool = p;
+    memcpy(r->pool + r->pool_len, text, len);
+    *at = r->pool_len;
+    r->pool_len += len;
+
+    return 0;
+}
+
+
+/* Add 'len' bytes to the last transaction, at 'offset_ns'.  Bytes seen at
+ * the same time as the last chunk join it.
+ */
+static int txn_add(elm327_replay_t *r, uint64_t offset_ns, const char *text, size_t len)
+{
+    replay_txn_t   *t = &r->txns[r->n_txns - 1];
+    replay_chunk_t *c;
+    size_t          at;
+
+    if (pool_add(r, text, len, &at) == -1)
+      return -1;
+
+    if (t->n && (r->chunks[r->n_chunks - 1].offset_ns == offset_ns))
+    {
+        r->chunks[r->n_chunks - 1].len += len;
+        return 0;
+    }
+    if (!(c = grow(r->chunks, &r->chunks_cap, r->n_chunks + 1, sizeof(replay_chunk_t))))
+      return -1;
+    r->chunks = c;
+    c = &r->chunks[r->n_chunks++];
+    c->offset_ns = offset_ns;
+    c->text = at;
+    c->len = len;
+    if (!t->n++)
+      t->first = r->n_chunks - 1;
+
+    return 0;
+}
+
+
+static size_t unescape(char *s)
+{
+    char  *w = s, *p;
+    size_t n;
+
+    for (p = s; *p; ++p)
+    {
+        if ((*p != '\\') || !p[1])
+        {
+            *w++ = *p;
+            continue;
+        }
+        switch (*++p)
+        {
+            case 'r':  *w++ = '\r'; break;
+            case 'n':  *w++ = '\n'; break;
+            case 'x':
+                if (isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2]))
+                {
+                    char hex[3] = { p[1], p[2], '\0' };
+
+                    *w++ = (char)strtol(hex, NULL, 16);
+                    p += 2;
+                    break;
+                }
+                /* fall through */
+            default:   *w++ = *p; break;
+        }
+    }
+    n = w - s;
+    *w = '\0';
+
+    return n;
+}
+
+
+static int by_request(const void *a, const void *b)
+{
+    const replay_txn_t *x = a, *y = b;
+    int                 c = strcmp(x->request, y->request);
+
+    return c ? c : (x->order > y->order) - (x->order < y->order);
+}
+
+
+static int by_offset(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+/* Split a capture into transactions: a request written, then the lines read
+ * up to the blank line or prompt that ends the response.  The echo is left
+ * out, the replay echoes as the client asks.
+ */
+static int replay_load(elm327_replay_t *r, const char *capture)
+{
+    FILE              *fp;
+    char               text[REPLAY_TEXT_MAX * 4 + 64], *bytes, wline[REPLAY_TEXT_MAX], rline[REPLAY_TEXT_MAX];
+    unsigned long long t_us, t_write = 0;
+    size_t             n, i, wlen = 0, rlen = 0;
+    int                lineno = 0, open = 0, lines = 0, err = -1;
+    char               dir, c;
+
+    if (!(fp = fopen(capture, "r")))
+      return -1;
+
+    while (fgets(text, sizeof(text), fp))
+    {
+        ++lineno;
+        text[strcspn(text, "\n")] = '\0';
+        if (!text[0] || (text[0] == '#'))
+          continue;
+        if ((sscanf(text, "%llu %c", &t_us, &dir) != 2) || ((dir != 'w') && (dir != 'r')) ||
+            !(bytes = strchr(text, ' ')) || !(bytes = strchr(bytes + 1, ' ')))
+        {
+            fprintf(stderr, "%s:%d: expected <us> <w|r> <bytes>\n", capture, lineno);
+            errno = EINVAL;
+            goto out;
+        }
+        n = unescape(++bytes);
+
+        for (i = 0; i < n; ++i)
+        {
+            if (dir == 'w')
+            {
+                if ((bytes[i] != '\r') && (bytes[i] != '\n'))
+                {
+                    if (wlen < sizeof(wline))
+                      wline[wlen++] = bytes[i];
+                    continue;
+                }
+
+                /* A new request, whatever became of the last */
+                if (open && lines && (txn_add(r, (t_us - t_write) * 1000, "\r>", 2) == -1))
+                  goto out;
+                if (!(r->txns = grow(r->txns, &r->txns_cap, r->n_txns + 1, sizeof(replay_txn_t))))
+                  goto out;
+                memset(&r->txns[r->n_txns], 0, sizeof(replay_txn_t));
+                normalize(r->txns[r->n_txns].request, wline, wlen);
+                r->txns[r->n_txns].order = r->n_txns;
+                ++r->n_txns;
+                t_write = t_us;
+                open = 1;
+                lines = 0;
+                wlen = rlen = 0;
+                continue;
+            }
+
+            if (!open)
+              continue;
+            c = (bytes[i] == '\r') ? '\n' : bytes[i];
+
+            /* The end: the prompt, or the blank line before it.  A prompt
+             * before anything is the last response's, held back by the tty.
+             */
+            if ((c == '>') || ((c == '\n') && (rlen == 0) && lines))
+            {
+                if (!lines && !rlen)
+                  continue;
+                if (txn_add(r, (t_us - t_write) * 1000, "\r>", 2) == -1)
+                  goto out;
+                open = 0;
+                continue;
+            }
+            if ((c == '\n') && (rlen == 0))
+              continue;
+            if (c != '\n')
+            {
+                if (rlen < sizeof(rline) - 1)
+                  rline[rlen++] = c;
+                continue;
+            }
+
+            /* A whole line, the first may be the echo */
+            if (!lines++)
+            {
+                char echo[REPLAY_REQUEST_MAX];
+
+                normalize(echo, rline, rlen);
+                if (!strcmp(echo, r->txns[r->n_txns - 1].request))
+                {
+                    lines = 0;
+                    rlen = 0;
+                    continue;
+                }
+            }
+            rline[rlen++] = '\r';
+            if (txn_add(r, (t_us - t_write) * 1000, rline, rlen) == -1)
+              goto out;
+            rlen = 0;
+        }
+    }
+    err = 0;
+
+out:
+    fclose(fp);
+
+    return err;
+}
+
+
+static int replay_index(elm327_replay_t *r)
+{
+    uint64_t *offsets;
+    size_t    i, n = 0;
+
+    /* Transactions that never ended are left out */
+    for (i = 0; i < r->n_txns; ++i)
+      if (r->txns[i].n && (r->pool[r->chunks[r->txns[i].first + r->txns[i].n - 1].text +
+                                   r->chunks[r->txns[i].first + r->txns[i].n - 1].len - 1] == '>'))
+        r->txns[n++] = r->txns[i];
+    r->n_txns = n;
+
+    qsort(r->txns, r->n_txns, sizeof(replay_txn_t), by_request);
+    if (!(r->keys = calloc(r->n_txns ? r->n_txns : 1, sizeof(replay_key_t))))
+      return -1;
+    for (i = 0; i < r->n_txns; ++i)
+    {
+        if (!r->n_keys || strcmp(r->keys[r->n_keys - 1].request, r->txns[i].request))
+        {
+            r->keys[r->n_keys].request = r->txns[i].request;
+            r->keys[r->n_keys].first = i;
+            ++r->n_keys;
+        }
+        ++r->keys[r->n_keys - 1].n;
+    }
+
+    /* NO DATA after the median time to the prompt of the vehicle's answers */
+    r->no_data.offset_ns = REPLAY_MISS_NS;
+    if (!(offsets = malloc((r->n_txns ? r->n_txns : 1) * sizeof(uint64_t))))
+      return -1;
+    for (i = n = 0; i < r->n_txns; ++i)
+      if (strncmp(r->txns[i].request, "AT", 2))
+        offsets[n++] = r->chunks[r->txns[i].first + r->txns[i].n - 1].offset_ns;
+    if (n)
+    {
+        qsort(offsets, n, sizeof(uint64_t), by_offset);
+        r->no_data.offset_ns = offsets[n / 2];
+    }
+    free(offsets);
+
+    if ((pool_add(r, "OK\r\r>", 5, &r->ok.text) == -1) ||
+        (pool_add(r, "ELM327 v1.5\r\r>", 14, &r->id.text) == -1) ||
+        (pool_add(r, "NO DATA\r\r>", 10, &r->no_data.text) == -1) ||
+        (pool_add(r, "STOPPED\r\r>", 10, &r->stopped.text) == -1))
+      return -1;
+    r->ok.len = 5;
+    r->id.len = 14;
+    r->no_data.len = 10;
+    r->stopped.len = 10;
+
+    return 0;
+}
+
+
+static int by_key(const void *a, const void *b)
+{
+    return strcmp(a, ((const replay_key_t *)b)->request);
+}
+
+
+static uint64_t replay_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/* A request line came in: the echo now, the response as it was timed */
+static void replay_request(elm327_replay_t *r, replay_pending_t *p)
+{
+    char          req[REPLAY_REQUEST_MAX];
+    replay_key_t *k;
+
+    /* An empty line repeats the last request, as on the ELM */
+    if (r->line_len)
+      normalize(req, r->line, r->line_len);
+    else
+      strcpy(req, r->last);
+    strcpy(r->last, req);
+
+    if (r->echo)
+    {
+        r->line[r->line_len++] = '\r';
+        if (write(r->master, r->line, r->line_len) != (ssize_t)r->line_len)
+          return;
+    }
+    r->line_len = 0;
+
+    p->t0 = replay_now_ns();
+    p->i = 0;
+    p->n = 1;
+    if ((k = bsearch(req, r->keys, r->n_keys, sizeof(replay_key_t), by_key)))
+    {
+        const replay_txn_t *t = &r->txns[k->first + k->next];
+
+        k->next = (k->next + 1) % k->n;
+        p->chunks = &r->chunks[t->first];
+        p->n = t->n;
+        __atomic_add_fetch(&r->served, 1, __ATOMIC_RELAXED);
+    }
+    else if (!strncmp(req, "AT", 2))
+    {
+        p->chunks = (!strcmp(req, "ATZ") || !strcmp(req, "ATWS") || !strcmp(req, "ATI")) ? &r->id : &r->ok;
+        __atomic_add_fetch(&r->misses, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        p->chunks = &r->no_data;
+        __atomic_add_fetch(&r->misses, 1, __ATOMIC_RELAXED);
+    }
+
+    if (!strcmp(req, "ATE0") || !strcmp(req, "ATE1"))
+      r->echo = req[3] == '1';
+    else if (!strcmp(req, "ATZ") || !strcmp(req, "ATWS"))
+      r->echo = 1;
+}
+
+
+static void *replay_serve(void *arg)
+{
+    elm327_replay_t  *r = arg;
+    replay_pending_t  p = { .n = 0 };
+    struct pollfd     pfd[2] = { { .fd = r->master, .events = POLLIN }, { .fd = r->stop[0], .events = POLLIN } };
+    struct timespec   ts;
+    uint64_t          now, due;
+    char              buf[256];
+    ssize_t           n, i;
+
+    for (;;)
+    {
+        /* Until the next chunk is due, or for ever */
+        if (p.i < p.n)
+        {
+            now = replay_now_ns();
+            due = p.t0 + (uint64_t)(p.chunks[p.i].offset_ns * r->scale);
+            due = (due > now) ? due - now : 0;
+            ts.tv_sec = due / 1000000000ull;
+            ts.tv_nsec = due % 1000000000ull;
+        }
+        if ((ppoll(pfd, 2, (p.i < p.n) ? &ts : NULL, NULL) == -1) && (errno != EINTR))
+          break;
+        if (pfd[1].revents)
+          break;
+
+        if (pfd[0].revents & POLLIN)
+          while ((n = read(r->master, buf, sizeof(buf))) > 0)
+            for (i = 0; i < n; ++i)
+            {
+                /* Any character stops a response */
+                if (p.i < p.n)
+                {
+                    p.chunks = &r->stopped;
+                    p.i = 0;
+                    p.n = 1;
+                    p.t0 = 0;
+                    continue;
+                }
+                if ((buf[i] == '\r') || (buf[i] == '\n'))
+                  replay_request(r, &p);
+                else if (r->line_len < sizeof(r->line) - 1)
+                  r->line[r->line_len++] = buf[i];
+            }
+
+        now = replay_now_ns();
+        while ((p.i < p.n) && (p.t0 + (uint64_t)(p.chunks[p.i].offset_ns * r->scale) <= now))
+        {
+            if (write(r->master, r->pool + p.chunks[p.i].text, p.chunks[p.i].len) == -1)
+              break;
+            ++p.i;
+        }
+    }
+
+    return NULL;
+}
+
+
+elm327_replay_t *elm327_replay_open(const char *capture, double scale)
+{
+    elm327_replay_t *r;
+    struct termios   t;
+    int              saved;
+
+    if (!(r = calloc(1, sizeof(elm327_replay_t))))
+      return NULL;
+    r->master = r->slave = r->stop[0] = r->stop[1] = -1;
+    r->scale = (scale >= 0) ? scale : 1.0;
+    r->echo = 1;
+
+    if ((replay_load(r, capture) == -1) || (replay_index(r) == -1))
+      goto fail;
+
+    /* The line discipline of a real adapter's tty: lines end in CR */
+    if (((r->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) == -1) ||
+        (grantpt(r->master) == -1) || (unlockpt(r->master) == -1) ||
+        (ptsname_r(r->master, r->path, sizeof(r->path)) != 0) ||
+        ((r->slave = open(r->path, O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1) ||
+        (tcgetattr(r->slave, &t) == -1))
+      goto fail;
+    cfmakeraw(&t);
+    t.c_iflag |= ICRNL;
+    t.c_lflag |= ICANON;
+    if ((tcsetattr(r->slave, TCSANOW, &t) == -1) || (pipe2(r->stop, O_CLOEXEC) == -1))
+      goto fail;
+    if ((errno = pthread_create(&r->thread, NULL, replay_serve, r)) != 0)
+      goto fail;
+    r->running = 1;
+
+    return r;
+
+fail:
+    saved = errno;
+    elm327_replay_close(r);
+    errno = saved;
+
+    return NULL;
+}
+
+
+const char *elm327_replay_path(const elm327_replay_t *r)
+{
+    return r->path;
+}
+
+
+size_t elm327_replay_transactions(const elm327_replay_t *r)
+{
+    return r->n_txns;
+}
+
+
+size_t elm327_replay_requests(const elm327_replay_t *r)
+{
+    return r->n_keys;
+}
+
+
+uint64_t elm327_replay_served(const elm327_replay_t *r)
+{
+    return __atomic_load_n(&r->served, __ATOMIC_RELAXED);
+}
+
+
+uint64_t elm327_replay_misses(const elm327_replay_t *r)
+{
+    return __atomic_load_n(&r->misses, __ATOMIC_RELAXED);
+}
+
+
+void elm327_replay_close(elm327_replay_t *r)
+{
+    if (!r)
+      return;
+
+    if (r->running && (write(r->stop[1], "", 1) == 1))
+      pthread_join(r->thread, NULL);
+    if (r->stop[0] != -1)
+    {
+        close(r->stop[0]);
+        close(r->stop[1]);
+    }
+    if (r->slave != -1)
+      close(r->slave);
+    if (r->master != -1)
+      close(r->master);
+    free(r->keys);
+    free(r->txns);
+    free(r->chunks);
+    free(r->pool);
+    free(r);
+}
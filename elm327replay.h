@@ -0,0 +1,84 @@
+#ifndef _ELM327REPLAY_H
+#define _ELM327REPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Captures of what went over the serial line, and a pty adapter replaying
+ * one.
+ *
+ * With a capture started (-R), every adapter read and write of the library
+ * is appended to a text file, one chunk per line:
+ *
+ *   # elm327diag capture: <wall clock us> <w|r> <bytes>
+ *   1697712345123456 w 010C\r
+ *   1697712345168020 r 010C\n
+ *   1697712345168031 r 41 0C 1A F8 \n
+ *
+ * with '\r', '\n', '\\' and other bytes outside printable ASCII escaped.
+ * What is read is what the tty hands over (carriage returns as newlines,
+ * the prompt with the next line); a capture of the raw serial bytes reads
+ * the same.
+ *
+ * A replay indexes the transactions of a capture by request and serves
+ * them on the master side of a pty, from its own thread: the echo at once,
+ * each line of the response after the delay it was originally seen after,
+ * times 'scale'.  A request seen several times gets its answers in turn,
+ * so the values and timing vary as they did in the vehicle.  Requests the
+ * capture does not have are answered "OK" (AT commands) or "NO DATA" after
+ * the median response time of the capture.  As the ELM, any character while
+ * a response is going out stops it ("STOPPED").
+ */
+
+
+extern int elm327_capture_on;
+
+
+/* Record a chunk of adapter I/O, cheap while no capture is running */
+#define ELM327_CAPTURE(_dir, _buf, _len)                          \
+do {                                                               \
+    if (__builtin_expect(elm327_capture_on, 0) && ((_len) > 0))    \
+      elm327_capture_chunk((_dir), (_buf), (_len));                \
+} while (0)
+
+
+/* Start capturing to 'path' (truncated).  Returns 0, or -1 with errno set. */
+extern int elm327_capture_start(const char *path);
+
+
+/* Use ELM327_CAPTURE() */
+extern void elm327_capture_chunk(char dir, const void *buf, size_t len);
+
+
+/* Close the capture, returns the result of the final flush */
+extern int elm327_capture_stop(void);
+
+
+typedef struct _elm327_replay elm327_replay_t;
+
+
+/* Index 'capture' and start serving it.  NULL on error with errno set,
+ * lines that do not parse are reported on stderr.
+ */
+extern elm327_replay_t *elm327_replay_open(const char *capture, double scale);
+
+
+/* The pty to hand to elm327_init() */
+extern const char *elm327_replay_path(const elm327_replay_t *r);
+
+
+/* Transactions in the capture, and distinct requests among them */
+extern size_t elm327_replay_transactions(const elm327_replay_t *r);
+extern size_t elm327_replay_requests(const elm327_replay_t *r);
+
+
+/* Requests answered from the capture, and not */
+extern uint64_t elm327_replay_served(const elm327_replay_t *r);
+extern uint64_t elm327_replay_misses(const elm327_replay_t *r);
+
+
+extern void elm327_replay_close(elm327_replay_t *r);
+
+
+#endif /* _ELM327REPLAY_H */
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "elm327.h"
+#include "elm327metrics.h"
+#include "elm327session.h"
+#include "elm327clock.h"
+
+
+const char *elm327_recovery_names[ELM327_RECOVER_REOPEN + 1] =
+{
+    "failed", "resync", "warm start", "reopen"
+};
+
+
+/* Length of the command name, "ATSP" of "ATSP6", "ATH" of "ATH1" */
+static size_t setting_key_len(const char *cmd)
+{
+    size_t n = 0;
+
+    while (cmd[n] && isalpha((unsigned char)cmd[n]))
+      ++n;
+
+    return n;
+}
+
+
+static void sleep_ms(int ms)
+{
+    elm327_clock_sleep_ns((uint64_t)ms * 1000000);
+}
+
+
+/* Errors that say the device itself is gone, only reopening helps */
+static int device_lost(int err)
+{
+    return (err == EIO) || (err == ENXIO) || (err == ENODEV) || (err == EBADF);
+}
+
+
+static int session_command(int fd, const char *cmd, int timeout_ms)
+{
+    elm327_flush(fd);
+    if (elm327_send_cmd(fd, cmd) == -1)
+      return -1;
+    if (elm327_wait_prompt(fd, timeout_ms) == -1)
+      return -1;
+    elm327_flush(fd);
+
+    return 0;
+}
+
+
+static int session_restore(elm327_session_t *s)
+{
+    int i;
+
+    for (i = 0; i < s->n_settings; ++i)
+      if (session_command(s->fd, s->settings[i], ELM327_WARM_START_MS) == -1)
+        return -1;
+
+    return 0;
+}
+
+
+elm327_session_t *elm327_session_open(const char *device)
+{
+    elm327_session_t *s;
+
+    if (!(s = calloc(1, sizeof(elm327_session_t))))
+      return NULL;
+    if (!(s->device = strdup(device)) ||
+        ((s->fd = elm327_init(device)) == -1))
+    {
+        int err = errno;
+
+        free(s->device);
+        free(s);
+        errno = err;
+        return NULL;
+    }
+
+    return s;
+}
+
+
+int elm327_session_at(elm327_session_t *s, const char *cmd)
+{
+    size_t key = setting_key_len(cmd);
+    int    i;
+
+    if ((strlen(cmd) >= ELM327_SESSION_SETTING_MAX) || (key == 0))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (session_command(s->fd, cmd, ELM327_WARM_START_MS) == -1)
+      return -1;
+
+    /* A reset or warm start is not a setting */
+    if (!strcasecmp(cmd, "ATZ") || !strcasecmp(cmd, "ATWS") || !strcasecmp(cmd, "ATD"))
+      return 0;
+
+    for (i = 0; i < s->n_settings; ++i)
+      if ((setting_key_len(s->settings[i]) == key) && !strncasecmp(s->settings[i], cmd, key))
+        break;
+    if (i == ELM327_SESSION_MAX_SETTINGS)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+    strcpy(s->settings[i], cmd);
+    if (i == s->n_settings)
+      ++s->n_settings;
+
+    return 0;
+}
+
+
+elm327_recovery_t elm327_session_recover(elm327_session_t *s, int err)
+{
+    elm327_recovery_t step = ELM327_RECOVER_FAILED;
+
+    if ((s->fd != -1) && !device_lost(err))
+    {
+        /* A bare CR makes the ELM answer (it repeats the last command) */
+        if (session_command(s->fd, "", ELM327_RESYNC_MS) == 0)
+          step = ELM327_RECOVER_RESYNC;
+        else if (!device_lost(errno) &&
+                 (session_command(s->fd, "ATWS", ELM327_WARM_START_MS) == 0) &&
+                 (session_restore(s) == 0))
+          step = ELM327_RECOVER_WARM_START;
+    }
+
+    if (step == ELM327_RECOVER_FAILED)
+    {
+        if (s->fd != -1)
+          elm327_shutdown(s->fd);
+
+        if (((s->fd = elm327_init(s->device)) != -1) &&
+            (session_command(s->fd, "", ELM327_REOPEN_MS) == 0) &&
+            (session_restore(s) == 0))
+          step = ELM327_RECOVER_REOPEN;
+        else
+          sleep_ms(ELM327_REOPEN_BACKOFF_MS);
+    }
+
+    if (step != ELM327_RECOVER_FAILED)
+    {
+        ++s->recoveries[step];
+        ELM327_METRIC_ADD(reconnects, 1);
+    }
+
+    return step;
+}
+
+
+void elm327_session_close(elm327_session_t *s)
+{
+    if (!s)
+      return;
+
+    elm327_shutdown(s->fd);
+    free(s->device);
+    free(s);
+}
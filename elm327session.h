@@ -0,0 +1,76 @@
+#ifndef _ELM327SESSION_H
+#define _ELM327SESSION_H
+
+
+/* An adapter connection that survives a loose connector or a brown-out.
+ *
+ * The session remembers the device path and every AT setting applied
+ * through it.  When a request fails, elm327_session_recover() walks a ladder
+ * from cheapest to most expensive and stops at the first step that gets a
+ * prompt back:
+ *
+ *   resync      flush, send a bare CR and wait for the prompt (garbage on
+ *               the line, a lost prompt)
+ *   warm start  AT WS, then replay the cached settings (adapter stuck)
+ *   reopen      close and reopen the device, replay the settings (EIO, the
+ *               USB adapter went away and came back)
+ *
+ * Steps that cannot work for the error at hand (resyncing a device that
+ * returned EIO) are skipped.
+ */
+#define ELM327_SESSION_MAX_SETTINGS  16
+#define ELM327_SESSION_SETTING_MAX   24
+
+/* Time given to each step, milliseconds */
+#define ELM327_RESYNC_MS       300
+#define ELM327_WARM_START_MS   2000
+#define ELM327_REOPEN_MS       2000
+
+/* Pause after a failed reopen, so a missing device is not polled flat out */
+#define ELM327_REOPEN_BACKOFF_MS 500
+
+
+typedef enum _elm327_recovery
+{
+    ELM327_RECOVER_FAILED = 0,
+    ELM327_RECOVER_RESYNC,
+    ELM327_RECOVER_WARM_START,
+    ELM327_RECOVER_REOPEN
+} elm327_recovery_t;
+
+
+typedef struct _elm327_session
+{
+    char          *device;
+    int            fd;          /* -1 while the device is gone */
+    char           settings[ELM327_SESSION_MAX_SETTINGS][ELM327_SESSION_SETTING_MAX];
+    int            n_settings;
+    unsigned long  recoveries[ELM327_RECOVER_REOPEN + 1];
+} elm327_session_t;
+
+
+extern const char *elm327_recovery_names[ELM327_RECOVER_REOPEN + 1];
+
+
+/* Open the device, NULL on error with errno set */
+extern elm327_session_t *elm327_session_open(const char *device);
+
+
+/* Send an AT command, wait for the prompt and remember it for replay.  A
+ * later command of the same kind ("ATSP6" after "ATSP0") replaces the cached
+ * one.  Returns 0 or -1 with errno set.
+ */
+extern int elm327_session_at(elm327_session_t *s, const char *cmd);
+
+
+/* Bring the adapter back after a request failed with 'err' (an errno
+ * value).  Returns the step that worked, ELM327_RECOVER_FAILED if none did
+ * (call again later).
+ */
+extern elm327_recovery_t elm327_session_recover(elm327_session_t *s, int err);
+
+
+extern void elm327_session_close(elm327_session_t *s);
+
+
+#endif /* _ELM327SESSION_H */
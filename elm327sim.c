@@ -0,0 +1,288 @@
+/* posix_openpt(), ptsname_r() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "elm327clock.h"
+#include "elm327sim.h"
+
+
+/* 8N1 at 38400 baud */
+#define SIM_BYTE_NS        260417ull
+#define SIM_CAN_ECU_NS     12000000ull
+#define SIM_LEGACY_ECU_NS  60000000ull
+#define SIM_AT_NS          1000000ull
+#define SIM_RESET_NS       500000000ull
+
+#define SIM_LINE_MAX       64
+#define SIM_REPLY_MAX      128
+
+
+struct _elm327_sim
+{
+    int      master;
+    int      slave;      /* kept open, the pty hangs up when the last closes */
+    char     path[64];
+    char     line[SIM_LINE_MAX];
+    size_t   len;
+    int      echo;
+    int      protocol;   /* ATSP number, 0 automatic (found CAN) */
+    uint64_t busy_ns;    /* the adapter is half duplex */
+    uint64_t requests;
+};
+
+
+typedef struct _sim_reply
+{
+    elm327_sim_t *sim;
+    size_t        len;
+    char          text[SIM_REPLY_MAX];
+} sim_reply_t;
+
+
+static int sim_deliver(void *arg)
+{
+    sim_reply_t *r = arg;
+    int          wrote = (write(r->sim->master, r->text, r->len) == (ssize_t)r->len);
+
+    free(r);
+
+    return wrote;
+}
+
+
+/* The drive cycle: speed in km/h at 't' seconds, a 15 minute wave with stops */
+static double sim_speed(double t)
+{
+    double v = 55.0 + 60.0 * sin(2.0 * M_PI * t / 900.0);
+
+    return (v < 0.0) ? 0.0 : v;
+}
+
+
+/* Data bytes of Mode 01 'pid' at 't' seconds, their number or -1 when the
+ * vehicle does not have it
+ */
+static int sim_pid(unsigned int pid, double t, unsigned char data[4])
+{
+    double v = sim_speed(t), rpm = v ? 900.0 + v * 30.0 : 750.0;
+
+    switch (pid)
+    {
+        case 0x00:
+            memcpy(data, "\xBE\x1F\xA8\x13", 4);
+            return 4;
+        case 0x03:
+            data[0] = 0x02;   /* closed loop */
+            data[1] = 0x00;
+            return 2;
+        case 0x04:
+            data[0] = (unsigned char)((15.0 + v * 0.5) * 255.0 / 100.0);
+            return 1;
+        case 0x05:
+            data[0] = (unsigned char)(((t < 420.0) ? 20.0 + t / 6.0 : 90.0) + 40.0);
+            return 1;
+        case 0x0A:
+            data[0] = 100;
+            return 1;
+        case 0x0B:
+            data[0] = (unsigned char)(30.0 + v * 0.6);
+            return 1;
+        case 0x0C:
+            data[0] = (unsigned int)(rpm * 4.0) >> 8;
+            data[1] = (unsigned int)(rpm * 4.0) & 0xFF;
+            return 2;
+        case 0x0D:
+            data[0] = (unsigned char)v;
+            return 1;
+    }
+
+    return -1;
+}
+
+
+/* Queue the answer to one command */
+static int sim_answer(elm327_sim_t *sim, const char *cmd)
+{
+    sim_reply_t  *r;
+    unsigned char data[4];
+    unsigned int  mode, pid;
+    uint64_t      now = elm327_clock_now_ns(), delay = SIM_AT_NS;
+    int           n, i;
+
+    if (!(r = malloc(sizeof(sim_reply_t))))
+      return -1;
+    r->sim = sim;
+    r->len = sim->echo ? (size_t)snprintf(r->text, SIM_REPLY_MAX, "%s\r", cmd) : 0;
+
+#define SIM_SAY(...) (r->len += snprintf(r->text + r->len, SIM_REPLY_MAX - r->len, __VA_ARGS__))
+
+    if (!strncasecmp(cmd, "AT", 2))
+    {
+        if (!strcasecmp(cmd, "ATZ") || !strcasecmp(cmd, "ATWS"))
+        {
+            sim->echo = 1;
+            sim->protocol = 0;
+            delay = SIM_RESET_NS;
+            SIM_SAY("\rELM327 v1.5\r");
+        }
+        else if (!strcasecmp(cmd, "ATI"))
+          SIM_SAY("ELM327 v1.5\r");
+        else if (!strcasecmp(cmd, "ATRV"))
+          SIM_SAY("14.1V\r");
+        else if (!strcasecmp(cmd, "ATDPN"))
+          SIM_SAY("A6\r");
+        else
+        {
+            if (!strcasecmp(cmd, "ATE0") || !strcasecmp(cmd, "ATE1"))
+              sim->echo = cmd[3] == '1';
+            else if (!strncasecmp(cmd, "ATSP", 4))
+              sim->protocol = (int)strtol(cmd + 4, NULL, 16);
+            SIM_SAY("OK\r");
+        }
+    }
+    else if ((sscanf(cmd, "%2x%2x", &mode, &pid) == 2) && (mode == 1) &&
+             ((n = sim_pid(pid, now / 1e9, data)) > 0))
+    {
+        SIM_SAY("41 %02X", pid);
+        for (i = 0; i < n; ++i)
+          SIM_SAY(" %02X", data[i]);
+        SIM_SAY(" \r");
+        delay = ((sim->protocol >= 1) && (sim->protocol <= 5)) ? SIM_LEGACY_ECU_NS : SIM_CAN_ECU_NS;
+    }
+    else if (sscanf(cmd, "%2x", &mode) == 1)
+    {
+        SIM_SAY("NO DATA\r");
+        delay = SIM_CAN_ECU_NS;
+    }
+    else
+      SIM_SAY("?\r");
+    SIM_SAY("\r>");
+
+#undef SIM_SAY
+
+    if (sim->busy_ns < now)
+      sim->busy_ns = now;
+    sim->busy_ns += delay + (strlen(cmd) + 1 + r->len) * SIM_BYTE_NS;
+    ++sim->requests;
+
+    if (elm327_clock_at(sim->busy_ns, sim_deliver, r) == -1)
+    {
+        free(r);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Clock source: commands that came in, each answered by an event */
+static int sim_pump(void *arg, int real_ms)
+{
+    elm327_sim_t *sim = arg;
+    struct pollfd pfd = { .fd = sim->master, .events = POLLIN };
+    char          buf[256];
+    ssize_t       n, i;
+    int           queued = 0;
+
+    if (poll(&pfd, 1, real_ms) != 1)
+      return 0;
+
+    while ((n = read(sim->master, buf, sizeof(buf))) > 0)
+    {
+        elm327_clock_taken(n);
+        for (i = 0; i < n; ++i)
+        {
+            if ((buf[i] == '\r') || (buf[i] == '\n'))
+            {
+                sim->line[sim->len] = '\0';
+                if (sim->len && (sim_answer(sim, sim->line) == 0))
+                  ++queued;
+                sim->len = 0;
+            }
+            else if ((buf[i] != ' ') && (sim->len < SIM_LINE_MAX - 1))
+              sim->line[sim->len++] = buf[i];
+        }
+    }
+
+    return queued;
+}
+
+
+elm327_sim_t *elm327_sim_open(void)
+{
+    elm327_sim_t  *sim;
+    struct termios t;
+
+    if (!elm327_clock_is_virtual())
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!(sim = calloc(1, sizeof(elm327_sim_t))))
+      return NULL;
+    sim->echo = 1;
+    sim->slave = -1;
+
+    /* The line discipline of a real adapter's tty: lines end in CR */
+    if (((sim->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) == -1) ||
+        (grantpt(sim->master) == -1) || (unlockpt(sim->master) == -1) ||
+        (ptsname_r(sim->master, sim->path, sizeof(sim->path)) != 0) ||
+        ((sim->slave = open(sim->path, O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1) ||
+        (tcgetattr(sim->slave, &t) == -1))
+      goto fail;
+    cfmakeraw(&t);
+    t.c_iflag |= ICRNL;
+    t.c_lflag |= ICANON;
+    if ((tcsetattr(sim->slave, TCSANOW, &t) == -1) ||
+        (elm327_clock_add_source(sim_pump, sim) == -1))
+      goto fail;
+
+    return sim;
+
+fail:
+    {
+        int saved = errno;
+
+        if (sim->slave != -1)
+          close(sim->slave);
+        if (sim->master != -1)
+          close(sim->master);
+        free(sim);
+        errno = saved;
+    }
+    return NULL;
+}
+
+
+const char *elm327_sim_path(const elm327_sim_t *sim)
+{
+    return sim->path;
+}
+
+
+uint64_t elm327_sim_requests(const elm327_sim_t *sim)
+{
+    return sim->requests;
+}
+
+
+void elm327_sim_close(elm327_sim_t *sim)
+{
+    if (!sim)
+      return;
+
+    elm327_clock_remove_source(sim_pump, sim);
+    close(sim->slave);
+    close(sim->master);
+    free(sim);
+}
@@ -0,0 +1,38 @@
+#ifndef _ELM327SIM_H
+#define _ELM327SIM_H
+
+#include <stdint.h>
+
+
+/* An ELM327 in the process, for running the sampling loop on the virtual
+ * clock (elm327clock.h).
+ *
+ * It sits on the master side of a pty, so the program opens the slave like
+ * any adapter.  Commands are picked up when the clock asks its sources;
+ * each answer is an event at the time a real adapter would have it ready:
+ * the serial time of request and reply at 38400 baud plus the vehicle's
+ * response time (12 ms on CAN, 60 ms on the older protocols), one request at
+ * a time.  Mode 01 values follow a fixed drive cycle of virtual time, so two
+ * runs give the same samples at the same times.
+ */
+
+
+typedef struct _elm327_sim elm327_sim_t;
+
+
+/* Needs the virtual clock.  NULL on error with errno set. */
+extern elm327_sim_t *elm327_sim_open(void);
+
+
+/* The pty to hand to elm327_init() */
+extern const char *elm327_sim_path(const elm327_sim_t *sim);
+
+
+/* Requests answered so far */
+extern uint64_t elm327_sim_requests(const elm327_sim_t *sim);
+
+
+extern void elm327_sim_close(elm327_sim_t *sim);
+
+
+#endif /* _ELM327SIM_H */
@@ -0,0 +1,642 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "elm327.h"
+#include "elm327buf.h"
+#include "elm327log.h"
+#include "elm327num.h"
+#include "elm327probe.h"
+#include "elm327sink.h"
+#include "elm327sqlite.h"
+
+
+/* Per sink queue, a whole number of log records */
+#define SINK_QUEUE_SIZE  (8192 * sizeof(elm327_log_record_t))
+#define SINK_MAX         16
+
+
+typedef struct _sink
+{
+    char                 *spec;
+    elm327_sink_format_t  format;
+    int                   fd;
+    int                   owns_fd;
+    int                   is_socket;
+    int                   drop;
+    elm327_log_t         *log;       /* "log" format to a file */
+    elm327_sqlite_t      *sqlite;    /* "sqlite" target, log encoded */
+    struct timespec       txn_deadline;
+
+    /* Byte ring, the producer fills after head+len, the writer drains head */
+    char                 *ring;
+    size_t                cap;
+    size_t                head;
+    size_t                len;
+    pthread_mutex_t       lock;
+    pthread_cond_t        data_cv;
+    pthread_cond_t        space_cv;
+    int                   stop;
+    int                   failed;
+
+    /* Mirrors for the metrics endpoint, read without the lock */
+    _Atomic size_t        queued;    /* Bytes, len */
+    _Atomic uint64_t      written;   /* Bytes */
+    _Atomic uint64_t      dropped;   /* Batches */
+    pthread_t             thread;
+} sink_t;
+
+
+struct _elm327_sinks
+{
+    uint32_t      vehicle;
+    int           n_sinks;
+    sink_t       *sinks[SINK_MAX];
+    elm327_buf_t  encoded[ELM327_SINK_N_FORMATS];
+};
+
+
+static const char *format_names[ELM327_SINK_N_FORMATS] = { "csv", "ndjson", "log" };
+
+
+/*
+ * Writer thread
+ */
+
+/* Hand 'n' bytes to the target, returns how many were taken or -1 */
+static ssize_t sink_emit(sink_t *s, const char *p, size_t n)
+{
+    const elm327_log_record_t *rec;
+    ssize_t                    w;
+    size_t                     i;
+
+    if (s->log)
+    {
+        rec = (const elm327_log_record_t *)p;
+        for (i = 0; i < n / sizeof(elm327_log_record_t); ++i)
+          if (elm327_log_append_record(s->log, &rec[i]) == -1)
+            return -1;
+        return n;
+    }
+
+#ifdef HAVE_SQLITE
+    if (s->sqlite)
+    {
+        /* A transaction lives at most ELM327_SQLITE_TXN_MS from its first row */
+        if (!elm327_sqlite_in_txn(s->sqlite))
+        {
+            clock_gettime(CLOCK_MONOTONIC, &s->txn_deadline);
+            s->txn_deadline.tv_nsec += ELM327_SQLITE_TXN_MS * 1000000L;
+            s->txn_deadline.tv_sec += s->txn_deadline.tv_nsec / 1000000000L;
+            s->txn_deadline.tv_nsec %= 1000000000L;
+        }
+
+        rec = (const elm327_log_record_t *)p;
+        for (i = 0; i < n / sizeof(elm327_log_record_t); ++i)
+          if (elm327_sqlite_insert(s->sqlite, &rec[i]) == -1)
+            return -1;
+        return n;
+    }
+#endif
+
+    do
+    {
+        if (s->is_socket)
+          w = send(s->fd, p, n, MSG_NOSIGNAL);
+        else
+          w = write(s->fd, p, n);
+    }
+    while ((w == -1) && (errno == EINTR));
+
+    return w;
+}
+
+
+#ifdef HAVE_SQLITE
+/* Close the transaction, a commit that fails disables the sink like an insert */
+static void sink_commit(sink_t *s)
+{
+    if (elm327_sqlite_commit(s->sqlite) == -1)
+    {
+        fprintf(stderr, "sink %s: commit: %s, disabled\n", s->spec, strerror(errno));
+        pthread_mutex_lock(&s->lock);
+        s->failed = 1;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+#endif
+
+
+static void *sink_writer(void *arg)
+{
+    sink_t   *s = arg;
+    size_t    span;
+    ssize_t   n;
+    uint64_t  t0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&s->lock);
+        while ((s->len == 0) && !s->stop)
+        {
+#ifdef HAVE_SQLITE
+            /* Close the transaction when it is due, even if nothing arrives */
+            if (s->sqlite && !s->failed && elm327_sqlite_in_txn(s->sqlite))
+            {
+                if (pthread_cond_timedwait(&s->data_cv, &s->lock, &s->txn_deadline) == ETIMEDOUT)
+                {
+                    pthread_mutex_unlock(&s->lock);
+                    sink_commit(s);
+                    pthread_mutex_lock(&s->lock);
+                }
+                continue;
+            }
+#endif
+            pthread_cond_wait(&s->data_cv, &s->lock);
+        }
+        if (s->len == 0)
+        {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        span = s->len;
+        if (span > s->cap - s->head)
+          span = s->cap - s->head;
+        pthread_mutex_unlock(&s->lock);
+
+        /* The span is ours until we give it back, write without the lock */
+        t0 = ELM327_PROBE_ENABLED(sink_write) ? elm327_probe_ns() : 0;
+        if (s->failed)
+          n = span;
+        else if ((n = sink_emit(s, s->ring + s->head, span)) == -1)
+        {
+            fprintf(stderr, "sink %s: %s, disabled\n", s->spec, strerror(errno));
+            n = span;
+            pthread_mutex_lock(&s->lock);
+            s->failed = 1;
+            pthread_mutex_unlock(&s->lock);
+        }
+        if (ELM327_PROBE_ENABLED(sink_write))
+          ELM327_PROBE3(sink_write, s->format, n, elm327_probe_ns() - t0);
+
+#ifdef HAVE_SQLITE
+        if (s->sqlite && !s->failed && elm327_sqlite_in_txn(s->sqlite))
+        {
+            struct timespec now;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec > s->txn_deadline.tv_sec) ||
+                ((now.tv_sec == s->txn_deadline.tv_sec) && (now.tv_nsec >= s->txn_deadline.tv_nsec)))
+              sink_commit(s);
+        }
+#endif
+
+        if (!s->failed)
+          atomic_fetch_add_explicit(&s->written, n, memory_order_relaxed);
+
+        pthread_mutex_lock(&s->lock);
+        s->head = (s->head + n) % s->cap;
+        s->len -= n;
+        atomic_store_explicit(&s->queued, s->len, memory_order_relaxed);
+        pthread_cond_broadcast(&s->space_cv);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    return NULL;
+}
+
+
+static void sink_enqueue(sink_t *s, const char *p, size_t n)
+{
+    size_t tail, room, chunk, first;
+
+    pthread_mutex_lock(&s->lock);
+
+    if (s->failed || (s->drop && (s->cap - s->len < n)))
+    {
+        if (!s->failed)
+          atomic_fetch_add_explicit(&s->dropped, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+
+    while ((n > 0) && !s->failed)
+    {
+        while ((s->len == s->cap) && !s->failed)
+          pthread_cond_wait(&s->space_cv, &s->lock);
+        if (s->failed)
+          break;
+
+        room = s->cap - s->len;
+        chunk = (n < room) ? n : room;
+        tail = (s->head + s->len) % s->cap;
+        first = (chunk < s->cap - tail) ? chunk : s->cap - tail;
+
+        memcpy(s->ring + tail, p, first);
+        memcpy(s->ring, p + first, chunk - first);
+
+        s->len += chunk;
+        atomic_store_explicit(&s->queued, s->len, memory_order_relaxed);
+        p += chunk;
+        n -= chunk;
+        pthread_cond_signal(&s->data_cv);
+    }
+
+    pthread_mutex_unlock(&s->lock);
+}
+
+
+/*
+ * Serialization, once per format and batch
+ */
+
+static char *put_str(char *w, const char *s, size_t len)
+{
+    memcpy(w, s, len);
+
+    return w + len;
+}
+
+
+static char *put_sample_name(char *w, const elm327_sample_t *smp, int json)
+{
+    const char *c;
+
+    if (!smp->name)
+    {
+        /* "01 0C" */
+        *w++ = elm327_digit_to_hexascii((ELM327_CHANNEL_MODE(smp->channel) >> 4) & 0xF);
+        *w++ = elm327_digit_to_hexascii(ELM327_CHANNEL_MODE(smp->channel) & 0xF);
+        *w++ = ' ';
+        *w++ = elm327_digit_to_hexascii((ELM327_CHANNEL_ID(smp->channel) >> 4) & 0xF);
+        *w++ = elm327_digit_to_hexascii(ELM327_CHANNEL_ID(smp->channel) & 0xF);
+        return w;
+    }
+
+    for (c = smp->name; *c; ++c)
+    {
+        if (json && ((*c == '"') || (*c == '\\')))
+          *w++ = '\\';
+        *w++ = *c;
+    }
+
+    return w;
+}
+
+
+static void encode_batch(
+    elm327_sinks_t        *sinks,
+    elm327_sink_format_t   fmt,
+    const elm327_sample_t *smp,
+    size_t                 n)
+{
+    elm327_buf_t        *buf = &sinks->encoded[fmt];
+    elm327_log_record_t *rec;
+    size_t               i, name_len;
+    char                *w;
+
+    elm327_buf_reset(buf);
+
+    for (i = 0; i < n; ++i)
+    {
+        name_len = smp[i].name ? strlen(smp[i].name) : 5;
+
+        switch (fmt)
+        {
+        case ELM327_SINK_CSV:
+            if (!(w = elm327_buf_reserve(buf, name_len + ELM327_FMT_MAX + 3)))
+              return;
+            w = put_sample_name(w, &smp[i], 0);
+            w = put_str(w, ", ", 2);
+            w = elm327_fmt_fixed(w, smp[i].value, 6);
+            *w++ = '\n';
+            elm327_buf_commit(buf, w);
+            break;
+
+        case ELM327_SINK_NDJSON:
+            if (!(w = elm327_buf_reserve(buf, 2 * name_len + ELM327_FMT_MAX + 96)))
+              return;
+            w = put_str(w, "{\"ts\":", 6);
+            w = elm327_fmt_uint(w, smp[i].timestamp_us);
+            w = put_str(w, ",\"mode\":", 8);
+            w = elm327_fmt_uint(w, ELM327_CHANNEL_MODE(smp[i].channel));
+            w = put_str(w, ",\"pid\":", 7);
+            w = elm327_fmt_uint(w, ELM327_CHANNEL_ID(smp[i].channel));
+            w = put_str(w, ",\"name\":\"", 9);
+            w = put_sample_name(w, &smp[i], 1);
+            w = put_str(w, "\",\"value\":", 10);
+            if (isfinite(smp[i].value))
+              w = elm327_fmt_fixed(w, smp[i].value, 6);
+            else
+              w = put_str(w, "null", 4);
+            w = put_str(w, "}\n", 2);
+            elm327_buf_commit(buf, w);
+            break;
+
+        case ELM327_SINK_LOG:
+            if (!(rec = (elm327_log_record_t *)elm327_buf_reserve(buf, sizeof(*rec))))
+              return;
+            memset(rec, 0, sizeof(*rec));
+            rec->timestamp_us = smp[i].timestamp_us;
+            rec->value = smp[i].value;
+            rec->vehicle = sinks->vehicle;
+            rec->channel = smp[i].channel;
+            buf->len += sizeof(*rec);
+            break;
+
+        default:
+            return;
+        }
+    }
+}
+
+
+/*
+ * Setup
+ */
+
+elm327_sinks_t *elm327_sinks_create(uint32_t vehicle)
+{
+    elm327_sinks_t *sinks;
+    int             f;
+
+    if (!(sinks = calloc(1, sizeof(elm327_sinks_t))))
+      return NULL;
+
+    sinks->vehicle = vehicle;
+    for (f = 0; f < ELM327_SINK_N_FORMATS; ++f)
+      if (elm327_buf_init(&sinks->encoded[f], 4096) == -1)
+      {
+          elm327_sinks_destroy(sinks);
+          return NULL;
+      }
+
+    return sinks;
+}
+
+
+static int sink_open_target(sink_t *s, uint32_t vehicle, const char *target, int sqlite)
+{
+    struct sockaddr_un addr;
+
+    s->fd = -1;
+
+    if (sqlite)
+    {
+#ifdef HAVE_SQLITE
+        if (!(s->sqlite = elm327_sqlite_open(target)))
+        {
+            errno = EIO;
+            return -1;
+        }
+        return 0;
+#else
+        errno = ENOTSUP;
+        return -1;
+#endif
+    }
+
+    if (!strcmp(target, "-"))
+    {
+        s->fd = STDOUT_FILENO;
+        s->drop = 1;
+        return 0;
+    }
+
+    if (!strncmp(target, "unix:", 5))
+    {
+        target += 5;
+        if (strlen(target) >= sizeof(addr.sun_path))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, target);
+
+        if ((s->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+          return -1;
+        if (connect(s->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        {
+            close(s->fd);
+            s->fd = -1;
+            return -1;
+        }
+
+        s->owns_fd = 1;
+        s->is_socket = 1;
+        s->drop = 1;
+        return 0;
+    }
+
+    if (s->format == ELM327_SINK_LOG)
+    {
+        if (!(s->log = elm327_log_create(target, vehicle)))
+          return -1;
+        return 0;
+    }
+
+    if ((s->fd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+      return -1;
+    s->owns_fd = 1;
+
+    return 0;
+}
+
+
+static void sink_free(sink_t *s)
+{
+    if (s->owns_fd && (s->fd != -1))
+      close(s->fd);
+    if (s->log && (elm327_log_close(s->log) == -1))
+      fprintf(stderr, "sink %s: %s\n", s->spec, strerror(errno));
+#ifdef HAVE_SQLITE
+    elm327_sqlite_close(s->sqlite);
+#endif
+
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->data_cv);
+    pthread_cond_destroy(&s->space_cv);
+    free(s->ring);
+    free(s->spec);
+    free(s);
+}
+
+
+int elm327_sinks_add(elm327_sinks_t *sinks, const char *spec)
+{
+    sink_t             *s;
+    char               *target, *policy;
+    int                 f, sqlite = 0;
+    pthread_condattr_t  attr;
+
+    if (sinks->n_sinks == SINK_MAX)
+    {
+        fprintf(stderr, "sink %s: too many sinks\n", spec);
+        return -1;
+    }
+
+    if (!(s = calloc(1, sizeof(sink_t))) || !(s->spec = strdup(spec)))
+    {
+        free(s);
+        return -1;
+    }
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->data_cv, &attr);
+    pthread_cond_init(&s->space_cv, NULL);
+    pthread_condattr_destroy(&attr);
+    s->fd = -1;
+
+    /* "sqlite:<path>" is shorthand for log records into a database */
+    if (!strncmp(spec, "sqlite:", 7))
+    {
+        s->format = ELM327_SINK_LOG;
+        target = strchr(s->spec, ':');
+        sqlite = 1;
+    }
+    else
+    {
+        /* Split "<format>:<target>[,policy]" */
+        target = strchr(s->spec, ':');
+        for (f = 0; target && (f < ELM327_SINK_N_FORMATS); ++f)
+          if ((strlen(format_names[f]) == (size_t)(target - s->spec)) &&
+              !strncmp(s->spec, format_names[f], target - s->spec))
+            break;
+        if (!target || (f == ELM327_SINK_N_FORMATS))
+        {
+            fprintf(stderr, "sink %s: expected <csv|ndjson|log>:<target> or sqlite:<path>\n", spec);
+            sink_free(s);
+            return -1;
+        }
+        s->format = f;
+    }
+
+    if (!(target = strdup(target + 1)))
+    {
+        sink_free(s);
+        return -1;
+    }
+    if ((policy = strrchr(target, ',')))
+      *policy++ = '\0';
+
+    if (sink_open_target(s, sinks->vehicle, target, sqlite) == -1)
+    {
+        fprintf(stderr, "sink %s: %s\n", spec, strerror(errno));
+        free(target);
+        sink_free(s);
+        return -1;
+    }
+
+    if (policy && !strcmp(policy, "drop"))
+      s->drop = 1;
+    else if (policy && !strcmp(policy, "block"))
+      s->drop = 0;
+    else if (policy)
+      fprintf(stderr, "sink %s: unknown policy '%s' ignored\n", spec, policy);
+    free(target);
+
+    s->cap = SINK_QUEUE_SIZE;
+    if (!(s->ring = malloc(s->cap)) ||
+        (pthread_create(&s->thread, NULL, sink_writer, s) != 0))
+    {
+        fprintf(stderr, "sink %s: unable to start\n", spec);
+        sink_free(s);
+        return -1;
+    }
+
+    sinks->sinks[sinks->n_sinks++] = s;
+
+    return 0;
+}
+
+
+int elm327_sinks_count(const elm327_sinks_t *sinks)
+{
+    return sinks->n_sinks;
+}
+
+
+void elm327_sinks_write(
+    elm327_sinks_t        *sinks,
+    const elm327_sample_t *samples,
+    size_t                 n)
+{
+    int i, f, used[ELM327_SINK_N_FORMATS] = {0};
+
+    if (n == 0)
+      return;
+
+    for (i = 0; i < sinks->n_sinks; ++i)
+      used[sinks->sinks[i]->format] = 1;
+
+    for (f = 0; f < ELM327_SINK_N_FORMATS; ++f)
+      if (used[f])
+        encode_batch(sinks, f, samples, n);
+
+    for (i = 0; i < sinks->n_sinks; ++i)
+    {
+        f = sinks->sinks[i]->format;
+        sink_enqueue(sinks->sinks[i], sinks->encoded[f].data, sinks->encoded[f].len);
+    }
+}
+
+
+int elm327_sinks_stats(const elm327_sinks_t *sinks, elm327_sink_stats_t *stats, int max)
+{
+    const sink_t *s;
+    int           i;
+
+    for (i = 0; (i < sinks->n_sinks) && (i < max); ++i)
+    {
+        s = sinks->sinks[i];
+        stats[i].spec = s->spec;
+        stats[i].capacity = s->cap;
+        stats[i].queued = atomic_load_explicit(&s->queued, memory_order_relaxed);
+        stats[i].written = atomic_load_explicit(&s->written, memory_order_relaxed);
+        stats[i].dropped = atomic_load_explicit(&s->dropped, memory_order_relaxed);
+    }
+
+    return i;
+}
+
+
+void elm327_sinks_destroy(elm327_sinks_t *sinks)
+{
+    sink_t *s;
+    int     i, f;
+
+    if (!sinks)
+      return;
+
+    for (i = 0; i < sinks->n_sinks; ++i)
+    {
+        s = sinks->sinks[i];
+
+        pthread_mutex_lock(&s->lock);
+        s->stop = 1;
+        pthread_cond_signal(&s->data_cv);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->thread, NULL);
+
+        if (s->dropped)
+          fprintf(stderr, "sink %s: %lu batches dropped\n", s->spec, (unsigned long)s->dropped);
+        sink_free(s);
+    }
+
+    for (f = 0; f < ELM327_SINK_N_FORMATS; ++f)
+      elm327_buf_free(&sinks->encoded[f]);
+    free(sinks);
+}
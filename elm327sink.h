@@ -0,0 +1,100 @@
+#ifndef _ELM327SINK_H
+#define _ELM327SINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Output fan-out.
+ *
+ * Samples are handed over a batch at a time (a pass over the PIDs).  The
+ * batch is serialized once for every format that has at least one sink, and
+ * the same bytes are queued to each sink of that format.  Every sink owns a
+ * bounded queue drained by its own thread, so a slow consumer (a socket
+ * nobody reads, a busy disk) only ever stalls itself, unless it was asked to
+ * push back on the producer.
+ *
+ * Sinks are described by a spec string:
+ *
+ *   <format>:<target>[,drop|,block]
+ *   sqlite:<path>[,drop|,block]
+ *
+ *   format  csv     "<name>, <value>" lines, as carstats.csv always was
+ *           ndjson  one JSON object per sample and line
+ *           log     binary log records (see elm327log.h)
+ *   target  -             stdout
+ *           unix:<path>   connect to a listening unix stream socket
+ *           <path>        file, truncated
+ *   policy  drop   discard a batch that does not fit in the queue (default
+ *                  for stdout and sockets)
+ *           block  wait for room, the producer slows down (default for files)
+ *
+ * A "log" sink writing to a file produces a complete binary log, to stdout
+ * or a socket it streams bare records.  A "sqlite" sink takes the log
+ * records and inserts them in time bounded transactions (elm327sqlite.h).
+ */
+
+typedef struct _elm327_sample
+{
+    uint64_t    timestamp_us;
+    uint32_t    channel;        /* ELM327_CHANNEL(mode, pid) */
+    double      value;
+    const char *name;
+} elm327_sample_t;
+
+
+typedef enum _elm327_sink_format
+{
+    ELM327_SINK_CSV = 0,
+    ELM327_SINK_NDJSON,
+    ELM327_SINK_LOG,
+    ELM327_SINK_N_FORMATS
+} elm327_sink_format_t;
+
+
+typedef struct _elm327_sinks elm327_sinks_t;
+
+
+extern elm327_sinks_t *elm327_sinks_create(uint32_t vehicle);
+
+
+/* Add a sink from a spec string, returns 0 on success and -1 on error (a
+ * message has been printed).
+ */
+extern int elm327_sinks_add(elm327_sinks_t *sinks, const char *spec);
+
+
+extern int elm327_sinks_count(const elm327_sinks_t *sinks);
+
+
+/* Serialize and queue a batch.  Only blocks on sinks with the block policy
+ * whose queue is full.
+ */
+extern void elm327_sinks_write(
+    elm327_sinks_t        *sinks,
+    const elm327_sample_t *samples,
+    size_t                 n);
+
+
+/* Queue state of one sink, for monitoring.  Read without taking the sink
+ * locks, so the numbers of one sink may be from slightly different moments.
+ */
+typedef struct _elm327_sink_stats
+{
+    const char *spec;
+    uint64_t    queued;       /* Bytes waiting for the writer */
+    uint64_t    capacity;     /* Bytes                        */
+    uint64_t    written;      /* Bytes                        */
+    uint64_t    dropped;      /* Batches                      */
+} elm327_sink_stats_t;
+
+
+/* Fill up to 'max' entries, returns how many */
+extern int elm327_sinks_stats(const elm327_sinks_t *sinks, elm327_sink_stats_t *stats, int max);
+
+
+/* Drain every queue, stop the writers and close the targets */
+extern void elm327_sinks_destroy(elm327_sinks_t *sinks);
+
+
+#endif /* _ELM327SINK_H */
@@ -0,0 +1,164 @@
+#ifdef HAVE_SQLITE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sqlite3.h>
+#include "elm327sqlite.h"
+
+
+struct _elm327_sqlite
+{
+    sqlite3      *db;
+    sqlite3_stmt *insert;
+    sqlite3_stmt *begin;
+    sqlite3_stmt *commit;
+    int           in_txn;
+};
+
+
+static const char *schema =
+    "PRAGMA journal_mode=WAL;"
+    "PRAGMA synchronous=NORMAL;"
+    "CREATE TABLE IF NOT EXISTS samples ("
+    "  ts      INTEGER NOT NULL,"
+    "  vehicle INTEGER NOT NULL,"
+    "  mode    INTEGER NOT NULL,"
+    "  pid     INTEGER NOT NULL,"
+    "  value   REAL"
+    ");";
+
+
+static int step_reset(elm327_sqlite_t *db, sqlite3_stmt *stmt)
+{
+    int rc = sqlite3_step(stmt);
+
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE)
+    {
+        fprintf(stderr, "sqlite: %s\n", sqlite3_errmsg(db->db));
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+elm327_sqlite_t *elm327_sqlite_open(const char *path)
+{
+    elm327_sqlite_t *db;
+    char            *msg = NULL;
+
+    if (!(db = calloc(1, sizeof(elm327_sqlite_t))))
+      return NULL;
+
+    if (sqlite3_open(path, &db->db) != SQLITE_OK)
+    {
+        fprintf(stderr, "sqlite %s: %s\n", path, sqlite3_errmsg(db->db));
+        goto err;
+    }
+
+    if (sqlite3_exec(db->db, schema, NULL, NULL, &msg) != SQLITE_OK)
+    {
+        fprintf(stderr, "sqlite %s: %s\n", path, msg);
+        sqlite3_free(msg);
+        goto err;
+    }
+
+    if ((sqlite3_prepare_v2(db->db,
+            "INSERT INTO samples (ts, vehicle, mode, pid, value) VALUES (?, ?, ?, ?, ?)",
+            -1, &db->insert, NULL) != SQLITE_OK) ||
+        (sqlite3_prepare_v2(db->db, "BEGIN", -1, &db->begin, NULL) != SQLITE_OK) ||
+        (sqlite3_prepare_v2(db->db, "COMMIT", -1, &db->commit, NULL) != SQLITE_OK))
+    {
+        fprintf(stderr, "sqlite %s: %s\n", path, sqlite3_errmsg(db->db));
+        goto err;
+    }
+
+    return db;
+
+err:
+    sqlite3_finalize(db->insert);
+    sqlite3_finalize(db->begin);
+    sqlite3_finalize(db->commit);
+    sqlite3_close(db->db);
+    free(db);
+    return NULL;
+}
+
+
+int elm327_sqlite_insert(elm327_sqlite_t *db, const elm327_log_record_t *rec)
+{
+    if (!db->in_txn)
+    {
+        if (step_reset(db, db->begin) == -1)
+          return -1;
+        db->in_txn = 1;
+    }
+
+    sqlite3_bind_int64(db->insert, 1, rec->timestamp_us);
+    sqlite3_bind_int64(db->insert, 2, rec->vehicle);
+    sqlite3_bind_int(db->insert, 3, ELM327_CHANNEL_MODE(rec->channel));
+    sqlite3_bind_int(db->insert, 4, ELM327_CHANNEL_ID(rec->channel));
+    sqlite3_bind_double(db->insert, 5, rec->value);
+
+    return step_reset(db, db->insert);
+}
+
+
+int elm327_sqlite_commit(elm327_sqlite_t *db)
+{
+    if (!db->in_txn)
+      return 0;
+
+    /* A COMMIT that failed (SQLITE_BUSY...) leaves the transaction open */
+    if (step_reset(db, db->commit) == -1)
+      return -1;
+    db->in_txn = 0;
+
+    return 0;
+}
+
+
+int elm327_sqlite_in_txn(const elm327_sqlite_t *db)
+{
+    return db->in_txn;
+}
+
+
+void elm327_sqlite_close(elm327_sqlite_t *db)
+{
+    if (!db)
+      return;
+
+    elm327_sqlite_commit(db);
+    sqlite3_finalize(db->insert);
+    sqlite3_finalize(db->begin);
+    sqlite3_finalize(db->commit);
+    sqlite3_close(db->db);
+    free(db);
+}
+
+
+int elm327_sqlite_insert_autocommit(elm327_sqlite_t *db, const elm327_log_record_t *rec)
+{
+    char sql[192];
+    char *msg = NULL;
+
+    snprintf(sql, sizeof(sql),
+             "INSERT INTO samples (ts, vehicle, mode, pid, value) VALUES (%llu, %u, %u, %u, %.17g)",
+             (unsigned long long)rec->timestamp_us, rec->vehicle,
+             ELM327_CHANNEL_MODE(rec->channel), ELM327_CHANNEL_ID(rec->channel), rec->value);
+
+    if (sqlite3_exec(db->db, sql, NULL, NULL, &msg) != SQLITE_OK)
+    {
+        fprintf(stderr, "sqlite: %s\n", msg);
+        sqlite3_free(msg);
+        return -1;
+    }
+
+    return 0;
+}
+
+#endif /* HAVE_SQLITE */
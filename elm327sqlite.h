@@ -0,0 +1,51 @@
+#ifndef _ELM327SQLITE_H
+#define _ELM327SQLITE_H
+
+#include "elm327log.h"
+
+
+/* SQLite storage for samples (built when HAVE_SQLITE is defined).
+ *
+ * The database runs in WAL mode with synchronous=NORMAL, and rows go in
+ * through one prepared INSERT inside an explicit transaction.  The caller
+ * decides when to commit, the sink does so when a transaction has been open
+ * for ELM327_SQLITE_TXN_MS or on shutdown.
+ *
+ *   CREATE TABLE samples (ts INTEGER, vehicle INTEGER, mode INTEGER,
+ *                         pid INTEGER, value REAL)
+ *
+ * 'ts' is microseconds since the epoch, as in the binary log.
+ */
+#define ELM327_SQLITE_TXN_MS 250
+
+
+typedef struct _elm327_sqlite elm327_sqlite_t;
+
+
+/* Open (creating if needed) a database, NULL on error with a message printed */
+extern elm327_sqlite_t *elm327_sqlite_open(const char *path);
+
+
+/* Insert a row, opening a transaction if none is.  0 on success, -1 on error */
+extern int elm327_sqlite_insert(elm327_sqlite_t *db, const elm327_log_record_t *rec);
+
+
+/* Commit the open transaction, if any.  On error the transaction stays open. */
+extern int elm327_sqlite_commit(elm327_sqlite_t *db);
+
+
+/* Non zero while a transaction is open */
+extern int elm327_sqlite_in_txn(const elm327_sqlite_t *db);
+
+
+/* Commit and close */
+extern void elm327_sqlite_close(elm327_sqlite_t *db);
+
+
+/* For comparison only: the same insert as a statement of its own, compiled
+ * and committed per row.
+ */
+extern int elm327_sqlite_insert_autocommit(elm327_sqlite_t *db, const elm327_log_record_t *rec);
+
+
+#endif /* _ELM327SQLITE_H */
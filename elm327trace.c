@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "elm327log.h"
+#include "elm327trace.h"
+#include "elm327clock.h"
+
+
+typedef struct _trace_event
+{
+    uint64_t ts_ns;
+    uint32_t channel;
+    uint32_t mark;
+} trace_event_t;
+
+
+int elm327_trace_on = 0;
+
+static trace_event_t *ring = NULL;
+static uint64_t       ring_mask = 0;
+static uint64_t       ring_head = 0;     /* Total events ever recorded */
+
+
+/* Name of the phase a mark ends */
+static const char *phase_names[ELM327_TRACE_N_MARKS] =
+{
+    "begin", "encode", "write", "wait", "read", "prompt", "decode", "sink"
+};
+
+
+int elm327_trace_enable(size_t n_events)
+{
+    size_t n = 1;
+
+    while (n < n_events)
+      n <<= 1;
+
+    free(ring);
+    if (!(ring = calloc(n, sizeof(trace_event_t))))
+      return -1;
+
+    ring_mask = n - 1;
+    ring_head = 0;
+    elm327_trace_on = 1;
+
+    return 0;
+}
+
+
+void elm327_trace_mark(elm327_trace_mark_t mark, uint32_t channel)
+{
+    trace_event_t *e;
+
+    if (!ring)
+      return;
+
+    e = &ring[ring_head++ & ring_mask];
+    e->ts_ns = elm327_clock_now_ns();
+    e->channel = channel;
+    e->mark = mark;
+}
+
+
+static void export_slice(
+    FILE       *fp,
+    int        *first,
+    const char *name,
+    int         tid,
+    uint64_t    start_ns,
+    uint64_t    end_ns,
+    uint64_t    origin_ns,
+    uint32_t    channel)
+{
+    fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"mode\":%u,\"pid\":%u}}",
+            *first ? "" : ",", name, tid,
+            (start_ns - origin_ns) / 1e3, (end_ns - start_ns) / 1e3,
+            ELM327_CHANNEL_MODE(channel), ELM327_CHANNEL_ID(channel));
+    *first = 0;
+}
+
+
+/* Close the transaction slice that spans all of its phases */
+static void export_txn(FILE *fp, int *first, const trace_event_t *begin, uint64_t end_ns, uint64_t origin_ns)
+{
+    char name[32];
+
+    if (begin->channel)
+      snprintf(name, sizeof(name), "mode %02X pid %02X",
+               ELM327_CHANNEL_MODE(begin->channel), ELM327_CHANNEL_ID(begin->channel));
+    else
+      snprintf(name, sizeof(name), "output");
+
+    export_slice(fp, first, name, 1, begin->ts_ns, end_ns, origin_ns, begin->channel);
+}
+
+
+int elm327_trace_export(const char *path)
+{
+    FILE                *fp;
+    const trace_event_t *e, *begin = NULL;
+    uint64_t             i, start, origin = 0, prev = 0;
+    int                  first = 1;
+
+    if (!ring)
+      return 0;
+    if (!(fp = fopen(path, "w")))
+      return -1;
+
+    /* Oldest event still in the ring */
+    start = (ring_head > ring_mask + 1) ? ring_head - (ring_mask + 1) : 0;
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (i = start; i < ring_head; ++i)
+    {
+        e = &ring[i & ring_mask];
+
+        if (e->mark == ELM327_TRACE_BEGIN)
+        {
+            if (begin)
+              export_txn(fp, &first, begin, prev, origin);
+            else
+              origin = e->ts_ns;
+            begin = e;
+            prev = e->ts_ns;
+            continue;
+        }
+
+        /* The ring wrapped in the middle of a transaction */
+        if (!begin || (e->mark >= ELM327_TRACE_N_MARKS))
+          continue;
+
+        export_slice(fp, &first, phase_names[e->mark], 2, prev, e->ts_ns, origin, begin->channel);
+        prev = e->ts_ns;
+    }
+    if (begin)
+      export_txn(fp, &first, begin, prev, origin);
+    fprintf(fp, "\n]}\n");
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+
+void elm327_trace_disable(void)
+{
+    elm327_trace_on = 0;
+    free(ring);
+    ring = NULL;
+}
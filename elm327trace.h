@@ -0,0 +1,70 @@
+#ifndef _ELM327TRACE_H
+#define _ELM327TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Transaction timeline.
+ *
+ * Each step of a request/response with the adapter drops a timestamped mark
+ * into an in-memory ring.  A mark ends the phase named after it, the phase
+ * starting at the previous mark of the same transaction, and BEGIN opens a
+ * transaction.  The ring is exported as Chrome trace JSON, which both
+ * chrome://tracing and ui.perfetto.dev load.
+ *
+ * Recording is a branch on a global when tracing is off, and a clock read
+ * plus a 16 byte store when it is on.  There is one recording thread (the
+ * one talking to the adapter), the ring is not locked.
+ */
+typedef enum _elm327_trace_mark
+{
+    ELM327_TRACE_BEGIN = 0,
+    ELM327_TRACE_ENCODED,       /* Request built              */
+    ELM327_TRACE_WRITTEN,       /* Request written            */
+    ELM327_TRACE_FIRST_BYTE,    /* Response started to arrive */
+    ELM327_TRACE_LAST_BYTE,     /* End of the response lines  */
+    ELM327_TRACE_PROMPT,        /* '>' seen                   */
+    ELM327_TRACE_DECODED,       /* Value calculated           */
+    ELM327_TRACE_SUNK,          /* Batch handed to the sinks  */
+    ELM327_TRACE_N_MARKS
+} elm327_trace_mark_t;
+
+
+/* Events kept by default, older ones are overwritten (1 MB) */
+#define ELM327_TRACE_DEFAULT_EVENTS 65536
+
+
+extern int elm327_trace_on;
+
+
+#define ELM327_TRACE_MARK(_mark, _channel)                 \
+do {                                                        \
+    if (__builtin_expect(elm327_trace_on, 0))               \
+      elm327_trace_mark((_mark), (_channel));               \
+} while (0)
+
+
+/* Allocate a ring of at least 'n_events' (rounded up to a power of two) and
+ * start recording.  Returns 0 on success and -1 on error.
+ */
+extern int elm327_trace_enable(size_t n_events);
+
+
+/* Record a mark, use ELM327_TRACE_MARK() instead on hot paths.  'channel'
+ * is an ELM327_CHANNEL(), 0 for work that is not about one channel.
+ */
+extern void elm327_trace_mark(elm327_trace_mark_t mark, uint32_t channel);
+
+
+/* Write the ring as Chrome trace JSON.  Returns 0 on success and -1 on
+ * error with errno set.
+ */
+extern int elm327_trace_export(const char *path);
+
+
+/* Stop recording and free the ring */
+extern void elm327_trace_disable(void);
+
+
+#endif /* _ELM327TRACE_H */
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "elm327buf.h"
+#include "elm327num.h"
+#include "elm327tui.h"
+
+
+/* Screen layout */
+#define TUI_FIRST_ROW   3
+#define TUI_NAME_COL    1
+#define TUI_VALUE_COL   38
+#define TUI_VALUE_W     14
+#define TUI_UNIT_COL    (TUI_VALUE_COL + TUI_VALUE_W + 1)
+#define TUI_COUNT_COL   (TUI_UNIT_COL + 6)
+#define TUI_COUNT_W     10
+#define TUI_CELL_MAX    32
+
+
+typedef struct _tui_slot
+{
+    _Atomic uint64_t bits;       /* The double, as raw bits */
+    _Atomic uint64_t updates;
+} tui_slot_t;
+
+
+struct _elm327_tui
+{
+    int               fd;
+    long              frame_ns;
+    pthread_t         thread;
+    atomic_int        stop;
+    _Atomic uint64_t  passes;
+
+    int               row[OBDPID_TABLE_SIZE];     /* 0 when not shown */
+    tui_slot_t        slot[OBDPID_TABLE_SIZE];
+
+    /* Owned by the render thread: what the terminal currently shows */
+    char              shown_value[OBDPID_TABLE_SIZE][TUI_CELL_MAX];
+    char              shown_count[OBDPID_TABLE_SIZE][TUI_CELL_MAX];
+    char              shown_status[80];
+    int               status_row;
+    uint64_t          last_passes;
+    struct timespec   last_rate;
+    double            rate;
+    elm327_buf_t      frame;
+};
+
+
+static const char *unit_names[] = { "%", "rpm", "C", "kPa", "km/h" };
+
+
+static char *put_move(char *w, int row, int col)
+{
+    *w++ = '\033';
+    *w++ = '[';
+    w = elm327_fmt_uint(w, row);
+    *w++ = ';';
+    w = elm327_fmt_uint(w, col);
+    *w++ = 'H';
+
+    return w;
+}
+
+
+/* Append "move + text" when 'text' differs from what the cell shows */
+static void put_cell(elm327_tui_t *tui, char *shown, int row, int col, const char *text)
+{
+    size_t len = strlen(text);
+    char  *w;
+
+    if (!strcmp(shown, text))
+      return;
+
+    if (!(w = elm327_buf_reserve(&tui->frame, len + 24)))
+      return;
+    w = put_move(w, row, col);
+    memcpy(w, text, len);
+    elm327_buf_commit(&tui->frame, w + len);
+
+    strcpy(shown, text);
+}
+
+
+/* Right align 'len' characters of 'src' in a field of 'width' */
+static void right_align(char *dst, const char *src, size_t len, int width)
+{
+    int pad = width - (int)len;
+
+    if (pad < 0)
+      pad = 0;
+    memset(dst, ' ', pad);
+    memcpy(dst + pad, src, len);
+    dst[pad + len] = '\0';
+}
+
+
+static void tui_frame(elm327_tui_t *tui)
+{
+    char            tmp[ELM327_FMT_MAX + 2], cell[TUI_CELL_MAX + ELM327_FMT_MAX];
+    char           *e;
+    uint64_t        bits, updates, passes;
+    double          v, secs;
+    struct timespec now;
+    int             i;
+
+    for (i = 0; i < OBDPID_TABLE_SIZE; ++i)
+    {
+        if (!tui->row[i])
+          continue;
+
+        updates = atomic_load_explicit(&tui->slot[i].updates, memory_order_acquire);
+        bits = atomic_load_explicit(&tui->slot[i].bits, memory_order_relaxed);
+
+        if (updates == 0)
+          right_align(cell, "-", 1, TUI_VALUE_W);
+        else
+        {
+            memcpy(&v, &bits, sizeof(v));
+            e = elm327_fmt_fixed(tmp, v, 2);
+            if (e - tmp > TUI_VALUE_W)
+              e = tmp + TUI_VALUE_W;
+            right_align(cell, tmp, e - tmp, TUI_VALUE_W);
+        }
+        put_cell(tui, tui->shown_value[i], tui->row[i], TUI_VALUE_COL, cell);
+
+        e = elm327_fmt_uint(tmp, updates);
+        right_align(cell, tmp, e - tmp, TUI_COUNT_W);
+        put_cell(tui, tui->shown_count[i], tui->row[i], TUI_COUNT_COL, cell);
+    }
+
+    /* Pass rate, refreshed once a second */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = (now.tv_sec - tui->last_rate.tv_sec) + (now.tv_nsec - tui->last_rate.tv_nsec) / 1e9;
+    passes = atomic_load_explicit(&tui->passes, memory_order_relaxed);
+    if (secs >= 1.0)
+    {
+        tui->rate = (passes - tui->last_passes) / secs;
+        tui->last_passes = passes;
+        tui->last_rate = now;
+    }
+    e = tmp;
+    e = (char *)memcpy(e, "passes: ", 8) + 8;
+    e = elm327_fmt_uint(e, passes);
+    e = (char *)memcpy(e, "   passes/s: ", 13) + 13;
+    e = elm327_fmt_fixed(e, tui->rate, 1);
+    e = (char *)memcpy(e, "      ", 6) + 6;   /* Wipe leftovers of a longer line */
+    *e = '\0';
+    put_cell(tui, tui->shown_status, tui->status_row, 1, tmp);
+
+    if (tui->frame.len)
+      elm327_buf_write(&tui->frame, tui->fd);
+    elm327_buf_reset(&tui->frame);
+}
+
+
+static void *tui_render(void *arg)
+{
+    elm327_tui_t    *tui = arg;
+    struct timespec  next;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!atomic_load(&tui->stop))
+    {
+        tui_frame(tui);
+
+        next.tv_nsec += tui->frame_ns;
+        next.tv_sec += next.tv_nsec / 1000000000L;
+        next.tv_nsec %= 1000000000L;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    /* Last values on screen before we leave */
+    tui_frame(tui);
+
+    return NULL;
+}
+
+
+elm327_tui_t *elm327_tui_start(
+    int                 fd,
+    const struct obdpid o[OBDPID_TABLE_SIZE],
+    int                 hz)
+{
+    elm327_tui_t *tui;
+    char         *w;
+    int           i, row = TUI_FIRST_ROW;
+    size_t        len;
+
+    if (!(tui = calloc(1, sizeof(elm327_tui_t))))
+      return NULL;
+    if (elm327_buf_init(&tui->frame, 4096) == -1)
+    {
+        free(tui);
+        return NULL;
+    }
+
+    if ((hz <= 0) || (hz > ELM327_TUI_MAX_HZ))
+      hz = ELM327_TUI_MAX_HZ;
+    tui->fd = fd;
+    tui->frame_ns = 1000000000L / hz;
+    clock_gettime(CLOCK_MONOTONIC, &tui->last_rate);
+
+    /* Alternate screen, no cursor, then the static parts once */
+    elm327_buf_append(&tui->frame, "\033[?1049h\033[?25l\033[2J", 18);
+    w = elm327_buf_reserve(&tui->frame, 128);
+    w = put_move(w, 1, TUI_NAME_COL);
+    len = sprintf(w, "elm327diag live  (%d Hz, ctrl-c to stop)", hz);
+    elm327_buf_commit(&tui->frame, w + len);
+
+    for (i = 0; i < OBDPID_TABLE_SIZE; ++i)
+    {
+        if (!o[i].bytes)
+          continue;
+
+        tui->row[i] = row++;
+        w = elm327_buf_reserve(&tui->frame, 128);
+        w = put_move(w, tui->row[i], TUI_NAME_COL);
+        len = snprintf(w, 64, "%.*s", TUI_VALUE_COL - 2, o[i].commandname);
+        w = put_move(w + len, tui->row[i], TUI_UNIT_COL);
+        if ((unsigned)o[i].units < sizeof(unit_names) / sizeof(unit_names[0]))
+          len = sprintf(w, "%s", unit_names[o[i].units]);
+        else
+          len = 0;
+        elm327_buf_commit(&tui->frame, w + len);
+    }
+    tui->status_row = row + 1;
+    elm327_buf_write(&tui->frame, fd);
+
+    if (pthread_create(&tui->thread, NULL, tui_render, tui) != 0)
+    {
+        elm327_buf_free(&tui->frame);
+        free(tui);
+        return NULL;
+    }
+
+    return tui;
+}
+
+
+void elm327_tui_update(elm327_tui_t *tui, int idx, double value)
+{
+    uint64_t bits;
+
+    if (!tui || (idx < 0) || (idx >= OBDPID_TABLE_SIZE))
+      return;
+
+    memcpy(&bits, &value, sizeof(bits));
+    atomic_store_explicit(&tui->slot[idx].bits, bits, memory_order_relaxed);
+    atomic_fetch_add_explicit(&tui->slot[idx].updates, 1, memory_order_release);
+}
+
+
+void elm327_tui_pass(elm327_tui_t *tui)
+{
+    if (tui)
+      atomic_fetch_add_explicit(&tui->passes, 1, memory_order_relaxed);
+}
+
+
+void elm327_tui_stop(elm327_tui_t *tui)
+{
+    static const char restore[] = "\033[?25h\033[?1049l";
+
+    if (!tui)
+      return;
+
+    atomic_store(&tui->stop, 1);
+    pthread_join(tui->thread, NULL);
+
+    (void)!write(tui->fd, restore, sizeof(restore) - 1);
+    elm327_buf_free(&tui->frame);
+    free(tui);
+}
@@ -0,0 +1,43 @@
+#ifndef _ELM327TUI_H
+#define _ELM327TUI_H
+
+#include "elm327pids.h"
+
+
+/* Full screen live view of every sampled PID.
+ *
+ * The sampling thread only ever stores the newest value of a channel into an
+ * atomic slot (elm327_tui_update), it never formats or writes.  A render
+ * thread wakes up at the frame rate, formats each slot, compares the text
+ * against what is on screen and emits cursor moves plus text for the cells
+ * that differ, the whole frame in a single write().
+ */
+#define ELM327_TUI_MAX_HZ 30
+
+
+typedef struct _elm327_tui elm327_tui_t;
+
+
+/* Take over the terminal on 'fd' and start rendering the PIDs of 'o' that
+ * are read (bytes > 0).  'hz' is capped at ELM327_TUI_MAX_HZ.  Returns NULL
+ * on error.
+ */
+extern elm327_tui_t *elm327_tui_start(
+    int                 fd,
+    const struct obdpid o[OBDPID_TABLE_SIZE],
+    int                 hz);
+
+
+/* Publish a new value for the PID at table index 'idx', lock free */
+extern void elm327_tui_update(elm327_tui_t *tui, int idx, double value);
+
+
+/* Count a completed pass over the PIDs (shown in the status line) */
+extern void elm327_tui_pass(elm327_tui_t *tui);
+
+
+/* Stop rendering and give the terminal back */
+extern void elm327_tui_stop(elm327_tui_t *tui);
+
+
+#endif /* _ELM327TUI_H */
@@ -0,0 +1,608 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "elm327uring.h"
+
+/* The engine needs the 5.11 interface, older headers get the stubs */
+#if defined(__has_include) && !defined(ELM327_NO_URING)
+#  if __has_include(<linux/io_uring.h>)
+#    include <linux/io_uring.h>
+#    ifdef IORING_FEAT_EXT_ARG
+#      define ELM327_HAVE_URING 1
+#    endif
+#  endif
+#endif
+
+#ifdef ELM327_HAVE_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* 5.18 and 5.19, asked for and dropped when the kernel does not know them */
+#ifndef IORING_SETUP_SUBMIT_ALL
+#define IORING_SETUP_SUBMIT_ALL   (1U << 7)
+#endif
+#ifndef IORING_SETUP_COOP_TASKRUN
+#define IORING_SETUP_COOP_TASKRUN (1U << 8)
+#endif
+
+
+#define URING_CMD_MAX  64
+#define URING_READ_MAX 256
+
+/* Waits for the cancelled operations on close, of this long each */
+#define URING_DRAIN_TRIES 5
+#define URING_DRAIN_MS    200
+
+/* What a completion is for: the operation above, the adapter (or for an
+ * append the length it had to write) below
+ */
+#define URING_OP_READ    1ull
+#define URING_OP_WRITE   2ull
+#define URING_OP_APPEND  3ull
+#define URING_OP_ASYNC   4ull     /* A cancellation, on close */
+#define URING_DATA(_op, _low) (((_op) << 32) | (uint32_t)(_low))
+
+
+typedef struct _uring_adapter
+{
+    int    fd;
+    int    reading;
+    int    writing;
+    int    failed;
+    char   in[URING_READ_MAX];
+    char   out[URING_CMD_MAX];
+
+    /* The response being framed */
+    char   text[ELM327_URING_RESPONSE_MAX];
+    size_t n;
+    char   prev;
+    int    overflow;
+} uring_adapter_t;
+
+
+struct _elm327_uring
+{
+    int                       ring_fd;
+    void                     *sq_ring, *cq_ring;
+    size_t                    sq_ring_size, cq_ring_size;
+    struct io_uring_sqe      *sqes;
+    unsigned int             *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int             *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe      *cqes;
+    unsigned int              sq_entries, cq_entries;
+    unsigned int              tail;        /* ours, published on submit */
+    unsigned int              to_submit;
+    unsigned int              in_flight;   /* queued or in the kernel */
+    unsigned int              appends;
+    int                       append_error;
+    uint64_t                  syscalls;
+
+    elm327_uring_response_fn  fn;
+    void                     *arg;
+    uring_adapter_t          *adapters;
+    int                       n_adapters, max_adapters;
+};
+
+
+static int uring_enter(elm327_uring_t *u, unsigned int min_complete, int timeout_ms)
+{
+    struct io_uring_getevents_arg arg = {0};
+    struct __kernel_timespec      ts;
+    unsigned int                  flags = 0;
+    int                           r;
+
+    __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+
+    if (min_complete)
+    {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout_ms >= 0)
+        {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000ll;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+    }
+
+    ++u->syscalls;
+    r = syscall(__NR_io_uring_enter, u->ring_fd, u->to_submit, min_complete, flags,
+                (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL, sizeof(arg));
+    if (r >= 0)
+      u->to_submit -= ((unsigned int)r < u->to_submit) ? (unsigned int)r : u->to_submit;
+
+    return r;
+}
+
+
+/* The next free submission, handing the queued ones to the kernel when the
+ * ring is full
+ */
+static struct io_uring_sqe *uring_sqe(elm327_uring_t *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int         idx;
+
+    /* The kernel may take fewer than were queued (or none): only a head
+     * that moved frees a slot
+     */
+    if (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries)
+    {
+        if (uring_enter(u, 0, 0) == -1)
+          return NULL;
+        if (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries)
+        {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    idx = u->tail & *u->sq_mask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    ++u->tail;
+    ++u->to_submit;
+    ++u->in_flight;
+
+    return sqe;
+}
+
+
+static int uring_post_read(elm327_uring_t *u, int i)
+{
+    uring_adapter_t     *a = &u->adapters[i];
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = uring_sqe(u)))
+      return -1;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = a->fd;
+    sqe->addr = (uint64_t)(uintptr_t)a->in;
+    sqe->len = sizeof(a->in);
+    sqe->off = (uint64_t)-1;   /* a tty has no offset */
+    sqe->user_data = URING_DATA(URING_OP_READ, i);
+    a->reading = 1;
+
+    return 0;
+}
+
+
+static void uring_fail(elm327_uring_t *u, int i, int err)
+{
+    errno = err;
+    u->fn(u->arg, i, NULL, -1);
+}
+
+
+/* Frame what adapter 'i' sent, as elm327_read_response() does.  Returns
+ * the responses completed.
+ */
+static int uring_feed(elm327_uring_t *u, int i, size_t len)
+{
+    uring_adapter_t *a = &u->adapters[i];
+    size_t           k;
+    char             c;
+    int              done = 0;
+
+    for (k = 0; k < len; ++k)
+    {
+        c = (a->in[k] == '\r') ? '\n' : a->in[k];
+
+        if ((a->n == 0) && !a->overflow && ((c == '>') || (c == '\n')))
+          continue;
+
+        if ((c == '>') || ((c == '\n') && (a->prev == '\n')))
+        {
+            a->text[a->n] = '\0';
+            if (a->overflow)
+              uring_fail(u, i, EMSGSIZE);
+            else
+            {
+                u->fn(u->arg, i, a->text, (int)a->n);
+                ++done;
+            }
+            a->n = 0;
+            a->prev = 0;
+            a->overflow = 0;
+            continue;
+        }
+
+        if (a->n < sizeof(a->text) - 1)
+          a->text[a->n++] = c;
+        else
+          a->overflow = 1;
+        a->prev = c;
+    }
+
+    return done;
+}
+
+
+elm327_uring_t *elm327_uring_open(
+    unsigned int             entries,
+    int                      max_adapters,
+    elm327_uring_response_fn fn,
+    void                     *arg)
+{
+    struct io_uring_params p;
+    elm327_uring_t        *u;
+    int                    saved;
+
+    if (!(u = calloc(1, sizeof(elm327_uring_t))) ||
+        !(u->adapters = calloc(max_adapters > 0 ? max_adapters : 1, sizeof(uring_adapter_t))))
+    {
+        free(u);
+        return NULL;
+    }
+    u->ring_fd = -1;
+    u->fn = fn;
+    u->arg = arg;
+    u->max_adapters = max_adapters;
+    u->sq_ring = u->cq_ring = u->sqes = MAP_FAILED;
+
+    /* Task work run when we enter anyway, and a failed submission does not
+     * hold up the rest; older kernels take neither
+     */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL;
+    if ((u->ring_fd = syscall(__NR_io_uring_setup, entries, &p)) == -1)
+    {
+        memset(&p, 0, sizeof(p));
+        if ((errno != EINVAL) || ((u->ring_fd = syscall(__NR_io_uring_setup, entries, &p)) == -1))
+          goto fail;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG))
+    {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    /* Every adapter keeps a read and a write in flight, their completions
+     * must fit the completion ring
+     */
+    if ((max_adapters <= 0) || (2 * (unsigned int)max_adapters >= p.cq_entries))
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+    u->sq_entries = p.sq_entries;
+    u->cq_entries = p.cq_entries;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (u->cq_ring_size > u->sq_ring_size)
+          u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+
+    if ((u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           u->ring_fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+      goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+      u->cq_ring = u->sq_ring;
+    else if ((u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                u->ring_fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+      goto fail;
+    if ((u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES)) == MAP_FAILED)
+      goto fail;
+
+    u->sq_head = (unsigned int *)((char *)u->sq_ring + p.sq_off.head);
+    u->sq_tail = (unsigned int *)((char *)u->sq_ring + p.sq_off.tail);
+    u->sq_mask = (unsigned int *)((char *)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned int *)((char *)u->sq_ring + p.sq_off.array);
+    u->cq_head = (unsigned int *)((char *)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned int *)((char *)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = (unsigned int *)((char *)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+    u->tail = *u->sq_tail;
+
+    return u;
+
+fail:
+    saved = errno;
+    elm327_uring_close(u);
+    errno = saved;
+
+    return NULL;
+}
+
+
+int elm327_uring_add(elm327_uring_t *u, int fd)
+{
+    int i = u->n_adapters;
+
+    if (i == u->max_adapters)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    memset(&u->adapters[i], 0, sizeof(uring_adapter_t));
+    u->adapters[i].fd = fd;
+    if (uring_post_read(u, i) == -1)
+      return -1;
+    ++u->n_adapters;
+
+    return i;
+}
+
+
+int elm327_uring_send(elm327_uring_t *u, int adapter, const char *cmd)
+{
+    uring_adapter_t     *a;
+    struct io_uring_sqe *sqe;
+    size_t               len = strlen(cmd);
+
+    if ((adapter < 0) || (adapter >= u->n_adapters) || (len > URING_CMD_MAX - 1))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    a = &u->adapters[adapter];
+    if (a->failed)
+    {
+        errno = EIO;
+        return -1;
+    }
+    if (a->writing)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    memcpy(a->out, cmd, len);
+    a->out[len++] = '\r';
+    if (!(sqe = uring_sqe(u)))
+      return -1;
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = a->fd;
+    sqe->addr = (uint64_t)(uintptr_t)a->out;
+    sqe->len = len;
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = URING_DATA(URING_OP_WRITE, adapter);
+    a->writing = 1;
+
+    return 0;
+}
+
+
+int elm327_uring_append(elm327_uring_t *u, int fd, const void *buf, size_t len, uint64_t offset)
+{
+    struct io_uring_sqe *sqe;
+
+    if (len > UINT32_MAX)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Room for its completion: wait for some if the ring is spoken for */
+    while (u->in_flight >= u->cq_entries)
+      if (elm327_uring_run(u, 1, -1) == -1)
+        return -1;
+
+    if (!(sqe = uring_sqe(u)))
+      return -1;
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = URING_DATA(URING_OP_APPEND, len);
+    ++u->appends;
+
+    return 0;
+}
+
+
+unsigned int elm327_uring_appends(const elm327_uring_t *u)
+{
+    return u->appends;
+}
+
+
+int elm327_uring_run(elm327_uring_t *u, unsigned int min_complete, int timeout_ms)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int         head, tail;
+    uint64_t             op;
+    int                  i, res, delivered = 0;
+
+    if ((u->to_submit || min_complete) && (uring_enter(u, min_complete, timeout_ms) == -1) &&
+        (errno != ETIME) && (errno != EINTR))
+      return -1;
+
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+        cqe = &u->cqes[head & *u->cq_mask];
+        op = cqe->user_data >> 32;
+        i = (int)(cqe->user_data & 0xFFFFFFFFu);
+        res = cqe->res;
+        --u->in_flight;
+
+        if (op == URING_OP_APPEND)
+        {
+            --u->appends;
+            if ((res != i) && !u->append_error)
+              u->append_error = (res < 0) ? -res : EIO;
+        }
+        else if (op == URING_OP_WRITE)
+        {
+            u->adapters[i].writing = 0;
+            if (res < 0)
+              uring_fail(u, i, -res);
+        }
+        else
+        {
+            u->adapters[i].reading = 0;
+            if (res > 0)
+            {
+                delivered += uring_feed(u, i, res);
+                if (uring_post_read(u, i) == -1)
+                  uring_fail(u, i, errno);
+            }
+            else if ((res == -EINTR) || (res == -EAGAIN))
+            {
+                if (uring_post_read(u, i) == -1)
+                  uring_fail(u, i, errno);
+            }
+            else
+            {
+                u->adapters[i].failed = 1;
+                uring_fail(u, i, res ? -res : EIO);
+            }
+        }
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+    if (u->append_error)
+    {
+        errno = u->append_error;
+        u->append_error = 0;
+        return -1;
+    }
+
+    return delivered;
+}
+
+
+uint64_t elm327_uring_syscalls(const elm327_uring_t *u)
+{
+    return u->syscalls;
+}
+
+
+/* Cancel what is still posted on the adapters and wait for every operation
+ * to complete: the kernel writes into the adapters' buffers until then.
+ * Returns 0 once nothing is in flight.
+ */
+static int uring_drain(elm327_uring_t *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int         head, tail;
+    uint64_t             op;
+    int                  i, tries;
+
+    for (i = 0; i < u->n_adapters; ++i)
+    {
+        for (op = URING_OP_READ; op <= URING_OP_WRITE; ++op)
+        {
+            if (!((op == URING_OP_READ) ? u->adapters[i].reading : u->adapters[i].writing) ||
+                !(sqe = uring_sqe(u)))
+              continue;
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = URING_DATA(op, i);
+            sqe->user_data = URING_DATA(URING_OP_ASYNC, 0);
+        }
+    }
+
+    for (tries = 0; u->in_flight && (tries < URING_DRAIN_TRIES); ++tries)
+    {
+        if ((uring_enter(u, 1, URING_DRAIN_MS) == -1) && (errno != ETIME) && (errno != EINTR))
+          return -1;
+
+        head = *u->cq_head;
+        tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        if (head != tail)
+          tries = 0;
+        for (; head != tail; ++head)
+          --u->in_flight;
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return u->in_flight ? -1 : 0;
+}
+
+
+void elm327_uring_close(elm327_uring_t *u)
+{
+    int drained = 1;
+
+    if (!u)
+      return;
+
+    if (u->sqes != MAP_FAILED)
+      drained = (uring_drain(u) == 0);
+
+    if (u->sqes != MAP_FAILED)
+      munmap(u->sqes, u->sq_entries * sizeof(struct io_uring_sqe));
+    if ((u->cq_ring != MAP_FAILED) && (u->cq_ring != u->sq_ring))
+      munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring != MAP_FAILED)
+      munmap(u->sq_ring, u->sq_ring_size);
+    if (u->ring_fd != -1)
+      close(u->ring_fd);
+
+    /* Whatever is still in flight goes on with the ring gone, into these */
+    if (drained)
+      free(u->adapters);
+    free(u);
+}
+
+#else /* !ELM327_HAVE_URING */
+
+elm327_uring_t *elm327_uring_open(
+    unsigned int             entries,
+    int                      max_adapters,
+    elm327_uring_response_fn fn,
+    void                     *arg)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+
+int elm327_uring_add(elm327_uring_t *u, int fd)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+
+int elm327_uring_send(elm327_uring_t *u, int adapter, const char *cmd)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+
+int elm327_uring_append(elm327_uring_t *u, int fd, const void *buf, size_t len, uint64_t offset)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+
+unsigned int elm327_uring_appends(const elm327_uring_t *u)
+{
+    return 0;
+}
+
+
+int elm327_uring_run(elm327_uring_t *u, unsigned int min_complete, int timeout_ms)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+
+uint64_t elm327_uring_syscalls(const elm327_uring_t *u)
+{
+    return 0;
+}
+
+
+void elm327_uring_close(elm327_uring_t *u)
+{
+}
+
+#endif /* ELM327_HAVE_URING */
@@ -0,0 +1,93 @@
+#ifndef _ELM327URING_H
+#define _ELM327URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* io_uring engine for many adapters and their logs.
+ *
+ * Driving adapters one system call at a time costs a poll, a read per line
+ * and a write per command, plus the log writes, for every sample.  The
+ * engine keeps a read posted on every adapter, queues command writes and log
+ * appends in the submission ring, and hands all of them to the kernel with
+ * the wait for completions in one io_uring_enter(); completions are reaped
+ * from the shared ring in bulk without any system call.  Rings are set up
+ * with the raw system calls, no liburing.
+ *
+ * Responses are framed like elm327_read_response(): text up to the prompt or
+ * the blank line before it, carriage returns as '\n', a prompt left over
+ * from the previous response skipped.  Needs Linux 5.11 (the timeout of
+ * IORING_ENTER_EXT_ARG), at run time and in the headers built against;
+ * elsewhere elm327_uring_open() fails with ENOSYS.
+ */
+
+
+#define ELM327_URING_RESPONSE_MAX 256
+
+
+typedef struct _elm327_uring elm327_uring_t;
+
+
+/* A response of adapter 'adapter' (as returned by elm327_uring_add()), NUL
+ * terminated.  'len' is -1 with errno set when the adapter failed (EIO at
+ * end of file, EMSGSIZE for a response that did not fit, then the adapter
+ * carries on); its read is not posted again after an error other than
+ * EMSGSIZE.
+ */
+typedef void (*elm327_uring_response_fn) (void *arg, int adapter, const char *text, int len);
+
+
+/* A ring of 'entries' submissions (a power of two) for 'max_adapters'.
+ * Every adapter keeps up to two operations in flight, log appends share what
+ * is left.  NULL on error with errno set.
+ */
+extern elm327_uring_t *elm327_uring_open(
+    unsigned int             entries,
+    int                      max_adapters,
+    elm327_uring_response_fn fn,
+    void                    *arg);
+
+
+/* Start reading adapter 'fd' (left open by the engine).  Returns the
+ * adapter's number, or -1 with errno set.
+ */
+extern int elm327_uring_add(elm327_uring_t *u, int fd);
+
+
+/* Queue command line 'cmd' ("010C", the carriage return is added) for
+ * 'adapter'.  The ELM is half duplex: EBUSY while its last command is
+ * still being written.
+ */
+extern int elm327_uring_send(elm327_uring_t *u, int adapter, const char *cmd);
+
+
+/* Queue 'len' bytes of 'buf' for 'fd' at 'offset'.  'buf' must stay
+ * untouched until elm327_uring_appends() says it was written.
+ */
+extern int elm327_uring_append(elm327_uring_t *u, int fd, const void *buf, size_t len, uint64_t offset);
+
+
+/* Appends still in flight */
+extern unsigned int elm327_uring_appends(const elm327_uring_t *u);
+
+
+/* Submit everything queued and wait up to 'timeout_ms' (-1 for ever) for
+ * at least 'min_complete' completions, then reap every completion there is.
+ * Returns the responses delivered, or -1 with errno set (ETIME on timeout
+ * counts as success with what was reaped).  A failed append is reported
+ * here once, with its errno (EIO for a short write).
+ */
+extern int elm327_uring_run(elm327_uring_t *u, unsigned int min_complete, int timeout_ms);
+
+
+/* io_uring_enter() calls so far, the engine's only system calls after
+ * elm327_uring_open()
+ */
+extern uint64_t elm327_uring_syscalls(const elm327_uring_t *u);
+
+
+extern void elm327_uring_close(elm327_uring_t *u);
+
+
+#endif /* _ELM327URING_H */